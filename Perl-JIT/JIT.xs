@@ -32,6 +32,9 @@
 /* The custom peephole optimizer routines */
 #include "pj_jit_peep.h"
 
+/* The run loop that records traces of hot loops */
+#include "pj_trace.h"
+
 
 MODULE = Perl::JIT	PACKAGE = Perl::JIT
 
@@ -39,11 +42,6 @@ BOOT:
     pj_init_global_state(aTHX);
 
 void
-import(char *cl)
-  PPCODE:
-    /* Currently disabled lexicalization hacks/experiments */
-    /*
-    const PERL_CONTEXT *cxt = caller_cx(1, NULL);
-    cophh_store_pvs(cxt->cx_u.cx_blk.blku_oldcop->cop_hints_hash, "jit", sv_2mortal(newSViv(1)), 0);
-    */
-    XSRETURN_EMPTY;
+_set_tracing(int enable)
+  CODE:
+    pj_set_tracing(aTHX_ enable);
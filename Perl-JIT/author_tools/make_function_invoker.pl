@@ -8,7 +8,7 @@ print <<"HERE";
 
 HERE
 $\ = " \\\n";
-print "#define PJ_TYPE_SWITCH(type, args, nargs, retval)";
+print "#define PJ_TYPE_SWITCH(rettype, type, args, nargs, retval)";
 print "  {";
 print "  type *a = (type *)args;";
 print "  switch (nargs) {";
@@ -17,8 +17,8 @@ foreach my $i (0..$n) {
   my $params = join(", ", ("type") x $i)||'void';
   my $args   = $i == 0 ? "" : join(", ", map "a[$_]", 0..($i-1));
   print "    case $i: {";
-  print "      type (*f)($params) = (void *)fptr;";
-  print "      *((type *)retval) = f($args);";
+  print "      rettype (*f)($params) = (void *)fptr;";
+  print "      *((rettype *)retval) = f($args);";
   print "      break; }";
 }
 
@@ -0,0 +1,22 @@
+# Sums the Euclidean and Manhattan distances between all pairs of a set
+# of points in 3D, stored as hashes. Argument: number of points.
+use strict;
+use warnings;
+
+my $n = shift(@ARGV) || 1000;
+
+my @points = map {
+  { x => sin($_), y => cos($_ * 0.5), z => $_ / $n }
+} 1 .. $n;
+
+my ($euclid, $manhattan) = (0, 0);
+for my $i (0 .. $n - 1) {
+  my $p = $points[$i];
+  for my $j ($i + 1 .. $n - 1) {
+    my $q = $points[$j];
+    $euclid += sqrt(($p->{x} - $q->{x}) ** 2 + ($p->{y} - $q->{y}) ** 2 + ($p->{z} - $q->{z}) ** 2);
+    $manhattan += abs($p->{x} - $q->{x}) + abs($p->{y} - $q->{y}) + abs($p->{z} - $q->{z});
+  }
+}
+
+printf "%.6f %.6f\n", $euclid, $manhattan;
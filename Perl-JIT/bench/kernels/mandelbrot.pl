@@ -0,0 +1,23 @@
+# Counts the points of a square grid over [-1.5, 0.5] x [-1, 1] that are
+# in the Mandelbrot set. Argument: width of the grid.
+use strict;
+use warnings;
+
+my $size = shift(@ARGV) || 300;
+my $max_iter = 50;
+my $inside = 0;
+
+for my $y (0 .. $size - 1) {
+  my $ci = 2 * $y / $size - 1;
+  for my $x (0 .. $size - 1) {
+    my $cr = 2 * $x / $size - 1.5;
+    my ($zr, $zi, $i) = (0, 0, 0);
+    while ($i < $max_iter && $zr * $zr + $zi * $zi <= 4) {
+      ($zr, $zi) = ($zr * $zr - $zi * $zi + $cr, 2 * $zr * $zi + $ci);
+      $i++;
+    }
+    $inside++ if $i == $max_iter;
+  }
+}
+
+print "$inside\n";
@@ -0,0 +1,30 @@
+# Multiplies two square matrices of arrays of arrays. Argument: number
+# of rows.
+use strict;
+use warnings;
+
+my $n = shift(@ARGV) || 150;
+
+my (@a, @b);
+for my $i (0 .. $n - 1) {
+  for my $j (0 .. $n - 1) {
+    $a[$i][$j] = ($i - 2 * $j) / $n;
+    $b[$i][$j] = ($i * $j + 1) / $n;
+  }
+}
+
+my @c;
+for my $i (0 .. $n - 1) {
+  my $row = $a[$i];
+  for my $j (0 .. $n - 1) {
+    my $sum = 0;
+    for my $k (0 .. $n - 1) {
+      $sum += $row->[$k] * $b[$k][$j];
+    }
+    $c[$i][$j] = $sum;
+  }
+}
+
+my $trace = 0;
+$trace += $c[$_][$_] for 0 .. $n - 1;
+printf "%.9f\n", $trace;
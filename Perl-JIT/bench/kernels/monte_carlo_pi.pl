@@ -0,0 +1,16 @@
+# Estimates pi from random points in the unit square, with a fixed
+# seed. Argument: number of points.
+use strict;
+use warnings;
+
+my $n = shift(@ARGV) || 2_000_000;
+srand(42);
+
+my $hits = 0;
+for (1 .. $n) {
+  my $x = rand();
+  my $y = rand();
+  $hits++ if $x * $x + $y * $y <= 1;
+}
+
+printf "%.6f\n", 4 * $hits / $n;
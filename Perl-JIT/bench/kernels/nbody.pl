@@ -0,0 +1,82 @@
+# The n-body simulation of the Jovian planets, as in the Computer
+# Language Benchmarks Game. Argument: number of steps.
+use strict;
+use warnings;
+
+use constant PI            => 3.141592653589793;
+use constant SOLAR_MASS    => 4 * PI * PI;
+use constant DAYS_PER_YEAR => 365.24;
+
+my $steps = shift(@ARGV) || 50_000;
+
+#         sun  jupiter  saturn  uranus  neptune
+my @xs  = (0, 4.84143144246472090e+00, 8.34336671824457987e+00, 1.28943695621391310e+01, 1.53796971148509165e+01);
+my @ys  = (0, -1.16032004402742839e+00, 4.12479856412430479e+00, -1.51111514016986312e+01, -2.59193146099879641e+01);
+my @zs  = (0, -1.03622044471123109e-01, -4.03523417114321381e-01, -2.23307578892655734e-01, 1.79258772950371181e-01);
+my @vxs = map { $_ * DAYS_PER_YEAR }
+  (0, 1.66007664274403694e-03, -2.76742510726862411e-03, 2.96460137564761618e-03, 2.68067772490389322e-03);
+my @vys = map { $_ * DAYS_PER_YEAR }
+  (0, 7.69901118419740425e-03, 4.99852801234917238e-03, 2.37847173959480950e-03, 1.62824170038242295e-03);
+my @vzs = map { $_ * DAYS_PER_YEAR }
+  (0, -6.90460016972063023e-05, 2.30417297573763929e-05, -2.96589568540237556e-05, -9.51592254519715870e-05);
+my @mass = map { $_ * SOLAR_MASS }
+  (1, 9.54791938424326609e-04, 2.85885980666130812e-04, 4.36624404335156298e-05, 5.15138902046611451e-05);
+
+my $last = $#xs;
+
+sub offset_momentum {
+  my ($px, $py, $pz) = (0, 0, 0);
+  for my $i (0 .. $last) {
+    $px += $vxs[$i] * $mass[$i];
+    $py += $vys[$i] * $mass[$i];
+    $pz += $vzs[$i] * $mass[$i];
+  }
+  $vxs[0] = -$px / SOLAR_MASS;
+  $vys[0] = -$py / SOLAR_MASS;
+  $vzs[0] = -$pz / SOLAR_MASS;
+}
+
+sub energy {
+  my $e = 0;
+  for my $i (0 .. $last) {
+    $e += 0.5 * $mass[$i] * ($vxs[$i] * $vxs[$i] + $vys[$i] * $vys[$i] + $vzs[$i] * $vzs[$i]);
+    for my $j ($i + 1 .. $last) {
+      my $dx = $xs[$i] - $xs[$j];
+      my $dy = $ys[$i] - $ys[$j];
+      my $dz = $zs[$i] - $zs[$j];
+      $e -= $mass[$i] * $mass[$j] / sqrt($dx * $dx + $dy * $dy + $dz * $dz);
+    }
+  }
+  return $e;
+}
+
+sub advance {
+  my ($dt) = @_;
+  for my $i (0 .. $last) {
+    for my $j ($i + 1 .. $last) {
+      my $dx = $xs[$i] - $xs[$j];
+      my $dy = $ys[$i] - $ys[$j];
+      my $dz = $zs[$i] - $zs[$j];
+      my $d2 = $dx * $dx + $dy * $dy + $dz * $dz;
+      my $mag = $dt / ($d2 * sqrt($d2));
+      my $mi = $mass[$i] * $mag;
+      my $mj = $mass[$j] * $mag;
+      $vxs[$i] -= $dx * $mj;
+      $vys[$i] -= $dy * $mj;
+      $vzs[$i] -= $dz * $mj;
+      $vxs[$j] += $dx * $mi;
+      $vys[$j] += $dy * $mi;
+      $vzs[$j] += $dz * $mi;
+    }
+  }
+  for my $i (0 .. $last) {
+    $xs[$i] += $dt * $vxs[$i];
+    $ys[$i] += $dt * $vys[$i];
+    $zs[$i] += $dt * $vzs[$i];
+  }
+}
+
+offset_momentum();
+my $before = energy();
+advance(0.01) for 1 .. $steps;
+printf "%.9f %.9f\n", $before, energy();
@@ -0,0 +1,56 @@
+# The spectral norm of the infinite matrix A with a(i,j) = 1/((i+j)(i+j+1)/2+i+1),
+# as in the Computer Language Benchmarks Game. Argument: size of the
+# truncated matrix.
+use strict;
+use warnings;
+
+my $n = shift(@ARGV) || 150;
+
+sub a_elem {
+  my ($i, $j) = @_;
+  return 1 / (($i + $j) * ($i + $j + 1) / 2 + $i + 1);
+}
+
+sub times_vec {
+  my ($v) = @_;
+  my @r;
+  for my $i (0 .. $n - 1) {
+    my $sum = 0;
+    for my $j (0 .. $n - 1) {
+      $sum += a_elem($i, $j) * $v->[$j];
+    }
+    $r[$i] = $sum;
+  }
+  return \@r;
+}
+
+sub times_transp_vec {
+  my ($v) = @_;
+  my @r;
+  for my $i (0 .. $n - 1) {
+    my $sum = 0;
+    for my $j (0 .. $n - 1) {
+      $sum += a_elem($j, $i) * $v->[$j];
+    }
+    $r[$i] = $sum;
+  }
+  return \@r;
+}
+
+sub times_ata_vec {
+  return times_transp_vec(times_vec($_[0]));
+}
+
+my $u = [(1) x $n];
+my $v;
+for (1 .. 10) {
+  $v = times_ata_vec($u);
+  $u = times_ata_vec($v);
+}
+
+my ($vbv, $vv) = (0, 0);
+for my $i (0 .. $n - 1) {
+  $vbv += $u->[$i] * $v->[$i];
+  $vv += $v->[$i] * $v->[$i];
+}
+printf "%.9f\n", sqrt($vbv / $vv);
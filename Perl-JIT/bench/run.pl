@@ -0,0 +1,124 @@
+#!/usr/bin/env perl
+# Runs the kernels in bench/kernels with stock perl and with Perl::JIT
+# loaded and reports the timings as JSON. See bench/README.
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use File::Spec;
+use Getopt::Long qw(GetOptions);
+use JSON::PP ();
+use List::Util qw(sum min max);
+use Time::HiRes qw(time);
+
+my %opt = (
+  perl   => $^X,
+  repeat => 5,
+  lib    => [],
+);
+GetOptions(
+  'perl=s'   => \$opt{perl},
+  'repeat=i' => \$opt{repeat},
+  'kernel=s' => \$opt{kernel},
+  'size=i'   => \$opt{size},
+  'lib|I=s@' => $opt{lib},
+  'output=s' => \$opt{output},
+) or die "Usage: $0 [--perl PERL] [--repeat N] [--kernel REGEX] [--size N] [-I DIR] [--output FILE]\n";
+die "--repeat must be at least 1\n" if $opt{repeat} < 1;
+
+# By default, the build tree's blib, as for ./Build test
+my @inc = @{$opt{lib}};
+@inc = (File::Spec->catdir($Bin, '..', 'blib', 'lib'), File::Spec->catdir($Bin, '..', 'blib', 'arch'))
+  if !@inc;
+
+my $kerneldir = File::Spec->catdir($Bin, 'kernels');
+opendir(my $dh, $kerneldir) or die "Can't open $kerneldir: $!";
+my @kernels = sort grep { /\.pl\z/ && (!defined $opt{kernel} || /$opt{kernel}/) } readdir($dh);
+closedir($dh);
+die "No kernels to run\n" if !@kernels;
+
+# Runs the script once, returns the wall clock time and its output
+sub run_once {
+  my ($jit, $script, @args) = @_;
+  my @cmd = ($opt{perl}, (map "-I$_", @inc), ($jit ? ('-MPerl::JIT') : ()), $script, @args);
+  my $start = time;
+  open(my $fh, '-|', @cmd) or die "Can't run @cmd: $!";
+  my $output = do { local $/; <$fh> };
+  close($fh) or die "@cmd failed: " . ($! || "exit status " . ($? >> 8)) . "\n";
+  return (time - $start, $output);
+}
+
+sub median {
+  my @sorted = sort { $a <=> $b } @_;
+  my $mid = int(@sorted / 2);
+  return @sorted % 2 ? $sorted[$mid] : ($sorted[$mid - 1] + $sorted[$mid]) / 2;
+}
+
+sub stats {
+  my @times = @_;
+  my $mean = sum(@times) / @times;
+  my $var = @times > 1 ? sum(map { ($_ - $mean) ** 2 } @times) / (@times - 1) : 0;
+  return {
+    median => median(@times),
+    mean   => $mean,
+    min    => min(@times),
+    max    => max(@times),
+    stddev => sqrt($var),
+    runs   => \@times,
+  };
+}
+
+# Alternates between the two so that drift in machine load hits both
+sub measure {
+  my ($script, @args) = @_;
+  my (%times, %output);
+  for (1 .. $opt{repeat}) {
+    for my $jit (0, 1) {
+      my ($t, $out) = run_once($jit, $script, @args);
+      push @{$times{$jit}}, $t;
+      $output{$jit} = $out;
+    }
+  }
+  return (stats(@{$times{0}}), stats(@{$times{1}}), $output{0}, $output{1});
+}
+
+my @results;
+foreach my $kernel (@kernels) {
+  my $script = File::Spec->catfile($kerneldir, $kernel);
+  (my $name = $kernel) =~ s/\.pl\z//;
+  print STDERR "$name...\n";
+
+  my ($perl, $jit, $perl_out, $jit_out) = measure($script, defined $opt{size} ? ($opt{size}) : ());
+
+  # With a problem size of 1, the run time is mostly startup and
+  # compilation, and the difference is what Perl::JIT adds at compile time
+  my ($perl_small, $jit_small) = measure($script, 1);
+
+  push @results, {
+    kernel           => $name,
+    size             => $opt{size},
+    perl             => $perl,
+    jit              => $jit,
+    speedup          => $jit->{median} > 0 ? $perl->{median} / $jit->{median} : undef,
+    compile_overhead => $jit_small->{median} - $perl_small->{median},
+    output_matches   => ($perl_out eq $jit_out ? JSON::PP::true : JSON::PP::false),
+  };
+}
+
+my $report = {
+  perl      => $opt{perl},
+  version   => `$opt{perl} -e "print \$]"`,
+  repeat    => $opt{repeat},
+  timestamp => time,
+  kernels   => \@results,
+};
+
+my $json = JSON::PP->new->canonical->pretty->encode($report);
+if (defined $opt{output}) {
+  open(my $fh, '>', $opt{output}) or die "Can't write $opt{output}: $!";
+  print $fh $json;
+  close($fh);
+}
+else {
+  print $json;
+}
@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include <jit/jit.h>
@@ -12,11 +13,21 @@
 #include "mytap.h"
 
 void basic_term_tests();
+void pvload_tests();
+void fieldload_tests();
+void elemload_tests();
+void opcall_tests();
+void trace_tests();
 
 int
 main ()
 {
   basic_term_tests();
+  pvload_tests();
+  fieldload_tests();
+  elemload_tests();
+  opcall_tests();
+  trace_tests();
 
   ok_m(1, "alive at end");
   done_testing();
@@ -25,10 +36,74 @@ main ()
 
 #define TEST_ARGS_MAX 20
 
+/* Inlined calls: callee points to whether the guard holds */
+static int
+test_inline_guard(void *callee)
+{
+  return *(int *)callee;
+}
+
+/* Stands in for the real call of a redefined function: $a - $b */
+static double
+test_inline_fallback(void *callee, double *args, unsigned int nargs)
+{
+  (void)callee;
+  return nargs == 2 ? args[0] - args[1] : -1.;
+}
+
+/* Not very random */
+static double
+test_drand(void *state)
+{
+  return *(double *)state;
+}
+
+/* Runs the compiled function, converting its result to a double */
+static double
+invoke_as_double(void *closure, double *args, unsigned int nargs, pj_basic_type funtype)
+{
+  union {
+    double nv;
+    jit_long iv;
+    jit_ulong uv;
+  } result;
+
+  pj_invoke_func((pj_invoke_func_t)closure, args, nargs, funtype, (void *)&result);
+  if (funtype == pj_int_type)
+    return (double)result.iv;
+  if (funtype == pj_uint_type)
+    return (double)result.uv;
+  return result.nv;
+}
+
+static pj_term_t *
+make_inline_test_tree(int *guard)
+{
+  /* f($a, 2) with f($x, $y) = $x * $y inlined */
+  pj_term_t *body = pj_make_binop(
+    pj_binop_multiply,
+    pj_make_variable(0, pj_double_type),
+    pj_make_variable(1, pj_double_type)
+  );
+  pj_term_t *args[2];
+  pj_term_t *t;
+
+  args[0] = pj_make_variable(0, pj_double_type);
+  args[1] = pj_make_const_dbl(2.);
+  args[0]->op_sibling = args[1];
+  t = pj_make_inline(pj_clone_tree(body, args), args[0], 2, (void *)guard,
+                     test_inline_guard, test_inline_fallback);
+  pj_free_tree(body);
+
+  return pj_make_binop(pj_binop_add, t, pj_make_const_dbl(1.));
+}
+
 void
 basic_term_tests()
 {
-  const unsigned int ntests = 9;
+  const unsigned int ntests = 23;
+  static int guard_ok = 1, guard_failed = 0;
+  static double rand_value = 0.25;
   pj_term_t *test_tree[ntests];
   unsigned int test_inputcount[ntests];
   double *test_input[ntests];
@@ -150,6 +225,165 @@ basic_term_tests()
   test_input[i][0] = 3.0;
   test_output[i] = 0.1;
 
+  i = 9;
+  test_name[i] = "$a <=> $b, $a == 1, $b == 2";
+  test_inputcount[i] = 2;
+  test_tree[i] = pj_make_binop(
+    pj_binop_ncmp,
+    pj_make_variable(0, pj_double_type),
+    pj_make_variable(1, pj_double_type)
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*2);
+  test_input[i][0] = 1.;
+  test_input[i][1] = 2.;
+  test_output[i] = -1.;
+
+  i = 10;
+  test_name[i] = "$a % 3, $a == -7";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_modulo,
+    pj_make_variable(0, pj_double_type),
+    pj_make_const_dbl(3.)
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = -7.;
+  test_output[i] = 2.;
+
+  i = 11;
+  test_name[i] = "use integer; $a % 3, $a == -7.5";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_i_modulo,
+    pj_make_unop(pj_unop_iv, pj_make_variable(0, pj_double_type)),
+    pj_make_unop(pj_unop_iv, pj_make_const_dbl(3.))
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = -7.5;
+  test_output[i] = -1.;
+
+  i = 12;
+  test_name[i] = "use integer; $a / 2, $a == -7.5";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_divide,
+    pj_make_unop(pj_unop_iv, pj_make_variable(0, pj_double_type)),
+    pj_make_unop(pj_unop_iv, pj_make_const_dbl(2.))
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = -7.5;
+  test_output[i] = -3.;
+
+  i = 13;
+  test_name[i] = "inlined f($a, 2) + 1, guard holds, $a == 3";
+  test_inputcount[i] = 1;
+  test_tree[i] = make_inline_test_tree(&guard_ok);
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = 3.;
+  test_output[i] = 7.;
+
+  i = 14;
+  test_name[i] = "inlined f($a, 2) + 1, guard fails, $a == 3";
+  test_inputcount[i] = 1;
+  test_tree[i] = make_inline_test_tree(&guard_failed);
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = 3.;
+  test_output[i] = 2.;
+
+  i = 15;
+  test_name[i] = "floor($a), $a == -2.5";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_unop(pj_unop_floor, pj_make_variable(0, pj_double_type));
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = -2.5;
+  test_output[i] = -3.;
+
+  i = 16;
+  test_name[i] = "max(min($a, 3), 2), $a == 5";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_max,
+    pj_make_binop(pj_binop_min, pj_make_variable(0, pj_double_type), pj_make_const_dbl(3.)),
+    pj_make_const_dbl(2.)
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = 5.;
+  test_output[i] = 3.;
+
+  pj_drand_func = test_drand;
+  pj_drand_state = (void *)&rand_value;
+
+  i = 17;
+  test_name[i] = "rand($a), $a == 4";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_unop(pj_unop_rand, pj_make_variable(0, pj_double_type));
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = 4.;
+  test_output[i] = 1.;
+
+  i = 18;
+  test_name[i] = "rand($a), $a == 0 (same as 1)";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_unop(pj_unop_rand, pj_make_variable(0, pj_double_type));
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = 0.;
+  test_output[i] = 0.25;
+
+  i = 19;
+  test_name[i] = "$a >> 60, $a == -1 (a UV)";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_right_shift,
+    pj_make_unop(pj_unop_uv, pj_make_variable(0, pj_double_type)),
+    pj_make_unop(pj_unop_uv, pj_make_const_dbl(60.))
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = -1.;
+  test_output[i] = 15.;
+
+  i = 20;
+  test_name[i] = "use integer; $a >> 70, $a == -5";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_right_shift,
+    pj_make_unop(pj_unop_iv, pj_make_variable(0, pj_double_type)),
+    pj_make_unop(pj_unop_iv, pj_make_const_dbl(70.))
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = -5.;
+  test_output[i] = -1.;
+
+  i = 21;
+  test_name[i] = "~$a & 255, $a == 1";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_bitwise_and,
+    pj_make_unop(pj_unop_uv, pj_make_unop(pj_unop_bitwise_not,
+                                          pj_make_unop(pj_unop_uv, pj_make_variable(0, pj_double_type)))),
+    pj_make_unop(pj_unop_uv, pj_make_const_dbl(255.))
+  );
+  test_input[i] = (double *)malloc(sizeof(double)*1);
+  test_input[i][0] = 1.;
+  test_output[i] = 254.;
+
+  i = 22;
+  test_name[i] = "use integer; $a - 2**53, $a == 2**53 + 1 passed as an IV";
+  test_inputcount[i] = 1;
+  test_tree[i] = pj_make_binop(
+    pj_binop_subtract,
+    pj_make_unop(pj_unop_iv, pj_make_variable(0, pj_double_type)),
+    pj_make_unop(pj_unop_iv, pj_make_const_int(9007199254740992LL))
+  );
+  {
+    char int_vars[1];
+    const jit_long iv = 9007199254740993LL;
+    pj_tree_type_int_vars(test_tree[i], int_vars, 1);
+    ok_m(int_vars[0], "$a is only used as an IV");
+    test_input[i] = (double *)malloc(sizeof(double)*1);
+    memcpy(&test_input[i][0], &iv, sizeof(iv));
+  }
+  test_output[i] = 1.;
+
   for (i = 0; i < ntests; ++i) {
     jit_context_t context;
     pj_basic_type funtype;
@@ -165,10 +399,22 @@ basic_term_tests()
     ok_m(0 == pj_tree_jit(context, test_tree[i], &func, &funtype), namebuf);
 
     closure = jit_function_to_closure(func);
-    pj_invoke_func((pj_invoke_func_t)closure, test_input[i], test_inputcount[i], funtype, (void *)&result);
+    result = invoke_as_double(closure, test_input[i], test_inputcount[i], funtype);
     sprintf(namebuf, "%s, result correct", test_name[i]);
     is_double_m(1e-9, result, test_output[i], namebuf);
 
+    /* The cold tier's unoptimized code computes the same, compiled
+     * into the space of the function it replaces */
+    jit_function_destroy(func);
+    func = NULL;
+    sprintf(namebuf, "%s, unoptimized JIT succeeded", test_name[i]);
+    ok_m(0 == pj_tree_jit_level(context, test_tree[i], JIT_OPTLEVEL_NONE, &func, &funtype), namebuf);
+
+    closure = jit_function_to_closure(func);
+    result = invoke_as_double(closure, test_input[i], test_inputcount[i], funtype);
+    sprintf(namebuf, "%s, unoptimized result correct", test_name[i]);
+    is_double_m(1e-9, result, test_output[i], namebuf);
+
     jit_context_destroy(context);
 
     pj_free_tree(test_tree[i]);
@@ -177,3 +423,391 @@ basic_term_tests()
 
 }
 
+
+
+void
+pvload_tests()
+{
+  const unsigned char data[] = {0x01, 0x02, 0x03, 0x04, 0x05};
+  const double dbl = -2.5;
+  pj_pvbuf_t buf;
+  const unsigned int ntests = 9;
+  pj_term_t *test_tree[ntests];
+  double test_input[ntests];
+  double test_output[ntests];
+  char *test_name[ntests];
+  unsigned int i;
+
+  i = 0;
+  test_name[i] = "native uint8 load";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint8, 0,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  test_input[i] = 4;
+  test_output[i] = 5;
+
+  i = 1;
+  test_name[i] = "big endian uint16 load";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint16, PJ_PVLOADf_BIG_ENDIAN,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  test_input[i] = 1;
+  test_output[i] = 0x0203;
+
+  i = 2;
+  test_name[i] = "little endian uint32 load, negative offset from end";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint32, PJ_PVLOADf_LITTLE_ENDIAN|PJ_PVLOADf_NEG_FROM_END,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  test_input[i] = -4;
+  test_output[i] = 0x05040302;
+
+  i = 3;
+  test_name[i] = "out of bounds load";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint32, 0,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  test_input[i] = 2;
+  test_output[i] = 0;
+
+  i = 4;
+  test_name[i] = "zero-padded scaled big endian load (vec)";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint16, PJ_PVLOADf_BIG_ENDIAN|PJ_PVLOADf_ZERO_PAD,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 2);
+  test_input[i] = 2;
+  test_output[i] = 0x0500;
+
+  i = 5;
+  test_name[i] = "negative offset before the start is clamped";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint32, PJ_PVLOADf_LITTLE_ENDIAN|PJ_PVLOADf_NEG_FROM_END,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  test_input[i] = -100;
+  test_output[i] = 0x04030201;
+
+  i = 6;
+  test_name[i] = "clamped substring keeps the rest of its length";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint32, PJ_PVLOADf_BIG_ENDIAN|PJ_PVLOADf_NEG_FROM_END,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  ((pj_pvload_t *)test_tree[i])->sublen = 5;
+  test_input[i] = -6;
+  test_output[i] = 0x01020304;
+
+  i = 7;
+  test_name[i] = "clamped substring too short for the element";
+  test_tree[i] = pj_make_pvload(pj_pvload_uint32, PJ_PVLOADf_BIG_ENDIAN|PJ_PVLOADf_NEG_FROM_END,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  ((pj_pvload_t *)test_tree[i])->sublen = 5;
+  test_input[i] = -7;
+  test_output[i] = 0;
+
+  i = 8;
+  test_name[i] = "double load";
+  test_tree[i] = pj_make_pvload(pj_pvload_double, 0,
+                                pj_make_variable(0, pj_double_type),
+                                pj_make_variable(1, pj_double_type), 1);
+  test_input[i] = 0;
+  test_output[i] = dbl;
+
+  for (i = 0; i < ntests; ++i) {
+    jit_context_t context;
+    pj_basic_type funtype;
+    jit_function_t func = NULL;
+    void *closure;
+    double args[2];
+    double result = 0.;
+    char namebuf[1024];
+
+    if (i == ntests-1) {
+      buf.pv = (const char *)&dbl;
+      buf.len = sizeof(dbl);
+    }
+    else {
+      buf.pv = (const char *)data;
+      buf.len = sizeof(data);
+    }
+    ((pj_pvload_t *)test_tree[i])->buf = &buf;
+
+    context = jit_context_create();
+
+    sprintf(namebuf, "%s, JIT succeeded", test_name[i]);
+    ok_m(0 == pj_tree_jit(context, test_tree[i], &func, &funtype), namebuf);
+
+    args[0] = 0.; /* the buffer slot */
+    args[1] = test_input[i];
+    closure = jit_function_to_closure(func);
+    pj_invoke_func((pj_invoke_func_t)closure, args, 2, funtype, (void *)&result);
+    sprintf(namebuf, "%s, result correct", test_name[i]);
+    /* the loads yield exact integers up to 2**32, where 1e-9 is below one ulp */
+    is_double_m(1e-6, result, test_output[i], namebuf);
+
+    jit_context_destroy(context);
+    pj_free_tree(test_tree[i]);
+  }
+}
+
+
+/* Records are arrays of doubles, keys point to the index */
+static double
+test_field_fetch(void *record, void *key)
+{
+  return ((double *)record)[*(int *)key];
+}
+
+void
+fieldload_tests()
+{
+  double p[2] = {1.5, -2.};
+  double q[2] = {4., 3.};
+  int xkey = 0, ykey = 1;
+  void *records[2];
+  pj_term_t *tree;
+  pj_term_t **fieldloads;
+  unsigned int nfieldloads, i;
+  jit_context_t context;
+  pj_basic_type funtype;
+  jit_function_t func = NULL;
+  void *closure;
+  double args[2] = {0., 0.}; /* the record slots */
+  double result = 0.;
+
+  /* $p->{x} * $q->{x} + $p->{y} * $q->{y} */
+  tree = pj_make_binop(
+    pj_binop_add,
+    pj_make_binop(
+      pj_binop_multiply,
+      pj_make_fieldload(pj_make_variable(0, pj_double_type), &xkey, test_field_fetch),
+      pj_make_fieldload(pj_make_variable(1, pj_double_type), &xkey, test_field_fetch)
+    ),
+    pj_make_binop(
+      pj_binop_multiply,
+      pj_make_fieldload(pj_make_variable(0, pj_double_type), &ykey, test_field_fetch),
+      pj_make_fieldload(pj_make_variable(1, pj_double_type), &ykey, test_field_fetch)
+    )
+  );
+
+  pj_tree_extract_terms(tree, pj_ttype_fieldload, &fieldloads, &nfieldloads);
+  is_int_m(4, nfieldloads, "dot product of records, found all field loads");
+  for (i = 0; i < nfieldloads; ++i) {
+    pj_fieldload_t *f = (pj_fieldload_t *)fieldloads[i];
+    f->record = &records[((pj_variable_t *)f->container)->ivar];
+  }
+  free(fieldloads);
+
+  context = jit_context_create();
+  ok_m(0 == pj_tree_jit(context, tree, &func, &funtype), "dot product of records, JIT succeeded");
+
+  records[0] = p;
+  records[1] = q;
+  closure = jit_function_to_closure(func);
+  pj_invoke_func((pj_invoke_func_t)closure, args, 2, funtype, (void *)&result);
+  is_double_m(1e-9, result, 0., "dot product of records, result correct");
+
+  /* Published at call time, not compile time */
+  records[1] = p;
+  pj_invoke_func((pj_invoke_func_t)closure, args, 2, funtype, (void *)&result);
+  is_double_m(1e-9, result, 6.25, "dot product of records, result correct for other record");
+
+  jit_context_destroy(context);
+  pj_free_tree(tree);
+}
+
+
+/* Records are 2x2 matrices of doubles, rows are the first index */
+static double
+test_elem2_fetch(void *record, ptrdiff_t i, ptrdiff_t j)
+{
+  return ((double *)record)[i * 2 + j];
+}
+
+void
+elemload_tests()
+{
+  double m[4] = {1., 2., 3., 4.};
+  void *records[2] = {m, NULL};
+  pj_term_t *tree;
+  pj_term_t **elemloads;
+  unsigned int nelemloads, i;
+  jit_context_t context;
+  pj_basic_type funtype;
+  jit_function_t func = NULL;
+  void *closure;
+  double args[2] = {0., 1.9}; /* the record slot, the row index */
+  double result = 0.;
+
+  /* $m->[$i][0] + $m->[$i][1] * 10 */
+  tree = pj_make_binop(
+    pj_binop_add,
+    pj_make_elemload(pj_make_variable(0, pj_double_type),
+                     pj_make_variable(1, pj_double_type), pj_make_const_int(0),
+                     test_elem2_fetch),
+    pj_make_binop(
+      pj_binop_multiply,
+      pj_make_elemload(pj_make_variable(0, pj_double_type),
+                       pj_make_variable(1, pj_double_type), pj_make_const_int(1),
+                       test_elem2_fetch),
+      pj_make_const_dbl(10.)
+    )
+  );
+
+  pj_tree_extract_terms(tree, pj_ttype_elemload, &elemloads, &nelemloads);
+  is_int_m(2, nelemloads, "matrix row sum, found all element loads");
+  for (i = 0; i < nelemloads; ++i) {
+    pj_elemload_t *e = (pj_elemload_t *)elemloads[i];
+    e->record = &records[((pj_variable_t *)e->container)->ivar];
+  }
+  free(elemloads);
+
+  context = jit_context_create();
+  ok_m(0 == pj_tree_jit(context, tree, &func, &funtype), "matrix row sum, JIT succeeded");
+
+  /* The index is truncated, like Perl's */
+  closure = jit_function_to_closure(func);
+  pj_invoke_func((pj_invoke_func_t)closure, args, 2, funtype, (void *)&result);
+  is_double_m(1e-9, result, 43., "matrix row sum, result correct");
+
+  args[1] = 0.;
+  pj_invoke_func((pj_invoke_func_t)closure, args, 2, funtype, (void *)&result);
+  is_double_m(1e-9, result, 21., "matrix row sum, result correct for other row");
+
+  jit_context_destroy(context);
+  pj_free_tree(tree);
+}
+
+
+/* The op is a counter of calls. Yields the first arg minus the second. */
+static double
+test_opcall(void *op, double *args, unsigned int nargs)
+{
+  ++*(int *)op;
+  return nargs == 2 ? args[0] - args[1] : -1.;
+}
+
+void
+opcall_tests()
+{
+  int ncalls = 0;
+  pj_term_t *tree, *args;
+  pj_variable_t **vars;
+  unsigned int nvars;
+  jit_context_t context;
+  pj_basic_type funtype;
+  jit_function_t func = NULL;
+  void *closure;
+  double params[2] = {5., 2.};
+  double result = 0.;
+
+  /* ($x > 0 && OPCALL($x * 2, $y)) + 1 */
+  args = pj_make_binop(pj_binop_multiply, pj_make_variable(0, pj_double_type), pj_make_const_dbl(2.));
+  args->op_sibling = pj_make_variable(1, pj_double_type);
+  tree = pj_make_binop(
+    pj_binop_add,
+    pj_make_binop(
+      pj_binop_bool_and,
+      pj_make_binop(pj_binop_gt, pj_make_variable(0, pj_double_type), pj_make_const_dbl(0.)),
+      pj_make_opcall(args, 2, &ncalls, test_opcall)
+    ),
+    pj_make_const_dbl(1.)
+  );
+
+  pj_tree_extract_vars(tree, &vars, &nvars);
+  is_int_m(3, nvars, "opcall, found variables in arguments");
+  free(vars);
+
+  context = jit_context_create();
+  ok_m(0 == pj_tree_jit(context, tree, &func, &funtype), "opcall, JIT succeeded");
+
+  closure = jit_function_to_closure(func);
+  pj_invoke_func((pj_invoke_func_t)closure, params, 2, funtype, (void *)&result);
+  is_double_m(1e-9, result, 9., "opcall, result correct");
+  is_int_m(1, ncalls, "opcall, called once");
+
+  /* Conditionally evaluated like any other term */
+  params[0] = -1.;
+  pj_invoke_func((pj_invoke_func_t)closure, params, 2, funtype, (void *)&result);
+  is_double_m(1e-9, result, 1., "opcall, result correct if not called");
+  is_int_m(1, ncalls, "opcall, not called");
+
+  jit_context_destroy(context);
+  pj_free_tree(tree);
+}
+
+void
+trace_tests()
+{
+  pj_trace_step_t steps[4];
+  jit_context_t context;
+  jit_function_t func = NULL;
+  pj_trace_func_t closure;
+  double vars[2];
+  jit_nint niter = -1, iexit;
+  unsigned int i;
+
+  /* while ($i < 5) { $s += $i * $i; last if $s > 100; $i++ } */
+  steps[0].term = pj_make_binop(pj_binop_lt, pj_make_variable(0, pj_double_type), pj_make_const_dbl(5.));
+  steps[0].ivar = -1;
+  steps[0].expected = 1;
+  steps[0].exit = 0;
+  steps[0].exact_int = 0;
+  steps[1].term = pj_make_binop(
+    pj_binop_add,
+    pj_make_variable(1, pj_double_type),
+    pj_make_binop(pj_binop_multiply, pj_make_variable(0, pj_double_type), pj_make_variable(0, pj_double_type))
+  );
+  steps[1].ivar = 1;
+  steps[1].exact_int = 0;
+  steps[2].term = pj_make_binop(pj_binop_gt, pj_make_variable(1, pj_double_type), pj_make_const_dbl(100.));
+  steps[2].ivar = -1;
+  steps[2].expected = 0;
+  steps[2].exit = 1;
+  steps[2].exact_int = 0;
+  steps[3].term = pj_make_binop(pj_binop_add, pj_make_variable(0, pj_double_type), pj_make_const_dbl(1.));
+  steps[3].ivar = 0;
+  steps[3].exact_int = 0;
+
+  context = jit_context_create();
+  ok_m(0 == pj_tree_jit_trace(context, steps, 4, 2, 1000, &func), "trace, JIT succeeded");
+  closure = (pj_trace_func_t)jit_function_to_closure(func);
+
+  vars[0] = 0.;
+  vars[1] = 0.;
+  iexit = closure(vars, &niter);
+  is_int_m(0, (int)iexit, "trace, left through the loop condition");
+  is_int_m(5, (int)niter, "trace, iterations counted");
+  is_double_m(1e-9, vars[0], 5., "trace, counter written back");
+  is_double_m(1e-9, vars[1], 30., "trace, sum written back");
+
+  vars[0] = 0.;
+  vars[1] = 90.;
+  iexit = closure(vars, &niter);
+  is_int_m(1, (int)iexit, "trace, left through the side exit");
+  is_int_m(3, (int)niter, "trace, completed iterations counted");
+  is_double_m(1e-9, vars[0], 3., "trace, counter as of the side exit");
+  is_double_m(1e-9, vars[1], 104., "trace, sum as of the side exit");
+
+  jit_context_destroy(context);
+  for (i = 0; i < 4; ++i)
+    pj_free_tree(steps[i].term);
+
+  /* while (1) { $i += $i } with an integer $i */
+  steps[0].term = pj_make_binop(pj_binop_add, pj_make_variable(0, pj_double_type), pj_make_variable(0, pj_double_type));
+  steps[0].ivar = 0;
+  steps[0].exit = 2;
+  steps[0].exact_int = 1;
+
+  context = jit_context_create();
+  ok_m(0 == pj_tree_jit_trace(context, steps, 1, 1, 1000, &func), "integer trace, JIT succeeded");
+  closure = (pj_trace_func_t)jit_function_to_closure(func);
+
+  vars[0] = 1125899906842624.; /* 2**50 */
+  iexit = closure(vars, &niter);
+  is_int_m(2, (int)iexit, "integer trace, left before losing precision");
+  is_int_m(3, (int)niter, "integer trace, iterations counted");
+  ok_m(vars[0] == 9007199254740992., "integer trace, last exact value written back");
+
+  jit_context_destroy(context);
+  pj_free_tree(steps[0].term);
+}
@@ -0,0 +1,317 @@
+/* Microbenchmark of the AST layer: generates random trees of a given
+ * size and op mix and measures how long pj_tree_jit takes to compile
+ * them, how much code that yields, and how long a call to the compiled
+ * function takes via jit_function_apply, via the closure pointer and via
+ * pj_invoke_func. Built along with the C tests (--ctests) but not run
+ * by ./Build test, see bench/README. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <jit/jit.h>
+
+#include <pj_ast_terms.h>
+#include <pj_ast_walkers.h>
+#include <pj_ast_jit.h>
+
+#define BENCH_MAX_VARS 4
+
+typedef enum {
+  bench_mix_arith,
+  bench_mix_cmp,
+  bench_mix_math,
+  bench_mix_mixed
+} bench_mix;
+
+typedef struct {
+  unsigned int ntrees;
+  unsigned int nops;
+  unsigned int ncalls;
+  unsigned int level;
+  bench_mix mix;
+  unsigned long seed;
+} bench_options_t;
+
+/* Ops that can't fail at run time, by mix */
+static const pj_optype bench_arith_ops[] = {
+  pj_binop_add, pj_binop_subtract, pj_binop_multiply, pj_binop_min,
+  pj_binop_max, pj_unop_negate, pj_unop_abs
+};
+static const pj_optype bench_cmp_ops[] = {
+  pj_binop_eq, pj_binop_ne, pj_binop_lt, pj_binop_le, pj_binop_gt,
+  pj_binop_ge, pj_binop_ncmp, pj_binop_bool_and, pj_binop_bool_or,
+  pj_unop_bool_not, pj_binop_add
+};
+static const pj_optype bench_math_ops[] = {
+  pj_unop_sin, pj_unop_cos, pj_unop_exp, pj_unop_floor, pj_unop_ceil,
+  pj_binop_atan2, pj_binop_fmod, pj_binop_multiply, pj_binop_add
+};
+
+/* xorshift64, so that runs with the same seed see the same trees */
+static unsigned long long bench_rng_state;
+
+static unsigned int
+bench_rand(unsigned int n)
+{
+  bench_rng_state ^= bench_rng_state << 13;
+  bench_rng_state ^= bench_rng_state >> 7;
+  bench_rng_state ^= bench_rng_state << 17;
+  return (unsigned int)(bench_rng_state % n);
+}
+
+static pj_optype
+bench_pick_op(bench_mix mix)
+{
+  switch (mix) {
+  case bench_mix_arith:
+    return bench_arith_ops[bench_rand(sizeof(bench_arith_ops) / sizeof(pj_optype))];
+  case bench_mix_cmp:
+    return bench_cmp_ops[bench_rand(sizeof(bench_cmp_ops) / sizeof(pj_optype))];
+  case bench_mix_math:
+    return bench_math_ops[bench_rand(sizeof(bench_math_ops) / sizeof(pj_optype))];
+  default:
+    return bench_pick_op((bench_mix)bench_rand(bench_mix_mixed));
+  }
+}
+
+/* A tree of exactly nops ops, with variables and constants as leaves */
+static pj_term_t *
+bench_make_tree(unsigned int nops, bench_mix mix)
+{
+  pj_optype op;
+  unsigned int nleft;
+
+  if (nops == 0) {
+    if (bench_rand(4) == 0)
+      return pj_make_const_dbl(0.5 + bench_rand(100) / 10.);
+    return pj_make_variable(bench_rand(BENCH_MAX_VARS), pj_double_type);
+  }
+
+  /* fmod's divisor is a constant that isn't 0 */
+  op = bench_pick_op(mix);
+  if (op == pj_binop_fmod)
+    return pj_make_binop(op, bench_make_tree(nops - 1, mix), pj_make_const_dbl(1.5 + bench_rand(10)));
+  if (op >= pj_unop_FIRST && op <= pj_unop_LAST)
+    return pj_make_unop(op, bench_make_tree(nops - 1, mix));
+
+  nleft = bench_rand(nops);
+  return pj_make_binop(op, bench_make_tree(nleft, mix), bench_make_tree(nops - 1 - nleft, mix));
+}
+
+static unsigned int
+bench_nparams(pj_term_t *tree)
+{
+  pj_variable_t **vars;
+  unsigned int nvar_uses, i, n = 0;
+
+  pj_tree_extract_vars(tree, &vars, &nvar_uses);
+  for (i = 0; i < nvar_uses; ++i) {
+    if ((unsigned int)vars[i]->ivar + 1 > n)
+      n = (unsigned int)vars[i]->ivar + 1;
+  }
+  free(vars);
+  return n;
+}
+
+static double
+bench_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The default memory manager, but remembering its context so that the
+ * size of compiled functions can be looked up */
+static jit_memory_context_t bench_memctx = NULL;
+static struct jit_memory_manager bench_memory_manager;
+
+static jit_memory_context_t
+bench_memory_create(jit_context_t context)
+{
+  bench_memctx = jit_default_memory_manager()->create(context);
+  return bench_memctx;
+}
+
+static unsigned long
+bench_code_size(void *closure)
+{
+  jit_memory_manager_t mm = jit_default_memory_manager();
+  void *info;
+
+  if (bench_memctx == NULL || (info = mm->find_function_info(bench_memctx, closure)) == NULL)
+    return 0;
+  return (unsigned long)((char *)mm->get_function_end(bench_memctx, info)
+                         - (char *)mm->get_function_start(bench_memctx, info));
+}
+
+/* Calls with a fixed number of double arguments, the way a C caller
+ * that knows the signature would. Only for funtype pj_double_type. */
+static double
+bench_call_closure(void *closure, double *a, unsigned int n)
+{
+  switch (n) {
+  case 0: return ((double (*)(void))closure)();
+  case 1: return ((double (*)(double))closure)(a[0]);
+  case 2: return ((double (*)(double, double))closure)(a[0], a[1]);
+  case 3: return ((double (*)(double, double, double))closure)(a[0], a[1], a[2]);
+  default: return ((double (*)(double, double, double, double))closure)(a[0], a[1], a[2], a[3]);
+  }
+}
+
+/* Results go here to keep the calls from being optimized away */
+static volatile double bench_sink;
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+static void
+bench_report(const char *what, double *samples, unsigned int n)
+{
+  if (n == 0) {
+    printf("%-32s (no samples)\n", what);
+    return;
+  }
+  qsort(samples, n, sizeof(double), bench_cmp_double);
+  printf("%-32s p50 %10.1f  p90 %10.1f  p99 %10.1f  max %10.1f\n", what,
+         samples[n / 2], samples[n * 9 / 10], samples[n * 99 / 100], samples[n - 1]);
+}
+
+static void
+bench_usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-t TREES] [-n OPS] [-c CALLS] [-m arith|cmp|math|mixed] [-O LEVEL] [-s SEED]\n",
+          prog);
+  exit(2);
+}
+
+static void
+bench_parse_options(int argc, char **argv, bench_options_t *opt)
+{
+  int i;
+
+  opt->ntrees = 200;
+  opt->nops = 32;
+  opt->ncalls = 10000;
+  opt->level = jit_function_get_max_optimization_level();
+  opt->mix = bench_mix_mixed;
+  opt->seed = 42;
+
+  for (i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc ? argv[i + 1] : NULL);
+    if (arg[0] != '-' || arg[1] == '\0' || arg[2] != '\0' || val == NULL)
+      bench_usage(argv[0]);
+    ++i;
+    switch (arg[1]) {
+    case 't': opt->ntrees = (unsigned int)atoi(val); break;
+    case 'n': opt->nops = (unsigned int)atoi(val); break;
+    case 'c': opt->ncalls = (unsigned int)atoi(val); break;
+    case 'O': opt->level = (unsigned int)atoi(val); break;
+    case 's': opt->seed = strtoul(val, NULL, 10); break;
+    case 'm':
+      if (strcmp(val, "arith") == 0)      opt->mix = bench_mix_arith;
+      else if (strcmp(val, "cmp") == 0)   opt->mix = bench_mix_cmp;
+      else if (strcmp(val, "math") == 0)  opt->mix = bench_mix_math;
+      else if (strcmp(val, "mixed") == 0) opt->mix = bench_mix_mixed;
+      else bench_usage(argv[0]);
+      break;
+    default:
+      bench_usage(argv[0]);
+    }
+  }
+  if (opt->ntrees == 0 || opt->ncalls == 0)
+    bench_usage(argv[0]);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char *mix_names[] = {"arith", "cmp", "math", "mixed"};
+  bench_options_t opt;
+  jit_context_t context;
+  double *compile_us, *code_bytes, *apply_ns, *closure_ns, *invoke_ns;
+  unsigned int nclosure = 0, t, i;
+  double args[BENCH_MAX_VARS] = {0.25, 1.5, -2., 3.75};
+  void *arg_ptrs[BENCH_MAX_VARS];
+
+  bench_parse_options(argc, argv, &opt);
+  bench_rng_state = 0x9E3779B97F4A7C15ULL ^ opt.seed;
+  for (i = 0; i < BENCH_MAX_VARS; ++i)
+    arg_ptrs[i] = &args[i];
+
+  compile_us = (double *)malloc(opt.ntrees * sizeof(double));
+  code_bytes = (double *)malloc(opt.ntrees * sizeof(double));
+  apply_ns = (double *)malloc(opt.ntrees * sizeof(double));
+  closure_ns = (double *)malloc(opt.ntrees * sizeof(double));
+  invoke_ns = (double *)malloc(opt.ntrees * sizeof(double));
+
+  bench_memory_manager = *jit_default_memory_manager();
+  bench_memory_manager.create = bench_memory_create;
+  context = jit_context_create();
+  jit_context_set_memory_manager(context, &bench_memory_manager);
+
+  for (t = 0; t < opt.ntrees; ++t) {
+    pj_term_t *tree = bench_make_tree(opt.nops, opt.mix);
+    const unsigned int nparams = bench_nparams(tree);
+    jit_function_t func = NULL;
+    pj_basic_type funtype;
+    void *closure;
+    double start, result[2];
+
+    start = bench_now_ns();
+    if (0 != pj_tree_jit_level(context, tree, opt.level, &func, &funtype)) {
+      fprintf(stderr, "Tree %u failed to compile\n", t);
+      return 1;
+    }
+    compile_us[t] = (bench_now_ns() - start) / 1000.;
+    closure = jit_function_to_closure(func);
+    code_bytes[t] = (double)bench_code_size(closure);
+
+    start = bench_now_ns();
+    for (i = 0; i < opt.ncalls; ++i) {
+      jit_function_apply(func, arg_ptrs, result);
+      bench_sink = result[0];
+    }
+    apply_ns[t] = (bench_now_ns() - start) / opt.ncalls;
+
+    if (funtype == pj_double_type) {
+      start = bench_now_ns();
+      for (i = 0; i < opt.ncalls; ++i)
+        bench_sink = bench_call_closure(closure, args, nparams);
+      closure_ns[nclosure++] = (bench_now_ns() - start) / opt.ncalls;
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < opt.ncalls; ++i) {
+      pj_invoke_func((pj_invoke_func_t)closure, args, nparams, funtype, (void *)result);
+      bench_sink = result[0];
+    }
+    invoke_ns[t] = (bench_now_ns() - start) / opt.ncalls;
+
+    pj_free_tree(tree);
+  }
+
+  printf("%u trees of %u ops (%s), optimization level %u, %u calls each\n",
+         opt.ntrees, opt.nops, mix_names[opt.mix], opt.level, opt.ncalls);
+  bench_report("compile (us)", compile_us, opt.ntrees);
+  bench_report("code size (bytes)", code_bytes, opt.ntrees);
+  bench_report("call, jit_function_apply (ns)", apply_ns, opt.ntrees);
+  bench_report("call, closure (ns)", closure_ns, nclosure);
+  bench_report("call, pj_invoke_func (ns)", invoke_ns, opt.ntrees);
+
+  jit_context_destroy(context);
+  free(compile_us);
+  free(code_bytes);
+  free(apply_ns);
+  free(closure_ns);
+  free(invoke_ns);
+  return 0;
+}
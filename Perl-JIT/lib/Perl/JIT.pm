@@ -6,13 +6,39 @@ our $VERSION = '0.01';
 require XSLoader;
 XSLoader::load("Perl::JIT", $VERSION);
 
-#sub import {
-#  $^H{jit} = 1;
-#}
-
-#sub unimport {
-#  $^H{jit} = 0;
-#}
+my %options = map { $_ => "Perl::JIT/$_" } qw(reassociate optimize);
+
+sub import {
+  my $class = shift;
+  while (@_) {
+    my $opt = shift;
+    if ($opt eq 'trace') {
+      _set_tracing(1);
+      next;
+    }
+    my $key = $options{$opt};
+    if (!defined $key) {
+      require Carp;
+      Carp::croak("Unknown Perl::JIT option '$opt'");
+    }
+    if ($opt eq 'optimize') {
+      my $level = shift;
+      if (!defined $level || $level !~ /^[0-9]+\z/) {
+        require Carp;
+        Carp::croak("Perl::JIT option 'optimize' needs a level");
+      }
+      $^H{$key} = $level;
+      next;
+    }
+    $^H{$key} = 1;
+  }
+}
+
+sub unimport {
+  my $class = shift;
+  _set_tracing(0) if grep $_ eq 'trace', @_;
+  delete $^H{$options{$_} || $_} for grep $_ ne 'trace', (@_ ? @_ : keys %options);
+}
 
 1;
 __END__
@@ -29,6 +55,53 @@ Perl::JIT - Perl extension for blah blah blah
 
 =head1 DESCRIPTION
 
+=head2 Options
+
+Options are lexically scoped, and C<no Perl::JIT 'OPTION'> turns them
+off again.
+
+=over 4
+
+=item reassociate
+
+  use Perl::JIT 'reassociate';
+  my $total = sum(map { $_ * $_ } @x);
+
+Allows floating point sums (of C<List::Util::sum> over C<map>) to be
+computed in a different order than Perl would, with several partial
+sums in flight. That is faster, but the result may differ in the last
+bits.
+
+=item optimize
+
+  use Perl::JIT optimize => 0;
+
+How hard libjit tries to optimize the code compiled in the scope,
+trading compile time against the speed of the code. Level 0 turns the
+optimizer off, level 1 has it clean up control flow, propagate copies
+and drop instructions whose results are unused, and level 2 (the
+default) also has it reuse values that were already computed. Outside
+of the scopes that set it, the level is taken from the
+C<PERL_JIT_OPTIMIZE> environment variable, if that's set. Expressions
+are compiled with the optimizer off when they're first run either way,
+and only compiled again at this level once they have run often.
+
+=item trace
+
+  use Perl::JIT 'trace';
+  while ($i < $n) { $s += $i * $i; $i++ }
+
+Runs the program with a run loop that watches for hot loops. Once a
+loop has gone round often enough, one iteration is recorded and, if it
+only does arithmetic on lexicals that hold numbers, compiled to native
+code. That runs for as long as the conditions of the loop come out the
+way they did while recording and otherwise hands back to perl at the
+start of the statement. Unlike the other options, this one affects the
+whole program and isn't lexically scoped. It stays off while the
+debugger is in use.
+
+=back
+
 =head1 SEE ALSO
 
 =head1 AUTHOR
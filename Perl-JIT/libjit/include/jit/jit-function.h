@@ -30,6 +30,7 @@ extern	"C" {
 /* Optimization levels */
 #define JIT_OPTLEVEL_NONE	0
 #define JIT_OPTLEVEL_NORMAL	1
+#define JIT_OPTLEVEL_AGGRESSIVE	2
 
 jit_function_t jit_function_create
 	(jit_context_t context, jit_type_t signature) JIT_NOTHROW;
@@ -37,6 +38,7 @@ jit_function_t jit_function_create_nested
 	(jit_context_t context, jit_type_t signature,
 	 jit_function_t parent) JIT_NOTHROW;
 void jit_function_abandon(jit_function_t func) JIT_NOTHROW;
+void jit_function_destroy(jit_function_t func) JIT_NOTHROW;
 jit_context_t jit_function_get_context(jit_function_t func) JIT_NOTHROW;
 jit_type_t jit_function_get_signature(jit_function_t func) JIT_NOTHROW;
 int jit_function_set_meta
@@ -76,6 +76,12 @@ optimize(jit_function_t func)
 	/* Eliminate useless control flow */
 	_jit_block_clean_cfg(func);
 
+	/* Reuse values that were already computed */
+	if(func->optimization_level >= JIT_OPTLEVEL_AGGRESSIVE)
+	{
+		_jit_function_local_cse(func);
+	}
+
 	/* Optimization is done */
 	func->is_optimized = 1;
 }
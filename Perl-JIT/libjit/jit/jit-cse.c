@@ -0,0 +1,238 @@
+/*
+ * jit-cse.c - Local common subexpression elimination.
+ *
+ * This file is part of the libjit library.
+ *
+ * The libjit library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * The libjit library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with the libjit library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "jit-internal.h"
+#include <string.h>
+
+/*
+ * Number of earlier instructions that a block remembers as candidates.
+ * Expressions that were computed further back are computed again.
+ */
+#define JIT_CSE_WINDOW		32
+
+/*
+ * Check if the instruction computes its destination from its values
+ * and nothing else: conversions, arithmetic, bitwise operations,
+ * comparisons and math intrinsics. Branches are interspersed with them.
+ */
+static int
+is_pure_insn(jit_insn_t insn)
+{
+	int opcode = insn->opcode;
+
+	if(opcode < JIT_OP_TRUNC_SBYTE || opcode > JIT_OP_NFSIGN)
+	{
+		return 0;
+	}
+	if(opcode >= JIT_OP_BR && opcode <= JIT_OP_BR_NFGE_INV)
+	{
+		return 0;
+	}
+	if((insn->flags & (JIT_INSN_DEST_OTHER_FLAGS
+			   | JIT_INSN_VALUE1_OTHER_FLAGS
+			   | JIT_INSN_VALUE2_OTHER_FLAGS)) != 0)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check if the value may change other than by being an instruction's
+ * destination.
+ */
+static int
+is_unstable_value(jit_value_t value)
+{
+	return value && (value->is_volatile || value->is_addressable);
+}
+
+/*
+ * Check if two values are known to be the same.
+ */
+static int
+same_value(jit_value_t value1, jit_value_t value2)
+{
+	jit_type_t type;
+
+	if(value1 == value2)
+	{
+		return 1;
+	}
+	if(!value1 || !value2 || !value1->is_constant || !value2->is_constant)
+	{
+		return 0;
+	}
+	type = jit_type_normalize(value1->type);
+	if(type != jit_type_normalize(value2->type))
+	{
+		return 0;
+	}
+	if(value1->is_nint_constant && value2->is_nint_constant)
+	{
+		return value1->address == value2->address;
+	}
+	switch(type->kind)
+	{
+	case JIT_TYPE_LONG:
+	case JIT_TYPE_ULONG:
+		return jit_value_get_long_constant(value1)
+			== jit_value_get_long_constant(value2);
+
+	case JIT_TYPE_FLOAT32:
+		{
+			jit_float32 f1 = jit_value_get_float32_constant(value1);
+			jit_float32 f2 = jit_value_get_float32_constant(value2);
+			/* Bitwise, so that 0.0 and -0.0 are different */
+			return memcmp(&f1, &f2, sizeof(f1)) == 0;
+		}
+
+	case JIT_TYPE_FLOAT64:
+		{
+			jit_float64 d1 = jit_value_get_float64_constant(value1);
+			jit_float64 d2 = jit_value_get_float64_constant(value2);
+			return memcmp(&d1, &d2, sizeof(d1)) == 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check if the instruction reads or writes the value.
+ */
+static int
+insn_uses_value(jit_insn_t insn, jit_value_t value)
+{
+	return insn->dest == value || insn->value1 == value || insn->value2 == value;
+}
+
+/*
+ * Replace instructions within a basic block that compute what an
+ * earlier instruction has already computed from the same values:
+ *
+ * i) t = x op y
+ * ...
+ * j) u = x op y
+ *
+ * becomes
+ *
+ * i) t = x op y
+ * ...
+ * j) u = t
+ *
+ * provided that none of "t", "x" and "y" have changed in between.
+ * Copy propagation and liveness analysis then usually get rid of the
+ * copy and of "u".
+ */
+static int
+local_cse(jit_function_t func, jit_block_t block)
+{
+	jit_insn_t candidates[JIT_CSE_WINDOW];
+	int ncandidates = 0;
+	int optimized = 0;
+	jit_insn_iter_t iter;
+	jit_insn_t insn;
+	jit_value_t dest;
+	int index;
+
+	jit_insn_iter_init(&iter, block);
+	while((insn = jit_insn_iter_next(&iter)) != 0)
+	{
+		dest = 0;
+		if((insn->flags & (JIT_INSN_DEST_OTHER_FLAGS | JIT_INSN_DEST_IS_VALUE)) == 0)
+		{
+			dest = insn->dest;
+		}
+
+		if(dest && is_pure_insn(insn) && !is_unstable_value(dest)
+		   && !is_unstable_value(insn->value1)
+		   && !is_unstable_value(insn->value2))
+		{
+			for(index = 0; index < ncandidates; ++index)
+			{
+				jit_insn_t prev = candidates[index];
+				if(prev->opcode == insn->opcode
+				   && jit_type_normalize(prev->dest->type)
+				      == jit_type_normalize(dest->type)
+				   && same_value(prev->value1, insn->value1)
+				   && same_value(prev->value2, insn->value2))
+				{
+					break;
+				}
+			}
+			if(index < ncandidates && candidates[index]->dest != dest)
+			{
+				jit_value_t value = candidates[index]->dest;
+				jit_value_ref(func, value);
+				insn->opcode = (short)_jit_store_opcode
+					(JIT_OP_COPY_INT, JIT_OP_COPY_STORE_BYTE, dest->type);
+				insn->value1 = value;
+				insn->value2 = 0;
+				insn->flags = 0;
+				optimized = 1;
+			}
+		}
+
+		if(!dest)
+		{
+			continue;
+		}
+
+		/* Forget what depended on the old contents of dest */
+		for(index = 0; index < ncandidates; )
+		{
+			if(insn_uses_value(candidates[index], dest))
+			{
+				candidates[index] = candidates[--ncandidates];
+			}
+			else
+			{
+				++index;
+			}
+		}
+
+		if(is_pure_insn(insn) && !is_unstable_value(dest)
+		   && !is_unstable_value(insn->value1)
+		   && !is_unstable_value(insn->value2)
+		   && insn->value1 != dest && insn->value2 != dest)
+		{
+			if(ncandidates == JIT_CSE_WINDOW)
+			{
+				memmove(candidates, candidates + 1,
+					(JIT_CSE_WINDOW - 1) * sizeof(jit_insn_t));
+				--ncandidates;
+			}
+			candidates[ncandidates++] = insn;
+		}
+	}
+
+	return optimized;
+}
+
+void
+_jit_function_local_cse(jit_function_t func)
+{
+	jit_block_t block = func->builder->entry_block;
+	while(block != 0)
+	{
+		local_cse(func, block);
+		block = block->next;
+	}
+}
@@ -299,6 +299,20 @@ void jit_function_abandon(jit_function_t func)
 	}
 }
 
+/*@
+ * @deftypefun void jit_function_destroy (jit_function_t @var{func})
+ * Destroy a function that is no longer needed, whether it was compiled
+ * or not.  The @var{func} object is detached from its owning context,
+ * and the memory of its compiled code is reused for functions that
+ * are compiled later.  Closures and pointers to the code must not be
+ * used any more, and the function must not be running.
+ * @end deftypefun
+@*/
+void jit_function_destroy(jit_function_t func)
+{
+	_jit_function_destroy(func);
+}
+
 /*@
  * @deftypefun jit_context_t jit_function_get_context (jit_function_t @var{func})
  * Get the context associated with a function.
@@ -973,6 +987,20 @@ int jit_function_apply_vararg
  * function inlining.  If it has identified more such candidates, then
  * it may still want to recompile @var{func} again even once it has
  * reached the maximum optimization level.
+ *
+ * The levels are:
+ *
+ * @table @code
+ * @item JIT_OPTLEVEL_NONE
+ * No optimization at all, for the fastest compilation.
+ * @item JIT_OPTLEVEL_NORMAL
+ * Cleanup of the control flow graph, copy propagation within basic
+ * blocks and elimination of instructions whose results are unused.
+ * This is the default.
+ * @item JIT_OPTLEVEL_AGGRESSIVE
+ * As @code{JIT_OPTLEVEL_NORMAL}, plus elimination of common
+ * subexpressions within basic blocks.
+ * @end table
  * @end deftypefun
 @*/
 void
@@ -1015,7 +1043,7 @@ jit_function_get_optimization_level(jit_function_t func)
 unsigned int
 jit_function_get_max_optimization_level(void)
 {
-	return JIT_OPTLEVEL_NORMAL;
+	return JIT_OPTLEVEL_AGGRESSIVE;
 }
 
 /*@
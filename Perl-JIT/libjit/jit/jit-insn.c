@@ -4304,6 +4304,14 @@ static jit_value_t apply_unary_conversion
 		(jit_function_t func, int oper, jit_value_t value1,
 		 jit_type_t result_type)
 {
+	/* Same-width reinterpretations (e.g. long to ulong) are mapped onto
+	   the copy opcodes, which have no intrinsic equivalent */
+	if(oper < 1 || oper > (int)(sizeof(convert_intrinsics) /
+								sizeof(convert_intrinsics[0])))
+	{
+		return apply_unary(func, oper, value1, result_type);
+	}
+
 	/* Set the "may_throw" flag if the conversion may throw an exception */
 	if(convert_intrinsics[oper - 1].descr.ptr_result_type)
 	{
@@ -531,6 +531,11 @@ void _jit_function_destroy(jit_function_t func);
  */
 void _jit_function_compute_liveness(jit_function_t func);
 
+/*
+ * Eliminate common subexpressions within the basic blocks of a function.
+ */
+void _jit_function_local_cse(jit_function_t func);
+
 /*
  * Compile a function on-demand.  Returns the entry point.
  */
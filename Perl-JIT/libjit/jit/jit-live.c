@@ -565,11 +565,15 @@ reset_liveness_flags(jit_block_t block, int reset_all)
 void _jit_function_compute_liveness(jit_function_t func)
 {
 	jit_block_t block = func->builder->entry_block;
+	int propagate = (func->optimization_level != JIT_OPTLEVEL_NONE);
 	while(block != 0)
 	{
 #ifdef USE_FORWARD_PROPAGATION
 		/* Perform forward copy propagation for the block */
-		forward_propagation(block);
+		if(propagate)
+		{
+			forward_propagation(block);
+		}
 #endif
 
 		/* Reset the liveness flags for the next block */
@@ -580,7 +584,7 @@ void _jit_function_compute_liveness(jit_function_t func)
 
 #ifdef USE_BACKWARD_PROPAGATION
 		/* Perform backward copy propagation for the block */
-		if(backward_propagation(block))
+		if(propagate && backward_propagation(block))
 		{
 			/* Reset the liveness flags and compute them again */
 			reset_liveness_flags(block, 1);
@@ -50,6 +50,14 @@ extern	"C" {
 #define JIT_CACHE_MAX_PAGE_FACTOR	1024
 #endif
 
+/*
+ * Tune the smallest region of a destroyed function that is worth
+ * translating another function into.
+ */
+#ifndef JIT_CACHE_MIN_REUSE
+#define JIT_CACHE_MIN_REUSE		128
+#endif
+
 /*
  * Method information block, organised as a red-black tree node.
  * There may be more than one such block associated with a method
@@ -62,7 +70,9 @@ struct jit_cache_node
 	jit_cache_node_t	right;		/* Right sub-tree */
 	unsigned char		*start;		/* Start of the cache region */
 	unsigned char		*end;		/* End of the cache region */
+	unsigned char		*limit;		/* End of the space owned by the region */
 	jit_function_t		func;		/* Function info block slot */
+	jit_cache_node_t	next_free;	/* Next free region, if func is 0 */
 };
 
 /*
@@ -91,6 +101,10 @@ struct jit_cache
 	unsigned char		*prev_start;	/* Previous start of the free region */
 	unsigned char		*prev_end;	/* Previous end of the free region */
 	jit_cache_node_t	node;		/* Information for the current function */
+	int			reusing;	/* The current function reuses a free region */
+	int			reuse_failed;	/* The last one didn't fit in it */
+	jit_cache_node_t	free_nodes;	/* Regions of destroyed functions */
+	void			*free_trampolines; /* Trampolines of destroyed functions */
 	struct jit_cache_node	head;		/* Head of the lookup tree */
 	struct jit_cache_node	nil;		/* Nil pointer for the lookup tree */
 };
@@ -120,6 +134,7 @@ struct jit_cache
 
 void _jit_cache_destroy(jit_cache_t cache);
 void * _jit_cache_alloc_data(jit_cache_t cache, unsigned long size, unsigned long align);
+void * _jit_cache_find_function_info(jit_cache_t cache, void *pc);
 
 /*
  * Allocate a cache page and add it to the cache.
@@ -425,6 +440,10 @@ _jit_cache_create(jit_context_t context)
 		cache->pagesLeft = -1;
 	}
 	cache->node = 0;
+	cache->reusing = 0;
+	cache->reuse_failed = 0;
+	cache->free_nodes = 0;
+	cache->free_trampolines = 0;
 	cache->nil.left = &(cache->nil);
 	cache->nil.right = &(cache->nil);
 	cache->nil.func = 0;
@@ -476,6 +495,14 @@ _jit_cache_extend(jit_cache_t cache, int count)
 		return;
 	}
 
+	/* The function didn't fit into the free region it was tried in.
+	   Try again at the current position before allocating a page */
+	if(cache->reuse_failed == 1)
+	{
+		cache->reuse_failed = 2;
+		return;
+	}
+
 	/* If we had a newly allocated page then it has to be freed
 	   to let allocate another new page of appropriate size. */
 	struct jit_cache_page *p = &cache->pages[cache->numPages - 1];
@@ -511,9 +538,52 @@ _jit_cache_alloc_function(jit_cache_t cache)
 void
 _jit_cache_free_function(jit_cache_t cache, jit_function_t func)
 {
+	jit_cache_node_t node;
+
+	/* Keep the region of the function's code for reuse.  The node stays
+	   in the lookup tree, but no address maps to it until it's reused */
+	if(func->is_compiled)
+	{
+		node = _jit_cache_find_function_info(cache, func->entry_point);
+		if(node && node->func == func)
+		{
+			node->func = 0;
+			node->end = node->start;
+			node->next_free = cache->free_nodes;
+			cache->free_nodes = node;
+		}
+	}
 	jit_free(func);
 }
 
+/*
+ * Take the largest free region off the free list, if it's big enough
+ * to be worth trying.  Adjacent regions are not merged.
+ */
+static jit_cache_node_t
+TakeFreeNode(jit_cache_t cache)
+{
+	jit_cache_node_t *link;
+	jit_cache_node_t *best = 0;
+	jit_cache_node_t node;
+
+	for(link = &cache->free_nodes; *link; link = &(*link)->next_free)
+	{
+		if(!best || ((*link)->limit - (*link)->start) > ((*best)->limit - (*best)->start))
+		{
+			best = link;
+		}
+	}
+	if(!best || ((*best)->limit - (*best)->start) < JIT_CACHE_MIN_REUSE)
+	{
+		return 0;
+	}
+	node = *best;
+	*best = node->next_free;
+	node->next_free = 0;
+	return node;
+}
+
 int
 _jit_cache_start_function(jit_cache_t cache, jit_function_t func)
 {
@@ -523,16 +593,31 @@ _jit_cache_start_function(jit_cache_t cache, jit_function_t func)
 		return JIT_MEMORY_ERROR;
 	}
 
+	/* Save the cache position */
+	cache->prev_start = cache->free_start;
+	cache->prev_end = cache->free_end;
+
+	/* Translate the function where a destroyed one was, unless that
+	   has just been tried */
+	if(!cache->reuse_failed)
+	{
+		cache->node = TakeFreeNode(cache);
+		if(cache->node)
+		{
+			cache->reusing = 1;
+			cache->node->func = func;
+			cache->free_start = cache->node->start;
+			cache->free_end = cache->node->limit;
+			return JIT_MEMORY_OK;
+		}
+	}
+
 	/* Bail out if the cache is already full */
 	if(!cache->free_start)
 	{
 		return JIT_MEMORY_TOO_BIG;
 	}
 
-	/* Save the cache position */
-	cache->prev_start = cache->free_start;
-	cache->prev_end = cache->free_end;
-
 	/* Allocate a new cache node */
 	cache->node = _jit_cache_alloc_data(
 		cache, sizeof(struct jit_cache_node), sizeof(void *));
@@ -545,6 +630,8 @@ _jit_cache_start_function(jit_cache_t cache, jit_function_t func)
 	/* Initialize the function information */
 	cache->node->start = cache->free_start;
 	cache->node->end = 0;
+	cache->node->limit = 0;
+	cache->node->next_free = 0;
 	cache->node->left = 0;
 	cache->node->right = 0;
 
@@ -563,6 +650,16 @@ _jit_cache_end_function(jit_cache_t cache, int result)
 	/* Determine if we ran out of space while writing the function */
 	if(result != JIT_MEMORY_OK)
 	{
+		/* Put a reused region back on the free list */
+		if(cache->reusing)
+		{
+			cache->node->func = 0;
+			cache->node->next_free = cache->free_nodes;
+			cache->free_nodes = cache->node;
+			cache->reusing = 0;
+			cache->reuse_failed = 1;
+		}
+
 		/* Restore the saved cache position */
 		cache->free_start = cache->prev_start;
 		cache->free_end = cache->prev_end;
@@ -571,10 +668,22 @@ _jit_cache_end_function(jit_cache_t cache, int result)
 		return JIT_MEMORY_RESTART;
 	}
 
-	/* Update the method region block and then add it to the lookup tree */
+	/* Update the method region block and then add it to the lookup
+	   tree, where a reused one already is */
 	cache->node->end = cache->free_start;
-	AddToLookupTree(cache, cache->node);
+	if(cache->reusing)
+	{
+		cache->free_start = cache->prev_start;
+		cache->free_end = cache->prev_end;
+		cache->reusing = 0;
+	}
+	else
+	{
+		cache->node->limit = cache->node->end;
+		AddToLookupTree(cache, cache->node);
+	}
 	cache->node = 0;
+	cache->reuse_failed = 0;
 
 	/* The method is ready to go */
 	return JIT_MEMORY_OK;
@@ -702,6 +811,15 @@ alloc_code(jit_cache_t cache, unsigned int size, unsigned int align)
 void *
 _jit_cache_alloc_trampoline(jit_cache_t cache)
 {
+	void *trampoline;
+
+	/* Reuse one of a destroyed function, they're all the same size */
+	trampoline = cache->free_trampolines;
+	if(trampoline)
+	{
+		cache->free_trampolines = *(void **)trampoline;
+		return trampoline;
+	}
 	return alloc_code(cache,
 			  jit_get_trampoline_size(),
 			  jit_get_trampoline_alignment());
@@ -710,7 +828,11 @@ _jit_cache_alloc_trampoline(jit_cache_t cache)
 void
 _jit_cache_free_trampoline(jit_cache_t cache, void *trampoline)
 {
-	/* not supported yet */
+	if(trampoline)
+	{
+		*(void **)trampoline = cache->free_trampolines;
+		cache->free_trampolines = trampoline;
+	}
 }
 
 void *
@@ -994,6 +1116,16 @@ is used to perform fast lookups by address (_jit_cache_get_method).  These
 lookups are used when walking the stack during exceptions or security
 processing.
 
+Destroying a function (jit_function_destroy) keeps its jit_cache_method
+block in the tree, with an empty region, and puts it on a free list.
+The next method to be output is tried in the largest region on that
+list first, that is between the start of the old code and the end of
+the space it owned ("limit"), which includes auxiliary data written
+while outputting it into a reused region.  If it doesn't fit, the
+region goes back on the list and the method is output at the current
+position instead.  Adjacent free regions are not merged.  Trampolines
+of destroyed functions are reused as they are.
+
 Each method can also have offset information associated with it, to map
 between native code addresses and offsets within the original bytecode.
 This is typically used to support debugging.  Offset information is stored
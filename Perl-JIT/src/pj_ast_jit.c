@@ -4,11 +4,324 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 
 #include <pj_debug.h>
 #include <pj_ast_walkers.h>
 
 static jit_value_t pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars, pj_op_t *op);
+static jit_value_t pj_jit_internal_pvload(jit_function_t function, jit_value_t *var_values, int nvars, pj_pvload_t *pl);
+static jit_value_t pj_jit_internal_inline(jit_function_t function, jit_value_t *var_values, int nvars, pj_inline_t *in);
+static jit_value_t pj_jit_internal_fieldload(jit_function_t function, pj_fieldload_t *f);
+static jit_value_t pj_jit_internal_elemload(jit_function_t function, jit_value_t *var_values, int nvars, pj_elemload_t *e);
+static jit_value_t pj_jit_internal_opcall(jit_function_t function, jit_value_t *var_values, int nvars, pj_opcall_t *c);
+
+void (*pj_runtime_error_handler)(pj_runtime_error err, double value) = NULL;
+double (*pj_drand_func)(void *state) = NULL;
+void *pj_drand_state = NULL;
+
+static void
+pj_raise_runtime_error(int err, double value)
+{
+  if (pj_runtime_error_handler != NULL)
+    pj_runtime_error_handler((pj_runtime_error)err, value);
+  abort();
+}
+
+/* Emits a call to the run-time error handler. Flagged NOTHROW since the
+ * handler leaves via longjmp rather than libjit's exception handling. */
+static void
+pj_jit_emit_runtime_error(jit_function_t function, pj_runtime_error err, jit_value_t value)
+{
+  static jit_type_t signature = NULL;
+  jit_value_t args[2];
+
+  if (signature == NULL) {
+    jit_type_t params[2];
+    params[0] = jit_type_sys_int;
+    params[1] = jit_type_sys_double;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void, params, 2, 1);
+  }
+
+  args[0] = jit_value_create_nint_constant(function, jit_type_sys_int, (jit_nint)err);
+  args[1] = jit_insn_convert(function, value, jit_type_sys_double, 0);
+  jit_insn_call_native(function, "pj_raise_runtime_error", (void *)pj_raise_runtime_error,
+                       signature, args, 2, JIT_CALL_NOTHROW|JIT_CALL_NORETURN);
+}
+
+/* Emits a call to the error handler if cond is true */
+static void
+pj_jit_error_if(jit_function_t function, jit_value_t cond, pj_runtime_error err, jit_value_t value)
+{
+  jit_label_t oklabel = jit_label_undefined;
+  jit_insn_branch_if_not(function, cond, &oklabel);
+  pj_jit_emit_runtime_error(function, err, value);
+  jit_insn_label(function, &oklabel);
+}
+
+/* Perl croaks on a zero divisor instead of producing inf or trapping */
+static void
+pj_jit_check_divisor(jit_function_t function, jit_value_t divisor, pj_runtime_error err)
+{
+  pj_jit_error_if(function, jit_insn_to_not_bool(function, divisor), err, divisor);
+}
+
+static int
+pj_jit_value_is_float(jit_value_t v)
+{
+  const int kind = jit_type_get_kind(jit_type_normalize(jit_value_get_type(v)));
+  return kind == JIT_TYPE_FLOAT32 || kind == JIT_TYPE_FLOAT64 || kind == JIT_TYPE_NFLOAT;
+}
+
+/* Perl's % on NVs (see pp_modulo): operands are truncated to UVs if they
+ * fit, otherwise rounded and fmod'ed. The result takes the sign of the
+ * right operand. */
+static double
+pj_perl_modulo(double left, double right)
+{
+  const double uv_max_p1 = 18446744073709551616.0; /* 2**64 */
+  const int left_neg = left < 0;
+  const int right_neg = right < 0;
+  double dleft = left_neg ? -left : left;
+  double dright = right_neg ? -right : right;
+
+  if (dleft < uv_max_p1 && dright < uv_max_p1) {
+    const jit_ulong uleft = (jit_ulong)dleft;
+    const jit_ulong uright = (jit_ulong)dright;
+    jit_ulong ans;
+
+    if (uright == 0)
+      pj_raise_runtime_error(pj_error_modulus_zero, right);
+
+    ans = uleft % uright;
+    if (left_neg != right_neg && ans)
+      ans = uright - ans;
+    return right_neg ? -(double)ans : (double)ans;
+  }
+  else {
+    double dans;
+
+    /* Backward-compatibility clause, as perl has it */
+    dright = floor(dright + 0.5);
+    dleft = floor(dleft + 0.5);
+    if (dright == 0.)
+      pj_raise_runtime_error(pj_error_modulus_zero, right);
+
+    dans = fmod(dleft, dright);
+    if (left_neg != right_neg && dans)
+      dans = dright - dans;
+    return right_neg ? -dans : dans;
+  }
+}
+
+/* Emits a call to a C function double f(double, double) */
+static jit_value_t
+pj_jit_call_dbl_binary(jit_function_t function, const char *name, double (*fptr)(double, double),
+                       jit_value_t arg1, jit_value_t arg2)
+{
+  static jit_type_t signature = NULL;
+  jit_value_t args[2];
+
+  if (signature == NULL) {
+    jit_type_t params[2];
+    params[0] = params[1] = jit_type_sys_double;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_sys_double, params, 2, 1);
+  }
+
+  args[0] = jit_insn_convert(function, arg1, jit_type_sys_double, 0);
+  args[1] = jit_insn_convert(function, arg2, jit_type_sys_double, 0);
+  return jit_insn_call_native(function, (char *)name, (void *)fptr,
+                              signature, args, 2, JIT_CALL_NOTHROW);
+}
+
+/* Perl's cast_iv, which is what SvIV and SvUV come down to for NVs. Both
+ * yield the same bits: out-of-range values are clamped, NaN is 0. */
+static jit_long
+pj_perl_cast_iv(double nv)
+{
+  if (nv < 9223372036854775808.0) /* 2**63 */
+    return nv < -9223372036854775808.0 ? jit_min_long : (jit_long)nv;
+  if (nv < 18446744073709551616.0) /* 2**64 */
+    return (jit_long)(jit_ulong)nv;
+  return nv > 0 ? (jit_long)jit_max_ulong : 0;
+}
+
+/* Perl's << and >> (see S_uv_shift and S_iv_shift in pp.c) for the
+ * shift counts the generated code doesn't handle inline: negative
+ * counts shift the other way and shifting by 64 or more leaves 0, or
+ * -1 for a negative IV shifted right. IVs are shifted left as UVs. */
+static jit_ulong
+pj_perl_shift(jit_ulong value, jit_int count, jit_int left, jit_int is_iv)
+{
+  jit_uint n = (jit_uint)count;
+
+  if (count < 0) {
+    n = -n;
+    left = !left;
+  }
+  if (n >= 64)
+    return (is_iv && !left && (jit_long)value < 0) ? jit_max_ulong : 0;
+  if (left)
+    return value << n;
+  return is_iv ? (jit_ulong)((jit_long)value >> n) : value >> n;
+}
+
+static int
+pj_jit_value_is_iv(jit_value_t v)
+{
+  const int kind = jit_type_get_kind(jit_type_normalize(jit_value_get_type(v)));
+  return kind == JIT_TYPE_INT || kind == JIT_TYPE_LONG;
+}
+
+/* FIXME IV and UV are assumed to be 64 bits */
+#define PJ_JIT_INT_TYPE(v) (pj_jit_value_is_iv(v) ? jit_type_long : jit_type_ulong)
+
+/* The value as an IV or UV (type), the way SvIV or SvUV would see it */
+static jit_value_t
+pj_jit_int_bits(jit_function_t function, jit_value_t v, jit_type_t type)
+{
+  static jit_type_t signature = NULL;
+  jit_label_t slowlabel = jit_label_undefined;
+  jit_label_t endlabel = jit_label_undefined;
+  jit_value_t rv;
+
+  if (!pj_jit_value_is_float(v))
+    return jit_insn_convert(function, v, type, 0);
+
+  if (signature == NULL) {
+    jit_type_t params[1];
+    params[0] = jit_type_sys_double;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_long, params, 1, 1);
+  }
+
+  v = jit_insn_convert(function, v, jit_type_sys_double, 0);
+  rv = jit_value_create(function, jit_type_long);
+
+  /* Within the IV range, it's plain truncation. NaN fails both tests. */
+  jit_insn_branch_if_not(function,
+    jit_insn_ge(function, v, jit_value_create_float64_constant(function, jit_type_sys_double, -9223372036854775808.0)),
+    &slowlabel);
+  jit_insn_branch_if_not(function,
+    jit_insn_lt(function, v, jit_value_create_float64_constant(function, jit_type_sys_double, 9223372036854775808.0)),
+    &slowlabel);
+  jit_insn_store(function, rv, jit_insn_convert(function, v, jit_type_long, 0));
+  jit_insn_branch(function, &endlabel);
+
+  jit_insn_label(function, &slowlabel);
+  jit_insn_store(function, rv, jit_insn_call_native(function, "pj_perl_cast_iv", (void *)pj_perl_cast_iv,
+                                                    signature, &v, 1, JIT_CALL_NOTHROW));
+  jit_insn_label(function, &endlabel);
+  return jit_insn_convert(function, rv, type, 0);
+}
+
+/* << and >> on the UV, or on the IV if the value has been made one
+ * (use integer). Counts from 0 to 63 are shifted inline. */
+static jit_value_t
+pj_jit_shift(jit_function_t function, jit_value_t value, jit_value_t count, int left)
+{
+  static jit_type_t signature = NULL;
+  const int is_iv = pj_jit_value_is_iv(value);
+  const jit_type_t type = (is_iv ? jit_type_long : jit_type_ulong);
+  jit_label_t slowlabel = jit_label_undefined;
+  jit_label_t endlabel = jit_label_undefined;
+  jit_value_t rv, tmp, args[4];
+
+  if (signature == NULL) {
+    jit_type_t params[4];
+    params[0] = jit_type_ulong;
+    params[1] = params[2] = params[3] = jit_type_int;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_ulong, params, 4, 1);
+  }
+
+  value = pj_jit_int_bits(function, value, type);
+  /* pp_left_shift passes the IV count on as an int */
+  count = jit_insn_convert(function, pj_jit_int_bits(function, count, jit_type_long), jit_type_int, 0);
+  rv = jit_value_create(function, type);
+
+  tmp = jit_insn_convert(function, count, jit_type_uint, 0);
+  jit_insn_branch_if_not(function,
+    jit_insn_lt(function, tmp, jit_value_create_nint_constant(function, jit_type_uint, 64)),
+    &slowlabel);
+  if (left)
+    tmp = jit_insn_shl(function, value, count);
+  else if (is_iv)
+    tmp = jit_insn_sshr(function, value, count);
+  else
+    tmp = jit_insn_ushr(function, value, count);
+  jit_insn_store(function, rv, tmp);
+  jit_insn_branch(function, &endlabel);
+
+  jit_insn_label(function, &slowlabel);
+  args[0] = jit_insn_convert(function, value, jit_type_ulong, 0);
+  args[1] = count;
+  args[2] = jit_value_create_nint_constant(function, jit_type_int, left);
+  args[3] = jit_value_create_nint_constant(function, jit_type_int, is_iv);
+  tmp = jit_insn_call_native(function, "pj_perl_shift", (void *)pj_perl_shift,
+                             signature, args, 4, JIT_CALL_NOTHROW);
+  jit_insn_store(function, rv, jit_insn_convert(function, tmp, type, 0));
+
+  jit_insn_label(function, &endlabel);
+  return rv;
+}
+
+/* Perl does arithmetic on IVs and UVs that may overflow in NVs. Only
+ * the IVs from the use integer OPs (pj_unop_iv) stay integers. */
+/* FIXME perl sticks to IVs and UVs where they don't overflow */
+static jit_value_t
+pj_jit_operand_as_nv(jit_function_t function, pj_term_t *operand, jit_value_t v)
+{
+  if (pj_jit_value_is_float(v))
+    return v;
+  if (pj_jit_value_is_iv(v) && operand->type == pj_ttype_op
+      && (PJ_OP_FLAGS((pj_op_t *)operand) & PJ_ASTf_INTEGER))
+    return v;
+  return jit_insn_convert(function, v, jit_type_sys_double, 0);
+}
+
+/* rand(max) as in pp_rand: a max of 0 means 1 */
+static jit_value_t
+pj_jit_rand(jit_function_t function, jit_value_t max)
+{
+  static jit_type_t signature = NULL;
+  jit_label_t nonzerolabel = jit_label_undefined;
+  jit_value_t factor, state, rnd;
+
+  assert(pj_drand_func != NULL);
+  if (signature == NULL) {
+    jit_type_t params[1];
+    params[0] = jit_type_void_ptr;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_sys_double, params, 1, 1);
+  }
+
+  factor = jit_value_create(function, jit_type_sys_double);
+  jit_insn_store(function, factor, jit_insn_convert(function, max, jit_type_sys_double, 0));
+  jit_insn_branch_if(function, factor, &nonzerolabel);
+  jit_insn_store(function, factor, jit_value_create_float64_constant(function, jit_type_sys_double, 1.0));
+  jit_insn_label(function, &nonzerolabel);
+
+  state = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)pj_drand_state);
+  rnd = jit_insn_call_native(function, "drand", (void *)pj_drand_func,
+                             signature, &state, 1, JIT_CALL_NOTHROW);
+  return jit_insn_mul(function, factor, rnd);
+}
+
+/* Compare and select, keeping the left operand unless the right one
+ * compares as requested (so NaNs behave as in List::Util) */
+static jit_value_t
+pj_jit_select(jit_function_t function, jit_value_t arg1, jit_value_t arg2, int want_greater)
+{
+  jit_label_t endlabel = jit_label_undefined;
+  jit_value_t rv, cmp;
+
+  rv = jit_value_create(function, jit_type_sys_double);
+  jit_insn_store(function, rv, jit_insn_convert(function, arg1, jit_type_sys_double, 0));
+  arg2 = jit_insn_convert(function, arg2, jit_type_sys_double, 0);
+  cmp = (want_greater ? jit_insn_gt(function, arg2, rv) : jit_insn_lt(function, arg2, rv));
+  jit_insn_branch_if_not(function, cmp, &endlabel);
+  jit_insn_store(function, rv, arg2);
+  jit_insn_label(function, &endlabel);
+  return rv;
+}
 
 static jit_value_t
 pj_jit_internal(jit_function_t function, jit_value_t *var_values, int nvars, pj_term_t *term)
@@ -20,9 +333,9 @@ pj_jit_internal(jit_function_t function, jit_value_t *var_values, int nvars, pj_
   else if (term->type == pj_ttype_constant) {
     pj_constant_t *c = (pj_constant_t *)term;
     if (c->const_type == pj_int_type)
-      return jit_value_create_nint_constant(function, jit_type_sys_int, c->value_u.int_value);
-    else if (c->const_type == pj_uint_type) /* FIXME no jit_value_create_nuint_constant defined? */
-      return jit_value_create_nint_constant(function, jit_type_sys_int, c->value_u.uint_value);
+      return jit_value_create_long_constant(function, jit_type_long, (jit_long)c->value_u.int_value);
+    else if (c->const_type == pj_uint_type)
+      return jit_value_create_long_constant(function, jit_type_ulong, (jit_long)c->value_u.uint_value);
     else if (c->const_type == pj_double_type)
       return jit_value_create_float64_constant(function, jit_type_sys_double, c->value_u.dbl_value);
     else
@@ -31,11 +344,305 @@ pj_jit_internal(jit_function_t function, jit_value_t *var_values, int nvars, pj_
   else if (term->type == pj_ttype_op) {
     return pj_jit_internal_op(function, var_values, nvars, (pj_op_t *)term);
   }
+  else if (term->type == pj_ttype_pvload) {
+    return pj_jit_internal_pvload(function, var_values, nvars, (pj_pvload_t *)term);
+  }
+  else if (term->type == pj_ttype_inline) {
+    return pj_jit_internal_inline(function, var_values, nvars, (pj_inline_t *)term);
+  }
+  else if (term->type == pj_ttype_fieldload) {
+    return pj_jit_internal_fieldload(function, (pj_fieldload_t *)term);
+  }
+  else if (term->type == pj_ttype_elemload) {
+    return pj_jit_internal_elemload(function, var_values, nvars, (pj_elemload_t *)term);
+  }
+  else if (term->type == pj_ttype_opcall) {
+    return pj_jit_internal_opcall(function, var_values, nvars, (pj_opcall_t *)term);
+  }
   else {
     abort();
   }
 }
 
+
+static int
+pj_host_is_little_endian(void)
+{
+  const unsigned int one = 1;
+  return *((const unsigned char *)&one) == 1;
+}
+
+static jit_type_t
+pj_pvload_jit_type(pj_pvload_elem_type t)
+{
+  switch (t) {
+  case pj_pvload_int8:   return jit_type_sbyte;
+  case pj_pvload_uint8:  return jit_type_ubyte;
+  case pj_pvload_int16:  return jit_type_short;
+  case pj_pvload_uint16: return jit_type_ushort;
+  case pj_pvload_int32:  return jit_type_int;
+  case pj_pvload_uint32: return jit_type_uint;
+  case pj_pvload_int64:  return jit_type_long;
+  case pj_pvload_uint64: return jit_type_ulong;
+  case pj_pvload_float:  return jit_type_float32;
+  case pj_pvload_double: return jit_type_float64;
+  default:
+    abort();
+  }
+}
+
+/* Assembles an element byte by byte in the requested byte order.
+ * If avail is non-NULL, only bytes below that many bytes after addr
+ * are read and the rest are taken to be zero (vec semantics). */
+static jit_value_t
+pj_jit_pvload_bytewise(jit_function_t function, jit_value_t addr, jit_value_t avail,
+                       pj_pvload_t *pl, unsigned int size)
+{
+  const int big_endian = (pl->flags & PJ_PVLOADf_BIG_ENDIAN)
+                         || (!(pl->flags & PJ_PVLOADf_LITTLE_ENDIAN) && !pj_host_is_little_endian());
+  jit_value_t bits, byte, tmp;
+  unsigned int i;
+
+  bits = jit_value_create(function, jit_type_ulong);
+  jit_insn_store(function, bits, jit_value_create_long_constant(function, jit_type_ulong, 0));
+
+  for (i = 0; i < size; ++i) {
+    jit_label_t skiplabel = jit_label_undefined;
+    const unsigned int shift = 8 * (big_endian ? size - i - 1 : i);
+
+    if (avail != NULL) {
+      tmp = jit_value_create_nint_constant(function, jit_type_nint, i);
+      jit_insn_branch_if(function, jit_insn_ge(function, tmp, avail), &skiplabel);
+    }
+
+    byte = jit_insn_load_relative(function, addr, i, jit_type_ubyte);
+    byte = jit_insn_convert(function, byte, jit_type_ulong, 0);
+    if (shift != 0) {
+      tmp = jit_value_create_nint_constant(function, jit_type_int, shift);
+      byte = jit_insn_shl(function, byte, tmp);
+    }
+    jit_insn_store(function, bits, jit_insn_or(function, bits, byte));
+
+    if (avail != NULL)
+      jit_insn_label(function, &skiplabel);
+  }
+
+  /* Now reinterpret the raw bits as the element type */
+  if (pl->elem_type == pj_pvload_float || pl->elem_type == pj_pvload_double) {
+    jit_type_t inttype = (size == 4 ? jit_type_uint : jit_type_ulong);
+    tmp = jit_value_create(function, inttype);
+    jit_insn_store(function, tmp, jit_insn_convert(function, bits, inttype, 0));
+    return jit_insn_load_relative(function, jit_insn_address_of(function, tmp),
+                                  0, pj_pvload_jit_type(pl->elem_type));
+  }
+
+  /* Truncating conversion takes care of the sign of signed elements */
+  return jit_insn_convert(function, bits, pj_pvload_jit_type(pl->elem_type), 0);
+}
+
+static jit_value_t
+pj_jit_internal_pvload(jit_function_t function, jit_value_t *var_values, int nvars, pj_pvload_t *pl)
+{
+  const unsigned int size = pj_pvload_elem_size(pl->elem_type);
+  const int swapped = (pj_host_is_little_endian() ? (pl->flags & PJ_PVLOADf_BIG_ENDIAN)
+                                                  : (pl->flags & PJ_PVLOADf_LITTLE_ENDIAN));
+  jit_label_t oob_label = jit_label_undefined;
+  jit_label_t endlabel = jit_label_undefined;
+  jit_value_t bufaddr, pv, len, off, zero, addr, elem, rv;
+
+  assert(pl->buf != NULL);
+
+  rv = jit_value_create(function, jit_type_sys_double);
+  off = jit_value_create(function, jit_type_nint);
+  zero = jit_value_create_nint_constant(function, jit_type_nint, 0);
+
+  /* Offsets get truncated towards zero just like SvIV does */
+  elem = pj_jit_internal(function, var_values, nvars, pl->offset);
+  elem = jit_insn_convert(function, elem, jit_type_nint, 0);
+  if (pl->scale != 1)
+    elem = jit_insn_mul(function, elem, jit_value_create_nint_constant(function, jit_type_nint, pl->scale));
+  jit_insn_store(function, off, elem);
+
+  /* Fetch the buffer location as it is at call time */
+  bufaddr = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)pl->buf);
+  pv = jit_insn_load_relative(function, bufaddr, offsetof(pj_pvbuf_t, pv), jit_type_void_ptr);
+  len = jit_insn_load_relative(function, bufaddr, offsetof(pj_pvbuf_t, len), jit_type_nint);
+
+  if (pl->flags & PJ_PVLOADf_NEG_FROM_END) {
+    jit_label_t poslabel = jit_label_undefined;
+    jit_insn_branch_if_not(function, jit_insn_lt(function, off, zero), &poslabel);
+    jit_insn_store(function, off, jit_insn_add(function, off, len));
+    /* Still before the start: substr starts at 0 and loses the part of
+     * its length that hung off the front */
+    jit_insn_branch_if_not(function, jit_insn_lt(function, off, zero), &poslabel);
+    if (pl->sublen != 0) {
+      jit_value_t end = jit_insn_add(function, off, jit_value_create_nint_constant(function, jit_type_nint, pl->sublen));
+      jit_insn_branch_if(function, jit_insn_lt(function, end, jit_value_create_nint_constant(function, jit_type_nint, size)), &oob_label);
+    }
+    jit_insn_store(function, off, zero);
+    jit_insn_label(function, &poslabel);
+  }
+
+  /* Bounds checks */
+  jit_insn_branch_if(function, jit_insn_lt(function, off, zero), &oob_label);
+  addr = jit_insn_add(function, pv, off);
+  if (pl->flags & PJ_PVLOADf_ZERO_PAD) {
+    jit_value_t avail = jit_insn_sub(function, len, off);
+    jit_insn_branch_if(function, jit_insn_le(function, avail, zero), &oob_label);
+    elem = pj_jit_pvload_bytewise(function, addr, avail, pl, size);
+  }
+  else {
+    jit_value_t maxoff = jit_insn_sub(function, len, jit_value_create_nint_constant(function, jit_type_nint, size));
+    jit_insn_branch_if(function, jit_insn_gt(function, off, maxoff), &oob_label);
+    if (swapped)
+      elem = pj_jit_pvload_bytewise(function, addr, NULL, pl, size);
+    else /* the plain load */
+      elem = jit_insn_load_relative(function, addr, 0, pj_pvload_jit_type(pl->elem_type));
+  }
+  jit_insn_store(function, rv, jit_insn_convert(function, elem, jit_type_sys_double, 0));
+  jit_insn_branch(function, &endlabel);
+
+  /* Out of bounds: Perl would give us undef (or 0 for vec) */
+  jit_insn_label(function, &oob_label);
+  jit_insn_store(function, rv, jit_value_create_float64_constant(function, jit_type_sys_double, 0.0));
+
+  jit_insn_label(function, &endlabel);
+  return rv;
+}
+
+static jit_value_t
+pj_jit_internal_fieldload(jit_function_t function, pj_fieldload_t *f)
+{
+  static jit_type_t signature = NULL;
+  jit_value_t args[2];
+
+  assert(f->record != NULL);
+  if (signature == NULL) {
+    jit_type_t params[2];
+    params[0] = jit_type_void_ptr;
+    params[1] = jit_type_void_ptr;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_sys_double, params, 2, 1);
+  }
+
+  /* The record as it is at call time */
+  args[0] = jit_insn_load_relative(function,
+                                   jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)f->record),
+                                   0, jit_type_void_ptr);
+  args[1] = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)f->key);
+  return jit_insn_call_native(function, "fieldload", (void *)f->fetch,
+                              signature, args, 2, JIT_CALL_NOTHROW);
+}
+
+static jit_value_t
+pj_jit_internal_elemload(jit_function_t function, jit_value_t *var_values, int nvars, pj_elemload_t *e)
+{
+  static jit_type_t signature = NULL;
+  jit_value_t args[3];
+
+  assert(e->record != NULL);
+  if (signature == NULL) {
+    jit_type_t params[3];
+    params[0] = jit_type_void_ptr;
+    params[1] = jit_type_nint;
+    params[2] = jit_type_nint;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_sys_double, params, 3, 1);
+  }
+
+  /* Indexes are truncated like Perl's, in the order Perl evaluates them */
+  args[1] = jit_insn_convert(function, pj_jit_internal(function, var_values, nvars, e->index),
+                             jit_type_nint, 0);
+  if (e->index2 != NULL)
+    args[2] = jit_insn_convert(function, pj_jit_internal(function, var_values, nvars, e->index2),
+                               jit_type_nint, 0);
+  else
+    args[2] = jit_value_create_nint_constant(function, jit_type_nint, 0);
+
+  /* The array as it is at call time */
+  args[0] = jit_insn_load_relative(function,
+                                   jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)e->record),
+                                   0, jit_type_void_ptr);
+  return jit_insn_call_native(function, "elemload", (void *)e->fetch,
+                              signature, args, 3, JIT_CALL_NOTHROW);
+}
+
+/* Evaluates the nargs terms of the args list into a buffer of doubles
+ * and calls fn(callee, buffer, nargs). Like the error handler, fn may
+ * leave via longjmp, hence NOTHROW. */
+static jit_value_t
+pj_jit_call_with_args(jit_function_t function, jit_value_t *var_values, int nvars,
+                      const char *name, void *fn, jit_value_t callee,
+                      pj_term_t *args, unsigned int nargs)
+{
+  static jit_type_t signature = NULL;
+  jit_value_t buf, value, callargs[3];
+  pj_term_t *arg;
+  unsigned int i;
+
+  if (signature == NULL) {
+    jit_type_t params[3];
+    params[0] = jit_type_void_ptr;
+    params[1] = jit_type_void_ptr;
+    params[2] = jit_type_sys_uint;
+    signature = jit_type_create_signature(jit_abi_cdecl, jit_type_sys_double, params, 3, 1);
+  }
+
+  buf = jit_insn_alloca(function, jit_value_create_nint_constant(
+          function, jit_type_nint, sizeof(double) * (nargs > 0 ? nargs : 1)));
+  for (i = 0, arg = args; arg != NULL; arg = arg->op_sibling, ++i) {
+    value = pj_jit_internal(function, var_values, nvars, arg);
+    jit_insn_store_relative(function, buf, i * sizeof(double),
+                            jit_insn_convert(function, value, jit_type_sys_double, 0));
+  }
+  callargs[0] = callee;
+  callargs[1] = buf;
+  callargs[2] = jit_value_create_nint_constant(function, jit_type_sys_uint, nargs);
+  return jit_insn_call_native(function, name, fn, signature, callargs, 3, JIT_CALL_NOTHROW);
+}
+
+static jit_value_t
+pj_jit_internal_inline(jit_function_t function, jit_value_t *var_values, int nvars, pj_inline_t *in)
+{
+  static jit_type_t guard_signature = NULL;
+  jit_label_t fallbacklabel = jit_label_undefined;
+  jit_label_t endlabel = jit_label_undefined;
+  jit_value_t rv, callee, ok, value;
+
+  if (guard_signature == NULL) {
+    jit_type_t params[1];
+    params[0] = jit_type_void_ptr;
+    guard_signature = jit_type_create_signature(jit_abi_cdecl, jit_type_sys_int, params, 1, 1);
+  }
+
+  rv = jit_value_create(function, jit_type_sys_double);
+  callee = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)in->callee);
+
+  /* Still calling what we inlined? */
+  ok = jit_insn_call_native(function, "pj_inline_guard", (void *)in->guard,
+                            guard_signature, &callee, 1, JIT_CALL_NOTHROW);
+  jit_insn_branch_if_not(function, ok, &fallbacklabel);
+
+  value = pj_jit_internal(function, var_values, nvars, in->body);
+  jit_insn_store(function, rv, jit_insn_convert(function, value, jit_type_sys_double, 0));
+  jit_insn_branch(function, &endlabel);
+
+  /* Make the real call */
+  jit_insn_label(function, &fallbacklabel);
+  value = pj_jit_call_with_args(function, var_values, nvars, "pj_inline_fallback",
+                                (void *)in->fallback, callee, in->args, in->nargs);
+  jit_insn_store(function, rv, value);
+
+  jit_insn_label(function, &endlabel);
+  return rv;
+}
+
+static jit_value_t
+pj_jit_internal_opcall(jit_function_t function, jit_value_t *var_values, int nvars, pj_opcall_t *c)
+{
+  return pj_jit_call_with_args(function, var_values, nvars, "pj_opcall", (void *)c->call,
+                               jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)c->op),
+                               c->args, c->nargs);
+}
+
 static jit_value_t
 pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars, pj_op_t *op)
 {
@@ -50,6 +657,12 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
     arg1 = EVAL_OPERAND1;
     if (op->op2 != NULL)
       arg2 = EVAL_OPERAND2;
+
+    if (!(PJ_OP_FLAGS(op) & (PJ_ASTf_INTEGER|PJ_ASTf_BOOLEAN))) {
+      arg1 = pj_jit_operand_as_nv(function, op->op1, arg1);
+      if (op->op2 != NULL)
+        arg2 = pj_jit_operand_as_nv(function, op->op2, arg2);
+    }
   }
 
   switch (op->optype) {
@@ -65,12 +678,18 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
   case pj_unop_abs:
     rv = jit_insn_abs(function, arg1);
     break;
-  case pj_unop_sqrt:
-    rv = jit_insn_sqrt(function, arg1);
-    break;
-  case pj_unop_log:
-    rv = jit_insn_log(function, arg1);
-    break;
+  case pj_unop_sqrt: {
+      jit_value_t zero = jit_value_create_float64_constant(function, jit_type_sys_double, 0.0);
+      pj_jit_error_if(function, jit_insn_lt(function, arg1, zero), pj_error_sqrt_of_negative, arg1);
+      rv = jit_insn_sqrt(function, arg1);
+      break;
+    }
+  case pj_unop_log: {
+      jit_value_t zero = jit_value_create_float64_constant(function, jit_type_sys_double, 0.0);
+      pj_jit_error_if(function, jit_insn_le(function, arg1, zero), pj_error_log_of_nonpositive, arg1);
+      rv = jit_insn_log(function, arg1);
+      break;
+    }
   case pj_unop_exp:
     rv = jit_insn_exp(function, arg1);
     break;
@@ -97,15 +716,30 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
       jit_insn_label(function, &endlabel);
       break;
     }
-  case pj_unop_bitwise_not: {
-      /* FIXME still not same as perl */
-      jit_value_t t = jit_insn_convert(function, arg1, jit_type_sys_ulong, 0); /* FIXME replace jit_type_sys_ulong with whatever a UV is */
-      rv = jit_insn_not(function, t);
-      break;
-  }
+  case pj_unop_bitwise_not:
+    rv = jit_insn_not(function, pj_jit_int_bits(function, arg1, PJ_JIT_INT_TYPE(arg1)));
+    break;
   case pj_unop_bool_not:
     rv = jit_insn_to_not_bool(function, arg1);
     break;
+  case pj_unop_iv:
+    rv = pj_jit_int_bits(function, arg1, jit_type_long);
+    break;
+  case pj_unop_uv:
+    rv = pj_jit_int_bits(function, arg1, jit_type_ulong);
+    break;
+  case pj_unop_floor:
+    rv = jit_insn_floor(function, jit_insn_convert(function, arg1, jit_type_sys_double, 0));
+    break;
+  case pj_unop_ceil:
+    rv = jit_insn_ceil(function, jit_insn_convert(function, arg1, jit_type_sys_double, 0));
+    break;
+  case pj_unop_tan:
+    rv = jit_insn_tan(function, arg1);
+    break;
+  case pj_unop_rand:
+    rv = pj_jit_rand(function, arg1);
+    break;
   case pj_binop_add:
     rv = jit_insn_add(function, arg1, arg2);
     break;
@@ -116,10 +750,56 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
     rv = jit_insn_mul(function, arg1, arg2);
     break;
   case pj_binop_divide:
-    rv = jit_insn_div(function, arg1, arg2);
+    pj_jit_check_divisor(function, arg2, pj_error_division_by_zero);
+    if (pj_jit_value_is_float(arg1) || pj_jit_value_is_float(arg2)) {
+      rv = jit_insn_div(function, arg1, arg2);
+    }
+    else {
+      /* Integer division (use integer). Like pp_i_divide, avoid
+       * IV_MIN / -1 trapping by negating instead. */
+      jit_label_t divlabel = jit_label_undefined;
+      jit_label_t endlabel = jit_label_undefined;
+      jit_value_t minus_one = jit_value_create_long_constant(function, jit_type_long, -1);
+
+      rv = jit_value_create(function, jit_type_long);
+      jit_insn_branch_if_not(function, jit_insn_eq(function, arg2, minus_one), &divlabel);
+      jit_insn_store(function, rv, jit_insn_neg(function, arg1));
+      jit_insn_branch(function, &endlabel);
+      jit_insn_label(function, &divlabel);
+      jit_insn_store(function, rv, jit_insn_div(function, arg1, arg2));
+      jit_insn_label(function, &endlabel);
+    }
     break;
   case pj_binop_modulo:
-    rv = jit_insn_rem(function, arg1, arg2); /* FIXME should this use jit_insn_rem_ieee? */
+    rv = pj_jit_call_dbl_binary(function, "pj_perl_modulo", pj_perl_modulo, arg1, arg2);
+    break;
+  case pj_binop_i_modulo: {
+      /* pp_i_modulo: x % -1 is 0, everything else is C's % */
+      jit_label_t remlabel = jit_label_undefined;
+      jit_label_t endlabel = jit_label_undefined;
+      jit_value_t minus_one = jit_value_create_long_constant(function, jit_type_long, -1);
+
+      arg1 = jit_insn_convert(function, arg1, jit_type_long, 0);
+      arg2 = jit_insn_convert(function, arg2, jit_type_long, 0);
+      pj_jit_check_divisor(function, arg2, pj_error_modulus_zero);
+
+      rv = jit_value_create(function, jit_type_long);
+      jit_insn_branch_if_not(function, jit_insn_eq(function, arg2, minus_one), &remlabel);
+      jit_insn_store(function, rv, jit_value_create_long_constant(function, jit_type_long, 0));
+      jit_insn_branch(function, &endlabel);
+      jit_insn_label(function, &remlabel);
+      jit_insn_store(function, rv, jit_insn_rem(function, arg1, arg2));
+      jit_insn_label(function, &endlabel);
+      break;
+    }
+  case pj_binop_fmod:
+    rv = pj_jit_call_dbl_binary(function, "fmod", fmod, arg1, arg2);
+    break;
+  case pj_binop_min:
+    rv = pj_jit_select(function, arg1, arg2, 0);
+    break;
+  case pj_binop_max:
+    rv = pj_jit_select(function, arg1, arg2, 1);
     break;
   case pj_binop_atan2:
     rv = jit_insn_atan2(function, arg1, arg2);
@@ -128,20 +808,26 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
     rv = jit_insn_pow(function, arg1, arg2);
     break;
   case pj_binop_left_shift:
-    rv = jit_insn_shl(function, arg1, arg2);
+    rv = pj_jit_shift(function, arg1, arg2, 1);
     break;
   case pj_binop_right_shift:
-    rv = jit_insn_ushr(function, arg1, arg2);
+    rv = pj_jit_shift(function, arg1, arg2, 0);
     break;
   case pj_binop_bitwise_and:
-    rv = jit_insn_and(function, arg1, arg2);
-    break;
   case pj_binop_bitwise_or:
-    rv = jit_insn_or(function, arg1, arg2);
-    break;
-  case pj_binop_bitwise_xor:
-    rv = jit_insn_xor(function, arg1, arg2);
-    break;
+  case pj_binop_bitwise_xor: {
+      /* Both operands are UVs, or both IVs under use integer */
+      const jit_type_t type = PJ_JIT_INT_TYPE(arg1);
+      arg1 = pj_jit_int_bits(function, arg1, type);
+      arg2 = pj_jit_int_bits(function, arg2, type);
+      if (op->optype == pj_binop_bitwise_and)
+        rv = jit_insn_and(function, arg1, arg2);
+      else if (op->optype == pj_binop_bitwise_or)
+        rv = jit_insn_or(function, arg1, arg2);
+      else
+        rv = jit_insn_xor(function, arg1, arg2);
+      break;
+    }
   case pj_binop_eq:
     rv = jit_insn_eq(function, arg1, arg2);
     break;
@@ -160,12 +846,20 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
   case pj_binop_ge:
     rv = jit_insn_ge(function, arg1, arg2);
     break;
+  case pj_binop_ncmp:
+    rv = jit_insn_sub(function,
+                      jit_insn_gt(function, arg1, arg2),
+                      jit_insn_lt(function, arg1, arg2));
+    break;
   case pj_binop_bool_and: {
       jit_label_t endlabel = jit_label_undefined;
 
-      rv = EVAL_OPERAND1;
+      /* Don't store into the operand's value, it may be a parameter */
+      rv = jit_value_create(function, jit_type_sys_double);
+      arg1 = EVAL_OPERAND1;
+      jit_insn_store(function, rv, arg1);
       /* If value is false, then goto end */
-      jit_insn_branch_if_not(function, rv, &endlabel);
+      jit_insn_branch_if_not(function, arg1, &endlabel);
 
       /* Left is true, move to right operand */
       arg2 = EVAL_OPERAND2;
@@ -178,9 +872,12 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
   case pj_binop_bool_or: {
       jit_label_t endlabel = jit_label_undefined;
 
-      rv = EVAL_OPERAND1;
+      /* Don't store into the operand's value, it may be a parameter */
+      rv = jit_value_create(function, jit_type_sys_double);
+      arg1 = EVAL_OPERAND1;
+      jit_insn_store(function, rv, arg1);
       /* If value is true, then goto end */
-      jit_insn_branch_if(function, rv, &endlabel);
+      jit_insn_branch_if(function, arg1, &endlabel);
 
       /* Left is false, move to right operand */
       arg2 = EVAL_OPERAND2;
@@ -199,9 +896,11 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
       /* operands are linked list of "condition", "true-value (left)", "false-value (right)" */
       operand = op->op1;
 
-      rv = EVAL_OPERAND(operand);
+      /* The result is not necessarily of the same type as the condition */
+      cond = EVAL_OPERAND(operand);
+      rv = jit_value_create(function, jit_type_sys_double);
       /* If value is false, then goto right branch */
-      jit_insn_branch_if_not(function, rv, &rightlabel);
+      jit_insn_branch_if_not(function, cond, &rightlabel);
 
       /* Left is true, return result of evaluating left operand */
       operand = operand->op_sibling;
@@ -232,42 +931,61 @@ pj_jit_internal_op(jit_function_t function, jit_value_t *var_values, int nvars,
 
 int
 pj_tree_jit(jit_context_t context, pj_term_t *term, jit_function_t *outfun, pj_basic_type *funtype)
+{
+  return pj_tree_jit_level(context, term, jit_function_get_max_optimization_level(), outfun, funtype);
+}
+
+int
+pj_tree_jit_level(jit_context_t context, pj_term_t *term, unsigned int level,
+                  jit_function_t *outfun, pj_basic_type *funtype)
 {
   unsigned int i;
   jit_function_t function;
   jit_type_t *params;
   jit_type_t signature;
+  jit_type_t rettype;
+  char *int_params;
 
   jit_context_build_start(context);
 
-  /* Get the "function type" which is the type that will be used for the
-   * return value as well as all arguments. Double trumps ints. */
+  /* Get the "function type" which is the type of the return value */
   *funtype = pj_tree_determine_funtype(term);
+  rettype = (*funtype == pj_int_type ? jit_type_long
+             : *funtype == pj_uint_type ? jit_type_ulong
+             : jit_type_sys_double);
 
   /* Extract all variable occurrances from the AST */
   pj_variable_t **vars;
   unsigned int nvars;
-  pj_tree_extract_vars(term, &vars, &nvars);
-  PJ_DEBUG_1("Found %i variable occurrances in tree.\n", nvars);
+  unsigned int nvar_uses;
+  pj_tree_extract_vars(term, &vars, &nvar_uses);
+  PJ_DEBUG_1("Found %i variable occurrances in tree.\n", nvar_uses);
 
   /* Naive assumption: the maximum ivar is the total number if distinct arguments (-1) */
   unsigned int max_var = 0;
-  for (i = 0; i < nvars; ++i) {
+  for (i = 0; i < nvar_uses; ++i) {
     if (max_var < (unsigned int)vars[i]->ivar)
       max_var = vars[i]->ivar;
   }
   PJ_DEBUG_1("Found %i distinct variables in tree.\n", 1+max_var);
   nvars = max_var+1;
+
+  int_params = (char *)calloc(nvars, sizeof(char));
+  for (i = 0; i < nvar_uses; ++i) {
+    if (vars[i]->var_type == pj_int_type)
+      int_params[vars[i]->ivar] = 1;
+  }
   free(vars);
 
-  /* Setup libjit func signature */
+  /* Setup libjit func signature. All parameters are passed as doubles,
+   * IVs as their bits (see pj_tree_type_int_vars). */
   params = (jit_type_t *)malloc(nvars*sizeof(jit_type_t));
   for (i = 0; i < nvars; ++i) {
-    params[i] = (*funtype == pj_int_type ? jit_type_sys_int : jit_type_sys_double);
+    params[i] = jit_type_sys_double;
   }
   signature = jit_type_create_signature(
     jit_abi_cdecl,
-    (*funtype == pj_int_type ? jit_type_sys_int : jit_type_sys_double),
+    rettype,
     params,
     nvars,
     1
@@ -279,14 +997,19 @@ pj_tree_jit(jit_context_t context, pj_term_t *term, jit_function_t *outfun, pj_b
   var_values = (jit_value_t *)malloc(nvars*sizeof(jit_value_t));
   for (i = 0; i < nvars; ++i) {
     var_values[i] = jit_value_get_param(function, i);
+    if (int_params[i]) {
+      jit_value_t addr = jit_insn_address_of(function, var_values[i]);
+      var_values[i] = jit_insn_load_relative(function, addr, 0, jit_type_long);
+    }
   }
+  free(int_params);
 
   /* Recursively emit instructions for JIT and final return */
   jit_value_t rv = pj_jit_internal(function, var_values, nvars, term);
-  jit_insn_return(function, rv);
+  jit_insn_return(function, jit_insn_convert(function, rv, rettype, 0));
 
   /* Make it so! */
-  /* jit_function_set_optimization_level(function, jit_function_get_max_optimization_level()); */
+  jit_function_set_optimization_level(function, level);
   jit_function_compile(function);
   jit_context_build_end(context);
 
@@ -294,6 +1017,229 @@ pj_tree_jit(jit_context_t context, pj_term_t *term, jit_function_t *outfun, pj_b
   return 0;
 }
 
+/* What the kernel folds into the accumulator for element x */
+static jit_value_t
+pj_jit_kernel_body(jit_function_t function, pj_term_t *body, pj_kernel_kind kind,
+                   jit_value_t acc, jit_value_t x)
+{
+  jit_value_t var_values[2];
+
+  if (kind == pj_kernel_reduce) {
+    var_values[0] = acc;
+    var_values[1] = x;
+  }
+  else {
+    var_values[0] = x;
+    var_values[1] = x;
+  }
+  return jit_insn_convert(function, pj_jit_internal(function, var_values, 2, body),
+                          jit_type_sys_double, 0);
+}
+
+int
+pj_tree_jit_kernel(jit_context_t context, pj_term_t *body, pj_kernel_kind kind,
+                   unsigned int nacc, jit_function_t *outfun)
+{
+  jit_function_t function;
+  jit_type_t params[4];
+  jit_type_t signature;
+  jit_value_t accp, xp, n, init, i, x, v;
+  jit_value_t acc[PJ_KERNEL_MAX_ACC];
+  jit_label_t looplabel = jit_label_undefined;
+  jit_label_t unrolledlabel = jit_label_undefined;
+  jit_label_t donelabel = jit_label_undefined;
+  jit_label_t foundlabel = jit_label_undefined;
+  unsigned int k;
+
+  if (nacc < 1 || nacc > PJ_KERNEL_MAX_ACC || (nacc > 1 && kind != pj_kernel_sum))
+    return 1;
+
+  jit_context_build_start(context);
+
+  params[0] = jit_type_void_ptr;
+  params[1] = jit_type_void_ptr;
+  params[2] = jit_type_nint;
+  params[3] = jit_type_nint;
+  signature = jit_type_create_signature(jit_abi_cdecl, jit_type_nint, params, 4, 1);
+  function = jit_function_create(context, signature);
+
+  accp = jit_value_get_param(function, 0);
+  xp = jit_value_get_param(function, 1);
+  n = jit_value_get_param(function, 2);
+  init = jit_value_get_param(function, 3);
+
+  i = jit_value_create(function, jit_type_nint);
+  jit_insn_store(function, i, jit_value_create_nint_constant(function, jit_type_nint, 0));
+  for (k = 0; k < nacc; ++k) {
+    acc[k] = jit_value_create(function, jit_type_sys_double);
+    if (k > 0)
+      jit_insn_store(function, acc[k], jit_value_create_float64_constant(function, jit_type_sys_double, 0.));
+  }
+  jit_insn_store(function, acc[0], jit_insn_load_relative(function, accp, 0, jit_type_sys_double));
+
+  /* The first element starts off the accumulator, as in List::Util */
+  if (kind != pj_kernel_find) {
+    jit_insn_branch_if_not(function, init, &unrolledlabel);
+    x = jit_insn_load_elem(function, xp, i, jit_type_sys_double);
+    if (kind == pj_kernel_reduce)
+      jit_insn_store(function, acc[0], x);
+    else
+      jit_insn_store(function, acc[0], pj_jit_kernel_body(function, body, kind, acc[0], x));
+    jit_insn_store(function, i, jit_value_create_nint_constant(function, jit_type_nint, 1));
+  }
+
+  /* nacc elements at a time, each into its own accumulator */
+  jit_insn_label(function, &unrolledlabel);
+  if (nacc > 1) {
+    v = jit_insn_add(function, i, jit_value_create_nint_constant(function, jit_type_nint, nacc));
+    jit_insn_branch_if_not(function, jit_insn_le(function, v, n), &looplabel);
+    for (k = 0; k < nacc; ++k) {
+      x = jit_insn_load_elem(function, xp,
+                             jit_insn_add(function, i, jit_value_create_nint_constant(function, jit_type_nint, k)),
+                             jit_type_sys_double);
+      jit_insn_store(function, acc[k],
+                     jit_insn_add(function, acc[k], pj_jit_kernel_body(function, body, kind, acc[k], x)));
+    }
+    jit_insn_store(function, i, v);
+    jit_insn_branch(function, &unrolledlabel);
+  }
+
+  /* The rest one at a time */
+  jit_insn_label(function, &looplabel);
+  jit_insn_branch_if_not(function, jit_insn_lt(function, i, n), &donelabel);
+  x = jit_insn_load_elem(function, xp, i, jit_type_sys_double);
+  v = pj_jit_kernel_body(function, body, kind, acc[0], x);
+  switch (kind) {
+  case pj_kernel_sum:
+    jit_insn_store(function, acc[0], jit_insn_add(function, acc[0], v));
+    break;
+  case pj_kernel_min:
+  case pj_kernel_max:
+    jit_insn_store(function, acc[0], pj_jit_select(function, acc[0], v, kind == pj_kernel_max));
+    break;
+  case pj_kernel_reduce:
+    jit_insn_store(function, acc[0], v);
+    break;
+  case pj_kernel_find:
+    /* NaN is true, too */
+    jit_insn_branch_if(function,
+                       jit_insn_ne(function, v, jit_value_create_float64_constant(function, jit_type_sys_double, 0.)),
+                       &foundlabel);
+    break;
+  }
+  jit_insn_store(function, i, jit_insn_add(function, i, jit_value_create_nint_constant(function, jit_type_nint, 1)));
+  jit_insn_branch(function, &looplabel);
+
+  jit_insn_label(function, &donelabel);
+  for (k = 1; k < nacc; ++k)
+    jit_insn_store(function, acc[0], jit_insn_add(function, acc[0], acc[k]));
+  jit_insn_store_relative(function, accp, 0, acc[0]);
+  jit_insn_return(function, n);
+
+  if (kind == pj_kernel_find) {
+    jit_insn_label(function, &foundlabel);
+    jit_insn_return(function, i);
+  }
+
+  jit_function_compile(function);
+  jit_context_build_end(context);
+
+  *outfun = function;
+  return 0;
+}
+
+int
+pj_tree_jit_trace(jit_context_t context, pj_trace_step_t *steps, unsigned int nsteps,
+                  unsigned int nvars, jit_nint max_iter, jit_function_t *outfun)
+{
+  jit_function_t function;
+  jit_type_t params[2];
+  jit_type_t signature;
+  jit_value_t varsp, niterp, iter, exitval, v;
+  jit_value_t *var_values;
+  jit_label_t *exitlabels;
+  jit_label_t looplabel = jit_label_undefined;
+  jit_label_t budgetlabel = jit_label_undefined;
+  jit_label_t donelabel = jit_label_undefined;
+  unsigned int i;
+
+  jit_context_build_start(context);
+
+  params[0] = jit_type_void_ptr;
+  params[1] = jit_type_void_ptr;
+  signature = jit_type_create_signature(jit_abi_cdecl, jit_type_nint, params, 2, 1);
+  function = jit_function_create(context, signature);
+
+  varsp = jit_value_get_param(function, 0);
+  niterp = jit_value_get_param(function, 1);
+
+  var_values = (jit_value_t *)malloc((nvars > 0 ? nvars : 1) * sizeof(jit_value_t));
+  for (i = 0; i < nvars; ++i) {
+    var_values[i] = jit_value_create(function, jit_type_sys_double);
+    jit_insn_store(function, var_values[i],
+                   jit_insn_load_relative(function, varsp, i * sizeof(double), jit_type_sys_double));
+  }
+  exitlabels = (jit_label_t *)malloc((nsteps > 0 ? nsteps : 1) * sizeof(jit_label_t));
+  iter = jit_value_create(function, jit_type_nint);
+  jit_insn_store(function, iter, jit_value_create_nint_constant(function, jit_type_nint, 0));
+  exitval = jit_value_create(function, jit_type_nint);
+
+  jit_insn_label(function, &looplabel);
+  jit_insn_branch_if(function,
+                     jit_insn_ge(function, iter, jit_value_create_nint_constant(function, jit_type_nint, max_iter)),
+                     &budgetlabel);
+
+  for (i = 0; i < nsteps; ++i) {
+    exitlabels[i] = jit_label_undefined;
+    v = pj_jit_operand_as_nv(function, steps[i].term,
+                             pj_jit_internal(function, var_values, nvars, steps[i].term));
+    v = jit_insn_convert(function, v, jit_type_sys_double, 0);
+    if (steps[i].ivar >= 0) {
+      if (steps[i].exact_int) {
+        jit_value_t limit = jit_value_create_float64_constant(function, jit_type_sys_double, 9007199254740992.);
+        jit_insn_branch_if(function, jit_insn_gt(function, v, limit), &exitlabels[i]);
+        jit_insn_branch_if(function, jit_insn_lt(function, v, jit_insn_neg(function, limit)), &exitlabels[i]);
+      }
+      jit_insn_store(function, var_values[steps[i].ivar], v);
+    }
+    else {
+      /* NaN is true, too */
+      v = jit_insn_ne(function, v, jit_value_create_float64_constant(function, jit_type_sys_double, 0.));
+      if (steps[i].expected)
+        jit_insn_branch_if_not(function, v, &exitlabels[i]);
+      else
+        jit_insn_branch_if(function, v, &exitlabels[i]);
+    }
+  }
+  jit_insn_store(function, iter, jit_insn_add(function, iter, jit_value_create_nint_constant(function, jit_type_nint, 1)));
+  jit_insn_branch(function, &looplabel);
+
+  /* Side exits */
+  for (i = 0; i < nsteps; ++i) {
+    if (steps[i].ivar >= 0 && !steps[i].exact_int)
+      continue;
+    jit_insn_label(function, &exitlabels[i]);
+    jit_insn_store(function, exitval, jit_value_create_nint_constant(function, jit_type_nint, steps[i].exit));
+    jit_insn_branch(function, &donelabel);
+  }
+  jit_insn_label(function, &budgetlabel);
+  jit_insn_store(function, exitval, jit_value_create_nint_constant(function, jit_type_nint, 0));
+
+  jit_insn_label(function, &donelabel);
+  for (i = 0; i < nvars; ++i)
+    jit_insn_store_relative(function, varsp, i * sizeof(double), var_values[i]);
+  jit_insn_store_relative(function, niterp, 0, iter);
+  jit_insn_return(function, exitval);
+
+  jit_function_compile(function);
+  jit_context_build_end(context);
+
+  free(exitlabels);
+  free(var_values);
+  *outfun = function;
+  return 0;
+}
+
 /* Aaaaaaarg! */
 #include "pj_type_switch.h"
 
@@ -302,10 +1248,13 @@ pj_invoke_func(pj_invoke_func_t fptr, void *args, unsigned int nargs, pj_basic_t
 {
   assert(nargs <= 20);
   if (funtype == pj_double_type) {
-    PJ_TYPE_SWITCH(double, args, nargs, retval);
+    PJ_TYPE_SWITCH(double, double, args, nargs, retval);
   }
   else if (funtype == pj_int_type) {
-    PJ_TYPE_SWITCH(int, args, nargs, retval)
+    PJ_TYPE_SWITCH(jit_long, double, args, nargs, retval)
+  }
+  else if (funtype == pj_uint_type) {
+    PJ_TYPE_SWITCH(jit_ulong, double, args, nargs, retval)
   }
   else
     abort();
@@ -4,18 +4,100 @@
 #include <pj_ast_terms.h>
 #include <jit/jit.h>
 
-/* Generates outfun and funtype. funtype indicates the type of all parameters as well
- * as the return value. That's a very serious limitation, but perfectly good enough for
- * now. funtype will be int if all variables and constants are int, otherwise double. */
+/* Generates outfun and funtype. All parameters are doubles, except that
+ * variables of pj_int_type are passed as the bits of an IV in their double.
+ * funtype indicates the type of the return value: an IV (jit_long) for
+ * pj_int_type, a UV (jit_ulong) for pj_uint_type or a double. */
 int pj_tree_jit(jit_context_t context,
                 pj_term_t *term,
                 jit_function_t *outfun,
                 pj_basic_type *funtype);
 
+/* pj_tree_jit at one of libjit's optimization levels (JIT_OPTLEVEL_*)
+ * instead of the highest */
+int pj_tree_jit_level(jit_context_t context,
+                      pj_term_t *term,
+                      unsigned int level,
+                      jit_function_t *outfun,
+                      pj_basic_type *funtype);
+
+/* The loops pj_tree_jit_kernel generates */
+typedef enum {
+  pj_kernel_sum,    /* *acc += body(x[i]) */
+  pj_kernel_min,    /* *acc = body(x[i]) if that's less, as in List::Util */
+  pj_kernel_max,
+  pj_kernel_reduce, /* *acc = body(*acc, x[i]) */
+  pj_kernel_find    /* the first i for which body(x[i]) is true */
+} pj_kernel_kind;
+
+/* Most accumulators a sum kernel may use */
+#define PJ_KERNEL_MAX_ACC 8
+
+/* Generates a loop over an array of doubles with body inlined:
+ *   jit_nint kernel(double *acc, const double *x, jit_nint n, jit_nint init)
+ * Variable 0 of body is x[i], except for reduce, where it's the
+ * accumulator and variable 1 is x[i]. If init is non-zero (and n > 0),
+ * x[0] only sets up *acc: to body(x[0]), or to x[0] for reduce. The
+ * kernel returns n, or for find the index of the first match (n if
+ * there is none). With nacc > 1, a sum is split across that many
+ * accumulators, which reassociates the additions. */
+int pj_tree_jit_kernel(jit_context_t context,
+                       pj_term_t *body,
+                       pj_kernel_kind kind,
+                       unsigned int nacc,
+                       jit_function_t *outfun);
+
+typedef jit_nint (*pj_kernel_func_t)(double *acc, const double *x, jit_nint n, jit_nint init);
+
+/* One step of a trace, see pj_tree_jit_trace */
+typedef struct {
+  pj_term_t *term;
+  int ivar;          /* the variable to store the value in, -1 for a guard */
+  int expected;      /* guards: the truth of the value the trace was recorded with */
+  unsigned int exit; /* guards: what to return if it's not that */
+  int exact_int;     /* stores: return exit instead if the value is beyond
+                      * +-2**53, where doubles stop being exact integers */
+} pj_trace_step_t;
+
+/* Generates the loop of a recorded trace:
+ *   jit_nint trace(double *vars, jit_nint *niter)
+ * All variables are doubles, taken from vars. The steps are run over and
+ * over until a guard fails, which returns its exit, with the variables
+ * written back and the number of completed iterations in *niter. Exit 0
+ * is also taken after max_iter iterations. */
+int pj_tree_jit_trace(jit_context_t context,
+                      pj_trace_step_t *steps,
+                      unsigned int nsteps,
+                      unsigned int nvars,
+                      jit_nint max_iter,
+                      jit_function_t *outfun);
+
+typedef jit_nint (*pj_trace_func_t)(double *vars, jit_nint *niter);
+
 typedef void (*pj_invoke_func_t)(void);
 
+/* Conditions under which Perl would croak at run time */
+typedef enum {
+  pj_error_division_by_zero,
+  pj_error_modulus_zero,
+  pj_error_log_of_nonpositive,
+  pj_error_sqrt_of_negative
+} pj_runtime_error;
+
+/* Called from generated code when it hits one of the above, along with
+ * the offending operand. Must not return (ie. should croak or similar).
+ * If NULL, we abort(). */
+extern void (*pj_runtime_error_handler)(pj_runtime_error err, double value);
+
+/* The random number generator for rand: generated code calls
+ * pj_drand_func(pj_drand_state) for a number in [0, 1). Must be set
+ * before compiling code that uses rand. */
+extern double (*pj_drand_func)(void *state);
+extern void *pj_drand_state;
+
 /* thanks to the saddest code generation on the
- * planet, this can handle up to 20 args right now (see make regen) */
+ * planet, this can handle up to 20 args right now (see make regen).
+ * args are doubles, retval is of the funtype from pj_tree_jit. */
 void pj_invoke_func(pj_invoke_func_t fptr,
                     void *args,
                     unsigned int nargs,
@@ -16,6 +16,12 @@ static char *pj_ast_op_names[] = {
   "int",      /* pj_unop_int */
   "~",        /* pj_unop_bitwise_not */
   "!",        /* pj_unop_bool_not */
+  "iv",       /* pj_unop_iv */
+  "uv",       /* pj_unop_uv */
+  "floor",    /* pj_unop_floor */
+  "ceil",     /* pj_unop_ceil */
+  "tan",      /* pj_unop_tan */
+  "rand",     /* pj_unop_rand */
 
   /* binops */
   "+",        /* pj_binop_add */
@@ -36,6 +42,11 @@ static char *pj_ast_op_names[] = {
   "<=",       /* pj_binop_le */
   ">",        /* pj_binop_gt */
   ">=",       /* pj_binop_ge */
+  "<=>",      /* pj_binop_ncmp */
+  "i%",       /* pj_binop_i_modulo */
+  "fmod",     /* pj_binop_fmod */
+  "min",      /* pj_binop_min */
+  "max",      /* pj_binop_max */
   "&&",       /* pj_binop_bool_and */
   "||",       /* pj_binop_bool_or */
 
@@ -53,8 +64,14 @@ unsigned int pj_ast_op_flags[] = {
   0,                              /* pj_unop_log */
   0,                              /* pj_unop_exp */
   0,                              /* pj_unop_int */
-  0,                              /* pj_unop_bitwise_not */
-  0,                              /* pj_unop_bool_not */
+  PJ_ASTf_INTEGER,                /* pj_unop_bitwise_not */
+  PJ_ASTf_BOOLEAN,                /* pj_unop_bool_not */
+  PJ_ASTf_INTEGER,                /* pj_unop_iv */
+  PJ_ASTf_INTEGER,                /* pj_unop_uv */
+  0,                              /* pj_unop_floor */
+  0,                              /* pj_unop_ceil */
+  0,                              /* pj_unop_tan */
+  PJ_ASTf_SIDE_EFFECT,            /* pj_unop_rand */
 
   /* binops */
   0,                              /* pj_binop_add */
@@ -64,17 +81,22 @@ unsigned int pj_ast_op_flags[] = {
   0,                              /* pj_binop_modulo */
   0,                              /* pj_binop_atan2 */
   0,                              /* pj_binop_pow */
-  0,                              /* pj_binop_left_shift */
-  0,                              /* pj_binop_right_shift */
-  0,                              /* pj_binop_bitwise_and */
-  0,                              /* pj_binop_bitwise_or */
-  0,                              /* pj_binop_bitwise_xor */
-  0,                              /* pj_binop_eq */
-  0,                              /* pj_binop_ne */
-  0,                              /* pj_binop_lt */
-  0,                              /* pj_binop_le */
-  0,                              /* pj_binop_gt */
-  0,                              /* pj_binop_ge */
+  PJ_ASTf_INTEGER,                /* pj_binop_left_shift */
+  PJ_ASTf_INTEGER,                /* pj_binop_right_shift */
+  PJ_ASTf_INTEGER,                /* pj_binop_bitwise_and */
+  PJ_ASTf_INTEGER,                /* pj_binop_bitwise_or */
+  PJ_ASTf_INTEGER,                /* pj_binop_bitwise_xor */
+  PJ_ASTf_BOOLEAN,                /* pj_binop_eq */
+  PJ_ASTf_BOOLEAN,                /* pj_binop_ne */
+  PJ_ASTf_BOOLEAN,                /* pj_binop_lt */
+  PJ_ASTf_BOOLEAN,                /* pj_binop_le */
+  PJ_ASTf_BOOLEAN,                /* pj_binop_gt */
+  PJ_ASTf_BOOLEAN,                /* pj_binop_ge */
+  0,                              /* pj_binop_ncmp */
+  PJ_ASTf_INTEGER,                /* pj_binop_i_modulo */
+  0,                              /* pj_binop_fmod */
+  0,                              /* pj_binop_min */
+  0,                              /* pj_binop_max */
   PJ_ASTf_CONDITIONAL,            /* pj_binop_bool_and */
   PJ_ASTf_CONDITIONAL,            /* pj_binop_bool_or */
 
@@ -93,7 +115,7 @@ pj_make_const_dbl(double c)
 }
 
 pj_term_t *
-pj_make_const_int(int c)
+pj_make_const_int(int64_t c)
 {
   pj_constant_t *co = (pj_constant_t *)malloc(sizeof(pj_constant_t));
   co->type = pj_ttype_constant;
@@ -103,7 +125,7 @@ pj_make_const_int(int c)
 }
 
 pj_term_t *
-pj_make_const_uint(unsigned int c)
+pj_make_const_uint(uint64_t c)
 {
   pj_constant_t *co = (pj_constant_t *)malloc(sizeof(pj_constant_t));
   co->type = pj_ttype_constant;
@@ -167,6 +189,120 @@ pj_make_listop(pj_optype t, pj_term_t *o_start, pj_term_t *o_end)
 }
 
 
+pj_term_t *
+pj_make_pvload(pj_pvload_elem_type t, unsigned int flags,
+               pj_term_t *buffer, pj_term_t *offset, unsigned int scale)
+{
+  pj_pvload_t *l = (pj_pvload_t *)malloc(sizeof(pj_pvload_t));
+  l->op_sibling = NULL;
+  l->type = pj_ttype_pvload;
+  l->elem_type = t;
+  l->flags = flags;
+  l->scale = scale;
+  l->buffer = buffer;
+  l->offset = offset;
+  l->sublen = 0;
+  l->buf = NULL;
+  buffer->op_sibling = NULL;
+  offset->op_sibling = NULL;
+  return (pj_term_t *)l;
+}
+
+
+pj_term_t *
+pj_make_inline(pj_term_t *body, pj_term_t *args, unsigned int nargs, void *callee,
+               int (*guard)(void *callee),
+               double (*fallback)(void *callee, double *args, unsigned int nargs))
+{
+  pj_inline_t *in = (pj_inline_t *)malloc(sizeof(pj_inline_t));
+  in->op_sibling = NULL;
+  in->type = pj_ttype_inline;
+  in->body = body;
+  in->args = args;
+  in->nargs = nargs;
+  in->callee = callee;
+  in->guard = guard;
+  in->fallback = fallback;
+  body->op_sibling = NULL;
+  return (pj_term_t *)in;
+}
+
+
+pj_term_t *
+pj_make_fieldload(pj_term_t *container, void *key,
+                  double (*fetch)(void *record, void *key))
+{
+  pj_fieldload_t *f = (pj_fieldload_t *)malloc(sizeof(pj_fieldload_t));
+  f->op_sibling = NULL;
+  f->type = pj_ttype_fieldload;
+  f->container = container;
+  f->key = key;
+  f->fetch = fetch;
+  f->record = NULL;
+  container->op_sibling = NULL;
+  return (pj_term_t *)f;
+}
+
+
+pj_term_t *
+pj_make_elemload(pj_term_t *container, pj_term_t *index, pj_term_t *index2,
+                 double (*fetch)(void *record, ptrdiff_t i, ptrdiff_t j))
+{
+  pj_elemload_t *e = (pj_elemload_t *)malloc(sizeof(pj_elemload_t));
+  e->op_sibling = NULL;
+  e->type = pj_ttype_elemload;
+  e->container = container;
+  e->index = index;
+  e->index2 = index2;
+  e->fetch = fetch;
+  e->record = NULL;
+  container->op_sibling = NULL;
+  index->op_sibling = NULL;
+  if (index2 != NULL)
+    index2->op_sibling = NULL;
+  return (pj_term_t *)e;
+}
+
+
+pj_term_t *
+pj_make_opcall(pj_term_t *args, unsigned int nargs, void *op,
+               double (*call)(void *op, double *args, unsigned int nargs))
+{
+  pj_opcall_t *c = (pj_opcall_t *)malloc(sizeof(pj_opcall_t));
+  c->op_sibling = NULL;
+  c->type = pj_ttype_opcall;
+  c->args = args;
+  c->nargs = nargs;
+  c->op = op;
+  c->call = call;
+  return (pj_term_t *)c;
+}
+
+
+unsigned int
+pj_pvload_elem_size(pj_pvload_elem_type t)
+{
+  switch (t) {
+  case pj_pvload_int8:
+  case pj_pvload_uint8:
+    return 1;
+  case pj_pvload_int16:
+  case pj_pvload_uint16:
+    return 2;
+  case pj_pvload_int32:
+  case pj_pvload_uint32:
+  case pj_pvload_float:
+    return 4;
+  case pj_pvload_int64:
+  case pj_pvload_uint64:
+  case pj_pvload_double:
+    return 8;
+  default:
+    abort();
+  }
+}
+
+
 void
 pj_free_tree(pj_term_t *t)
 {
@@ -182,11 +318,135 @@ pj_free_tree(pj_term_t *t)
       pj_free_tree(kid);
     }
   }
+  else if (t->type == pj_ttype_pvload) {
+    /* the pj_pvbuf_t isn't owned by the AST */
+    pj_free_tree(((pj_pvload_t *)t)->buffer);
+    pj_free_tree(((pj_pvload_t *)t)->offset);
+  }
+  else if (t->type == pj_ttype_inline) {
+    pj_term_t *kid;
+    pj_term_t *next;
+    pj_inline_t *in = (pj_inline_t *)t;
+    pj_free_tree(in->body);
+    for (kid = in->args; kid; kid = next) {
+      next = kid->op_sibling;
+      pj_free_tree(kid);
+    }
+  }
+  else if (t->type == pj_ttype_fieldload) {
+    pj_free_tree(((pj_fieldload_t *)t)->container);
+  }
+  else if (t->type == pj_ttype_elemload) {
+    pj_free_tree(((pj_elemload_t *)t)->container);
+    pj_free_tree(((pj_elemload_t *)t)->index);
+    pj_free_tree(((pj_elemload_t *)t)->index2);
+  }
+  else if (t->type == pj_ttype_opcall) {
+    pj_term_t *kid;
+    pj_term_t *next;
+    for (kid = ((pj_opcall_t *)t)->args; kid; kid = next) {
+      next = kid->op_sibling;
+      pj_free_tree(kid);
+    }
+  }
 
   free(t);
 }
 
 
+/* Copies a list of sibling terms */
+static pj_term_t *
+pj_clone_term_list(pj_term_t *first, pj_term_t **vars, pj_term_t **last)
+{
+  pj_term_t *head = NULL, *tail = NULL, *kid, *copy;
+
+  for (kid = first; kid; kid = kid->op_sibling) {
+    copy = pj_clone_tree(kid, vars);
+    if (tail == NULL)
+      head = copy;
+    else
+      tail->op_sibling = copy;
+    tail = copy;
+  }
+  if (last != NULL)
+    *last = tail;
+  return head;
+}
+
+pj_term_t *
+pj_clone_tree(pj_term_t *t, pj_term_t **vars)
+{
+  pj_term_t *copy;
+
+  switch (t->type) {
+  case pj_ttype_variable:
+    if (vars != NULL)
+      return pj_clone_tree(vars[((pj_variable_t *)t)->ivar], NULL);
+    copy = (pj_term_t *)malloc(sizeof(pj_variable_t));
+    *(pj_variable_t *)copy = *(pj_variable_t *)t;
+    break;
+  case pj_ttype_constant:
+    copy = (pj_term_t *)malloc(sizeof(pj_constant_t));
+    *(pj_constant_t *)copy = *(pj_constant_t *)t;
+    break;
+  case pj_ttype_op: {
+      pj_op_t *o = (pj_op_t *)malloc(sizeof(pj_op_t));
+      *o = *(pj_op_t *)t;
+      o->op1 = pj_clone_term_list(((pj_op_t *)t)->op1, vars, &o->op2);
+      if (PJ_IS_OP_UNOP(o))
+        o->op2 = NULL;
+      copy = (pj_term_t *)o;
+      break;
+    }
+  case pj_ttype_pvload: {
+      pj_pvload_t *l = (pj_pvload_t *)malloc(sizeof(pj_pvload_t));
+      *l = *(pj_pvload_t *)t;
+      l->buffer = pj_clone_tree(l->buffer, vars);
+      l->offset = pj_clone_tree(l->offset, vars);
+      copy = (pj_term_t *)l;
+      break;
+    }
+  case pj_ttype_inline: {
+      pj_inline_t *in = (pj_inline_t *)malloc(sizeof(pj_inline_t));
+      *in = *(pj_inline_t *)t;
+      in->body = pj_clone_tree(in->body, vars);
+      in->args = pj_clone_term_list(in->args, vars, NULL);
+      copy = (pj_term_t *)in;
+      break;
+    }
+  case pj_ttype_fieldload: {
+      pj_fieldload_t *f = (pj_fieldload_t *)malloc(sizeof(pj_fieldload_t));
+      *f = *(pj_fieldload_t *)t;
+      f->container = pj_clone_tree(f->container, vars);
+      copy = (pj_term_t *)f;
+      break;
+    }
+  case pj_ttype_elemload: {
+      pj_elemload_t *e = (pj_elemload_t *)malloc(sizeof(pj_elemload_t));
+      *e = *(pj_elemload_t *)t;
+      e->container = pj_clone_tree(e->container, vars);
+      e->index = pj_clone_tree(e->index, vars);
+      if (e->index2 != NULL)
+        e->index2 = pj_clone_tree(e->index2, vars);
+      copy = (pj_term_t *)e;
+      break;
+    }
+  case pj_ttype_opcall: {
+      pj_opcall_t *c = (pj_opcall_t *)malloc(sizeof(pj_opcall_t));
+      *c = *(pj_opcall_t *)t;
+      c->args = pj_clone_term_list(c->args, vars, NULL);
+      copy = (pj_term_t *)c;
+      break;
+    }
+  default:
+    abort();
+  }
+
+  copy->op_sibling = NULL;
+  return copy;
+}
+
+
 /* pinnacle of software engineering, but it's just for debugging anyway...  */
 static void
 pj_dump_tree_indent(int lvl)
@@ -206,9 +466,9 @@ pj_dump_tree_internal(pj_term_t *term, int lvl)
     if (c->const_type == pj_double_type)
       printf("C = %f\n", (float)c->value_u.dbl_value);
     else if (c->const_type == pj_int_type)
-      printf("C = %i\n", (int)c->value_u.int_value);
+      printf("C = %lli\n", (long long)c->value_u.int_value);
     else if (c->const_type == pj_uint_type)
-      printf("C = %lu\n", (unsigned long)c->value_u.uint_value);
+      printf("C = %llu\n", (unsigned long long)c->value_u.uint_value);
     else
       abort();
   }
@@ -232,6 +492,73 @@ pj_dump_tree_internal(pj_term_t *term, int lvl)
     pj_dump_tree_indent(lvl);
     printf(")\n");
   }
+  else if (term->type == pj_ttype_pvload)
+  {
+    pj_pvload_t *l = (pj_pvload_t *)term;
+
+    pj_dump_tree_indent(lvl);
+    printf("PVLOAD type=%i flags=%u scale=%u (\n", (int)l->elem_type, l->flags, l->scale);
+    pj_dump_tree_internal(l->buffer, lvl+1);
+    pj_dump_tree_internal(l->offset, lvl+1);
+
+    pj_dump_tree_indent(lvl);
+    printf(")\n");
+  }
+  else if (term->type == pj_ttype_inline)
+  {
+    pj_inline_t *in = (pj_inline_t *)term;
+    pj_term_t *kid;
+
+    pj_dump_tree_indent(lvl);
+    printf("INLINE nargs=%u (\n", in->nargs);
+    pj_dump_tree_internal(in->body, lvl+1);
+
+    pj_dump_tree_indent(lvl);
+    printf(") FALLBACK (\n");
+    for (kid = in->args; kid; kid = kid->op_sibling)
+      pj_dump_tree_internal(kid, lvl+1);
+
+    pj_dump_tree_indent(lvl);
+    printf(")\n");
+  }
+  else if (term->type == pj_ttype_fieldload)
+  {
+    pj_fieldload_t *f = (pj_fieldload_t *)term;
+
+    pj_dump_tree_indent(lvl);
+    printf("FIELDLOAD key=%p (\n", f->key);
+    pj_dump_tree_internal(f->container, lvl+1);
+
+    pj_dump_tree_indent(lvl);
+    printf(")\n");
+  }
+  else if (term->type == pj_ttype_elemload)
+  {
+    pj_elemload_t *e = (pj_elemload_t *)term;
+
+    pj_dump_tree_indent(lvl);
+    printf("ELEMLOAD (\n");
+    pj_dump_tree_internal(e->container, lvl+1);
+    pj_dump_tree_internal(e->index, lvl+1);
+    if (e->index2 != NULL)
+      pj_dump_tree_internal(e->index2, lvl+1);
+
+    pj_dump_tree_indent(lvl);
+    printf(")\n");
+  }
+  else if (term->type == pj_ttype_opcall)
+  {
+    pj_opcall_t *c = (pj_opcall_t *)term;
+    pj_term_t *kid;
+
+    pj_dump_tree_indent(lvl);
+    printf("OPCALL op=%p nargs=%u (\n", c->op, c->nargs);
+    for (kid = c->args; kid; kid = kid->op_sibling)
+      pj_dump_tree_internal(kid, lvl+1);
+
+    pj_dump_tree_indent(lvl);
+    printf(")\n");
+  }
   else
     abort();
 }
@@ -3,12 +3,20 @@
 
 /* Definition of types and functions for the Perl JIT AST. */
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef int pj_optype;
 
 typedef enum {
   pj_ttype_constant,
   pj_ttype_variable,
-  pj_ttype_op
+  pj_ttype_op,
+  pj_ttype_pvload,
+  pj_ttype_inline,
+  pj_ttype_fieldload,
+  pj_ttype_elemload,
+  pj_ttype_opcall
 } pj_term_type;
 
 /* keep in sync with pj_ast_op_names in .c file */
@@ -21,8 +29,14 @@ typedef enum {
   pj_unop_log,
   pj_unop_exp,
   pj_unop_perl_int, /* the equivalent to the perl int function */
-  pj_unop_bitwise_not, /* TODO check */
+  pj_unop_bitwise_not, /* ~ on the operand's UV, or IV if it's been made one */
   pj_unop_bool_not,
+  pj_unop_iv, /* numeric value converted to an IV, like SvIV (use integer) */
+  pj_unop_uv, /* numeric value converted to a UV, like SvUV */
+  pj_unop_floor, /* POSIX::floor */
+  pj_unop_ceil, /* POSIX::ceil */
+  pj_unop_tan, /* POSIX::tan */
+  pj_unop_rand, /* rand, using the generator set up in pj_ast_jit.h */
 
   pj_binop_add,
   pj_binop_subtract,
@@ -31,17 +45,22 @@ typedef enum {
   pj_binop_modulo,
   pj_binop_atan2,
   pj_binop_pow,
-  pj_binop_left_shift, /* differs from perl for negative left operands */
-  pj_binop_right_shift, /* differs from perl for negative left operands */
-  pj_binop_bitwise_and, /* TODO check */
-  pj_binop_bitwise_or, /* TODO check */
-  pj_binop_bitwise_xor, /* TODO check */
+  pj_binop_left_shift, /* on UVs, or IVs under use integer, see pj_unop_bitwise_not */
+  pj_binop_right_shift, /* ditto */
+  pj_binop_bitwise_and, /* ditto */
+  pj_binop_bitwise_or, /* ditto */
+  pj_binop_bitwise_xor, /* ditto */
   pj_binop_eq, /* TODO check */
   pj_binop_ne, /* TODO check */
   pj_binop_lt, /* TODO check */
   pj_binop_le, /* TODO check */
   pj_binop_gt, /* TODO check */
   pj_binop_ge, /* TODO check */
+  pj_binop_ncmp, /* <=>, FIXME NaN yields 0 instead of undef */
+  pj_binop_i_modulo, /* % under use integer: C semantics on IVs */
+  pj_binop_fmod, /* POSIX::fmod: C semantics, no croaking */
+  pj_binop_min, /* List::Util::min: right operand if smaller, else left */
+  pj_binop_max, /* List::Util::max: right operand if larger, else left */
   pj_binop_bool_and,
   pj_binop_bool_or,
 
@@ -49,7 +68,7 @@ typedef enum {
   /* TODO: more boolean operators, ternary */
 
   pj_unop_FIRST  = pj_unop_negate,
-  pj_unop_LAST   = pj_unop_bool_not,
+  pj_unop_LAST   = pj_unop_rand,
 
   pj_binop_FIRST = pj_binop_add,
   pj_binop_LAST  = pj_binop_bool_or,
@@ -58,9 +77,9 @@ typedef enum {
   pj_listop_LAST  = pj_listop_ternary,
 } pj_op_type;
 
-#define PJ_IS_OP_UNOP(o) ((o)->type >= pj_unop_FIRST && (o)->type <= pj_unop_LAST)
-#define PJ_IS_OP_BINOP(o) ((o)->type >= pj_binop_FIRST && (o)->type <= pj_binop_LAST)
-#define PJ_IS_OP_LISTOP(o) ((o)->type >= pj_listop_FIRST && (o)->type <= pj_listop_LAST)
+#define PJ_IS_OP_UNOP(o) ((o)->optype >= pj_unop_FIRST && (o)->optype <= pj_unop_LAST)
+#define PJ_IS_OP_BINOP(o) ((o)->optype >= pj_binop_FIRST && (o)->optype <= pj_binop_LAST)
+#define PJ_IS_OP_LISTOP(o) ((o)->optype >= pj_listop_FIRST && (o)->optype <= pj_listop_LAST)
 
 typedef enum {
   pj_double_type,
@@ -71,9 +90,16 @@ typedef enum {
 /* Indicates that the given op will only evaluate its arguments
  * conditionally (eg. short-circuiting boolean and/or). */
 #define PJ_ASTf_CONDITIONAL (1<<0)
+/* Indicates that the given op yields a boolean (Perl's yes/no) */
+#define PJ_ASTf_BOOLEAN (1<<1)
+/* Indicates that evaluating the op has a side effect (rand) */
+#define PJ_ASTf_SIDE_EFFECT (1<<2)
+/* Indicates that the op works on the IVs or UVs of its operands and
+ * yields one, too. Other ops see UVs as NVs. */
+#define PJ_ASTf_INTEGER (1<<3)
 
 extern unsigned int pj_ast_op_flags[];
-#define PJ_OP_FLAGS(op) pj_ast_op_flags[(op)->type]
+#define PJ_OP_FLAGS(op) pj_ast_op_flags[(op)->optype]
 
 #define BASE_TERM_MEMBERS   \
   pj_optype type;           \
@@ -96,8 +122,8 @@ typedef struct {
   pj_basic_type const_type;
   union {
     double dbl_value;
-    int int_value;
-    unsigned int uint_value;
+    int64_t int_value; /* an IV, FIXME assumed to be 64 bits */
+    uint64_t uint_value; /* a UV */
   } value_u;
 } pj_constant_t;
 
@@ -107,18 +133,146 @@ typedef struct {
   int ivar;
 } pj_variable_t;
 
+/* Element types that can be read straight out of a string buffer.
+ * These correspond to the fixed-size pack/unpack formats. */
+typedef enum {
+  pj_pvload_int8,
+  pj_pvload_uint8,
+  pj_pvload_int16,
+  pj_pvload_uint16,
+  pj_pvload_int32,
+  pj_pvload_uint32,
+  pj_pvload_int64,
+  pj_pvload_uint64,
+  pj_pvload_float,
+  pj_pvload_double
+} pj_pvload_elem_type;
+
+/* Byte order of the element in the buffer. Neither flag means "native". */
+#define PJ_PVLOADf_LITTLE_ENDIAN  (1<<0)
+#define PJ_PVLOADf_BIG_ENDIAN     (1<<1)
+/* Negative offsets count from the end of the buffer (like substr). */
+#define PJ_PVLOADf_NEG_FROM_END   (1<<2)
+/* Elements hanging off the end of the buffer are zero-padded (like vec)
+ * instead of yielding 0 altogether. */
+#define PJ_PVLOADf_ZERO_PAD       (1<<3)
+
+/* Where a string buffer lives at run time. The generated code reads
+ * pv and len from here on every call, so whoever invokes the function
+ * has to fill this in beforehand. */
+typedef struct {
+  const char *pv;
+  size_t len;
+} pj_pvbuf_t;
+
+/* Load of a single element from a string buffer:
+ *   element at byte offset (offset * scale) of buf, bounds-checked.
+ * Out-of-bounds loads yield 0. The buffer itself is also passed as
+ * a (dummy) variable so that the function signature accounts for its
+ * slot in the parameter list. */
+typedef struct {
+  BASE_TERM_MEMBERS
+  pj_pvload_elem_type elem_type;
+  unsigned int flags;
+  unsigned int scale;
+  pj_term_t *buffer; /* a pj_variable_t */
+  pj_term_t *offset;
+  /* With PJ_PVLOADf_NEG_FROM_END: length of the substring the element is
+   * read from, 0 for "to the end of the buffer". Offsets still before the
+   * start of the buffer are clamped to it and the substring shortened,
+   * like substr does. Set after construction like buf. */
+  unsigned int sublen;
+  pj_pvbuf_t *buf; /* set by the user of the AST before JIT compilation */
+} pj_pvload_t;
+
+/* A call to an external function whose body has been inlined. The body
+ * is only valid for as long as guard(callee) returns non-zero. If it
+ * doesn't, the arguments are evaluated and passed to the fallback, which
+ * makes the actual call. In the body, the arguments have already been
+ * substituted for the function's parameters. */
+typedef struct {
+  BASE_TERM_MEMBERS
+  pj_term_t *body;
+  pj_term_t *args; /* linked list using op_sibling */
+  unsigned int nargs;
+  void *callee; /* opaque, passed to guard and fallback */
+  int (*guard)(void *callee);
+  double (*fallback)(void *callee, double *args, unsigned int nargs);
+} pj_inline_t;
+
+/* Numeric value of a named field of a record, such as $p->{x}. The
+ * record is passed as a (dummy) variable, like a pvload's buffer, and
+ * published in *record by whoever invokes the function. The generated
+ * code calls fetch(*record, key) for the value. */
+typedef struct {
+  BASE_TERM_MEMBERS
+  pj_term_t *container; /* a pj_variable_t */
+  void *key; /* opaque, passed to fetch. Not owned by the AST. */
+  double (*fetch)(void *record, void *key);
+  void **record; /* set by the user of the AST before JIT compilation */
+} pj_fieldload_t;
+
+/* Numeric value of an element of an array, or of an array of arrays,
+ * such as $v->[$i] or $m->[$i][$j]. Like a fieldload, the array is
+ * passed as a (dummy) variable and published in *record. The generated
+ * code truncates the indices to integers and calls
+ * fetch(*record, i, j) for the value, with j = 0 if there's no index2. */
+typedef struct {
+  BASE_TERM_MEMBERS
+  pj_term_t *container; /* a pj_variable_t */
+  pj_term_t *index;
+  pj_term_t *index2; /* NULL for a single index */
+  double (*fetch)(void *record, ptrdiff_t i, ptrdiff_t j);
+  void **record; /* set by the user of the AST before JIT compilation */
+} pj_elemload_t;
+
+/* An operation the AST has no term for, done by calling back into
+ * whoever built the AST: the operands are evaluated natively and passed
+ * to call(op, args, nargs), which returns the result. Saves cutting the
+ * expression in two around it. The call must have no side effects
+ * beyond what evaluating the operation in place would have. */
+typedef struct {
+  BASE_TERM_MEMBERS
+  pj_term_t *args; /* linked list using op_sibling */
+  unsigned int nargs;
+  void *op; /* opaque, passed to call. Not owned by the AST. */
+  double (*call)(void *op, double *args, unsigned int nargs);
+} pj_opcall_t;
+
 
 pj_term_t *pj_make_const_dbl(double c);
-pj_term_t *pj_make_const_int(int c);
-pj_term_t *pj_make_const_uint(unsigned int c);
+pj_term_t *pj_make_const_int(int64_t c);
+pj_term_t *pj_make_const_uint(uint64_t c);
 pj_term_t *pj_make_variable(int iv, pj_basic_type t);
 pj_term_t *pj_make_binop(pj_optype t, pj_term_t *o1, pj_term_t *o2);
 pj_term_t *pj_make_unop(pj_optype t, pj_term_t *o1);
 /* for pj_make_listop, o_start and o_end have to form a linked list of ops alread (using op_sibling) */
 pj_term_t *pj_make_listop(pj_optype t, pj_term_t *o_start, pj_term_t *o_end);
+pj_term_t *pj_make_pvload(pj_pvload_elem_type t, unsigned int flags,
+                          pj_term_t *buffer, pj_term_t *offset, unsigned int scale);
+/* args has to be a linked list of nargs terms (using op_sibling) */
+pj_term_t *pj_make_inline(pj_term_t *body, pj_term_t *args, unsigned int nargs, void *callee,
+                          int (*guard)(void *callee),
+                          double (*fallback)(void *callee, double *args, unsigned int nargs));
+
+pj_term_t *pj_make_fieldload(pj_term_t *container, void *key,
+                             double (*fetch)(void *record, void *key));
+/* index2 may be NULL */
+pj_term_t *pj_make_elemload(pj_term_t *container, pj_term_t *index, pj_term_t *index2,
+                            double (*fetch)(void *record, ptrdiff_t i, ptrdiff_t j));
+/* args has to be a linked list of nargs terms (using op_sibling) */
+pj_term_t *pj_make_opcall(pj_term_t *args, unsigned int nargs, void *op,
+                          double (*call)(void *op, double *args, unsigned int nargs));
+
+/* Size in bytes of a single element of the given type */
+unsigned int pj_pvload_elem_size(pj_pvload_elem_type t);
 
 void pj_free_tree(pj_term_t *t);
 
+/* Deep copy of a tree. If vars is non-NULL, variables are replaced by
+ * copies of vars[ivar] instead (substitution of arguments for params). */
+pj_term_t *pj_clone_tree(pj_term_t *t, pj_term_t **vars);
+
 /* purely a debugging aid! */
 void pj_dump_tree(pj_term_t *term);
 
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "pj_ast_walkers.h"
 
 static void
@@ -8,7 +9,7 @@ pj_tree_extract_vars_internal(pj_term_t *term, pj_variable_t * **vars, unsigned
   if (term->type == pj_ttype_variable)
   {
     /* not efficient, but simple */
-    if (vars == NULL)
+    if (*vars == NULL)
       *vars = (pj_variable_t **)malloc(sizeof(pj_variable_t *));
     else
       *vars = (pj_variable_t **)realloc(*vars, (*nvars+1) * sizeof(pj_variable_t *));
@@ -17,10 +18,42 @@ pj_tree_extract_vars_internal(pj_term_t *term, pj_variable_t * **vars, unsigned
   }
   else if (term->type == pj_ttype_op)
   {
-    pj_op_t *o = (pj_op_t *)term;
-    pj_tree_extract_vars_internal(o->op1, vars, nvars);
-    if (o->op2 != NULL)
-      pj_tree_extract_vars_internal(o->op2, vars, nvars);
+    /* Not just op1 and op2: listops may have more kids in between */
+    pj_term_t *kid;
+    for (kid = ((pj_op_t *)term)->op1; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_vars_internal(kid, vars, nvars);
+  }
+  else if (term->type == pj_ttype_pvload)
+  {
+    pj_pvload_t *l = (pj_pvload_t *)term;
+    pj_tree_extract_vars_internal(l->buffer, vars, nvars);
+    pj_tree_extract_vars_internal(l->offset, vars, nvars);
+  }
+  else if (term->type == pj_ttype_inline)
+  {
+    pj_inline_t *in = (pj_inline_t *)term;
+    pj_term_t *kid;
+    pj_tree_extract_vars_internal(in->body, vars, nvars);
+    for (kid = in->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_vars_internal(kid, vars, nvars);
+  }
+  else if (term->type == pj_ttype_fieldload)
+  {
+    pj_tree_extract_vars_internal(((pj_fieldload_t *)term)->container, vars, nvars);
+  }
+  else if (term->type == pj_ttype_elemload)
+  {
+    pj_elemload_t *e = (pj_elemload_t *)term;
+    pj_tree_extract_vars_internal(e->container, vars, nvars);
+    pj_tree_extract_vars_internal(e->index, vars, nvars);
+    if (e->index2 != NULL)
+      pj_tree_extract_vars_internal(e->index2, vars, nvars);
+  }
+  else if (term->type == pj_ttype_opcall)
+  {
+    pj_term_t *kid;
+    for (kid = ((pj_opcall_t *)term)->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_vars_internal(kid, vars, nvars);
   }
 }
 
@@ -32,8 +65,117 @@ pj_tree_extract_vars(pj_term_t *term, pj_variable_t * **vars, unsigned int *nvar
   pj_tree_extract_vars_internal(term, vars, nvars);
 }
 
-/* FIXME this isn't really very useful right now and if it becomes that,
- *       it could really do with a rewrite */
+static void
+pj_tree_extract_pvloads_internal(pj_term_t *term, pj_pvload_t * **pvloads, unsigned int *npvloads)
+{
+  if (term->type == pj_ttype_pvload)
+  {
+    pj_pvload_t *l = (pj_pvload_t *)term;
+    *pvloads = (pj_pvload_t **)realloc(*pvloads, (*npvloads+1) * sizeof(pj_pvload_t *));
+    (*pvloads)[*npvloads] = l;
+    (*npvloads)++;
+    pj_tree_extract_pvloads_internal(l->offset, pvloads, npvloads);
+  }
+  else if (term->type == pj_ttype_op)
+  {
+    pj_term_t *kid;
+    for (kid = ((pj_op_t *)term)->op1; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_pvloads_internal(kid, pvloads, npvloads);
+  }
+  else if (term->type == pj_ttype_inline)
+  {
+    pj_inline_t *in = (pj_inline_t *)term;
+    pj_term_t *kid;
+    pj_tree_extract_pvloads_internal(in->body, pvloads, npvloads);
+    for (kid = in->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_pvloads_internal(kid, pvloads, npvloads);
+  }
+  else if (term->type == pj_ttype_elemload)
+  {
+    pj_elemload_t *e = (pj_elemload_t *)term;
+    pj_tree_extract_pvloads_internal(e->index, pvloads, npvloads);
+    if (e->index2 != NULL)
+      pj_tree_extract_pvloads_internal(e->index2, pvloads, npvloads);
+  }
+  else if (term->type == pj_ttype_opcall)
+  {
+    pj_term_t *kid;
+    for (kid = ((pj_opcall_t *)term)->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_pvloads_internal(kid, pvloads, npvloads);
+  }
+}
+
+void
+pj_tree_extract_pvloads(pj_term_t *term, pj_pvload_t * **pvloads, unsigned int *npvloads)
+{
+  *npvloads = 0;
+  *pvloads = NULL;
+  pj_tree_extract_pvloads_internal(term, pvloads, npvloads);
+}
+
+static void
+pj_tree_extract_terms_internal(pj_term_t *term, pj_term_type type, pj_term_t * **terms, unsigned int *nterms)
+{
+  if (term->type == (pj_optype)type)
+  {
+    *terms = (pj_term_t **)realloc(*terms, (*nterms+1) * sizeof(pj_term_t *));
+    (*terms)[*nterms] = term;
+    (*nterms)++;
+  }
+
+  if (term->type == pj_ttype_op)
+  {
+    pj_term_t *kid;
+    for (kid = ((pj_op_t *)term)->op1; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_terms_internal(kid, type, terms, nterms);
+  }
+  else if (term->type == pj_ttype_pvload)
+  {
+    pj_tree_extract_terms_internal(((pj_pvload_t *)term)->offset, type, terms, nterms);
+  }
+  else if (term->type == pj_ttype_inline)
+  {
+    pj_inline_t *in = (pj_inline_t *)term;
+    pj_term_t *kid;
+    pj_tree_extract_terms_internal(in->body, type, terms, nterms);
+    for (kid = in->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_terms_internal(kid, type, terms, nterms);
+  }
+  else if (term->type == pj_ttype_elemload)
+  {
+    pj_elemload_t *e = (pj_elemload_t *)term;
+    pj_tree_extract_terms_internal(e->index, type, terms, nterms);
+    if (e->index2 != NULL)
+      pj_tree_extract_terms_internal(e->index2, type, terms, nterms);
+  }
+  else if (term->type == pj_ttype_opcall)
+  {
+    pj_term_t *kid;
+    for (kid = ((pj_opcall_t *)term)->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_extract_terms_internal(kid, type, terms, nterms);
+  }
+}
+
+void
+pj_tree_extract_terms(pj_term_t *term, pj_term_type type, pj_term_t * **terms, unsigned int *nterms)
+{
+  *nterms = 0;
+  *terms = NULL;
+  pj_tree_extract_terms_internal(term, type, terms, nterms);
+}
+
+/* Whether the term is an IV produced by one of the integer ops */
+static int
+pj_tree_is_int_op(pj_term_t *term)
+{
+  return term->type == pj_ttype_op
+         && (PJ_OP_FLAGS((pj_op_t *)term) & PJ_ASTf_INTEGER)
+         && pj_tree_determine_funtype(term) == pj_int_type;
+}
+
+/* Mirrors what pj_ast_jit makes of the tree: the integer ops yield
+ * IVs or UVs, arithmetic on their IVs (use integer) stays in IVs,
+ * everything else ends up an NV. */
 pj_basic_type
 pj_tree_determine_funtype(pj_term_t *term)
 {
@@ -45,30 +187,168 @@ pj_tree_determine_funtype(pj_term_t *term)
   }
   else if (term->type == pj_ttype_op) {
     pj_op_t *o = (pj_op_t *)term;
-    pj_basic_type t1, t2;
-    t1 = pj_tree_determine_funtype(o->op1);
-    if (t1 == pj_double_type)
-      return pj_double_type; /* double >> int */
-
-    if (PJ_IS_OP_LISTOP(o)) {
-      pj_term_t *kid;
-      pj_basic_type t;
-      for (kid = o->op1->op_sibling; kid != NULL; kid = kid->op_sibling) {
-        t = pj_tree_determine_funtype(kid);
-        if (t == pj_double_type)
-          return pj_double_type;
-        if (t != t1)
-          return pj_double_type; /* FIXME correct? */
-      }
-    }
-    else if (PJ_IS_OP_BINOP(o)) {
-      t2 = pj_tree_determine_funtype(o->op2);
-      if (t2 == pj_double_type)
-        return pj_double_type;
-      if (t1==t2) return t1;
+
+    switch (o->optype) {
+    case pj_unop_iv:
+    case pj_binop_i_modulo:
+      return pj_int_type;
+    case pj_unop_uv:
+      return pj_uint_type;
+    case pj_unop_bitwise_not:
+    case pj_binop_left_shift:
+    case pj_binop_right_shift:
+    case pj_binop_bitwise_and:
+    case pj_binop_bitwise_or:
+    case pj_binop_bitwise_xor:
+      /* UVs unless the operands are IVs */
+      return pj_tree_determine_funtype(o->op1) == pj_int_type ? pj_int_type : pj_uint_type;
+    case pj_unop_negate:
+      return pj_tree_is_int_op(o->op1) ? pj_int_type : pj_double_type;
+    case pj_binop_add:
+    case pj_binop_subtract:
+    case pj_binop_multiply:
+    case pj_binop_divide:
+      if (pj_tree_is_int_op(o->op1) && pj_tree_is_int_op(o->op2))
+        return pj_int_type;
+      return pj_double_type;
+    default:
+      return pj_double_type;
     }
-    else return t1;
   }
-  return pj_int_type; /* no uint support yet */
+  return pj_double_type; /* pvloads, fieldloads, elemloads, inlined calls and opcalls */
 }
 
+/* With cmp_ok, operands of numeric comparisons count as used as integers */
+static void
+pj_tree_find_int_vars(pj_term_t *term, int as_int, int cmp_ok, char *int_vars, char *other_vars, unsigned int nvars)
+{
+  if (term->type == pj_ttype_variable)
+  {
+    const unsigned int ivar = (unsigned int)((pj_variable_t *)term)->ivar;
+    if (ivar < nvars)
+      (as_int ? int_vars : other_vars)[ivar] = 1;
+  }
+  else if (term->type == pj_ttype_op)
+  {
+    pj_op_t *o = (pj_op_t *)term;
+    const int kids_as_int = (o->optype == pj_unop_iv || o->optype == pj_unop_uv
+                             || (cmp_ok && o->optype >= pj_binop_eq && o->optype <= pj_binop_ncmp));
+    pj_term_t *kid;
+    for (kid = o->op1; kid != NULL; kid = kid->op_sibling)
+      pj_tree_find_int_vars(kid, kids_as_int, cmp_ok, int_vars, other_vars, nvars);
+  }
+  else if (term->type == pj_ttype_pvload)
+  {
+    pj_pvload_t *l = (pj_pvload_t *)term;
+    pj_tree_find_int_vars(l->buffer, 0, cmp_ok, int_vars, other_vars, nvars);
+    pj_tree_find_int_vars(l->offset, 0, cmp_ok, int_vars, other_vars, nvars);
+  }
+  else if (term->type == pj_ttype_inline)
+  {
+    pj_inline_t *in = (pj_inline_t *)term;
+    pj_term_t *kid;
+    pj_tree_find_int_vars(in->body, 0, cmp_ok, int_vars, other_vars, nvars);
+    for (kid = in->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_find_int_vars(kid, 0, cmp_ok, int_vars, other_vars, nvars);
+  }
+  else if (term->type == pj_ttype_fieldload)
+  {
+    pj_tree_find_int_vars(((pj_fieldload_t *)term)->container, 0, cmp_ok, int_vars, other_vars, nvars);
+  }
+  else if (term->type == pj_ttype_elemload)
+  {
+    pj_elemload_t *e = (pj_elemload_t *)term;
+    pj_tree_find_int_vars(e->container, 0, cmp_ok, int_vars, other_vars, nvars);
+    pj_tree_find_int_vars(e->index, 0, cmp_ok, int_vars, other_vars, nvars);
+    if (e->index2 != NULL)
+      pj_tree_find_int_vars(e->index2, 0, cmp_ok, int_vars, other_vars, nvars);
+  }
+  else if (term->type == pj_ttype_opcall)
+  {
+    pj_term_t *kid;
+    for (kid = ((pj_opcall_t *)term)->args; kid != NULL; kid = kid->op_sibling)
+      pj_tree_find_int_vars(kid, 0, cmp_ok, int_vars, other_vars, nvars);
+  }
+}
+
+void
+pj_tree_type_int_vars(pj_term_t *term, char *int_vars, unsigned int nvars)
+{
+  pj_variable_t **vars;
+  unsigned int nvar_uses, i;
+  char *other_vars = (char *)calloc(nvars > 0 ? nvars : 1, sizeof(char));
+
+  memset(int_vars, 0, nvars);
+  pj_tree_find_int_vars(term, 0, 0, int_vars, other_vars, nvars);
+  for (i = 0; i < nvars; ++i) {
+    if (other_vars[i])
+      int_vars[i] = 0;
+  }
+  free(other_vars);
+
+  pj_tree_extract_vars(term, &vars, &nvar_uses);
+  for (i = 0; i < nvar_uses; ++i) {
+    if ((unsigned int)vars[i]->ivar < nvars && int_vars[vars[i]->ivar])
+      vars[i]->var_type = pj_int_type;
+  }
+  free(vars);
+}
+
+void
+pj_tree_find_cmp_vars(pj_term_t *term, char *cmp_vars, unsigned int nvars)
+{
+  char *other_vars = (char *)calloc(nvars > 0 ? nvars : 1, sizeof(char));
+  unsigned int i;
+
+  memset(cmp_vars, 0, nvars);
+  pj_tree_find_int_vars(term, 0, 1, cmp_vars, other_vars, nvars);
+  for (i = 0; i < nvars; ++i) {
+    if (other_vars[i])
+      cmp_vars[i] = 0;
+  }
+  free(other_vars);
+}
+
+int
+pj_tree_has_op_flag(pj_term_t *term, unsigned int flag)
+{
+  pj_term_t *kid;
+
+  if (term->type == pj_ttype_op)
+  {
+    if (PJ_OP_FLAGS((pj_op_t *)term) & flag)
+      return 1;
+    for (kid = ((pj_op_t *)term)->op1; kid != NULL; kid = kid->op_sibling) {
+      if (pj_tree_has_op_flag(kid, flag))
+        return 1;
+    }
+  }
+  else if (term->type == pj_ttype_pvload)
+  {
+    return pj_tree_has_op_flag(((pj_pvload_t *)term)->offset, flag);
+  }
+  else if (term->type == pj_ttype_elemload)
+  {
+    pj_elemload_t *e = (pj_elemload_t *)term;
+    return pj_tree_has_op_flag(e->index, flag)
+           || (e->index2 != NULL && pj_tree_has_op_flag(e->index2, flag));
+  }
+  else if (term->type == pj_ttype_inline)
+  {
+    pj_inline_t *in = (pj_inline_t *)term;
+    if (pj_tree_has_op_flag(in->body, flag))
+      return 1;
+    for (kid = in->args; kid != NULL; kid = kid->op_sibling) {
+      if (pj_tree_has_op_flag(kid, flag))
+        return 1;
+    }
+  }
+  else if (term->type == pj_ttype_opcall)
+  {
+    for (kid = ((pj_opcall_t *)term)->args; kid != NULL; kid = kid->op_sibling) {
+      if (pj_tree_has_op_flag(kid, flag))
+        return 1;
+    }
+  }
+  return 0;
+}
@@ -7,6 +7,30 @@
 
 void pj_tree_extract_vars(pj_term_t *term, pj_variable_t * **vars, unsigned int *nvars);
 
+/* Collects all string buffer loads so that their pj_pvbuf_t can be set up */
+void pj_tree_extract_pvloads(pj_term_t *term, pj_pvload_t * **pvloads, unsigned int *npvloads);
+
+/* Collects all terms of the given type, such as the field and element
+ * loads whose record needs to be set up */
+void pj_tree_extract_terms(pj_term_t *term, pj_term_type type, pj_term_t * **terms, unsigned int *nterms);
+
+/* The type of the value the compiled tree yields: pj_int_type for an
+ * IV, pj_uint_type for a UV, pj_double_type otherwise */
 pj_basic_type pj_tree_determine_funtype(pj_term_t *term);
 
+/* Variables that are only ever converted to IVs or UVs (use integer,
+ * bitwise OPs) can be passed as IVs, see pj_tree_jit. Sets their
+ * var_type to pj_int_type and flags them in int_vars, which has an
+ * entry for each of the nvars variables. */
+void pj_tree_type_int_vars(pj_term_t *term, char *int_vars, unsigned int nvars);
+
+/* Like pj_tree_type_int_vars, but flags the variables that are only
+ * ever converted to integers or compared numerically and leaves their
+ * var_type alone. For IVs, comparing them as such gives the same result
+ * (or a more exact one) as comparing their NVs. */
+void pj_tree_find_cmp_vars(pj_term_t *term, char *cmp_vars, unsigned int nvars);
+
+/* Whether any op in the tree has the given PJ_ASTf_* flag */
+int pj_tree_has_op_flag(pj_term_t *term, unsigned int flag);
+
 #endif
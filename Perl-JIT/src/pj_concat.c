@@ -0,0 +1,144 @@
+#include "pj_concat.h"
+#include <string.h>
+
+#include "ppport.h"
+#include "pj_debug.h"
+
+/* A concatenation that can be part of a chain: not ".=" */
+#define PJ_IS_CONCAT_LINK(o) \
+  ((o)->op_type == OP_CONCAT && !((o)->op_flags & OPf_STACKED))
+
+#if PERL_VERSION < 28
+/* Number of pieces the chain below o evaluates to. Only left-nested
+ * chains, (($a . $b) . $c) . $d, are collapsed: a concatenation on the
+ * right is an operand of its own, which overloaded "." must see. */
+static unsigned int
+pj_count_concat_pieces(OP *o)
+{
+  OP *first = cBINOPo->op_first;
+
+  if (PJ_IS_CONCAT_LINK(first) && !(first->op_private & OPpTARGET_MY))
+    return pj_count_concat_pieces(first) + 1;
+  return 2;
+}
+
+/* The pieces stay where they are and push their values one after the
+ * other. The inner concatenations just don't do anything any more. */
+static void
+pj_null_concat_links(pTHX_ OP *o)
+{
+  OP *first = cBINOPo->op_first;
+
+  if (PJ_IS_CONCAT_LINK(first) && !(first->op_private & OPpTARGET_MY)) {
+    pj_null_concat_links(aTHX_ first);
+    /* FIXME leaks the inner concat's pad temporary. Harmless, but
+     *       Perl_op_null isn't public API on all perls we support. */
+    first->op_targ = first->op_type;
+    first->op_type = OP_NULL;
+    first->op_ppaddr = PL_ppaddr[OP_NULL];
+  }
+}
+#endif
+
+int
+pj_attempt_concat_chain(pTHX_ OP *o)
+{
+#if PERL_VERSION >= 28
+  /* perl's own peephole optimizer turns the same chains into
+   * OP_MULTICONCAT, which also deals with the constant pieces at
+   * compile time. Leave them alone. */
+  PERL_UNUSED_ARG(o);
+  return 0;
+#else
+  unsigned int npieces;
+
+  if (!PJ_IS_CONCAT_LINK(o))
+    return 0;
+
+  npieces = pj_count_concat_pieces(o);
+  /* A single concatenation is what pp_concat does anyway */
+  if (npieces < 3 || npieces > PJ_CONCAT_MAX_PIECES)
+    return 0;
+
+  PJ_DEBUG_1("Collapsing chain of %u concatenations\n", npieces - 1);
+  pj_null_concat_links(aTHX_ o);
+
+  /* Same OP, different implementation. op_targ stays TARG, which is
+   * the lexical for "my $x = ..." (OPpTARGET_MY). pp_concat only looks
+   * at that flag for a warning about "$x = $x . ...", which we never
+   * run into: see the aliasing check in pj_pp_jit_concat. */
+  o->op_type = OP_CUSTOM;
+  o->op_ppaddr = pj_pp_jit_concat;
+  o->op_private = (U8)npieces;
+
+  return 1;
+#endif
+}
+
+OP *
+pj_pp_jit_concat(pTHX)
+{
+  dSP; dTARGET;
+  const unsigned int n = PL_op->op_private;
+  SV **pieces = SP - n + 1;
+  STRLEN total = 0;
+  STRLEN len;
+  unsigned int i, nutf8 = 0;
+  bool slow = FALSE;
+  const char *pv;
+  char *d;
+
+  for (i = 0; i < n; ++i) {
+    SV *sv = pieces[i];
+    /* TARG is being overwritten, so use its old value */
+    if (sv == TARG)
+      pieces[i] = sv = sv_mortalcopy(sv);
+    if (SvGMAGICAL(sv) || SvAMAGIC(sv) || !SvOK(sv))
+      slow = TRUE;
+    else if (SvUTF8(sv))
+      ++nutf8;
+  }
+
+  if (slow || (nutf8 != 0 && nutf8 != n)) {
+    /* Magic, overloading, undef (warnings!) or a mix of encodings: let
+     * pp_concat deal with the details, once per piece, like the
+     * original chain. Each step appends to the result of the previous
+     * one, which is fine for all of them to do in our TARG. */
+    SV *acc = pieces[0];
+    for (i = 1; i < n; ++i) {
+      SV *right = pieces[i];
+      pieces[0] = acc;
+      pieces[1] = right;
+      SP = pieces + 1;
+      PUTBACK;
+      (void)PL_ppaddr[OP_CONCAT](aTHX);
+      SPAGAIN;
+      acc = TOPs;
+    }
+    RETURN;
+  }
+
+  for (i = 0; i < n; ++i) {
+    (void)SvPV_nomg_const(pieces[i], len);
+    total += len;
+  }
+
+  /* Drops whatever TARG held before, references included */
+  sv_setpvs(TARG, "");
+  d = SvGROW(TARG, total + 1);
+  for (i = 0; i < n; ++i) {
+    pv = SvPV_nomg_const(pieces[i], len);
+    Copy(pv, d, len, char);
+    d += len;
+  }
+  *d = '\0';
+  SvCUR_set(TARG, total);
+  (void)SvPOK_only(TARG);
+  if (nutf8 != 0)
+    SvUTF8_on(TARG);
+  SvTAINT(TARG);
+
+  SP = pieces;
+  SETTARG;
+  RETURN;
+}
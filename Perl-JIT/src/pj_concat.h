@@ -0,0 +1,23 @@
+#ifndef PJ_CONCAT_H_
+#define PJ_CONCAT_H_
+
+/* Chains of string concatenations ("foo${a}bar$b" and friends)
+ * collapsed into a single custom OP that builds the result in one go. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+/* Longest chain we collapse. The number of pieces lives in op_private. */
+#define PJ_CONCAT_MAX_PIECES 255
+
+/* If o is the top of a chain of at least two concatenations, turn it
+ * into a jitconcat OP. The inner concatenations are nulled, the pieces
+ * are left in place. Returns whether it did so. */
+int pj_attempt_concat_chain(pTHX_ OP *o);
+
+/* The jitconcat OP implementation. Measures all pieces, grows TARG
+ * once and copies them in. Overloading, magic, undef and mixed
+ * encodings fall back to one pp_concat per piece. */
+OP *pj_pp_jit_concat(pTHX);
+
+#endif
@@ -0,0 +1,178 @@
+#include "pj_deref.h"
+#include <stdlib.h>
+
+#include "ppport.h"
+#include "pj_debug.h"
+
+/* Chains deeper than this aren't worth the trouble of counting */
+#define PJ_DEREF_MAX_LEVELS 16
+
+/* If o is a lookup of a constant key or index in a hash or array
+ * reference, returns the kid that yields the reference (and the type
+ * of the container and the key OP). NULL otherwise. */
+static OP *
+pj_deref_level_kids(pTHX_ OP *o, svtype *type, OP **keyop)
+{
+  OP *rv2xv;
+
+  if (o->op_type == OP_HELEM)
+    *type = SVt_PVHV;
+  else if (o->op_type == OP_AELEM)
+    *type = SVt_PVAV;
+  else
+    return NULL;
+
+  if (o->op_private & (OPpLVAL_INTRO | OPpLVAL_DEFER | OPpMAYBE_LVSUB))
+    return NULL;
+
+  rv2xv = cBINOPo->op_first;
+  if (rv2xv->op_type != (*type == SVt_PVHV ? OP_RV2HV : OP_RV2AV)
+      || !(rv2xv->op_flags & OPf_KIDS))
+    return NULL;
+
+  *keyop = rv2xv->op_sibling;
+  if (*keyop == NULL || (*keyop)->op_type != OP_CONST || SvROK(cSVOPx_sv(*keyop)))
+    return NULL;
+
+  return cUNOPx(rv2xv)->op_first;
+}
+
+int
+pj_attempt_deref_chain(pTHX_ OP *o)
+{
+  OP *levelops[PJ_DEREF_MAX_LEVELS];
+  OP *keyops[PJ_DEREF_MAX_LEVELS];
+  svtype types[PJ_DEREF_MAX_LEVELS];
+  unsigned int nlevels = 0, i;
+  pj_deref_aux_t *aux;
+  OP *kid, *rv2xv;
+  UNOP *jitop;
+
+#if PERL_VERSION >= 22
+  /* perl's own peephole optimizer turns the same chains into
+   * OP_MULTIDEREF. Leave them alone. */
+  return 0;
+#endif
+
+  /* Only rvalues. For the intermediate levels, OPf_MOD and OPpDEREF_*
+   * are just what makes perl autovivify them. */
+  if ((o->op_flags & OPf_MOD) || (o->op_private & OPpDEREF))
+    return 0;
+
+  /* Top down, so the levels come out in reverse */
+  kid = o;
+  while (1) {
+    if (nlevels == PJ_DEREF_MAX_LEVELS)
+      return 0;
+    levelops[nlevels] = kid;
+    kid = pj_deref_level_kids(aTHX_ kid, &types[nlevels], &keyops[nlevels]);
+    if (kid == NULL)
+      return 0;
+    ++nlevels;
+
+    /* What kid yields needs to be a reference to what we look into */
+    if ((kid->op_private & OPpDEREF) != (types[nlevels-1] == SVt_PVHV ? OPpDEREF_HV : OPpDEREF_AV))
+      return 0;
+    if (kid->op_type == OP_PADSV)
+      break;
+  }
+
+  if (nlevels < 2 || (kid->op_private & OPpLVAL_INTRO))
+    return 0;
+
+  PJ_DEBUG_1("Fusing chain of %u dereferences\n", nlevels);
+  aux = (pj_deref_aux_t *)malloc(sizeof(pj_deref_aux_t));
+  aux->top = o;
+  aux->nlevels = nlevels;
+  aux->levels = (pj_deref_level_t *)malloc(sizeof(pj_deref_level_t) * nlevels);
+  for (i = 0; i < nlevels; ++i) {
+    pj_deref_level_t *level = &aux->levels[nlevels - 1 - i];
+    SV *keysv = cSVOPx_sv(keyops[i]);
+
+    level->type = types[i];
+    level->key = NULL;
+    level->hash = 0;
+    level->index = 0;
+    if (types[i] == SVt_PVHV) {
+      STRLEN len;
+      const char *pv = SvPV_const(keysv, len);
+      level->key = newSVpvn_share(pv, SvUTF8(keysv) ? -(I32)len : (I32)len, 0);
+      level->hash = SvSHARED_HASH(level->key);
+    }
+    else {
+      level->index = SvIV(keysv);
+    }
+  }
+
+  /* Goes between the lexical and the innermost rv2hv/rv2av, so that
+   * continuing with the original OPs is just carrying on. */
+  rv2xv = cBINOPx(levelops[nlevels-1])->op_first;
+  NewOp(1101, jitop, 1, UNOP);
+  jitop->op_type = (OPCODE)OP_CUSTOM;
+  jitop->op_ppaddr = pj_pp_jit_deref;
+  jitop->op_flags = OPf_KIDS | OPf_WANT_SCALAR;
+  jitop->op_targ = (PADOFFSET)PTR2UV(aux);
+  jitop->op_first = kid;
+  jitop->op_sibling = kid->op_sibling;
+  kid->op_sibling = NULL;
+  cUNOPx(rv2xv)->op_first = (OP *)jitop;
+  jitop->op_next = kid->op_next;
+  kid->op_next = (OP *)jitop;
+
+  return 1;
+}
+
+OP *
+pj_pp_jit_deref(pTHX)
+{
+  dSP;
+  const pj_deref_aux_t *aux = (const pj_deref_aux_t *)PL_op->op_targ;
+  SV *sv = TOPs;
+  unsigned int i;
+
+  for (i = 0; i < aux->nlevels; ++i) {
+    const pj_deref_level_t *level = &aux->levels[i];
+    SV *container;
+
+    if (SvGMAGICAL(sv) || !SvROK(sv) || SvAMAGIC(sv))
+      return NORMAL;
+    container = SvRV(sv);
+    if (SvTYPE(container) != level->type || SvRMAGICAL(container))
+      return NORMAL;
+
+    if (level->type == SVt_PVHV) {
+      HE *he = hv_fetch_ent((HV *)container, level->key, 0, level->hash);
+      sv = he != NULL ? HeVAL(he) : NULL;
+    }
+    else {
+      AV *av = (AV *)container;
+      IV ix = level->index;
+      if (ix < 0)
+        ix += AvFILLp(av) + 1;
+      sv = ix >= 0 && ix <= AvFILLp(av) ? AvARRAY(av)[ix] : NULL;
+    }
+
+    /* Missing in the middle: perl autovivifies it */
+    if (sv == NULL) {
+      if (i + 1 < aux->nlevels)
+        return NORMAL;
+      sv = &PL_sv_undef;
+    }
+  }
+
+  SETs(sv);
+  RETURNOP(aux->top->op_next);
+}
+
+void
+pj_deref_free_aux(pTHX_ OP *o)
+{
+  pj_deref_aux_t *aux = (pj_deref_aux_t *)o->op_targ;
+  unsigned int i;
+
+  for (i = 0; i < aux->nlevels; ++i)
+    SvREFCNT_dec(aux->levels[i].key);
+  free(aux->levels);
+  free(aux);
+  o->op_targ = 0; /* important or Perl will use it to access the pad */
+}
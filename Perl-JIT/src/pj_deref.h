@@ -0,0 +1,40 @@
+#ifndef PJ_DEREF_H_
+#define PJ_DEREF_H_
+
+/* Chains of element lookups through references with constant keys,
+ * like $h->{foo}{bar}[3], done by a single custom OP. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+/* One step of the chain */
+typedef struct {
+  svtype type;    /* SVt_PVHV or SVt_PVAV */
+  SV *key;        /* shared key for hashes, with precomputed hash */
+  U32 hash;
+  IV index;       /* for arrays */
+} pj_deref_level_t;
+
+/* The struct of per-OP data of the jitderef OP */
+typedef struct {
+  OP *top;        /* the last element lookup, we continue with its op_next */
+  unsigned int nlevels;
+  pj_deref_level_t *levels;
+} pj_deref_aux_t;
+
+/* If o is the outermost element lookup of a chain of at least two in
+ * rvalue context, starting at a lexical, insert a jitderef OP right
+ * after the lexical. The original OPs stay in place as the slow path.
+ * Returns whether it did so. */
+int pj_attempt_deref_chain(pTHX_ OP *o);
+
+/* The jitderef OP implementation. Walks the whole chain if all of it
+ * is plain, unmagical references to existing HVs and AVs. Otherwise
+ * (autovivification, ties, overloading...), continues with the
+ * original OPs. */
+OP *pj_pp_jit_deref(pTHX);
+
+/* Frees the aux struct of a jitderef OP */
+void pj_deref_free_aux(pTHX_ OP *o);
+
+#endif
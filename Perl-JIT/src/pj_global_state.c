@@ -2,12 +2,92 @@
 #include "pj_debug.h"
 #include "pj_jit_peep.h"
 #include "pj_jit_op.h"
+#include "pj_ast_jit.h"
+#include "pj_op_map.h"
+#include "pj_native_sub.h"
+#include "pj_concat.h"
+#include "pj_deref.h"
+#include "pj_sort.h"
+#include "pj_reduce.h"
+#include "pj_threaded.h"
+#include "pj_trace.h"
 
 XOP PJ_xop_jitop;
+XOP PJ_xop_jitbranch;
+XOP PJ_xop_jitentersub;
+XOP PJ_xop_jitconcat;
+XOP PJ_xop_jitderef;
+XOP PJ_xop_jitsort;
+XOP PJ_xop_jitreduce;
 peep_t PJ_orig_peepp;
 Perl_ophook_t PJ_orig_opfreehook;
 jit_context_t PJ_jit_context = NULL; /* jit_context_t is a ptr */
 
+/* From PERL_JIT_OPTIMIZE */
+static unsigned int pj_default_optimization_level;
+
+/* Croak with the same messages as the corresponding pp functions */
+static void
+pj_croak_runtime_error(pj_runtime_error err, double value)
+{
+  dTHX;
+
+  switch (err) {
+  case pj_error_division_by_zero:
+    Perl_croak(aTHX_ "Illegal division by zero");
+  case pj_error_modulus_zero:
+    Perl_croak(aTHX_ "Illegal modulus zero");
+  case pj_error_log_of_nonpositive:
+    Perl_croak(aTHX_ "Can't take log of %" NVgf, (NV)value);
+  case pj_error_sqrt_of_negative:
+    Perl_croak(aTHX_ "Can't take sqrt of %" NVgf, (NV)value);
+  }
+  Perl_croak(aTHX_ "Unknown error in JIT compiled code");
+}
+
+/* Perl's generator, seeded on first use unless srand has been called,
+ * just like pp_rand does. state is the interpreter, if there is one. */
+static double
+pj_perl_drand01(void *state)
+{
+#ifdef MULTIPLICITY
+  dTHXa((PerlInterpreter *)state);
+#else
+  (void)state;
+#endif
+  if (!PL_srand_called) {
+    (void)seedDrand01((Rand_seed_t)seed());
+    PL_srand_called = TRUE;
+  }
+  return (double)Drand01();
+}
+
+unsigned int
+pj_optimization_level(pTHX_ const COP *cop)
+{
+#ifdef cop_hints_fetch_pvs
+  SV *sv = cop_hints_fetch_pvs(cop, "Perl::JIT/optimize", 0);
+  if (sv != NULL && sv != &PL_sv_placeholder && SvOK(sv)) {
+    const IV level = SvIV(sv);
+    if (level < 0)
+      return JIT_OPTLEVEL_NONE;
+    if ((UV)level > jit_function_get_max_optimization_level())
+      return jit_function_get_max_optimization_level();
+    return (unsigned int)level;
+  }
+#else
+  PERL_UNUSED_ARG(cop);
+#endif
+  return pj_default_optimization_level;
+}
+
+void
+pj_free_jit_function(jit_function_t func)
+{
+  if (func != NULL && PJ_jit_context != NULL)
+    jit_function_destroy(func);
+}
+
 /* TODO: Make jit_context_t interpreter-local */
 void
 pj_init_global_state(pTHX)
@@ -18,6 +98,23 @@ pj_init_global_state(pTHX)
 
   /* Set up JIT compiler */
   PJ_jit_context = jit_context_create();
+  pj_runtime_error_handler = pj_croak_runtime_error;
+  {
+    const char *env = PerlEnv_getenv("PERL_JIT_OPTIMIZE");
+    const unsigned int max = jit_function_get_max_optimization_level();
+    pj_default_optimization_level = max;
+    if (env != NULL && isDIGIT(*env) && (unsigned int)atoi(env) < max)
+      pj_default_optimization_level = (unsigned int)atoi(env);
+  }
+
+  /* rand uses Perl's generator, for the same sequence of numbers */
+  pj_drand_func = pj_perl_drand01;
+#ifdef MULTIPLICITY
+  pj_drand_state = (void *)aTHX;
+#endif
+
+  /* Set up the table of OPs we can JIT */
+  pj_init_op_map(aTHX);
 
   /* Setup our callback for cleaning up JIT OPs during global cleanup */
   PJ_orig_opfreehook = PL_opfreehook;
@@ -29,6 +126,37 @@ pj_init_global_state(pTHX)
   XopENTRY_set(&PJ_xop_jitop, xop_class, OA_LISTOP);
   Perl_custom_op_register(aTHX_ pj_pp_jit, &PJ_xop_jitop);
 
+  XopENTRY_set(&PJ_xop_jitbranch, xop_name, "jitbranch");
+  XopENTRY_set(&PJ_xop_jitbranch, xop_desc, "a just-in-time compiled branch condition");
+  XopENTRY_set(&PJ_xop_jitbranch, xop_class, OA_LOGOP);
+  Perl_custom_op_register(aTHX_ pj_pp_jit_branch, &PJ_xop_jitbranch);
+
+  XopENTRY_set(&PJ_xop_jitentersub, xop_name, "jitentersub");
+  XopENTRY_set(&PJ_xop_jitentersub, xop_desc, "a direct call to a natively compiled sub");
+  XopENTRY_set(&PJ_xop_jitentersub, xop_class, OA_UNOP);
+  Perl_custom_op_register(aTHX_ pj_pp_jit_entersub, &PJ_xop_jitentersub);
+
+  /* Same desc as concat, it's used in warnings */
+  XopENTRY_set(&PJ_xop_jitconcat, xop_name, "jitconcat");
+  XopENTRY_set(&PJ_xop_jitconcat, xop_desc, "concatenation (.) or string");
+  XopENTRY_set(&PJ_xop_jitconcat, xop_class, OA_BINOP);
+  Perl_custom_op_register(aTHX_ pj_pp_jit_concat, &PJ_xop_jitconcat);
+
+  XopENTRY_set(&PJ_xop_jitderef, xop_name, "jitderef");
+  XopENTRY_set(&PJ_xop_jitderef, xop_desc, "a fused chain of element lookups");
+  XopENTRY_set(&PJ_xop_jitderef, xop_class, OA_UNOP);
+  Perl_custom_op_register(aTHX_ pj_pp_jit_deref, &PJ_xop_jitderef);
+
+  XopENTRY_set(&PJ_xop_jitsort, xop_name, "jitsort");
+  XopENTRY_set(&PJ_xop_jitsort, xop_desc, "sort");
+  XopENTRY_set(&PJ_xop_jitsort, xop_class, OA_LISTOP);
+  Perl_custom_op_register(aTHX_ pj_pp_jit_sort, &PJ_xop_jitsort);
+
+  XopENTRY_set(&PJ_xop_jitreduce, xop_name, "jitreduce");
+  XopENTRY_set(&PJ_xop_jitreduce, xop_desc, "a natively compiled List::Util reduction");
+  XopENTRY_set(&PJ_xop_jitreduce, xop_class, OA_BASEOP);
+  Perl_custom_op_register(aTHX_ pj_pp_jit_reduce, &PJ_xop_jitreduce);
+
   /* Register super-late global cleanup hook for global JIT state */
   Perl_call_atexit(aTHX_ pj_global_state_final_cleanup, NULL);
 }
@@ -44,4 +172,11 @@ pj_global_state_final_cleanup(pTHX_ void *ptr)
 
   if (PJ_jit_context != NULL)
     jit_context_destroy(PJ_jit_context);
+  PJ_jit_context = NULL;
+
+  pj_free_native_subs(aTHX);
+  pj_free_native_blocks(aTHX);
+  pj_free_threaded_subs(aTHX);
+  pj_free_traces(aTHX);
+  pj_free_op_map(aTHX);
 }
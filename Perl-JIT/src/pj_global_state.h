@@ -10,8 +10,14 @@
 #include <perl.h>
 #include <jit/jit.h>
 
-/* The custom op definition structure */
+/* The custom op definition structures */
 extern XOP PJ_xop_jitop;
+extern XOP PJ_xop_jitbranch;
+extern XOP PJ_xop_jitentersub;
+extern XOP PJ_xop_jitconcat;
+extern XOP PJ_xop_jitderef;
+extern XOP PJ_xop_jitsort;
+extern XOP PJ_xop_jitreduce;
 
 /* Original peephole optimizer */
 extern peep_t PJ_orig_peepp;
@@ -24,6 +30,16 @@ extern Perl_ophook_t PJ_orig_opfreehook;
  * interpreter struct in some fashion. */
 extern jit_context_t PJ_jit_context;
 
+/* libjit's optimization level (JIT_OPTLEVEL_*) for code compiled where
+ * cop is: that of "use Perl::JIT optimize => LEVEL", else that of the
+ * PERL_JIT_OPTIMIZE environment variable, else the highest */
+unsigned int pj_optimization_level(pTHX_ const COP *cop);
+
+/* Releases a function compiled in PJ_jit_context and its code, which
+ * must not be running. Does nothing once the context is gone: the OPs
+ * of named subs are only freed after that, if at all. */
+void pj_free_jit_function(jit_function_t func);
+
 /* Initialize global JIT state like JIT context, custom op description, etc. */
 void pj_init_global_state(pTHX);
 
@@ -0,0 +1,62 @@
+#include "pj_intrinsics.h"
+#include <string.h>
+
+#include "ppport.h"
+
+/* Only ones whose result we reproduce exactly. List::Util::sum is
+ * deliberately missing: it accumulates IVs where it can. */
+static const pj_intrinsic_t pj_intrinsics[] = {
+  {"POSIX::floor",     pj_unop_floor,  1},
+  {"POSIX::ceil",      pj_unop_ceil,   1},
+  {"POSIX::tan",       pj_unop_tan,    1},
+  {"POSIX::fabs",      pj_unop_abs,    1},
+  {"POSIX::fmod",      pj_binop_fmod,  2},
+  {"List::Util::min",  pj_binop_min,  -1},
+  {"List::Util::max",  pj_binop_max,  -1},
+  {NULL,               0,              0}
+};
+
+const pj_intrinsic_t *
+pj_find_intrinsic(pTHX_ CV *cv)
+{
+  const pj_intrinsic_t *in;
+  const char *stashname;
+  GV *gv;
+  HV *stash;
+  STRLEN len;
+
+  if (!CvISXSUB(cv) || (gv = CvGV(cv)) == NULL || (stash = GvSTASH(gv)) == NULL)
+    return NULL;
+  stashname = HvNAME_get(stash);
+  if (stashname == NULL)
+    return NULL;
+  len = strlen(stashname);
+
+  for (in = pj_intrinsics; in->name != NULL; ++in) {
+    if (strncmp(in->name, stashname, len) == 0
+        && in->name[len] == ':' && in->name[len+1] == ':'
+        && strcmp(in->name + len + 2, GvNAME(gv)) == 0)
+    {
+      return in;
+    }
+  }
+  return NULL;
+}
+
+pj_term_t *
+pj_make_intrinsic_term(const pj_intrinsic_t *in, pj_term_t **args, unsigned int nargs)
+{
+  pj_term_t *term;
+  unsigned int i;
+
+  if (in->nargs == 1)
+    return pj_make_unop(in->ast_optype, pj_clone_tree(args[0], NULL));
+  if (in->nargs == 2)
+    return pj_make_binop(in->ast_optype, pj_clone_tree(args[0], NULL), pj_clone_tree(args[1], NULL));
+
+  /* min($a, $b, $c) is min(min($a, $b), $c) */
+  term = pj_clone_tree(args[0], NULL);
+  for (i = 1; i < nargs; ++i)
+    term = pj_make_binop(in->ast_optype, term, pj_clone_tree(args[i], NULL));
+  return term;
+}
@@ -0,0 +1,25 @@
+#ifndef PJ_INTRINSICS_H_
+#define PJ_INTRINSICS_H_
+
+/* Well-known XS functions (POSIX, List::Util) that have direct
+ * equivalents in the AST, so calls to them can stay in JIT code. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "pj_ast_terms.h"
+
+typedef struct {
+  const char *name;     /* fully qualified sub name */
+  pj_op_type ast_optype;
+  int nargs;            /* -1: one or more, folded left with ast_optype */
+} pj_intrinsic_t;
+
+/* Returns the intrinsic if cv is one of the known XSUBs, NULL otherwise */
+const pj_intrinsic_t *pj_find_intrinsic(pTHX_ CV *cv);
+
+/* Builds the AST equivalent of calling the intrinsic with the nargs
+ * args. The args are copied, not consumed. */
+pj_term_t *pj_make_intrinsic_term(const pj_intrinsic_t *in, pj_term_t **args, unsigned int nargs);
+
+#endif
@@ -2,10 +2,573 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 
 #include "pj_debug.h"
+#include "pj_inline.h"
 #include "pj_global_state.h"
 #include "pj_ast_jit.h"
+#include "pj_ast_walkers.h"
+#include "pj_native_sub.h"
+#include "pj_deref.h"
+#include "pj_sort.h"
+#include "pj_reduce.h"
+#include "pj_threaded.h"
+#include "pj_trace.h"
+
+/* The HV or AV that rv2hv or rv2av would give us for sv, under
+ * "strict refs". sv is the dereferenced lexical, so an undef one is
+ * autovivified like vivify_ref does, even for an rvalue. */
+static SV *
+pj_record_container(pTHX_ SV *sv, svtype type)
+{
+  if (!SvOK(sv) && !SvREADONLY(sv)) {
+    sv_setsv(sv, sv_2mortal(newRV_noinc(type == SVt_PVHV ? (SV *)newHV() : (SV *)newAV())));
+    SvSETMAGIC(sv);
+  }
+  if (SvROK(sv)) {
+    if (SvAMAGIC(sv))
+      sv = amagic_deref_call(sv, type == SVt_PVHV ? to_hv_amg : to_av_amg);
+    if (SvTYPE(SvRV(sv)) != type)
+      Perl_croak(aTHX_ type == SVt_PVHV ? "Not a HASH reference" : "Not an ARRAY reference");
+    return SvRV(sv);
+  }
+  if (!SvOK(sv))
+    Perl_croak(aTHX_ PL_no_usym, type == SVt_PVHV ? "a HASH" : "an ARRAY");
+  Perl_croak(aTHX_ PL_no_symref_sv, sv,
+             (SvPOKp(sv) && SvCUR(sv) > 32 ? "..." : ""),
+             type == SVt_PVHV ? "a HASH" : "an ARRAY");
+  return NULL; /* not reached */
+}
+
+int
+pj_plain_nv(pTHX_ SV *sv, NV *nv)
+{
+  if (SvGMAGICAL(sv) || SvROK(sv))
+    return 0;
+
+  if (SvNOK(sv)) {
+    *nv = SvNVX(sv);
+  }
+  else if (SvIOK(sv)) {
+    if (SvIsUV(sv) ? SvUVX(sv) > PJ_MAX_EXACT_NV
+                   : (SvIVX(sv) > (IV)PJ_MAX_EXACT_NV || SvIVX(sv) < -(IV)PJ_MAX_EXACT_NV))
+    {
+      return 0;
+    }
+    *nv = SvIsUV(sv) ? (NV)SvUVX(sv) : (NV)SvIVX(sv);
+  }
+  else if (SvPOK(sv) && looks_like_number(sv)) {
+    /* Numifies and caches it, like any numeric OP would */
+    *nv = SvNV_nomg(sv);
+    if (*nv > (NV)PJ_MAX_EXACT_NV || *nv < -(NV)PJ_MAX_EXACT_NV)
+      return 0;
+  }
+  else {
+    /* undef and non-numeric strings warn */
+    return 0;
+  }
+  return 1;
+}
+
+/* Numeric value of a hash or array element, NOK being the usual case
+ * for records and matrices of numbers. Everything else (tied
+ * containers, magic, overloading, strings, undef with its warning)
+ * goes through SvNV. */
+PJ_STATIC_INLINE double
+pj_elem_sv_nv(pTHX_ SV *sv)
+{
+  if (SvNOK(sv) && !SvGMAGICAL(sv))
+    return SvNVX(sv);
+  return SvNV(sv);
+}
+
+/* Like an rvalue aelem, but NULL for nonexistent elements */
+PJ_STATIC_INLINE SV *
+pj_av_elem_sv(pTHX_ AV *av, ptrdiff_t i)
+{
+  SV **svp;
+
+  if (!SvRMAGICAL(av)) {
+    if (i < 0)
+      i += AvFILLp(av) + 1;
+    return (i >= 0 && i <= AvFILLp(av) ? AvARRAY(av)[i] : NULL);
+  }
+  svp = av_fetch(av, (SSize_t)i, 0);
+  return (svp != NULL ? *svp : NULL);
+}
+
+pj_hv_field_t *
+pj_make_hv_field(pTHX_ SV *keysv)
+{
+  pj_hv_field_t *field = (pj_hv_field_t *)malloc(sizeof(pj_hv_field_t));
+  STRLEN len;
+  const char *pv = SvPV_const(keysv, len);
+
+  field->key = newSVpvn_share(pv, SvUTF8(keysv) ? -(I32)len : (I32)len, 0);
+  field->hash = SvSHARED_HASH(field->key);
+  return field;
+}
+
+double
+pj_hv_field_nv(void *record, void *field)
+{
+  dTHX;
+  const pj_hv_field_t *f = (const pj_hv_field_t *)field;
+  HE *he = hv_fetch_ent((HV *)record, f->key, 0, f->hash);
+  SV *sv = (he != NULL ? HeVAL(he) : &PL_sv_undef);
+
+  return pj_elem_sv_nv(aTHX_ sv);
+}
+
+double
+pj_av_elem_nv(void *record, ptrdiff_t i, ptrdiff_t j)
+{
+  dTHX;
+  SV *sv = pj_av_elem_sv(aTHX_ (AV *)record, i);
+  PERL_UNUSED_ARG(j);
+  return pj_elem_sv_nv(aTHX_ sv != NULL ? sv : &PL_sv_undef);
+}
+
+double
+pj_av_elem2_nv(void *record, ptrdiff_t i, ptrdiff_t j)
+{
+  dTHX;
+  SV *row = pj_av_elem_sv(aTHX_ (AV *)record, i);
+  SV *sv;
+
+  /* Perl autovivifies the row, even for an rvalue */
+  if (row == NULL || (!SvGMAGICAL(row) && !SvOK(row))) {
+    SV **rowp = av_fetch((AV *)record, (SSize_t)i, 1);
+    if (rowp == NULL)
+      Perl_croak(aTHX_ PL_no_aelem, (int)i);
+    row = *rowp;
+    if (!SvOK(row)) {
+      sv_setsv(row, sv_2mortal(newRV_noinc((SV *)newAV())));
+      SvSETMAGIC(row);
+    }
+  }
+  SvGETMAGIC(row);
+
+  sv = pj_av_elem_sv(aTHX_ (AV *)pj_record_container(aTHX_ row, SVt_PVAV), j);
+  return pj_elem_sv_nv(aTHX_ sv != NULL ? sv : &PL_sv_undef);
+}
+
+pj_opcall_op_t *
+pj_make_opcall_op(pTHX_ OP *o)
+{
+  pj_opcall_op_t *c = (pj_opcall_op_t *)malloc(sizeof(pj_opcall_op_t));
+
+  PERL_UNUSED_CONTEXT;
+  c->op = o;
+  c->nkids = 0;
+  return c;
+}
+
+/* FIXME overloaded operands run Perl code from within the JIT code. If
+ *       that re-enters the same JIT OP, the records and string buffers
+ *       it published are overwritten. */
+double
+pj_opcall_nv(void *op, double *args, unsigned int nargs)
+{
+  dTHX;
+  dSP;
+  const pj_opcall_op_t *c = (const pj_opcall_op_t *)op;
+  OP *saved_op = PL_op;
+  unsigned int i, iarg = 0;
+  SV *sv;
+
+  PERL_UNUSED_ARG(nargs);
+
+  EXTEND(SP, (SSize_t)c->nkids);
+  for (i = 0; i < c->nkids; ++i) {
+    switch (c->kids[i].kind) {
+    case pj_opcall_kid_padsv:
+      sv = PAD_SV(c->kids[i].padix);
+      break;
+    case pj_opcall_kid_const:
+      sv = cSVOPx_sv(c->kids[i].constop);
+      break;
+    default:
+      sv = c->kids[i].sv;
+      sv_setnv(sv, (NV)args[iarg++]);
+      break;
+    }
+    PUSHs(sv);
+  }
+  PUTBACK;
+
+  /* As if the run loop had got to it. Its op_next doesn't matter. */
+  PL_op = c->op;
+  (void)PL_op->op_ppaddr(aTHX);
+  PL_op = saved_op;
+
+  SPAGAIN;
+  sv = POPs;
+  PUTBACK;
+  return (double)SvNV(sv);
+}
+
+/* Convert a single stack value to what the compiled function expects,
+ * a param of the given kinds, other than a string buffer */
+PJ_STATIC_INLINE void
+pj_jitop_fetch_param(pTHX_ pj_jitop_aux_t *aux, const char *kinds, unsigned int i, SV *sv)
+{
+  if (kinds == NULL || kinds[i] == pj_param_nv) {
+    aux->paramslist[i] = SvNV_nomg(sv);
+    PJ_DEBUG_2("Param %i is %f.\n", i, aux->paramslist[i]);
+  }
+  else if (kinds[i] == pj_param_iv) {
+    PJ_SET_IV_PARAM(aux->paramslist[i], SvIV_nomg(sv));
+    PJ_DEBUG_1("Param %i is an IV.\n", i);
+  }
+  else if (kinds[i] == pj_param_record) {
+    aux->records[i] = (void *)pj_record_container(aTHX_ sv, SVt_PVHV);
+    aux->paramslist[i] = 0.;
+    PJ_DEBUG_1("Param %i is a hash reference.\n", i);
+  }
+  else {
+    aux->records[i] = (void *)pj_record_container(aTHX_ sv, SVt_PVAV);
+    aux->paramslist[i] = 0.;
+    PJ_DEBUG_1("Param %i is an array reference.\n", i);
+  }
+}
+
+/* Publish a string param in its buffer. Returns 0 for strings with wide
+ * characters, which unpack and vec would warn about or croak on. */
+PJ_STATIC_INLINE int
+pj_jitop_fetch_pvbuf(pTHX_ pj_jitop_aux_t *aux, unsigned int i, SV *sv)
+{
+  pj_pvbuf_t *buf = &aux->pvbufs[i];
+  STRLEN len;
+  const char *pv = SvPV_nomg_const(sv, len);
+
+  /* unpack and vec work on the downgraded string */
+  if (SvUTF8(sv)) {
+    SV *tmpsv = sv_2mortal(newSVpvn(pv, len));
+    SvUTF8_on(tmpsv);
+    if (!sv_utf8_downgrade(tmpsv, TRUE))
+      return 0;
+    pv = SvPV_const(tmpsv, len);
+  }
+
+  buf->pv = pv;
+  buf->len = len;
+  aux->paramslist[i] = 0.;
+  PJ_DEBUG_2("Param %i is a string buffer of length %i.\n", i, (int)len);
+  return 1;
+}
+
+/* Continue with the OPs the JIT OP replaced, the params on the stack
+ * marked for the fallback param OPs */
+PJ_STATIC_INLINE OP *
+pj_jitop_fallback(pTHX_ pj_jitop_aux_t *aux)
+{
+  dSP;
+
+  PJ_DEBUG_1("Falling back to the OPs replaced by %s\n", OP_NAME(PL_op));
+  PUSHMARK(SP - aux->nparams);
+  return aux->fallback;
+}
+
+OP *
+pj_pp_jit_fallback_param(pTHX)
+{
+  dSP;
+
+  /* op_private marks have been pushed since the JIT OP's */
+  XPUSHs(PL_stack_base[PL_markstack_ptr[-(I32)PL_op->op_private] + 1 + PL_op->op_targ]);
+  RETURN;
+}
+
+OP *
+pj_pp_jit_fallback_leave(pTHX)
+{
+  dSP;
+  SV **params = PL_stack_base + POPMARK + 1;
+  const SSize_t nresults = SP - (params + PL_op->op_targ) + 1;
+
+  Move(params + PL_op->op_targ, params, nresults, SV *);
+  SP = params + nresults - 1;
+  RETURN;
+}
+
+PJ_STATIC_INLINE U8
+pj_jitop_seen_type(SV *sv)
+{
+  if (SvGMAGICAL(sv) || SvROK(sv))
+    return PJ_SEEN_OTHER;
+  if (SvIOK(sv) && !SvNOK(sv) && !SvIsUV(sv))
+    return PJ_SEEN_IV;
+  if (SvNOK(sv))
+    return PJ_SEEN_NV;
+  return PJ_SEEN_OTHER;
+}
+
+static pj_jitop_profile_t *
+pj_make_jitop_profile(const unsigned int nparams)
+{
+  pj_jitop_profile_t *p = (pj_jitop_profile_t *)malloc(sizeof(pj_jitop_profile_t));
+
+  p->nruns = 0;
+  p->nfails = 0;
+  p->nspecs = 0;
+  p->seen = (U8 *)calloc(nparams, sizeof(U8));
+  p->spec_kinds = NULL;
+  p->spec_fun = NULL;
+  p->spec_funtype = pj_double_type;
+  return p;
+}
+
+static void
+pj_free_jitop_profile(pj_jitop_profile_t *p)
+{
+  if (p == NULL)
+    return;
+  free(p->seen);
+  free(p->spec_kinds);
+  free(p);
+}
+
+/* Functions that have been replaced may still be running further up
+ * the C stack, since JIT code can run Perl code (overloaded operands,
+ * opcalls). So they're all released along with the OP, see
+ * pj_jitop_free_hook. */
+static void
+pj_jitop_add_function(pj_jitop_aux_t *aux, jit_function_t func)
+{
+  aux->funcs = (jit_function_t *)realloc(aux->funcs, (aux->nfuncs + 1) * sizeof(jit_function_t));
+  aux->funcs[aux->nfuncs++] = func;
+}
+
+/* The profile is complete: compile the function again, with the
+ * params that have only ever been IVs passed as such. Done with the
+ * profile if there are none. */
+static void
+pj_jitop_specialize(pTHX_ pj_jitop_aux_t *aux)
+{
+  pj_jitop_profile_t *p = aux->profile;
+  const unsigned int n = aux->nparams;
+  pj_variable_t **vars;
+  unsigned int nvar_uses, i;
+  char *kinds, *cmp_vars;
+  int nspecial = 0;
+  pj_term_t *ast;
+  jit_function_t func = NULL;
+  pj_basic_type funtype;
+
+  if (aux->ast == NULL) {
+    pj_free_jitop_profile(p);
+    aux->profile = NULL;
+    return;
+  }
+
+  /* Only where an IV's arithmetic is the same as its NV's */
+  cmp_vars = (char *)malloc(n);
+  pj_tree_find_cmp_vars(aux->ast, cmp_vars, n);
+  kinds = (char *)calloc(n, sizeof(char));
+  if (aux->param_kinds != NULL)
+    memcpy(kinds, aux->param_kinds, n);
+  for (i = 0; i < n; ++i) {
+    if (kinds[i] == pj_param_nv && cmp_vars[i] && p->seen[i] == PJ_SEEN_IV) {
+      kinds[i] = pj_param_iv;
+      ++nspecial;
+    }
+  }
+  free(cmp_vars);
+
+  if (nspecial == 0) {
+    PJ_DEBUG("Nothing to specialise JIT OP for\n");
+    free(kinds);
+    pj_free_jitop_profile(p);
+    aux->profile = NULL;
+    return;
+  }
+
+  ast = pj_clone_tree(aux->ast, NULL);
+  pj_tree_extract_vars(ast, &vars, &nvar_uses);
+  for (i = 0; i < nvar_uses; ++i) {
+    if ((unsigned int)vars[i]->ivar < n && kinds[vars[i]->ivar] == pj_param_iv)
+      vars[i]->var_type = pj_int_type;
+  }
+  free(vars);
+
+  /* At the level of the scope, like the hot tier */
+  if (0 != pj_tree_jit_level(PJ_jit_context, ast, pj_optimization_level(aTHX_ PL_curcop),
+                             &func, &funtype))
+  {
+    PJ_DEBUG("JIT of specialised function failed!\n");
+    free(kinds);
+    pj_free_tree(ast);
+    pj_free_jitop_profile(p);
+    aux->profile = NULL;
+    return;
+  }
+  pj_free_tree(ast);
+
+  PJ_DEBUG_1("Specialised JIT OP for %i IV params\n", nspecial);
+  pj_jitop_add_function(aux, func);
+  free(p->spec_kinds);
+  p->spec_kinds = kinds;
+  p->spec_fun = (void *)jit_function_to_closure(func);
+  p->spec_funtype = funtype;
+  p->nruns = 0;
+  p->nfails = 0;
+  ++p->nspecs;
+}
+
+/* Back to profiling, or to the generic function for good */
+static void
+pj_jitop_despecialize(pj_jitop_aux_t *aux)
+{
+  pj_jitop_profile_t *p = aux->profile;
+
+  PJ_DEBUG("Guards of specialised JIT OP fail too often\n");
+  if (p->nspecs >= PJ_PROFILE_MAX_SPECS) {
+    pj_free_jitop_profile(p);
+    aux->profile = NULL;
+    return;
+  }
+  free(p->spec_kinds);
+  p->spec_kinds = NULL;
+  p->spec_fun = NULL;
+  p->nruns = 0;
+  p->nfails = 0;
+  memset(p->seen, 0, aux->nparams);
+}
+
+/* Profile the params on the stack or check them against the guards of
+ * the specialised function. Returns the param kinds to run with, NULL
+ * for the generic function. */
+PJ_STATIC_INLINE const char *
+pj_jitop_feedback(pTHX_ pj_jitop_aux_t *aux, SV **params)
+{
+  pj_jitop_profile_t *p = aux->profile;
+  const unsigned int n = aux->nparams;
+  unsigned int i;
+
+  if (p->spec_fun == NULL) {
+    for (i = 0; i < n; ++i)
+      p->seen[i] |= pj_jitop_seen_type(params[i]);
+    if (++p->nruns == PJ_PROFILE_RUNS)
+      pj_jitop_specialize(aTHX_ aux);
+    return NULL;
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (p->spec_kinds[i] == pj_param_iv && pj_jitop_seen_type(params[i]) != PJ_SEEN_IV)
+      break;
+  }
+  if (i < n)
+    ++p->nfails;
+  if (++p->nruns == PJ_PROFILE_GUARD_WINDOW) {
+    if (p->nfails * PJ_PROFILE_GUARD_FAIL_SHARE > p->nruns) {
+      pj_jitop_despecialize(aux);
+      return NULL;
+    }
+    p->nruns = 0;
+    p->nfails = 0;
+  }
+  return (i < n ? NULL : p->spec_kinds);
+}
+
+/* Compiles the kept AST for the JIT OP to run */
+static void
+pj_jitop_compile(pTHX_ pj_jitop_aux_t *aux, unsigned int level)
+{
+  jit_function_t func = NULL;
+  pj_basic_type funtype;
+
+  PJ_DEBUG_1("Compiling JIT OP at optimization level %u\n", level);
+  if (0 != pj_tree_jit_level(PJ_jit_context, aux->ast, level, &func, &funtype)) {
+    /* The cold tier's function will do, or the replaced OPs */
+    PJ_DEBUG("JIT failed!\n");
+    return;
+  }
+  pj_jitop_add_function(aux, func);
+  aux->jit_fun = (void *)jit_function_to_closure(func);
+  aux->funtype = funtype;
+}
+
+/* Compile for the cold tier on the first run, for the hot one when
+ * PJ_TIER_HOT_RUNS is reached. The hot tier is compiled at the level
+ * that applies to the statement, if that's any better. If the cold tier
+ * can't be compiled, the JIT OP falls back to the OPs it replaced for
+ * good. */
+PJ_STATIC_INLINE void
+pj_jitop_tier_up(pTHX_ pj_jitop_aux_t *aux)
+{
+  if (aux->jit_fun == NULL) {
+    pj_jitop_compile(aTHX_ aux, JIT_OPTLEVEL_NONE);
+    if (aux->jit_fun == NULL) {
+      aux->nruns = PJ_TIER_HOT_RUNS;
+      return;
+    }
+  }
+  if (++aux->nruns == PJ_TIER_HOT_RUNS) {
+    const unsigned int level = pj_optimization_level(aTHX_ PL_curcop);
+    if (level != JIT_OPTLEVEL_NONE)
+      pj_jitop_compile(aTHX_ aux, level);
+  }
+}
+
+/* Pop the params off the stack and run the compiled function, or its
+ * specialised version. Returns 0, leaving the params on the stack, if
+ * the replaced OPs have to do the work instead (see pj_jitop_fallback). */
+PJ_STATIC_INLINE int
+pj_jitop_run(pTHX_ pj_jitop_aux_t *aux, pj_basic_type *funtype, pj_jit_result_t *result)
+{
+  dSP;
+  const unsigned int n = aux->nparams;
+  const char *kinds = aux->param_kinds;
+  SV **params = SP - n + 1;
+  void (*fun)(void);
+  unsigned int i;
+
+  if (aux->nruns < PJ_TIER_HOT_RUNS)
+    pj_jitop_tier_up(aTHX_ aux);
+  if (aux->jit_fun == NULL)
+    return 0;
+  fun = aux->jit_fun;
+  *funtype = aux->funtype;
+
+  if (aux->profile != NULL && pj_jitop_feedback(aTHX_ aux, params) != NULL) {
+    kinds = aux->profile->spec_kinds;
+    fun = aux->profile->spec_fun;
+    *funtype = aux->profile->spec_funtype;
+  }
+
+  PJ_DEBUG_1("Expecting %u parameters on stack.\n", n);
+  /* Strings first, so that the replaced OPs don't get to see any of the
+   * others numified already */
+  if (aux->pvbufs != NULL) {
+    for (i = 0; i < n; ++i) {
+      if (kinds[i] == pj_param_pvbuf && !pj_jitop_fetch_pvbuf(aTHX_ aux, i, params[i]))
+        return 0;
+    }
+  }
+  for (i = n; i-- > 0; ) {
+    if (kinds == NULL || kinds[i] != pj_param_pvbuf)
+      pj_jitop_fetch_param(aTHX_ aux, kinds, i, params[i]);
+  }
+  SP -= n;
+  PUTBACK;
+
+  pj_invoke_func((pj_invoke_func_t) fun, aux->paramslist, n, *funtype, (void *)result);
+  return 1;
+}
+
+SV *
+pj_jit_result_sv(pTHX_ pj_basic_type funtype, bool bool_result, const pj_jit_result_t *result)
+{
+  if (bool_result)
+    return boolSV(PJ_JIT_RESULT_TRUE(funtype, result));
+  if (funtype == pj_int_type)
+    return sv_2mortal(newSViv((IV)result->iv));
+  if (funtype == pj_uint_type)
+    return sv_2mortal(newSVuv((UV)result->uv));
+  return sv_2mortal(newSVnv((NV)result->nv));
+}
 
 OP *
 pj_pp_jit(pTHX)
@@ -20,7 +583,6 @@ pj_pp_jit(pTHX)
   pj_jitop_aux_t *aux = (pj_jitop_aux_t *) ((BINOP *)PL_op)->op_targ;
 
   SV *tmpsv;
-  unsigned int i, n;
 
   PJ_DEBUG_1("Custom op '%s' called\n", OP_NAME(PL_op));
   PJ_DEBUG_2("Custom op op_flags are %i STACKED|KIDS==%i.\n", (int)(PL_op->op_flags), (int)(OPf_STACKED|OPf_KIDS));
@@ -44,41 +606,63 @@ pj_pp_jit(pTHX)
   /* tryAMAGICbin_MG(add_amg, AMGf_assign|AMGf_numeric); */
 
   {
-    double result; /* FIXME function ret type should be dynamic */
-    double *params = aux->paramslist;
-    n = aux->nparams;
-
-    PJ_DEBUG_1("Expecting %u parameters on stack.\n", n);
-    /* FIXME future optimization: Don't pop the last param off the stack but reuse. */
-    /* Pop all args from stack */
-    for (i = 0; i < n-1; ++i) {
-      tmpsv = POPs;
-      params[n-i-1] = SvNV_nomg(tmpsv);
-      PJ_DEBUG_2("Param %i is %f.\n", n-i-1, params[n-i-1]);
-    }
-    if (n != 0) {
-      tmpsv = TOPs;
-      params[0] = SvNV_nomg(tmpsv);
-      PJ_DEBUG_2("Param %i is %f.\n", 0, params[0]);
-    }
+    pj_jit_result_t result;
+    pj_basic_type funtype;
 
-    //printf("In: %f %f\n", params[0], params[1]);
-    pj_invoke_func((pj_invoke_func_t) aux->jit_fun, params, aux->nparams, pj_double_type, (void *)&result);
+    PUTBACK;
+    if (!pj_jitop_run(aTHX_ aux, &funtype, &result))
+      return pj_jitop_fallback(aTHX_ aux);
+    SPAGAIN;
 
-    PJ_DEBUG_1("Result from JIT OP: %f\n", (float)result);
     //PUSHn((NV)result);
-    SETs(sv_2mortal(newSVnv((NV)result)));
+    tmpsv = pj_jit_result_sv(aTHX_ funtype, aux->bool_result, &result);
+    XPUSHs(tmpsv);
   }
 
   PJ_DEBUG("Finished executing JIT OP.\n");
   RETURN;
 }
 
+OP *
+pj_pp_jit_branch(pTHX)
+{
+  dVAR;
+  pj_jitop_aux_t *aux = (pj_jitop_aux_t *) PL_op->op_targ;
+  pj_jit_result_t result;
+  pj_basic_type funtype;
+
+  PJ_DEBUG_1("Custom op '%s' called\n", OP_NAME(PL_op));
+  if (!pj_jitop_run(aTHX_ aux, &funtype, &result))
+    return pj_jitop_fallback(aTHX_ aux);
+
+  /* Like pp_and, pp_or and pp_cond_expr, minus the boolean SV */
+  if (PJ_JIT_RESULT_TRUE(funtype, &result) == aux->other_if_true)
+    return cLOGOP->op_other;
+  return NORMAL;
+}
+
+
+/* The OPs a JIT OP replaced. Their kids are orphans too or are the
+ * JIT OP's kids, which op_free gets to through the JIT OP. */
+static void
+pj_jitop_free_orphans(pTHX_ pj_jitop_aux_t *aux)
+{
+  unsigned int i;
+
+  for (i = 0; i < aux->norphans; ++i) {
+    OP *o = aux->orphans[i];
+    o->op_flags &= ~OPf_KIDS;
+    op_free(o);
+  }
+  free(aux->orphans);
+}
 
 /* Hook that will free the JIT OP aux structure of our custom ops */
-/* FIXME this doesn't appear to actually be called for all ops -
- *       specifically NOT for our custom OP. Is this because the
- *       custom OP isn't wired up correctly? */
+/* This is called for every OP that's freed: for a sub's OPs when it's
+ * undefined or its last reference goes away (anonymous subs, closures,
+ * string evals) and for the main program's at exit. The OPs of named
+ * subs are only freed at exit if PERL_DESTRUCT_LEVEL is set, and only
+ * after pj_global_state_final_cleanup released all compiled code. */
 void
 pj_jitop_free_hook(pTHX_ OP *o)
 {
@@ -86,21 +670,105 @@ pj_jitop_free_hook(pTHX_ OP *o)
     PJ_orig_opfreehook(aTHX_ o);
 
   /* printf("cleaning %s\n", OP_NAME(o)); */
-  if (o->op_ppaddr == pj_pp_jit) {
+  if (o->op_ppaddr == pj_pp_jit || o->op_ppaddr == pj_pp_jit_branch) {
     PJ_DEBUG("Cleaning up custom OP's pj_jitop_aux_t\n");
     pj_jitop_aux_t *aux = (pj_jitop_aux_t *)o->op_targ;
+    unsigned int i;
     free(aux->paramslist);
+    free(aux->param_kinds);
+    free(aux->pvbufs);
+    free(aux->records);
+    for (i = 0; i < aux->nfields; ++i) {
+      SvREFCNT_dec(aux->fields[i]->key);
+      free(aux->fields[i]);
+    }
+    free(aux->fields);
+    for (i = 0; i < aux->nopcalls; ++i) {
+      pj_opcall_op_t *c = aux->opcalls[i];
+      unsigned int k;
+      for (k = 0; k < c->nkids; ++k) {
+        if (c->kids[k].kind == pj_opcall_kid_native)
+          SvREFCNT_dec(c->kids[k].sv);
+      }
+      free(c);
+    }
+    free(aux->opcalls);
+    pj_jitop_free_orphans(aTHX_ aux);
+    for (i = 0; i < aux->nfuncs; ++i)
+      pj_free_jit_function(aux->funcs[i]);
+    free(aux->funcs);
+    pj_free_tree(aux->ast);
+    pj_free_jitop_profile(aux->profile);
     free(aux);
     o->op_targ = 0; /* important or Perl will use it to access the pad */
   }
+  else if (o->op_ppaddr == pj_pp_jit_fallback_param || o->op_ppaddr == pj_pp_jit_fallback_leave) {
+    o->op_targ = 0; /* a count, not a pad offset */
+  }
+  else if (o->op_ppaddr == pj_pp_jit_entersub) {
+    PJ_DEBUG("Cleaning up custom entersub OP's pj_entersub_aux_t\n");
+    pj_entersub_free_aux(aTHX_ o);
+  }
+  else if (o->op_ppaddr == pj_pp_jit_deref) {
+    PJ_DEBUG("Cleaning up custom deref OP's pj_deref_aux_t\n");
+    pj_deref_free_aux(aTHX_ o);
+  }
+  else if (o->op_ppaddr == pj_pp_jit_sort) {
+    PJ_DEBUG("Cleaning up custom sort OP's pj_sort_aux_t\n");
+    pj_sort_free_aux(aTHX_ o);
+  }
+  else if (o->op_ppaddr == pj_pp_jit_reduce) {
+    PJ_DEBUG("Cleaning up custom reduction OP's pj_reduce_aux_t\n");
+    pj_reduce_free_aux(aTHX_ o);
+  }
+  else if (o->op_ppaddr == pj_pp_threaded_enter || o->op_ppaddr == pj_pp_threaded_resume) {
+    PJ_DEBUG("Cleaning up threaded sub's pj_threaded_sub_t\n");
+    pj_threaded_free_op(aTHX_ o);
+  }
+  else if (o->op_ppaddr == pj_pp_trace_unstack) {
+    PJ_DEBUG("Cleaning up traced loop's pj_trace_t\n");
+    pj_trace_free_op(aTHX_ o);
+  }
 }
 
 
+static pj_jitop_aux_t *
+pj_make_jitop_aux(pTHX_ const unsigned int nvariables, OP *origop)
+{
+  pj_jitop_aux_t *jit_aux;
+
+  jit_aux = malloc(sizeof(pj_jitop_aux_t));
+  jit_aux->paramslist = (NV *)malloc(sizeof(NV) * nvariables);
+  jit_aux->nparams = nvariables;
+  jit_aux->jit_fun = NULL;
+  jit_aux->param_kinds = NULL;
+  jit_aux->pvbufs = NULL;
+  jit_aux->fallback = NULL;
+  jit_aux->records = NULL;
+  jit_aux->fields = NULL;
+  jit_aux->nfields = 0;
+  jit_aux->opcalls = NULL;
+  jit_aux->nopcalls = 0;
+  jit_aux->funtype = pj_double_type;
+  jit_aux->bool_result = FALSE;
+  jit_aux->other_if_true = TRUE;
+  jit_aux->ast = NULL;
+  jit_aux->profile = NULL;
+  jit_aux->nruns = 0;
+  jit_aux->funcs = NULL;
+  jit_aux->nfuncs = 0;
+  jit_aux->orphans = NULL;
+  jit_aux->norphans = 0;
+  jit_aux->saved_op_targ = origop->op_targ; /* save in case needed for sassign optimization */
+  /* FIXME is copying op_targ good enough? */
+
+  return jit_aux;
+}
+
 LISTOP *
 pj_prepare_jit_op(pTHX_ const unsigned int nvariables, OP *origop)
 {
   LISTOP *jitop;
-  pj_jitop_aux_t *jit_aux;
 
   NewOp(1101, jitop, 1, LISTOP);
   jitop->op_type = (OPCODE)OP_CUSTOM;
@@ -121,18 +789,137 @@ pj_prepare_jit_op(pTHX_ const unsigned int nvariables, OP *origop)
   /* Set it's implementation ptr */
   jitop->op_ppaddr = pj_pp_jit;
 
-  /* Init jit_aux */
-  jit_aux = malloc(sizeof(pj_jitop_aux_t));
-  jit_aux->paramslist = (NV *)malloc(sizeof(NV) * nvariables);
-  jit_aux->nparams = nvariables;
-  jit_aux->jit_fun = NULL;
-  jit_aux->saved_op_targ = origop->op_targ; /* save in case needed for sassign optimization */
-  /* FIXME is copying op_targ good enough? */
-
   /* It may turn out that op_targ is not safe to use for custom OPs because
    * some core functions may meddle with it. But chances are it's fine.
    * If not, we'll need to become extra-creative... */
+  jitop->op_targ = (PADOFFSET)PTR2UV(pj_make_jitop_aux(aTHX_ nvariables, origop));
+
+  return jitop;
+}
+
+LOGOP *
+pj_prepare_jit_branch_op(pTHX_ const unsigned int nvariables, LOGOP *origop)
+{
+  LOGOP *jitop;
+  pj_jitop_aux_t *jit_aux;
+
+  NewOp(1101, jitop, 1, LOGOP);
+  jitop->op_type = (OPCODE)OP_CUSTOM;
+  jitop->op_ppaddr = pj_pp_jit_branch;
+  /* Keeps the original OP's kids other than the condition */
+  jitop->op_flags = origop->op_flags | OPf_KIDS;
+  jitop->op_private = 0;
+  jitop->op_next = origop->op_next;
+  jitop->op_other = origop->op_other;
+
+  jit_aux = pj_make_jitop_aux(aTHX_ nvariables, (OP *)origop);
+  jit_aux->other_if_true = (origop->op_type != OP_OR);
+  jit_aux->saved_op_targ = 0; /* no result, so no TARG */
   jitop->op_targ = (PADOFFSET)PTR2UV(jit_aux);
 
   return jitop;
 }
+
+
+void
+pj_jitop_setup_params(pTHX_ pj_jitop_aux_t *aux, pj_term_t *ast)
+{
+  pj_pvload_t **pvloads;
+  pj_term_t **fieldloads, **elemloads, **opcalls;
+  unsigned int npvloads, nfieldloads, nelemloads, nopcalls, i, j;
+  char *int_vars = NULL;
+
+  if (PJ_IV_PARAMS && aux->nparams > 0) {
+    int_vars = (char *)malloc(aux->nparams);
+    pj_tree_type_int_vars(ast, int_vars, aux->nparams);
+  }
+  pj_tree_extract_pvloads(ast, &pvloads, &npvloads);
+  pj_tree_extract_terms(ast, pj_ttype_fieldload, &fieldloads, &nfieldloads);
+  pj_tree_extract_terms(ast, pj_ttype_elemload, &elemloads, &nelemloads);
+
+  if (npvloads > 0 || nfieldloads > 0 || nelemloads > 0
+      || (int_vars != NULL && memchr(int_vars, 1, aux->nparams) != NULL))
+  {
+    aux->param_kinds = (char *)calloc(aux->nparams, sizeof(char));
+  }
+
+  if (int_vars != NULL) {
+    for (i = 0; i < aux->nparams; ++i) {
+      if (int_vars[i])
+        aux->param_kinds[i] = pj_param_iv;
+    }
+    free(int_vars);
+
+    /* Compared ones may turn out to be IVs at run time */
+    int_vars = (char *)malloc(aux->nparams);
+    pj_tree_find_cmp_vars(ast, int_vars, aux->nparams);
+    for (i = 0; i < aux->nparams; ++i) {
+      if (int_vars[i] && (aux->param_kinds == NULL || aux->param_kinds[i] == pj_param_nv))
+        break;
+    }
+    if (i < aux->nparams)
+      aux->profile = pj_make_jitop_profile(aux->nparams);
+    free(int_vars);
+  }
+
+  if (nfieldloads > 0 || nelemloads > 0)
+    aux->records = (void **)calloc(aux->nparams, sizeof(void *));
+  if (nfieldloads > 0)
+    aux->fields = (pj_hv_field_t **)malloc(nfieldloads * sizeof(pj_hv_field_t *));
+
+  for (i = 0; i < nfieldloads; ++i) {
+    pj_fieldload_t *f = (pj_fieldload_t *)fieldloads[i];
+    const int ivar = ((pj_variable_t *)f->container)->ivar;
+    assert((UV)ivar < aux->nparams);
+    aux->param_kinds[ivar] = pj_param_record;
+    f->record = &aux->records[ivar];
+
+    /* Inlining may have copied the term, key and all */
+    for (j = 0; j < aux->nfields; ++j) {
+      if (aux->fields[j] == f->key)
+        break;
+    }
+    if (j == aux->nfields)
+      aux->fields[aux->nfields++] = (pj_hv_field_t *)f->key;
+  }
+  free(fieldloads);
+
+  for (i = 0; i < nelemloads; ++i) {
+    pj_elemload_t *e = (pj_elemload_t *)elemloads[i];
+    const int ivar = ((pj_variable_t *)e->container)->ivar;
+    assert((UV)ivar < aux->nparams);
+    aux->param_kinds[ivar] = pj_param_array;
+    e->record = &aux->records[ivar];
+  }
+  free(elemloads);
+
+  pj_tree_extract_terms(ast, pj_ttype_opcall, &opcalls, &nopcalls);
+  if (nopcalls > 0)
+    aux->opcalls = (pj_opcall_op_t **)malloc(nopcalls * sizeof(pj_opcall_op_t *));
+  for (i = 0; i < nopcalls; ++i) {
+    pj_opcall_op_t *c = (pj_opcall_op_t *)((pj_opcall_t *)opcalls[i])->op;
+
+    /* Copied along with inlined arguments, maybe */
+    for (j = 0; j < aux->nopcalls; ++j) {
+      if (aux->opcalls[j] == c)
+        break;
+    }
+    if (j == aux->nopcalls)
+      aux->opcalls[aux->nopcalls++] = c;
+  }
+  free(opcalls);
+
+  if (npvloads == 0)
+    return;
+
+  aux->pvbufs = (pj_pvbuf_t *)calloc(aux->nparams, sizeof(pj_pvbuf_t));
+
+  for (i = 0; i < npvloads; ++i) {
+    const int ivar = ((pj_variable_t *)pvloads[i]->buffer)->ivar;
+    assert((UV)ivar < aux->nparams);
+    aux->param_kinds[ivar] = pj_param_pvbuf;
+    pvloads[i]->buf = &aux->pvbufs[ivar];
+  }
+
+  free(pvloads);
+}
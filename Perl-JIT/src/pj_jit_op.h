@@ -8,8 +8,99 @@
 #include <perl.h>
 
 #include "pj_ast_terms.h"
+#include "pj_ast_jit.h"
 #include "stack.h"
 
+/* How the JIT OP hands a value from the stack to the compiled function */
+typedef enum {
+  pj_param_nv = 0, /* plain numeric function parameter */
+  pj_param_pvbuf,  /* string buffer, published via pvbufs[i] */
+  pj_param_iv,     /* the IV's bits, see pj_tree_jit */
+  pj_param_record, /* hash reference, the HV is published via records[i] */
+  pj_param_array   /* array reference, the AV is published via records[i] */
+} pj_param_kind;
+
+/* IV parameters travel in the NV slots */
+#define PJ_IV_PARAMS (IVSIZE == 8 && NVSIZE == 8)
+
+/* Stores the IV in a parameter slot, as a pj_param_iv */
+#define PJ_SET_IV_PARAM(slot, iv) STMT_START { \
+    const IV pj_iv_param_ = (iv);              \
+    memcpy(&(slot), &pj_iv_param_, sizeof(IV)); \
+  } STMT_END
+
+/* What the compiled function returns, see pj_tree_jit */
+typedef union {
+  double nv;
+  jit_long iv;
+  jit_ulong uv;
+} pj_jit_result_t;
+
+/* A constant hash key as used by the fieldload term, with its hash
+ * computed up front */
+typedef struct {
+  SV *key; /* a shared key */
+  U32 hash;
+} pj_hv_field_t;
+
+/* Kids of an OP done by an opcall term */
+#define PJ_OPCALL_MAX_KIDS 2
+
+typedef enum {
+  pj_opcall_kid_native, /* computed by the JIT code, pushed as an NV */
+  pj_opcall_kid_padsv,  /* a lexical, pushed as it is */
+  pj_opcall_kid_const   /* a constant, pushed as it is */
+} pj_opcall_kid_kind;
+
+/* An OP the AST can't represent, run from JIT code by calling its pp
+ * function (the opcall term's op). The OP itself is one of the JIT OP's
+ * orphans, which are freed after the opcalls. */
+typedef struct {
+  OP *op;
+  unsigned int nkids;
+  struct {
+    pj_opcall_kid_kind kind;
+    PADOFFSET padix;  /* for padsv */
+    OP *constop;      /* for const, the SV may live in the pad */
+    SV *sv;           /* for native: ours, reused for each call */
+  } kids[PJ_OPCALL_MAX_KIDS];
+} pj_opcall_op_t;
+
+/* JIT OPs are compiled when first run, without libjit's optimizations
+ * (the cold tier), and compiled again at the level that applies to them
+ * (see pj_optimization_level) once they've run this often (the hot tier) */
+#define PJ_TIER_HOT_RUNS 1000
+
+/* Runs of a JIT OP whose param types are sampled before specialising */
+#define PJ_PROFILE_RUNS 32
+
+/* Runs of the specialised function before its guards are judged, and
+ * the share of them (1/n) that may fail before we go back to profiling */
+#define PJ_PROFILE_GUARD_WINDOW 64
+#define PJ_PROFILE_GUARD_FAIL_SHARE 8
+
+/* Specialisations per JIT OP before it sticks with the generic function */
+#define PJ_PROFILE_MAX_SPECS 3
+
+/* What a param has been seen to be */
+#define PJ_SEEN_IV    (1<<0) /* an IV and nothing else, no magic */
+#define PJ_SEEN_NV    (1<<1)
+#define PJ_SEEN_OTHER (1<<2) /* strings, UVs, undef, references, magic */
+
+/* Type feedback of a JIT OP: the types its params have been seen with
+ * and the version of the compiled function specialised to them. Params
+ * that are only compared (see pj_tree_find_cmp_vars) and have only been
+ * IVs are passed as such (pj_param_iv) instead of as NVs. */
+typedef struct {
+  unsigned int nruns;   /* runs profiled, or run with the specialised function */
+  unsigned int nfails;  /* runs whose guards failed */
+  unsigned int nspecs;  /* times specialised */
+  U8 *seen;             /* PJ_SEEN_* per param */
+  char *spec_kinds;     /* pj_param_kind per param for spec_fun */
+  void (*spec_fun)(void); /* NULL while profiling */
+  pj_basic_type spec_funtype;
+} pj_jitop_profile_t;
+
 /* The struct of pertinent per-OP instance
  * data that we attach to each JIT OP. */
 typedef struct {
@@ -17,15 +108,96 @@ typedef struct {
   NV *paramslist;
   UV nparams;
   PADOFFSET saved_op_targ; /* Replacement for JIT OP's op_targ if necessary */
+  char *param_kinds; /* pj_param_kind per param, NULL if all are pj_param_nv */
+  pj_pvbuf_t *pvbufs; /* one per param, NULL if there are no string params */
+  OP *fallback; /* the first of the OPs it replaced, see pj_pp_jit_fallback_param */
+  void **records; /* one per param, NULL if there are no hash/array reference params */
+  pj_hv_field_t **fields; /* the keys of the fieldloads, owned by the OP */
+  unsigned int nfields;
+  pj_opcall_op_t **opcalls; /* the OPs of the opcalls, owned by the OP */
+  unsigned int nopcalls;
+  pj_basic_type funtype; /* the type of the result: NV, IV or UV */
+  bool bool_result; /* push PL_sv_yes/PL_sv_no instead of an NV */
+  bool other_if_true; /* branch OPs: go to op_other if the result is true (AND, COND_EXPR) or false (OR) */
+  pj_term_t *ast; /* a copy of the compiled AST, for recompiling and for traces to inline */
+  pj_jitop_profile_t *profile; /* NULL if there's nothing (left) to specialise */
+  unsigned int nruns; /* up to PJ_TIER_HOT_RUNS */
+  jit_function_t *funcs; /* all functions compiled for the OP, replaced ones included */
+  unsigned int nfuncs;
+  OP **orphans; /* the OPs it replaced, other than its kids, owned by the OP */
+  unsigned int norphans;
 } pj_jitop_aux_t;
 
 /* The generic custom OP implementation - push/pop function */
 OP *pj_pp_jit(pTHX);
 
+/* The branching custom OP that replaces AND/OR/COND_EXPR in void
+ * context: pops the params, continues with op_other or op_next */
+OP *pj_pp_jit_branch(pTHX);
+
+/* When a JIT OP can't do its work (its function couldn't be compiled, a
+ * string param has wide characters), it runs the OPs it replaced instead,
+ * starting with aux->fallback. The params it would have popped are left
+ * on the stack above a mark. Where the replaced OPs ran the subtrees that
+ * became the JIT OP's kids, they now run a fallback param OP, which
+ * pushes the param numbered by its op_targ again, op_private marks down.
+ * They finish with a fallback leave OP, which drops the op_targ params
+ * from below their result and pops the mark. */
+OP *pj_pp_jit_fallback_param(pTHX);
+OP *pj_pp_jit_fallback_leave(pTHX);
+
 /* Hook that will free the JIT OP aux structure of our custom ops */
 void pj_jitop_free_hook(pTHX_ OP *o);
 
 /* Set up JIT OP without doing actual compilation. */
 LISTOP *pj_prepare_jit_op(pTHX_ const unsigned int nvariables, OP *origop);
 
+/* Set up a branching JIT OP to replace the given AND/OR/COND_EXPR */
+LOGOP *pj_prepare_jit_branch_op(pTHX_ const unsigned int nvariables, LOGOP *origop);
+
+/* Wire up the string buffer and field loads in the AST to the JIT OP's
+ * buffer and record slots and pass the variables that are only used as
+ * integers as IVs. Takes ownership of the fieldloads' keys and of the
+ * opcalls' OPs. Must be called before compiling the AST. */
+void pj_jitop_setup_params(pTHX_ pj_jitop_aux_t *aux, pj_term_t *ast);
+
+/* Makes the key of a fieldload term for $hashref->{CONSTANT} */
+pj_hv_field_t *pj_make_hv_field(pTHX_ SV *keysv);
+
+/* The fieldload term's fetch function: the numeric value of the field
+ * (a pj_hv_field_t) of the record (an HV) */
+double pj_hv_field_nv(void *record, void *field);
+
+/* The elemload term's fetch functions: the numeric value of element i
+ * of the record (an AV), or of element j of the array referenced by
+ * element i. Rows are autovivified as Perl would. */
+double pj_av_elem_nv(void *record, ptrdiff_t i, ptrdiff_t j);
+double pj_av_elem2_nv(void *record, ptrdiff_t i, ptrdiff_t j);
+
+/* Makes the op of an opcall term for o, without any kids yet */
+pj_opcall_op_t *pj_make_opcall_op(pTHX_ OP *o);
+
+/* The opcall term's call function: pushes the kids of the OP (a
+ * pj_opcall_op_t), the native ones taken from args, runs its pp
+ * function and returns the numeric value of the result */
+double pj_opcall_nv(void *op, double *args, unsigned int nargs);
+
+/* The SV to push for the result of a compiled function: a mortal or
+ * PL_sv_yes/PL_sv_no */
+SV *pj_jit_result_sv(pTHX_ pj_basic_type funtype, bool bool_result, const pj_jit_result_t *result);
+
+/* Integers beyond this don't survive being converted to NVs. Assumes
+ * NV is a double. */
+#define PJ_MAX_EXACT_NV ((UV)1 << 53)
+
+/* The numeric value of sv, if getting it has no side effects (magic,
+ * overloading, warnings) and is exact as an NV: no references, undef,
+ * non-numeric strings or integers beyond 2**53. Returns whether it
+ * could be had. */
+int pj_plain_nv(pTHX_ SV *sv, NV *nv);
+
+/* Whether the result of a compiled function is true */
+#define PJ_JIT_RESULT_TRUE(funtype, result) \
+  ((funtype) == pj_double_type ? (result)->nv != 0. : (result)->iv != 0)
+
 #endif
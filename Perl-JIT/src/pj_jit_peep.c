@@ -6,11 +6,25 @@
 #include "pj_debug.h"
 #include "pj_global_state.h"
 #include "pj_optree.h"
+#include "pj_native_sub.h"
+#include "pj_reduce.h"
+#include "pj_threaded.h"
 
 void
 pj_jit_peep(pTHX_ OP *o)
 {
   OP *parent = o;
+  CV *sub = NULL;
+
+  /* Start of a sub body: compile the whole sub natively if we can.
+   * Needs the unmodified OP tree, so do it first. */
+  if (PL_compcv != NULL && CvROOT(PL_compcv) != NULL && CvSTART(PL_compcv) == o) {
+    pj_compile_native_sub(aTHX_ PL_compcv);
+    /* Or keep it for the reduce/first/any it may be the block of */
+    pj_compile_native_block(aTHX_ PL_compcv);
+    sub = PL_compcv;
+  }
+
   pj_find_jit_candidate(aTHX_ o, NULL);
 
   /* May be called one layer deep into the tree, it seems, so respect siblings. */
@@ -20,5 +34,11 @@ pj_jit_peep(pTHX_ OP *o)
   }
 
   PJ_orig_peepp(aTHX_ o);
+
+  /* Whatever is left to the run loop gets the baseline tier */
+  if (sub != NULL)
+    pj_install_threaded_sub(aTHX_ CvSTART(sub), CvROOT(sub), PJ_THREADED_MIN_CALLS);
+  else if (parent == PL_main_start && PL_main_root != NULL)
+    pj_install_threaded_sub(aTHX_ PL_main_start, PL_main_root, 1);
 }
 
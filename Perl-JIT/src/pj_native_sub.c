@@ -0,0 +1,586 @@
+#include "pj_native_sub.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ppport.h"
+#include "ptable.h"
+#include "pj_debug.h"
+#include "pj_inline.h"
+
+#include "pj_ast_terms.h"
+#include "pj_ast_jit.h"
+#include "pj_ast_walkers.h"
+#include "pj_op_map.h"
+#include "pj_global_state.h"
+#include "pj_jit_op.h"
+
+/* pj_invoke_func can't do more */
+#define PJ_NATIVE_SUB_MAX_PARAMS 20
+
+/* Natively compiled subs by CV */
+static PTABLE_t *pj_native_subs = NULL;
+
+/* A call site that a sub's body has been inlined into */
+typedef struct pj_inline_site pj_inline_site_t;
+struct pj_inline_site {
+  GV *gv; /* what the call went through, we hold a reference */
+  CV *cv;
+  OP *root; /* NULL for XSUBs */
+  pj_inline_site_t *next;
+};
+
+/* All of them, so we can free them at the end */
+static pj_inline_site_t *pj_inline_sites = NULL;
+
+/* Skip compiled-out OPs that only wrap a single other OP */
+PJ_STATIC_INLINE OP *
+pj_skip_null_wrappers(OP *o)
+{
+  while (o->op_type == OP_NULL && (o->op_flags & OPf_KIDS)
+         && cUNOPo->op_first->op_sibling == NULL)
+  {
+    o = cUNOPo->op_first;
+  }
+  return o;
+}
+
+/* Match "my ($a, $b, ...) = @_" and collect the pad offsets of the params */
+static int
+pj_match_param_list(pTHX_ OP *o, PADOFFSET *params, unsigned int *nparams)
+{
+  OP *rhs, *lhs, *kid;
+  int have_args = 0;
+
+  if (o->op_type != OP_AASSIGN || !(o->op_flags & OPf_KIDS))
+    return 0;
+  rhs = cBINOPo->op_first;
+  lhs = rhs->op_sibling;
+  if (lhs == NULL || !(rhs->op_flags & OPf_KIDS) || !(lhs->op_flags & OPf_KIDS))
+    return 0;
+
+  /* (pushmark, rv2av(gv(*_))) */
+  for (kid = cLISTOPx(rhs)->op_first; kid; kid = kid->op_sibling) {
+    if (kid->op_type == OP_PUSHMARK)
+      continue;
+    if (have_args || kid->op_type != OP_RV2AV || !(kid->op_flags & OPf_KIDS)
+        || cUNOPx(kid)->op_first->op_type != OP_GV
+        || cGVOPx_gv(cUNOPx(kid)->op_first) != PL_defgv)
+    {
+      return 0;
+    }
+    have_args = 1;
+  }
+  if (!have_args)
+    return 0;
+
+  /* (pushmark, padsv, padsv, ...) */
+  *nparams = 0;
+  for (kid = cLISTOPx(lhs)->op_first; kid; kid = kid->op_sibling) {
+    if (kid->op_type == OP_PUSHMARK)
+      continue;
+    if (kid->op_type != OP_PADSV || !(kid->op_private & OPpLVAL_INTRO)
+        || *nparams == PJ_NATIVE_SUB_MAX_PARAMS)
+    {
+      return 0;
+    }
+    params[(*nparams)++] = kid->op_targ;
+  }
+
+  return *nparams > 0;
+}
+
+OP *
+pj_single_expr(OP *o)
+{
+  while (o != NULL) {
+    OP *kid, *expr = NULL;
+
+    if (o->op_type != OP_SCOPE && o->op_type != OP_LINESEQ
+        && !(o->op_type == OP_NULL && (o->op_flags & OPf_KIDS)))
+    {
+      return o;
+    }
+
+    for (kid = cUNOPo->op_first; kid != NULL; kid = kid->op_sibling) {
+      if (kid->op_type == OP_NEXTSTATE || kid->op_type == OP_DBSTATE
+          || kid->op_type == OP_ENTER || kid->op_type == OP_PUSHMARK
+          || (kid->op_type == OP_NULL && !(kid->op_flags & OPf_KIDS)))
+      {
+        continue;
+      }
+      if (expr != NULL)
+        return NULL;
+      expr = kid;
+    }
+    o = expr;
+  }
+  return NULL;
+}
+
+/* Index of the variable o reads, -1 if it's none of them */
+static int
+pj_closed_var(pTHX_ OP *o, const PADOFFSET *params, GV * const *gvs, unsigned int nvars)
+{
+  GV *gv = NULL;
+  unsigned int i;
+
+  if ((o->op_flags & OPf_MOD) || (o->op_private & (OPpLVAL_INTRO|OPpDEREF)))
+    return -1;
+
+  if (o->op_type == OP_GVSV)
+    gv = cGVOPo_gv;
+  else if (o->op_type == OP_RV2SV && cUNOPo->op_first->op_type == OP_GV)
+    gv = cGVOPx_gv(cUNOPo->op_first);
+  else if (o->op_type != OP_PADSV)
+    return -1;
+
+  for (i = 0; i < nvars; ++i) {
+    if (gvs != NULL && gvs[i] != NULL ? gv == gvs[i]
+                                      : gv == NULL && params[i] == o->op_targ)
+      return (int)i;
+  }
+  return -1; /* some other variable */
+}
+
+pj_term_t *
+pj_build_closed_ast(pTHX_ OP *o, const PADOFFSET *params, GV * const *gvs,
+                    unsigned int nparams, int *max_param)
+{
+  const pj_op_mapping_t *map;
+  pj_term_t *kid_terms[3];
+  unsigned int ikid = 0, i;
+  int ivar;
+  OP *kid;
+
+  o = pj_skip_null_wrappers(o);
+
+  if (o->op_type == OP_CONST)
+    return pj_make_const_term(aTHX_ cSVOPo_sv);
+
+  if (o->op_type == OP_PADSV || o->op_type == OP_GVSV || o->op_type == OP_RV2SV) {
+    if ((ivar = pj_closed_var(aTHX_ o, params, gvs, nparams)) < 0)
+      return NULL;
+    if (ivar > *max_param)
+      *max_param = ivar;
+    return pj_make_variable(ivar, pj_double_type);
+  }
+
+  map = pj_op_mapping_checked(aTHX_ o, 0);
+  if (map == NULL)
+    return NULL;
+
+  for (kid = (o->op_flags & OPf_KIDS) ? cUNOPo->op_first : NULL; kid; kid = kid->op_sibling) {
+    pj_term_t *term;
+
+    if (kid->op_type == OP_PUSHMARK
+        || (kid->op_type == OP_NULL && !(kid->op_flags & OPf_KIDS)))
+      continue;
+
+    term = (ikid < map->nkids ? pj_build_closed_ast(aTHX_ kid, params, gvs, nparams, max_param) : NULL);
+    if (term == NULL) {
+      for (i = 0; i < ikid; ++i)
+        pj_free_tree(kid_terms[i]);
+      return NULL;
+    }
+    kid_terms[ikid++] = term;
+  }
+
+  if (ikid + 1 == map->nkids && (map->flags & PJ_OPMf_OPTIONAL_KID))
+    kid_terms[ikid++] = pj_make_const_dbl(0.);
+
+  if (ikid != map->nkids) {
+    for (i = 0; i < ikid; ++i)
+      pj_free_tree(kid_terms[i]);
+    return NULL;
+  }
+
+  return pj_op_mapping_make_term(aTHX_ o, map, kid_terms, ikid);
+}
+
+void
+pj_compile_native_sub(pTHX_ CV *cv)
+{
+  PADOFFSET params[PJ_NATIVE_SUB_MAX_PARAMS];
+  unsigned int nparams = 0;
+  int max_param = -1;
+  OP *body, *kid, *expr = NULL;
+  const pj_op_mapping_t *map;
+  pj_term_t *ast;
+  pj_native_sub_t *ns;
+  jit_function_t func = NULL;
+  pj_basic_type funtype;
+  char *int_params = NULL;
+  int stage = 0;
+
+  if (CvROOT(cv) == NULL || CvISXSUB(cv) || CvANON(cv) || CvCLONE(cv)
+      || CvLVALUE(cv) || PL_perldb)
+    return;
+
+  /* leavesub(lineseq(nextstate, aassign, nextstate, EXPR)) */
+  body = cUNOPx(CvROOT(cv))->op_first;
+  if (body == NULL || body->op_type != OP_LINESEQ || !(body->op_flags & OPf_KIDS))
+    return;
+
+  for (kid = cLISTOPx(body)->op_first; kid; kid = kid->op_sibling) {
+    if (kid->op_type == OP_NEXTSTATE)
+      continue;
+    if (stage == 0 && pj_match_param_list(aTHX_ kid, params, &nparams))
+      stage = 1;
+    else if (stage == 1)
+      expr = kid, stage = 2;
+    else
+      return;
+  }
+  if (stage != 2)
+    return;
+
+  /* Must be a real operation whose result we can reproduce exactly */
+  map = PJ_OP_MAPPING(pj_skip_null_wrappers(expr));
+  if (map == NULL)
+    return;
+  if (!pj_yields_plain_number(aTHX_ expr)
+      && !(pj_ast_op_flags[map->ast_optype] & PJ_ASTf_BOOLEAN))
+    return;
+
+  ast = pj_build_closed_ast(aTHX_ expr, params, NULL, nparams, &max_param);
+  if (ast == NULL)
+    return;
+  if (max_param < 0) { /* constant, perl handles that better */
+    pj_free_tree(ast);
+    return;
+  }
+
+  PJ_DEBUG_1("Compiling sub with %u params to native function\n", nparams);
+  if (PJ_DEBUGGING)
+    pj_dump_tree(ast);
+
+  if (PJ_IV_PARAMS) {
+    int_params = (char *)malloc(max_param + 1);
+    pj_tree_type_int_vars(ast, int_params, (unsigned int)max_param + 1);
+    if (memchr(int_params, 1, max_param + 1) == NULL) {
+      free(int_params);
+      int_params = NULL;
+    }
+  }
+
+  /* PL_compiling has the hints in effect where the sub is defined */
+  if (0 != pj_tree_jit_level(PJ_jit_context, ast, pj_optimization_level(aTHX_ &PL_compiling),
+                             &func, &funtype))
+  {
+    PJ_DEBUG("JIT failed!\n");
+    free(int_params);
+    pj_free_tree(ast);
+    return;
+  }
+
+  ns = (pj_native_sub_t *)malloc(sizeof(pj_native_sub_t));
+  ns->cv = cv;
+  ns->root = CvROOT(cv);
+  ns->jit_fun = (void *)jit_function_to_closure(func);
+  ns->nparams = nparams;
+  ns->nfunparams = (unsigned int)max_param + 1;
+  ns->funtype = funtype;
+  ns->bool_result = (ast->type == pj_ttype_op
+                     && (PJ_OP_FLAGS((pj_op_t *)ast) & PJ_ASTf_BOOLEAN));
+  ns->int_params = int_params;
+  ns->ast = ast;
+
+  /* If the sub is being redefined, call sites may still point to the
+   * old definition. Their guards take care of that. */
+  if (pj_native_subs == NULL)
+    pj_native_subs = PTABLE_new();
+  ns->prev = (pj_native_sub_t *)PTABLE_fetch(pj_native_subs, cv);
+  PTABLE_store(pj_native_subs, cv, ns);
+}
+
+/* The CV an entersub OP calls, if it can be determined at compile time */
+static CV *
+pj_entersub_target_cv(pTHX_ OP *o, GV **gvp)
+{
+  OP *cvop = cUNOPo->op_first;
+  SV *sv;
+  CV *cv;
+
+  /* Kids may be wrapped in an ex-list */
+  if (cvop->op_sibling == NULL && (cvop->op_flags & OPf_KIDS))
+    cvop = cUNOPx(cvop)->op_first;
+  while (cvop->op_sibling != NULL)
+    cvop = cvop->op_sibling;
+
+  /* ex-rv2cv(gv) */
+  if (cvop->op_type == OP_NULL && (cvop->op_flags & OPf_KIDS))
+    cvop = cUNOPx(cvop)->op_first;
+  if (cvop->op_type != OP_GV)
+    return NULL;
+
+  sv = (SV *)cGVOPx_gv(cvop);
+  if (isGV_with_GP(sv)) {
+    *gvp = (GV *)sv;
+    return GvCV((GV *)sv);
+  }
+  if (SvROK(sv) && SvTYPE(SvRV(sv)) == SVt_PVCV) {
+    /* Just an RV in the stash. Make sure there's a real GV that
+     * a redefinition would go through. */
+    cv = (CV *)SvRV(sv);
+    *gvp = CvGV(cv);
+    return cv;
+  }
+  return NULL;
+}
+
+CV *
+pj_call_target_cv(pTHX_ OP *o, GV **gvp)
+{
+  CV *cv;
+
+  if (o->op_type != OP_ENTERSUB)
+    return NULL;
+  /* Only plain foo(...) calls */
+  if ((o->op_flags & (OPf_STACKED|OPf_KIDS)) != (OPf_STACKED|OPf_KIDS)
+      || (o->op_flags & OPf_MOD)
+      || (o->op_private & (OPpLVAL_INTRO|OPpENTERSUB_INARGS|OPpENTERSUB_DB)))
+    return NULL;
+
+  cv = pj_entersub_target_cv(aTHX_ o, gvp);
+  if (cv == NULL || *gvp == NULL)
+    return NULL;
+  return cv;
+}
+
+pj_native_sub_t *
+pj_native_sub_for_cv(pTHX_ CV *cv)
+{
+  pj_native_sub_t *ns;
+  PERL_UNUSED_CONTEXT;
+
+  if (pj_native_subs == NULL)
+    return NULL;
+  ns = (pj_native_sub_t *)PTABLE_fetch(pj_native_subs, cv);
+  if (ns == NULL || ns->root != CvROOT(cv))
+    return NULL;
+  return ns;
+}
+
+int
+pj_native_sub_can_inline(const pj_native_sub_t *ns)
+{
+  pj_variable_t **vars;
+  unsigned int nvars, i;
+  unsigned int used = 0;
+
+  /* Unused params would mean not evaluating the corresponding args,
+   * which is only fine as long as they can't croak. Keep it simple. */
+  if (ns->nfunparams != ns->nparams)
+    return 0;
+  /* The caller can't tell that the call has side effects (rand) and
+   * might reorder it with others */
+  if (pj_tree_has_op_flag(ns->ast, PJ_ASTf_SIDE_EFFECT))
+    return 0;
+  pj_tree_extract_vars(ns->ast, &vars, &nvars);
+  for (i = 0; i < nvars; ++i)
+    used |= 1U << vars[i]->ivar;
+  free(vars);
+
+  return used == (1U << ns->nparams) - 1;
+}
+
+int
+pj_native_sub_can_inline_args(pTHX_ const pj_native_sub_t *ns, OP * const *args)
+{
+  pj_variable_t **vars;
+  unsigned int nvars, i;
+  unsigned int used = 0, reused = 0;
+
+  for (i = 0; i < ns->nparams; ++i) {
+    if (pj_has_side_effect_op(aTHX_ args[i]))
+      return 0;
+  }
+
+  pj_tree_extract_vars(ns->ast, &vars, &nvars);
+  for (i = 0; i < nvars; ++i) {
+    const unsigned int bit = 1U << vars[i]->ivar;
+    reused |= used & bit;
+    used |= bit;
+  }
+  free(vars);
+
+  for (i = 0; i < ns->nparams; ++i) {
+    if ((reused & (1U << i))
+        && args[i]->op_type != OP_CONST && args[i]->op_type != OP_PADSV)
+      return 0;
+  }
+  return 1;
+}
+
+/* Whether the inlined body is still what the call site would call */
+static int
+pj_inline_guard(void *callee)
+{
+  const pj_inline_site_t *site = (const pj_inline_site_t *)callee;
+  CV *cv = GvCV(site->gv);
+  return cv == site->cv && (site->root == NULL || CvROOT(cv) == site->root);
+}
+
+/* The sub has been redefined: call whatever is there now */
+static double
+pj_inline_fallback(void *callee, double *args, unsigned int nargs)
+{
+  dTHX;
+  dSP;
+  const pj_inline_site_t *site = (const pj_inline_site_t *)callee;
+  unsigned int i;
+  double result;
+
+  ENTER;
+  SAVETMPS;
+  PUSHMARK(SP);
+  EXTEND(SP, (SSize_t)nargs);
+  for (i = 0; i < nargs; ++i)
+    PUSHs(sv_2mortal(newSVnv((NV)args[i])));
+  PUTBACK;
+
+  call_sv((SV *)site->gv, G_SCALAR);
+
+  SPAGAIN;
+  result = (double)SvNV(POPs);
+  PUTBACK;
+  FREETMPS;
+  LEAVE;
+
+  return result;
+}
+
+pj_term_t *
+pj_make_guarded_call(pTHX_ GV *gv, CV *cv, OP *root, pj_term_t *body,
+                     pj_term_t *args, unsigned int nargs)
+{
+  pj_inline_site_t *site;
+
+  site = (pj_inline_site_t *)malloc(sizeof(pj_inline_site_t));
+  site->gv = (GV *)SvREFCNT_inc_simple_NN((SV *)gv);
+  site->cv = cv;
+  site->root = root;
+  site->next = pj_inline_sites;
+  pj_inline_sites = site;
+
+  return pj_make_inline(body, args, nargs, (void *)site, pj_inline_guard, pj_inline_fallback);
+}
+
+int
+pj_attempt_native_entersub(pTHX_ OP *o)
+{
+  pj_native_sub_t *ns;
+  pj_entersub_aux_t *aux;
+  GV *gv;
+  CV *cv;
+
+  cv = pj_call_target_cv(aTHX_ o, &gv);
+  if (cv == NULL || (ns = pj_native_sub_for_cv(aTHX_ cv)) == NULL)
+    return 0;
+
+  PJ_DEBUG("Replacing call to native sub with direct call\n");
+  aux = (pj_entersub_aux_t *)malloc(sizeof(pj_entersub_aux_t));
+  aux->sub = ns;
+  aux->paramslist = (NV *)malloc(sizeof(NV) * ns->nfunparams);
+
+  /* Same OP, just a different implementation. We hang our aux struct
+   * off op_targ, so pp_entersub mustn't use it as TARG when falling back. */
+  o->op_type = OP_CUSTOM;
+  o->op_ppaddr = pj_pp_jit_entersub;
+  o->op_private &= ~OPpENTERSUB_HASTARG;
+  o->op_targ = (PADOFFSET)PTR2UV(aux);
+
+  return 1;
+}
+
+OP *
+pj_pp_jit_entersub(pTHX)
+{
+  dVAR; dSP;
+  pj_entersub_aux_t *aux = (pj_entersub_aux_t *)PL_op->op_targ;
+  const pj_native_sub_t *ns = aux->sub;
+  SV **mark = PL_stack_base + TOPMARK;
+  SV *sv = TOPs;
+  CV *cv = NULL;
+  pj_jit_result_t result;
+  unsigned int i;
+
+  if (isGV_with_GP(sv))
+    cv = GvCV((GV *)sv);
+  else if (SvROK(sv))
+    cv = (CV *)SvRV(sv);
+
+  /* Redefined or called with a different number of args */
+  if (cv != ns->cv || CvROOT(cv) != ns->root || sp - mark - 1 != (SSize_t)ns->nparams)
+    return PL_ppaddr[OP_ENTERSUB](aTHX);
+
+  /* Magic and references (overloading!) take the slow path */
+  for (i = 0; i < ns->nparams; ++i) {
+    if (SvGMAGICAL(mark[i+1]) || SvROK(mark[i+1]))
+      return PL_ppaddr[OP_ENTERSUB](aTHX);
+  }
+
+  for (i = 0; i < ns->nfunparams; ++i) {
+    if (ns->int_params != NULL && ns->int_params[i])
+      PJ_SET_IV_PARAM(aux->paramslist[i], SvIV_nomg(mark[i+1]));
+    else
+      aux->paramslist[i] = SvNV_nomg(mark[i+1]);
+  }
+  (void)POPMARK;
+  SP = mark;
+  PUTBACK;
+
+  /* FIXME errors report the caller's line rather than the sub's */
+  pj_invoke_func((pj_invoke_func_t)ns->jit_fun, aux->paramslist, ns->nfunparams,
+                 ns->funtype, (void *)&result);
+
+  SPAGAIN;
+  if (GIMME_V != G_VOID)
+    XPUSHs(pj_jit_result_sv(aTHX_ ns->funtype, ns->bool_result, &result));
+  RETURN;
+}
+
+void
+pj_entersub_free_aux(pTHX_ OP *o)
+{
+  pj_entersub_aux_t *aux = (pj_entersub_aux_t *)o->op_targ;
+  PERL_UNUSED_CONTEXT;
+  free(aux->paramslist);
+  free(aux);
+  o->op_targ = 0; /* important or Perl will use it to access the pad */
+}
+
+void
+pj_free_native_subs(pTHX)
+{
+  PTABLE_ITER_t *iter;
+  PTABLE_ENTRY_t *entry;
+  pj_native_sub_t *ns, *prev;
+  pj_inline_site_t *site, *next;
+  PERL_UNUSED_CONTEXT;
+
+  /* Called after global destruction, so the GVs are gone already */
+  for (site = pj_inline_sites; site != NULL; site = next) {
+    next = site->next;
+    free(site);
+  }
+  pj_inline_sites = NULL;
+
+  if (pj_native_subs == NULL)
+    return;
+
+  iter = PTABLE_iter_new(pj_native_subs);
+  while ((entry = PTABLE_iter_next(iter)) != NULL) {
+    for (ns = (pj_native_sub_t *)entry->value; ns != NULL; ns = prev) {
+      prev = ns->prev;
+      pj_free_tree(ns->ast);
+      free(ns->int_params);
+      free(ns);
+    }
+  }
+  PTABLE_iter_free(iter);
+
+  PTABLE_free(pj_native_subs);
+  pj_native_subs = NULL;
+}
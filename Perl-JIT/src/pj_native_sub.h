@@ -0,0 +1,89 @@
+#ifndef PJ_NATIVE_SUB_H_
+#define PJ_NATIVE_SUB_H_
+
+/* Whole-subroutine compilation of purely numeric subs and the
+ * custom entersub OP that calls them directly. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "pj_ast_terms.h"
+
+/* A sub that was compiled to a native function as a whole */
+typedef struct pj_native_sub pj_native_sub_t;
+struct pj_native_sub {
+  CV *cv;
+  OP *root;               /* CvROOT at compile time, to detect redefinition */
+  void (*jit_fun)(void);
+  unsigned int nparams;   /* number of declared params: my (...) = @_ */
+  unsigned int nfunparams; /* number of params of jit_fun (the used ones) */
+  pj_basic_type funtype;  /* the type of the result: NV, IV or UV */
+  bool bool_result;       /* push PL_sv_yes/PL_sv_no instead of an NV */
+  char *int_params;       /* params passed as IVs, NULL if there are none */
+  pj_term_t *ast;         /* the body, for inlining. Params are the variables. */
+  pj_native_sub_t *prev;  /* previous definition, may still be referenced */
+};
+
+/* The struct of per-OP data of the custom entersub OP */
+typedef struct {
+  pj_native_sub_t *sub;
+  NV *paramslist;
+} pj_entersub_aux_t;
+
+/* If cv is a sub of the form
+ *   sub foo { my ($a, $b, ...) = @_; NUMERIC_EXPRESSION }
+ * then compile it to a native function and remember it for later
+ * calls. Must be called before the body is otherwise JIT'd. */
+void pj_compile_native_sub(pTHX_ CV *cv);
+
+/* Builds the AST for an expression whose only variables are the given
+ * lexicals (pad offsets in params) or, where gvs (which may be NULL)
+ * has a GV, package variables. Variable i of the AST is params[i] or
+ * gvs[i], max_param is set to the highest one used. Returns NULL if
+ * there's anything we can't compile, without touching the OP tree. */
+pj_term_t *pj_build_closed_ast(pTHX_ OP *o, const PADOFFSET *params, GV * const *gvs,
+                               unsigned int nparams, int *max_param);
+
+/* The single expression of a block, skipping its scope and statement
+ * boundaries. NULL if there's more than one statement. */
+OP *pj_single_expr(OP *o);
+
+/* If o is a call to a sub that's been compiled natively, turn it into
+ * a direct call. Returns whether it did so. */
+int pj_attempt_native_entersub(pTHX_ OP *o);
+
+/* If o is a plain foo(...) call, returns the CV it calls (as of compile
+ * time) and the GV it's called through. */
+CV *pj_call_target_cv(pTHX_ OP *o, GV **gvp);
+
+/* The native sub compiled from cv, if any */
+pj_native_sub_t *pj_native_sub_for_cv(pTHX_ CV *cv);
+
+/* Whether calls to the native sub may be inlined into a larger AST */
+int pj_native_sub_can_inline(const pj_native_sub_t *ns);
+
+/* Whether the args of a call (the OPs computing them, one per param)
+ * may be substituted into the inlined body. The body evaluates an arg
+ * once per use of its param, so only lexicals and constants may be
+ * used more than once. Args with side effects (rand) are never
+ * substituted, the body may evaluate them in a different order. */
+int pj_native_sub_can_inline_args(pTHX_ const pj_native_sub_t *ns, OP * const *args);
+
+/* Builds the AST term for a call through gv whose body has been inlined.
+ * The body is used as long as gv still holds cv (with the same root, if
+ * root is non-NULL), otherwise the sub is called with the args. Takes
+ * ownership of body and args (a list of nargs terms). */
+pj_term_t *pj_make_guarded_call(pTHX_ GV *gv, CV *cv, OP *root, pj_term_t *body,
+                                pj_term_t *args, unsigned int nargs);
+
+/* The custom entersub OP implementation. Falls back to pp_entersub
+ * if the sub has been redefined or the arguments don't fit. */
+OP *pj_pp_jit_entersub(pTHX);
+
+/* Frees the aux struct of a custom entersub OP */
+void pj_entersub_free_aux(pTHX_ OP *o);
+
+/* Releases all native subs */
+void pj_free_native_subs(pTHX);
+
+#endif
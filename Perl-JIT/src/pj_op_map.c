@@ -0,0 +1,510 @@
+#include "pj_op_map.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "ppport.h"
+#include "ptable.h"
+#include "pj_debug.h"
+
+const pj_op_mapping_t *pj_op_map[MAXO];
+
+/* Custom OPs by ppaddr. Created on first registration. */
+static PTABLE_t *pj_custom_op_map = NULL;
+
+static int pj_check_conditional(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root);
+static int pj_check_cond_expr(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root);
+static int pj_check_rand(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root);
+static int pj_check_numeric_bitop(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root);
+
+/* The core OPs we know how to JIT */
+#define PJ_UNOP(ast_op) {ast_op, 1, PJ_OPMf_ROOT, pj_double_type, NULL}
+#define PJ_BINOP(ast_op) {ast_op, 2, PJ_OPMf_ROOT, pj_double_type, NULL}
+/* "use integer" OPs work on the operands' IVs */
+#define PJ_IUNOP(ast_op) {ast_op, 1, PJ_OPMf_ROOT, pj_int_type, NULL}
+#define PJ_IBINOP(ast_op) {ast_op, 2, PJ_OPMf_ROOT, pj_int_type, NULL}
+
+static const pj_op_mapping_t pj_map_add = PJ_BINOP(pj_binop_add);
+static const pj_op_mapping_t pj_map_subtract = PJ_BINOP(pj_binop_subtract);
+static const pj_op_mapping_t pj_map_multiply = PJ_BINOP(pj_binop_multiply);
+static const pj_op_mapping_t pj_map_divide = PJ_BINOP(pj_binop_divide);
+static const pj_op_mapping_t pj_map_modulo = PJ_BINOP(pj_binop_modulo);
+static const pj_op_mapping_t pj_map_atan2 = PJ_BINOP(pj_binop_atan2);
+static const pj_op_mapping_t pj_map_pow = PJ_BINOP(pj_binop_pow);
+static const pj_op_mapping_t pj_map_eq = PJ_BINOP(pj_binop_eq);
+static const pj_op_mapping_t pj_map_ne = PJ_BINOP(pj_binop_ne);
+static const pj_op_mapping_t pj_map_lt = PJ_BINOP(pj_binop_lt);
+static const pj_op_mapping_t pj_map_gt = PJ_BINOP(pj_binop_gt);
+static const pj_op_mapping_t pj_map_le = PJ_BINOP(pj_binop_le);
+static const pj_op_mapping_t pj_map_ge = PJ_BINOP(pj_binop_ge);
+static const pj_op_mapping_t pj_map_ncmp = PJ_BINOP(pj_binop_ncmp);
+
+static const pj_op_mapping_t pj_map_i_add = PJ_IBINOP(pj_binop_add);
+static const pj_op_mapping_t pj_map_i_subtract = PJ_IBINOP(pj_binop_subtract);
+static const pj_op_mapping_t pj_map_i_multiply = PJ_IBINOP(pj_binop_multiply);
+static const pj_op_mapping_t pj_map_i_divide = PJ_IBINOP(pj_binop_divide);
+static const pj_op_mapping_t pj_map_i_modulo = PJ_IBINOP(pj_binop_i_modulo);
+static const pj_op_mapping_t pj_map_i_eq = PJ_IBINOP(pj_binop_eq);
+static const pj_op_mapping_t pj_map_i_ne = PJ_IBINOP(pj_binop_ne);
+static const pj_op_mapping_t pj_map_i_lt = PJ_IBINOP(pj_binop_lt);
+static const pj_op_mapping_t pj_map_i_gt = PJ_IBINOP(pj_binop_gt);
+static const pj_op_mapping_t pj_map_i_le = PJ_IBINOP(pj_binop_le);
+static const pj_op_mapping_t pj_map_i_ge = PJ_IBINOP(pj_binop_ge);
+static const pj_op_mapping_t pj_map_i_ncmp = PJ_IBINOP(pj_binop_ncmp);
+static const pj_op_mapping_t pj_map_i_negate = PJ_IUNOP(pj_unop_negate);
+
+static const pj_op_mapping_t pj_map_negate = PJ_UNOP(pj_unop_negate);
+static const pj_op_mapping_t pj_map_abs = PJ_UNOP(pj_unop_abs);
+static const pj_op_mapping_t pj_map_sin = PJ_UNOP(pj_unop_sin);
+static const pj_op_mapping_t pj_map_cos = PJ_UNOP(pj_unop_cos);
+static const pj_op_mapping_t pj_map_sqrt = PJ_UNOP(pj_unop_sqrt);
+static const pj_op_mapping_t pj_map_log = PJ_UNOP(pj_unop_log);
+static const pj_op_mapping_t pj_map_exp = PJ_UNOP(pj_unop_exp);
+static const pj_op_mapping_t pj_map_int = PJ_UNOP(pj_unop_perl_int);
+static const pj_op_mapping_t pj_map_not = PJ_UNOP(pj_unop_bool_not); /* FIXME Modification of a read-only value attempted at -e line 1. */
+
+/* Shifts and bitwise OPs work on UVs, or IVs under use integer. The
+ * bitwise ones work on strings unless their operands are numbers, so
+ * they're checked. Not so for the numeric-only ones of the "bitwise"
+ * feature. */
+#define PJ_INTUNOP(ast_op, check) {ast_op, 1, PJ_OPMf_ROOT|PJ_OPMf_INTEGER_OPERANDS, pj_double_type, check}
+#define PJ_INTBINOP(ast_op, check) {ast_op, 2, PJ_OPMf_ROOT|PJ_OPMf_INTEGER_OPERANDS, pj_double_type, check}
+
+static const pj_op_mapping_t pj_map_left_shift = PJ_INTBINOP(pj_binop_left_shift, NULL);
+static const pj_op_mapping_t pj_map_right_shift = PJ_INTBINOP(pj_binop_right_shift, NULL);
+static const pj_op_mapping_t pj_map_bit_and = PJ_INTBINOP(pj_binop_bitwise_and, pj_check_numeric_bitop);
+static const pj_op_mapping_t pj_map_bit_or = PJ_INTBINOP(pj_binop_bitwise_or, pj_check_numeric_bitop);
+static const pj_op_mapping_t pj_map_bit_xor = PJ_INTBINOP(pj_binop_bitwise_xor, pj_check_numeric_bitop);
+static const pj_op_mapping_t pj_map_complement = PJ_INTUNOP(pj_unop_bitwise_not, pj_check_numeric_bitop);
+#if PERL_VERSION >= 22
+static const pj_op_mapping_t pj_map_nbit_and = PJ_INTBINOP(pj_binop_bitwise_and, NULL);
+static const pj_op_mapping_t pj_map_nbit_or = PJ_INTBINOP(pj_binop_bitwise_or, NULL);
+static const pj_op_mapping_t pj_map_nbit_xor = PJ_INTBINOP(pj_binop_bitwise_xor, NULL);
+static const pj_op_mapping_t pj_map_ncomplement = PJ_INTUNOP(pj_unop_bitwise_not, NULL);
+#endif
+
+/* AND and OR at top level can be used in "interesting" places such as
+ * looping constructs. Thus, they're only supported as OPs within a tree.
+ * COND_EXPR is only a root in scalar context. In void context, all three
+ * are handled separately as branches, see pj_is_jittable_branch. */
+static const pj_op_mapping_t pj_map_and = {pj_binop_bool_and, 2, 0, pj_double_type, pj_check_conditional};
+static const pj_op_mapping_t pj_map_or = {pj_binop_bool_or, 2, 0, pj_double_type, pj_check_conditional};
+static const pj_op_mapping_t pj_map_cond_expr = {pj_listop_ternary, 3, PJ_OPMf_ROOT, pj_double_type, pj_check_cond_expr};
+
+/* rand() has no kids, same as rand(0) */
+static const pj_op_mapping_t pj_map_rand = {pj_unop_rand, 1, PJ_OPMf_ROOT|PJ_OPMf_OPTIONAL_KID|PJ_OPMf_SIDE_EFFECT,
+                                            pj_double_type, pj_check_rand};
+
+#undef PJ_UNOP
+#undef PJ_BINOP
+#undef PJ_IUNOP
+#undef PJ_IBINOP
+#undef PJ_INTUNOP
+#undef PJ_INTBINOP
+
+static const struct {
+  OPCODE optype;
+  const pj_op_mapping_t *map;
+} pj_core_op_map[] = {
+  {OP_ADD, &pj_map_add},
+  {OP_SUBTRACT, &pj_map_subtract},
+  {OP_MULTIPLY, &pj_map_multiply},
+  {OP_DIVIDE, &pj_map_divide},
+  {OP_MODULO, &pj_map_modulo},
+  {OP_ATAN2, &pj_map_atan2},
+  {OP_POW, &pj_map_pow},
+  {OP_LEFT_SHIFT, &pj_map_left_shift},
+  {OP_RIGHT_SHIFT, &pj_map_right_shift},
+  {OP_BIT_AND, &pj_map_bit_and},
+  {OP_BIT_OR, &pj_map_bit_or},
+  {OP_BIT_XOR, &pj_map_bit_xor},
+  {OP_COMPLEMENT, &pj_map_complement},
+#if PERL_VERSION >= 22
+  {OP_NBIT_AND, &pj_map_nbit_and},
+  {OP_NBIT_OR, &pj_map_nbit_or},
+  {OP_NBIT_XOR, &pj_map_nbit_xor},
+  {OP_NCOMPLEMENT, &pj_map_ncomplement},
+#endif
+  {OP_EQ, &pj_map_eq},
+  {OP_NE, &pj_map_ne},
+  {OP_LT, &pj_map_lt},
+  {OP_GT, &pj_map_gt},
+  {OP_LE, &pj_map_le},
+  {OP_GE, &pj_map_ge},
+  {OP_NCMP, &pj_map_ncmp},
+  {OP_I_ADD, &pj_map_i_add},
+  {OP_I_SUBTRACT, &pj_map_i_subtract},
+  {OP_I_MULTIPLY, &pj_map_i_multiply},
+  {OP_I_DIVIDE, &pj_map_i_divide},
+  {OP_I_MODULO, &pj_map_i_modulo},
+  {OP_I_EQ, &pj_map_i_eq},
+  {OP_I_NE, &pj_map_i_ne},
+  {OP_I_LT, &pj_map_i_lt},
+  {OP_I_GT, &pj_map_i_gt},
+  {OP_I_LE, &pj_map_i_le},
+  {OP_I_GE, &pj_map_i_ge},
+  {OP_I_NCMP, &pj_map_i_ncmp},
+  {OP_I_NEGATE, &pj_map_i_negate},
+  {OP_NEGATE, &pj_map_negate},
+  {OP_ABS, &pj_map_abs},
+  {OP_SIN, &pj_map_sin},
+  {OP_COS, &pj_map_cos},
+  {OP_SQRT, &pj_map_sqrt},
+  {OP_LOG, &pj_map_log},
+  {OP_EXP, &pj_map_exp},
+  {OP_INT, &pj_map_int},
+  {OP_NOT, &pj_map_not},
+  {OP_AND, &pj_map_and},
+  {OP_OR, &pj_map_or},
+  {OP_COND_EXPR, &pj_map_cond_expr},
+  {OP_RAND, &pj_map_rand}
+};
+
+
+int
+pj_is_callable_op(pTHX_ OP *o)
+{
+  const U32 args = PL_opargs[o->op_type];
+  const U32 cls = args & OA_CLASS_MASK;
+  unsigned int nkids = 0;
+  OP *kid;
+
+  PERL_UNUSED_CONTEXT;
+
+  if (o->op_type == OP_CUSTOM || !(args & OA_FOLDCONST) || !(args & OA_RETSCALAR)
+      || (cls != OA_UNOP && cls != OA_BINOP && cls != OA_BASEOP_OR_UNOP)
+      || !(o->op_flags & OPf_KIDS)
+      || (o->op_flags & (OPf_STACKED|OPf_MOD|OPf_REF|OPf_SPECIAL))
+      || ((args & OA_TARGLEX) && (o->op_private & OPpTARGET_MY)))
+  {
+    return 0;
+  }
+
+  for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling) {
+    if (++nkids > 2)
+      return 0;
+  }
+  return 1;
+}
+
+/* Whether the OP tree can be evaluated without side effects, ie. whether
+ * it's fine to execute it even if Perl wouldn't have. Kids of conditional
+ * OPs that end up as subtrees are executed before the JIT OP, that is:
+ * unconditionally. */
+/* FIXME tied or otherwise magical lexicals aren't side effect free */
+int
+pj_is_pure_op_tree(pTHX_ OP *o)
+{
+  const unsigned int otype = o->op_type;
+  OP *kid;
+
+  if (otype == OP_CONST || otype == OP_PUSHMARK)
+    return 1;
+  if (otype == OP_PADSV)
+    return !(o->op_flags & OPf_MOD) && !(o->op_private & (OPpLVAL_INTRO|OPpDEREF));
+  if (otype != OP_NULL && PJ_OP_MAPPING(o) == NULL && !pj_is_callable_op(aTHX_ o))
+    return 0;
+
+  if (o->op_flags & OPf_KIDS) {
+    for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling) {
+      if (!pj_is_pure_op_tree(aTHX_ kid))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+static void
+pj_scan_side_effects(pTHX_ OP *o, int *in_ast, int *in_subtrees)
+{
+  const pj_op_mapping_t *map;
+  OP *kid;
+
+  if (o->op_type == OP_CONST || o->op_type == OP_PUSHMARK || o->op_type == OP_PADSV)
+    return;
+  if (o->op_type != OP_NULL) {
+    map = PJ_OP_MAPPING(o);
+    if (map == NULL && !pj_is_callable_op(aTHX_ o)) {
+      /* Subtree, assume the worst */
+      *in_subtrees = 1;
+      return;
+    }
+    if (map != NULL && (map->flags & PJ_OPMf_SIDE_EFFECT))
+      *in_ast = 1;
+  }
+
+  if (o->op_flags & OPf_KIDS) {
+    for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling)
+      pj_scan_side_effects(aTHX_ kid, in_ast, in_subtrees);
+  }
+}
+
+int
+pj_jit_would_reorder(pTHX_ OP *o)
+{
+  int in_ast = 0, in_subtrees = 0;
+  pj_scan_side_effects(aTHX_ o, &in_ast, &in_subtrees);
+  return in_ast && in_subtrees;
+}
+
+int
+pj_has_side_effect_op(pTHX_ OP *o)
+{
+  int in_ast = 0, in_subtrees = 0;
+  pj_scan_side_effects(aTHX_ o, &in_ast, &in_subtrees);
+  return in_ast;
+}
+
+int
+pj_conditional_kids_are_pure(pTHX_ OP *o)
+{
+  OP *kid;
+  for (kid = cLOGOPo->op_first->op_sibling; kid; kid = kid->op_sibling) {
+    if (!pj_is_pure_op_tree(aTHX_ kid))
+      return 0;
+  }
+  return 1;
+}
+
+/* Whether the value of the OP tree is a plain number, that is: whether
+ * the NV the JIT OP yields is indistinguishable from what Perl would
+ * have returned. Not so for variables (which may hold strings or undef)
+ * and booleans (PL_sv_no is ""). If allow_boolean is set, booleans are
+ * fine, which is all that's needed to test the value's truth. */
+static int
+pj_yields_number(pTHX_ OP *o, int allow_boolean)
+{
+  const pj_op_mapping_t *map;
+  OP *kid;
+
+  if (o->op_type == OP_CONST) {
+    SV *sv = cSVOPo_sv;
+    return (SvNIOK(sv) && !SvPOK(sv));
+  }
+  else if (o->op_type == OP_NULL) {
+    return (o->op_flags & OPf_KIDS) && pj_yields_number(aTHX_ cUNOPo->op_first, allow_boolean);
+  }
+
+  map = PJ_OP_MAPPING(o);
+  if (map == NULL) {
+    /* String comparisons, run by calling their pp functions */
+    switch (o->op_type) {
+    case OP_SCMP:
+      return pj_is_callable_op(aTHX_ o);
+    case OP_SEQ:
+    case OP_SNE:
+    case OP_SLT:
+    case OP_SGT:
+    case OP_SLE:
+    case OP_SGE:
+      return allow_boolean && pj_is_callable_op(aTHX_ o);
+    default:
+      return 0;
+    }
+  }
+
+  if (pj_ast_op_flags[map->ast_optype] & PJ_ASTf_CONDITIONAL) {
+    /* The condition of a ternary isn't part of the result */
+    kid = cLOGOPo->op_first;
+    if (map->ast_optype == pj_listop_ternary)
+      kid = kid->op_sibling;
+    for (; kid; kid = kid->op_sibling) {
+      if (!pj_yields_number(aTHX_ kid, allow_boolean))
+        return 0;
+    }
+    return 1;
+  }
+
+  return allow_boolean || !(pj_ast_op_flags[map->ast_optype] & PJ_ASTf_BOOLEAN);
+}
+
+int
+pj_truth_is_numeric(pTHX_ OP *o)
+{
+  return pj_yields_number(aTHX_ o, 1);
+}
+
+int
+pj_yields_plain_number(pTHX_ OP *o)
+{
+  return pj_yields_number(aTHX_ o, 0);
+}
+
+/* AND/OR: the conditionally executed kids must be fine to execute eagerly */
+static int
+pj_check_conditional(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root)
+{
+  PERL_UNUSED_ARG(map);
+  PERL_UNUSED_ARG(as_root);
+  return pj_conditional_kids_are_pure(aTHX_ o);
+}
+
+/* A ternary is a candidate for replacement if it produces a single
+ * number. Within a larger tree, the parent OP takes care of that. */
+/* FIXME "$x < 0 ? 0 : $x" isn't covered since perl would return $x
+ *       as is. We'd need to return which variable to push instead. */
+static int
+pj_check_cond_expr(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root)
+{
+  if (!pj_check_conditional(aTHX_ o, map, as_root))
+    return 0;
+  if (as_root)
+    return (o->op_flags & OPf_WANT) == OPf_WANT_SCALAR && pj_yields_number(aTHX_ o, 0);
+  return 1;
+}
+
+/* A rand() root would have to be kept as the JIT OP's first kid */
+static int
+pj_check_rand(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root)
+{
+  PERL_UNUSED_ARG(map);
+  PERL_UNUSED_CONTEXT;
+
+  return !as_root || (o->op_flags & OPf_KIDS);
+}
+
+/* Whether the OP is certain to yield a number when run. Variables may
+ * hold strings, so only constants and OPs that we JIT qualify. */
+static int
+pj_is_numeric_operand(pTHX_ OP *o)
+{
+  if (o->op_type == OP_NULL)
+    return (o->op_flags & OPf_KIDS) && pj_is_numeric_operand(aTHX_ cUNOPo->op_first);
+  if (o->op_type != OP_CONST && pj_op_mapping_checked(aTHX_ o, 0) == NULL)
+    return 0;
+  return pj_yields_number(aTHX_ o, 1);
+}
+
+/* &, |, ^ and ~ do string operations unless an operand (the operand,
+ * for ~) is a number, see pp_bit_and and pp_complement */
+static int
+pj_check_numeric_bitop(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root)
+{
+  OP *kid;
+
+  PERL_UNUSED_ARG(map);
+  PERL_UNUSED_ARG(as_root);
+
+  for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling) {
+    if (pj_is_numeric_operand(aTHX_ kid))
+      return 1;
+  }
+  return 0;
+}
+
+
+pj_term_t *
+pj_op_mapping_make_term(pTHX_ OP *o, const pj_op_mapping_t *map,
+                        pj_term_t **kid_terms, unsigned int nkids)
+{
+  unsigned int i;
+
+  assert(nkids == map->nkids);
+
+  /* "use integer" OPs work on the operands' IVs */
+  if (map->operand_type == pj_int_type) {
+    for (i = 0; i < nkids; ++i)
+      kid_terms[i] = pj_make_unop(pj_unop_iv, kid_terms[i]);
+  }
+  else if (map->flags & PJ_OPMf_INTEGER_OPERANDS) {
+    const pj_op_type conv = (o->op_private & OPpUSEINT ? pj_unop_iv : pj_unop_uv);
+    for (i = 0; i < nkids; ++i)
+      kid_terms[i] = pj_make_unop(conv, kid_terms[i]);
+  }
+
+  switch (nkids) {
+  case 1:
+    return pj_make_unop(map->ast_optype, kid_terms[0]);
+  case 2:
+    return pj_make_binop(map->ast_optype, kid_terms[0], kid_terms[1]);
+  default:
+    /* List op operands are linked via their op_sibling */
+    for (i = 0; i+1 < nkids; ++i)
+      kid_terms[i]->op_sibling = kid_terms[i+1];
+    return pj_make_listop(map->ast_optype, kid_terms[0], kid_terms[nkids-1]);
+  }
+}
+
+pj_term_t *
+pj_make_const_term(pTHX_ SV *sv)
+{
+  if (SvIOK(sv) && !SvNOK(sv) && !SvPOK(sv)) {
+    if (SvIsUV(sv))
+      return pj_make_const_uint((uint64_t)SvUVX(sv));
+    return pj_make_const_int((int64_t)SvIVX(sv));
+  }
+  return pj_make_const_dbl(SvNV(sv));
+}
+
+const pj_op_mapping_t *
+pj_custom_op_mapping(pTHX_ const OP *o)
+{
+  if (pj_custom_op_map == NULL)
+    return NULL;
+  return (const pj_op_mapping_t *)PTABLE_fetch(pj_custom_op_map, (void *)o->op_ppaddr);
+}
+
+const pj_op_mapping_t *
+pj_op_mapping_checked(pTHX_ OP *o, int as_root)
+{
+  const pj_op_mapping_t *map = PJ_OP_MAPPING(o);
+
+  if (map == NULL)
+    return NULL;
+  if (as_root && !(map->flags & PJ_OPMf_ROOT))
+    return NULL;
+  if (map->check != NULL && !map->check(aTHX_ o, map, as_root))
+    return NULL;
+  return map;
+}
+
+void
+pj_register_op_mapping(pTHX_ OPCODE optype, const pj_op_mapping_t *map)
+{
+  PERL_UNUSED_CONTEXT;
+  if (optype >= MAXO || optype == OP_CUSTOM)
+    croak("Can't register JIT mapping for OP type %i", (int)optype);
+  if (map != NULL && (map->nkids < 1 || map->nkids > 3))
+    croak("Can't register JIT mapping with %u kids", map->nkids);
+  pj_op_map[optype] = map;
+}
+
+void
+pj_register_custom_op_mapping(pTHX_ Perl_ppaddr_t ppaddr, const pj_op_mapping_t *map)
+{
+  PERL_UNUSED_CONTEXT;
+  if (map != NULL && (map->nkids < 1 || map->nkids > 3))
+    croak("Can't register JIT mapping with %u kids", map->nkids);
+  if (pj_custom_op_map == NULL)
+    pj_custom_op_map = PTABLE_new();
+
+  if (map == NULL)
+    PTABLE_delete(pj_custom_op_map, (void *)ppaddr);
+  else
+    PTABLE_store(pj_custom_op_map, (void *)ppaddr, (void *)map);
+}
+
+void
+pj_init_op_map(pTHX)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(pj_core_op_map) / sizeof(pj_core_op_map[0]); ++i)
+    pj_register_op_mapping(aTHX_ pj_core_op_map[i].optype, pj_core_op_map[i].map);
+
+  /* Let other XS modules extend the mapping without linking against us */
+  (void)hv_stores(PL_modglobal, "Perl::JIT::register_op_mapping",
+                  newSViv(PTR2IV(pj_register_op_mapping)));
+  (void)hv_stores(PL_modglobal, "Perl::JIT::register_custom_op_mapping",
+                  newSViv(PTR2IV(pj_register_custom_op_mapping)));
+}
+
+void
+pj_free_op_map(pTHX)
+{
+  PERL_UNUSED_CONTEXT;
+  if (pj_custom_op_map != NULL) {
+    PTABLE_free(pj_custom_op_map);
+    pj_custom_op_map = NULL;
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef PJ_OP_MAP_H_
+#define PJ_OP_MAP_H_
+
+/* Registry of the Perl OPs that can be represented in the AST.
+ * Used by both candidate detection and AST building in pj_optree.
+ * Core OPs are looked up by opcode, custom OPs by their ppaddr. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "pj_ast_terms.h"
+
+typedef struct pj_op_mapping pj_op_mapping_t;
+
+/* Per-OP semantic check on top of the OP type. Returns non-zero if the
+ * OP can be JIT'd. as_root is true if the OP would be the root of the
+ * JIT candidate, false if it's part of a larger tree. */
+typedef int (*pj_op_check_t)(pTHX_ OP *o, const pj_op_mapping_t *map, int as_root);
+
+struct pj_op_mapping {
+  pj_op_type ast_optype;      /* the AST op to emit */
+  unsigned int nkids;         /* number of kids yielding a value (1-3), not counting pushmarks */
+  unsigned int flags;         /* PJ_OPMf_* */
+  pj_basic_type operand_type; /* pj_int_type truncates all kids to IVs ("use integer") */
+  pj_op_check_t check;        /* optional, may be NULL */
+};
+
+/* The OP may be the root of a JIT candidate. Otherwise, it will only
+ * be JIT'd as part of a larger tree. */
+#define PJ_OPMf_ROOT (1<<0)
+/* The last kid may be omitted, it then reads as undef, ie. 0 */
+#define PJ_OPMf_OPTIONAL_KID (1<<1)
+/* The OP has a side effect (rand advancing the generator), so it must
+ * not be reordered with other OPs that may have side effects. */
+#define PJ_OPMf_SIDE_EFFECT (1<<2)
+/* The OP works on its operands' UVs, or their IVs if it has OPpUSEINT
+ * set (use integer). For the bitwise OPs and shifts. */
+#define PJ_OPMf_INTEGER_OPERANDS (1<<3)
+
+/* Lookup tables, don't use directly */
+extern const pj_op_mapping_t *pj_op_map[MAXO];
+const pj_op_mapping_t *pj_custom_op_mapping(pTHX_ const OP *o);
+
+/* Returns the mapping for the OP or NULL if it can't be represented in
+ * the AST. Doesn't run the semantic check. */
+#define PJ_OP_MAPPING(o) \
+  ((o)->op_type == OP_CUSTOM ? pj_custom_op_mapping(aTHX_ (o)) : pj_op_map[(o)->op_type])
+
+/* Look up the mapping and run the semantic check, if any */
+const pj_op_mapping_t *pj_op_mapping_checked(pTHX_ OP *o, int as_root);
+
+/* Build the AST op for the OP o with the given mapping from its (nkids)
+ * operand terms */
+pj_term_t *pj_op_mapping_make_term(pTHX_ OP *o, const pj_op_mapping_t *map,
+                                   pj_term_t **kid_terms, unsigned int nkids);
+
+/* Build the AST constant for the value of an OP_CONST: integers
+ * stay IVs or UVs, anything else is an NV */
+pj_term_t *pj_make_const_term(pTHX_ SV *sv);
+
+/* Whether JIT'ing the OP tree as a whole would change the order of side
+ * effects: if some OP with PJ_OPMf_SIDE_EFFECT would end up in the AST
+ * while others that'd be run as subtrees (before the JIT OP) may have
+ * side effects, too. */
+int pj_jit_would_reorder(pTHX_ OP *o);
+
+/* Whether some OP with PJ_OPMf_SIDE_EFFECT would end up in the AST
+ * built from the OP tree (rather than in a subtree) */
+int pj_has_side_effect_op(pTHX_ OP *o);
+
+/* Whether the core OP can be run from JIT code by calling its pp
+ * function, see the opcall term: a pure function of one or two scalar
+ * operands (one perl would constant-fold) that doesn't assign to
+ * anything. */
+int pj_is_callable_op(pTHX_ OP *o);
+
+/* Whether the OP tree can be evaluated without side effects */
+int pj_is_pure_op_tree(pTHX_ OP *o);
+
+/* Whether the kids of a conditional OP that aren't always executed
+ * are safe to evaluate eagerly */
+int pj_conditional_kids_are_pure(pTHX_ OP *o);
+
+/* Whether testing the truth of the OP tree's value is the same as
+ * testing the NV the JIT'd AST yields for being non-zero. Not so for
+ * variables: "0.0" is true. */
+int pj_truth_is_numeric(pTHX_ OP *o);
+
+/* Whether the NV the JIT'd AST yields is exactly what Perl would have
+ * returned for the OP tree. */
+int pj_yields_plain_number(pTHX_ OP *o);
+
+/* Set up the core OP mappings */
+void pj_init_op_map(pTHX);
+void pj_free_op_map(pTHX);
+
+/* Add or replace the mapping of a core OP type or a custom OP.
+ * The mapping struct isn't copied and must outlive the interpreter.
+ * Passing NULL removes the mapping.
+ * XS extensions can find these as IV-wrapped function pointers in
+ * PL_modglobal under the keys "Perl::JIT::register_op_mapping" and
+ * "Perl::JIT::register_custom_op_mapping". */
+void pj_register_op_mapping(pTHX_ OPCODE optype, const pj_op_mapping_t *map);
+void pj_register_custom_op_mapping(pTHX_ Perl_ppaddr_t ppaddr, const pj_op_mapping_t *map);
+
+#endif
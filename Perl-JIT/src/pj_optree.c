@@ -1,6 +1,7 @@
 #include "pj_optree.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <assert.h>
 
 #include "ppport.h"
 #include "pj_debug.h"
@@ -8,31 +9,18 @@
 
 #include "pj_ast_terms.h"
 #include "pj_ast_jit.h"
+#include "pj_ast_walkers.h"
+#include "pj_op_map.h"
+#include "pj_native_sub.h"
+#include "pj_concat.h"
+#include "pj_deref.h"
+#include "pj_sort.h"
+#include "pj_reduce.h"
+#include "pj_intrinsics.h"
 
 #include "pj_jit_op.h"
 #include "pj_global_state.h"
 
-#define IS_JITTABLE_ROOT_OP_TYPE(otype) \
-        ( otype == OP_ADD || otype == OP_SUBTRACT || otype == OP_MULTIPLY || otype == OP_DIVIDE \
-          || otype == OP_SIN || otype == OP_COS || otype == OP_SQRT || otype == OP_EXP \
-          || otype == OP_LOG || otype == OP_POW || otype == OP_INT || otype == OP_NOT \
-          || otype == OP_LEFT_SHIFT || otype == OP_RIGHT_SHIFT /* || otype == OP_COMPLEMENT */ \
-          || otype == OP_EQ )
-
-/* AND and OR at top level can be used in "interesting" places such as looping constructs.
- * Thus, we'll -- for now -- only support them as OPs within a tree.
- * NULLs may need to be skipped occasionally, so we do something similar.
- * PADSVs are recognized as subtrees now, so no use making them jittable root OP.
- * CONSTs would be further constant folded if they were a candidate root OP, so
- * no sense trying to JIT them if they're free-standing. */
-#define IS_JITTABLE_OP_TYPE(otype) \
-        (IS_JITTABLE_ROOT_OP_TYPE(otype) \
-          || otype == OP_PADSV \
-          || otype == OP_CONST \
-          || otype == OP_AND \
-          || otype == OP_OR \
-          || otype == OP_NULL )
-
 /* Scan a section of the OP tree and find whichever OP is
  * going to be executed first. This is done by doing pure
  * left-hugging depth-first traversal. Ignores op_next. */
@@ -56,124 +44,618 @@ pj_find_first_executed_op(pTHX_ OP *o)
   abort(); /* not reached */
 }
 
+/* Calls with more args than this aren't inlined */
+#define PJ_MAX_INLINE_ARGS 20
+
+static pj_term_t *pj_build_ast(pTHX_ OP *o, ptrstack_t **subtrees, unsigned int *nvariables);
+static pj_term_t *pj_build_ast_kid(pTHX_ OP *kid, OP *parent, ptrstack_t **subtrees, unsigned int *nvariables);
+
+/* A leaf OP (CONST, PUSHMARK, ...) that would be executed first in the
+ * candidate subtree can't just be dropped since it's what the preceding
+ * OP's op_next points to. Keep it around as a no-op kid of the JIT OP instead. */
+static void
+pj_keep_leading_leaf(pTHX_ OP *kid, ptrstack_t **subtrees)
+{
+  if (ptrstack_empty(*subtrees)) {
+    PJ_DEBUG_1("%s is first-executed tree element, can't drop.\n", OP_NAME(kid));
+    kid->op_ppaddr = PL_ppaddr[OP_NULL]; /* FIXME hobo nulling not nice. Breaks incoming pointers for some reason otherwise. */
+    //Perl_op_null(aTHX_ kid);
+    ptrstack_push(*subtrees, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
+    ptrstack_push(*subtrees, kid);
+  }
+  else {
+    PJ_DEBUG_1("%s being dropped/inlined.\n", OP_NAME(kid));
+  }
+}
+
+/* Skip compiled-out pushmarks and the like in a list of kids */
+PJ_STATIC_INLINE OP *
+pj_skip_null_kids(OP *o)
+{
+  while (o != NULL && o->op_type == OP_NULL && !(o->op_flags & OPf_KIDS))
+    o = o->op_sibling;
+  return o;
+}
+
+/* Parse an unpack template that yields a single fixed-size element,
+ * such as "d", "d<", "N" or "q>". Returns 0 if it's not one of those. */
+static int
+pj_parse_unpack_template(const char *pat, STRLEN len, pj_pvload_elem_type *type, unsigned int *flags)
+{
+  const char *end = pat + len;
+  int native_only = 0;
+
+  *flags = 0;
+  if (len == 0)
+    return 0;
+
+  switch (*pat) {
+  case 'c': *type = pj_pvload_int8; native_only = 1; break;
+  case 'C': *type = pj_pvload_uint8; native_only = 1; break;
+  case 's': *type = pj_pvload_int16; break;
+  case 'S': *type = pj_pvload_uint16; break;
+  case 'l': *type = pj_pvload_int32; break;
+  case 'L': *type = pj_pvload_uint32; break;
+  case 'q': *type = pj_pvload_int64; break;
+  case 'Q': *type = pj_pvload_uint64; break;
+  case 'j': *type = (IVSIZE == 8 ? pj_pvload_int64 : pj_pvload_int32); break;
+  case 'J': *type = (UVSIZE == 8 ? pj_pvload_uint64 : pj_pvload_uint32); break;
+  case 'f': *type = pj_pvload_float; break;
+  case 'd': *type = pj_pvload_double; break;
+  case 'n': *type = pj_pvload_uint16; *flags = PJ_PVLOADf_BIG_ENDIAN; native_only = 1; break;
+  case 'N': *type = pj_pvload_uint32; *flags = PJ_PVLOADf_BIG_ENDIAN; native_only = 1; break;
+  case 'v': *type = pj_pvload_uint16; *flags = PJ_PVLOADf_LITTLE_ENDIAN; native_only = 1; break;
+  case 'V': *type = pj_pvload_uint32; *flags = PJ_PVLOADf_LITTLE_ENDIAN; native_only = 1; break;
+  default:
+    return 0;
+  }
+  ++pat;
+
+  /* n!, N!, v! and V! are the signed variants */
+  if (pat < end && *pat == '!' && native_only && *flags != 0) {
+    *type = (*type == pj_pvload_uint16 ? pj_pvload_int16 : pj_pvload_int32);
+    ++pat;
+  }
+
+  if (pat < end && (*pat == '<' || *pat == '>')) {
+    if (native_only)
+      return 0;
+    *flags = (*pat == '<' ? PJ_PVLOADf_LITTLE_ENDIAN : PJ_PVLOADf_BIG_ENDIAN);
+    ++pat;
+  }
+
+  /* "d*" in scalar context yields the first element, too */
+  if (pat < end && (*pat == '*' || *pat == '1'))
+    ++pat;
+
+  return pat == end;
+}
+
+/* Recognize scalar-context reads of a single element from a string:
+ *   unpack(TEMPLATE, $buf)
+ *   unpack(TEMPLATE, substr($buf, OFFSET))
+ *   unpack(TEMPLATE, substr($buf, OFFSET, CONSTLEN))
+ *   vec($buf, OFFSET, 8/16/32/64)
+ * If the OP matches, returns the OP that evaluates the buffer and
+ * sets the remaining output parameters. offsetop may be NULL for
+ * an offset of zero. The template CONST is returned in tmplop if
+ * there is one. */
+static OP *
+pj_match_pvload(pTHX_ OP *o, pj_pvload_elem_type *type, unsigned int *flags,
+                unsigned int *scale, unsigned int *sublen, OP **offsetop, OP **tmplop)
+{
+  OP *kid, *bufop;
+  SV *sv;
+
+  if ((o->op_flags & OPf_WANT) != OPf_WANT_SCALAR || (o->op_flags & OPf_MOD)
+      || !(o->op_flags & OPf_KIDS))
+    return NULL;
+
+  *offsetop = NULL;
+  *tmplop = NULL;
+  *sublen = 0;
+
+  if (o->op_type == OP_VEC) {
+    UV bits;
+
+    bufop = pj_skip_null_kids(cLISTOPo->op_first);
+    if (bufop == NULL || (*offsetop = bufop->op_sibling) == NULL)
+      return NULL;
+    kid = (*offsetop)->op_sibling;
+    if (kid == NULL || kid->op_type != OP_CONST || kid->op_sibling != NULL)
+      return NULL;
+
+    sv = cSVOPx_sv(kid);
+    if (!SvIOK(sv))
+      return NULL;
+    bits = SvUV(sv);
+    /* Sub-byte vec() isn't worth it */
+    switch (bits) {
+    case 8:  *type = pj_pvload_uint8; break;
+    case 16: *type = pj_pvload_uint16; break;
+    case 32: *type = pj_pvload_uint32; break;
+    case 64: *type = pj_pvload_uint64; break;
+    default:
+      return NULL;
+    }
+    *flags = PJ_PVLOADf_BIG_ENDIAN | PJ_PVLOADf_ZERO_PAD;
+    *scale = bits / 8;
+    return bufop;
+  }
+  else if (o->op_type == OP_UNPACK) {
+    const char *pat;
+    STRLEN len;
+
+    kid = pj_skip_null_kids(cLISTOPo->op_first);
+    if (kid == NULL || kid->op_type != OP_CONST)
+      return NULL;
+    sv = cSVOPx_sv(kid);
+    if (!SvPOK(sv) || SvUTF8(sv))
+      return NULL;
+    pat = SvPV_const(sv, len);
+    if (!pj_parse_unpack_template(pat, len, type, flags))
+      return NULL;
+    *tmplop = kid;
+    *scale = 1;
+
+    bufop = kid->op_sibling;
+    if (bufop == NULL || bufop->op_sibling != NULL)
+      return NULL;
+
+    if (bufop->op_type == OP_SUBSTR && (bufop->op_flags & OPf_KIDS)
+        && !(bufop->op_flags & OPf_MOD))
+    {
+      OP *lenop;
+      kid = pj_skip_null_kids(cLISTOPx(bufop)->op_first);
+      if (kid == NULL || (*offsetop = kid->op_sibling) == NULL)
+        return NULL;
+      lenop = (*offsetop)->op_sibling;
+      if (lenop != NULL) {
+        /* A substring shorter than the element would never yield anything */
+        if (lenop->op_type != OP_CONST || lenop->op_sibling != NULL)
+          return NULL;
+        sv = cSVOPx_sv(lenop);
+        if (!SvIOK(sv) || SvIV(sv) < (IV)pj_pvload_elem_size(*type)
+            || SvIV(sv) > I32_MAX)
+          return NULL;
+        *sublen = (unsigned int)SvIV(sv);
+      }
+      *flags |= PJ_PVLOADf_NEG_FROM_END;
+      bufop = kid;
+    }
+    return bufop;
+  }
+
+  return NULL;
+}
+
+/* Builds the AST for a string buffer load matched by pj_match_pvload.
+ * The buffer is passed in as a (dummy) variable whose run-time value
+ * is fetched as a string by the JIT OP. */
+static pj_term_t *
+pj_build_pvload(pTHX_ OP *o, OP *bufop, OP *offsetop, OP *tmplop,
+                pj_pvload_elem_type type, unsigned int flags, unsigned int scale,
+                unsigned int sublen, ptrstack_t **subtrees, unsigned int *nvariables)
+{
+  pj_term_t *buffer, *offset;
+  pj_pvload_t *pl;
+
+  if (tmplop != NULL)
+    pj_keep_leading_leaf(aTHX_ tmplop, subtrees);
+
+  if (bufop->op_type != OP_PADSV)
+    pj_find_jit_candidate(aTHX_ bufop, o);
+  buffer = pj_make_variable((*nvariables)++, pj_double_type);
+  PJ_DEBUG("String buffer being added to subtrees.\n");
+  ptrstack_push(*subtrees, pj_double_type); /* FIXME a "string" type would be more honest */
+  ptrstack_push(*subtrees, bufop);
+
+  if (offsetop == NULL)
+    offset = pj_make_const_dbl(0.);
+  else
+    offset = pj_build_ast_kid(aTHX_ offsetop, o, subtrees, nvariables);
+
+  pl = (pj_pvload_t *)pj_make_pvload(type, flags, buffer, offset, scale);
+  pl->sublen = sublen;
+  return (pj_term_t *)pl;
+}
+
+/* $lexical->{CONSTANT} as an rvalue. Only under "strict refs" since
+ * the record's symbolic references aren't resolved. Returns the PADSV
+ * OP of the lexical and the key, NULL if it's something else. */
+static OP *
+pj_match_fieldload(pTHX_ OP *o, SV **keysv)
+{
+  OP *rv2hv, *padsv, *keyop;
+
+  if (o->op_type != OP_HELEM || (o->op_flags & OPf_MOD)
+      || (o->op_private & (OPpLVAL_INTRO|OPpLVAL_DEFER|OPpMAYBE_LVSUB|OPpDEREF)))
+  {
+    return NULL;
+  }
+
+  /* ck_rvconst puts the strict refs hint into op_private */
+  rv2hv = cBINOPo->op_first;
+  if (rv2hv->op_type != OP_RV2HV || !(rv2hv->op_flags & OPf_KIDS)
+      || !(rv2hv->op_private & HINT_STRICT_REFS))
+  {
+    return NULL;
+  }
+
+  padsv = cUNOPx(rv2hv)->op_first;
+  keyop = rv2hv->op_sibling;
+  if (padsv->op_type != OP_PADSV || (padsv->op_private & OPpLVAL_INTRO)
+      || keyop == NULL || keyop->op_type != OP_CONST || SvROK(cSVOPx_sv(keyop)))
+  {
+    return NULL;
+  }
+
+  *keysv = cSVOPx_sv(keyop);
+  return padsv;
+}
+
+/* The hash reference is passed like any lexical, the JIT OP publishes
+ * the HV for the generated code to do the lookup in */
+static pj_term_t *
+pj_build_fieldload(pTHX_ OP *recordop, SV *keysv, ptrstack_t **subtrees, unsigned int *nvariables)
+{
+  pj_term_t *record = pj_make_variable((*nvariables)++, pj_double_type);
+
+  PJ_DEBUG("Hash reference being added to subtrees.\n");
+  ptrstack_push(*subtrees, pj_double_type); /* FIXME a "record" type would be more honest */
+  ptrstack_push(*subtrees, recordop);
+
+  /* FIXME the key leaks if compilation doesn't get as far as
+   *       pj_jitop_setup_params */
+  return pj_make_fieldload(record, (void *)pj_make_hv_field(aTHX_ keysv), pj_hv_field_nv);
+}
+
+/* The rv2av of an rvalue aelem, if that's under "strict refs" */
+static OP *
+pj_match_aelem_rv2av(pTHX_ OP *o, U8 deref)
+{
+  OP *rv2av;
+
+  if (o->op_type != OP_AELEM || (o->op_flags & OPf_MOD)
+      || (o->op_private & (OPpLVAL_INTRO|OPpLVAL_DEFER|OPpMAYBE_LVSUB|OPpDEREF)) != deref)
+  {
+    return NULL;
+  }
+
+  rv2av = cBINOPo->op_first;
+  if (rv2av->op_type != OP_RV2AV || !(rv2av->op_flags & OPf_KIDS)
+      || !(rv2av->op_private & HINT_STRICT_REFS) || rv2av->op_sibling == NULL)
+  {
+    return NULL;
+  }
+  return rv2av;
+}
+
+/* $lexical->[EXPR] or $lexical->[EXPR1][EXPR2] as an rvalue, under
+ * "strict refs" like fieldload. Returns the PADSV OP of the lexical
+ * and the index OPs (*index2op is NULL for the 1-D form), NULL if
+ * it's something else. */
+static OP *
+pj_match_elemload(pTHX_ OP *o, OP **indexop, OP **index2op)
+{
+  OP *rv2av, *padsv;
+
+  if ((rv2av = pj_match_aelem_rv2av(aTHX_ o, 0)) == NULL)
+    return NULL;
+
+  padsv = cUNOPx(rv2av)->op_first;
+  if (padsv->op_type == OP_AELEM) {
+    /* The row: its own aelem, autovivifying */
+    *index2op = rv2av->op_sibling;
+    if ((rv2av = pj_match_aelem_rv2av(aTHX_ padsv, OPpDEREF_AV)) == NULL)
+      return NULL;
+    padsv = cUNOPx(rv2av)->op_first;
+  }
+  else {
+    *index2op = NULL;
+  }
+  *indexop = rv2av->op_sibling;
+
+  if (padsv->op_type != OP_PADSV || (padsv->op_private & OPpLVAL_INTRO))
+    return NULL;
+  return padsv;
+}
+
+/* Like fieldload, the array reference is passed as a lexical and the
+ * JIT OP publishes the AV. The indexes are ordinary terms. */
+static pj_term_t *
+pj_build_elemload(pTHX_ OP *o, OP *arrayop, OP *indexop, OP *index2op,
+                  ptrstack_t **subtrees, unsigned int *nvariables)
+{
+  pj_term_t *array = pj_make_variable((*nvariables)++, pj_double_type);
+  pj_term_t *index, *index2 = NULL;
+  OP *rowop = (index2op != NULL ? cUNOPx(cBINOPo->op_first)->op_first : o);
+
+  PJ_DEBUG("Array reference being added to subtrees.\n");
+  ptrstack_push(*subtrees, pj_double_type); /* FIXME a "record" type would be more honest */
+  ptrstack_push(*subtrees, arrayop);
+
+  /* In execution order, so the subtrees are too */
+  index = pj_build_ast_kid(aTHX_ indexop, rowop, subtrees, nvariables);
+  if (index2op != NULL)
+    index2 = pj_build_ast_kid(aTHX_ index2op, o, subtrees, nvariables);
+
+  return pj_make_elemload(array, index, index2,
+                          index2 != NULL ? pj_av_elem2_nv : pj_av_elem_nv);
+}
+
+/* Calls to natively compiled subs get the sub's body inlined, with the
+ * args substituted for the params. Calls to well-known XS functions
+ * become the equivalent AST op. Either way, the JIT'd code checks that
+ * the sub hasn't been redefined and makes a real call otherwise. */
+static pj_term_t *
+pj_build_inline_call(pTHX_ OP *o, ptrstack_t **subtrees, unsigned int *nvariables)
+{
+  const pj_intrinsic_t *intrinsic = NULL;
+  pj_native_sub_t *ns;
+  GV *gv;
+  CV *cv;
+  OP *first, *kid;
+  OP *argops[PJ_MAX_INLINE_ARGS];
+  pj_term_t *argv[PJ_MAX_INLINE_ARGS];
+  pj_term_t *body;
+  unsigned int nargs = 0, i;
+
+  cv = pj_call_target_cv(aTHX_ o, &gv);
+  if (cv == NULL)
+    return NULL;
+  if ((ns = pj_native_sub_for_cv(aTHX_ cv)) != NULL) {
+    if (!pj_native_sub_can_inline(ns))
+      return NULL;
+  }
+  else if ((intrinsic = pj_find_intrinsic(aTHX_ cv)) == NULL) {
+    return NULL;
+  }
+
+  /* pushmark, args..., ex-rv2cv. Possibly wrapped in an ex-list. */
+  first = cUNOPo->op_first;
+  if (first->op_sibling == NULL && (first->op_flags & OPf_KIDS))
+    first = cUNOPx(first)->op_first;
+
+  /* Check the args before touching anything */
+  for (kid = first; kid->op_sibling != NULL; kid = kid->op_sibling) {
+    if (kid->op_type == OP_PUSHMARK
+        || (kid->op_type == OP_NULL && !(kid->op_flags & OPf_KIDS)))
+      continue;
+    if ((kid->op_flags & OPf_WANT) != OPf_WANT_SCALAR)
+      return NULL; /* may flatten into any number of args */
+    if (nargs == PJ_MAX_INLINE_ARGS)
+      return NULL;
+    argops[nargs++] = kid;
+  }
+  if (ns != NULL ? nargs != ns->nparams
+                 : (intrinsic->nargs < 0 ? nargs == 0 : nargs != (unsigned int)intrinsic->nargs))
+    return NULL;
+  if (ns != NULL && !pj_native_sub_can_inline_args(aTHX_ ns, argops))
+    return NULL;
+
+  PJ_DEBUG_1("Inlining call with %u args\n", nargs);
+  i = 0;
+  for (kid = first; kid->op_sibling != NULL; kid = kid->op_sibling) {
+    pj_term_t *term = pj_build_ast_kid(aTHX_ kid, o, subtrees, nvariables);
+    if (term == NULL)
+      continue;
+    if (i > 0)
+      argv[i-1]->op_sibling = term;
+    argv[i++] = term;
+  }
+  assert(i == nargs);
+
+  if (ns != NULL)
+    body = pj_clone_tree(ns->ast, argv);
+  else
+    body = pj_make_intrinsic_term(intrinsic, argv, nargs);
+
+  return pj_make_guarded_call(aTHX_ gv, cv, (ns != NULL ? ns->root : NULL),
+                              body, argv[0], nargs);
+}
+
+/* A kid of an opcall that is pushed as it is */
+PJ_STATIC_INLINE int
+pj_is_plain_sv_op(pTHX_ OP *o)
+{
+  PERL_UNUSED_CONTEXT;
+  return o->op_type == OP_CONST
+         || (o->op_type == OP_PADSV && !(o->op_flags & OPf_MOD)
+             && !(o->op_private & (OPpLVAL_INTRO|OPpDEREF)));
+}
+
+/* For an OP the AST can't represent, but that can be run from the JIT
+ * code (see pj_is_callable_op): builds an opcall term if its kids are
+ * lexicals or constants, which are pushed as they are, or numeric OPs,
+ * which are computed natively. Returns NULL otherwise. */
+static pj_term_t *
+pj_build_opcall(pTHX_ OP *o, ptrstack_t **subtrees, unsigned int *nvariables)
+{
+  OP *kids[PJ_OPCALL_MAX_KIDS];
+  pj_term_t *args = NULL, *lastarg = NULL, *term;
+  pj_opcall_op_t *c;
+  unsigned int nkids = 0, nargs = 0, i;
+  OP *kid;
+
+  if (!pj_is_callable_op(aTHX_ o))
+    return NULL;
+
+  /* Nothing must have been added to the subtrees if we bail out */
+  for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling) {
+    OP *k = kid;
+    while (k->op_type == OP_NULL && (k->op_flags & OPf_KIDS)
+           && cUNOPx(k)->op_first->op_sibling == NULL)
+    {
+      k = cUNOPx(k)->op_first;
+    }
+    if (!pj_is_plain_sv_op(aTHX_ k) && pj_op_mapping_checked(aTHX_ k, 0) == NULL)
+      return NULL;
+    kids[nkids++] = k;
+  }
+
+  c = pj_make_opcall_op(aTHX_ o);
+  c->nkids = nkids;
+  for (i = 0; i < nkids; ++i) {
+    if (kids[i]->op_type == OP_PADSV) {
+      pj_keep_leading_leaf(aTHX_ kids[i], subtrees);
+      c->kids[i].kind = pj_opcall_kid_padsv;
+      c->kids[i].padix = kids[i]->op_targ;
+    }
+    else if (kids[i]->op_type == OP_CONST) {
+      pj_keep_leading_leaf(aTHX_ kids[i], subtrees);
+      c->kids[i].kind = pj_opcall_kid_const;
+      c->kids[i].constop = kids[i];
+    }
+    else {
+      term = pj_build_ast(aTHX_ kids[i], subtrees, nvariables);
+      if (lastarg == NULL)
+        args = term;
+      else
+        lastarg->op_sibling = term;
+      lastarg = term;
+      ++nargs;
+      c->kids[i].kind = pj_opcall_kid_native;
+      c->kids[i].sv = newSV(0);
+    }
+  }
+
+  return pj_make_opcall(args, nargs, c, pj_opcall_nv);
+}
+
+/* Builds the AST term for a single OP that is the kid of parent. Kids
+ * that can't be represented in the AST are scanned for separate JIT
+ * candidates and turned into variables, that is: subtrees to be executed
+ * before the JIT OP. Returns NULL for kids that don't produce a value
+ * (PUSHMARK or compiled-out OPs). */
+static pj_term_t *
+pj_build_ast_kid(pTHX_ OP *kid, OP *parent, ptrstack_t **subtrees, unsigned int *nvariables)
+{
+  const unsigned int otype = kid->op_type;
+  pj_term_t *term;
+  pj_pvload_elem_type pvtype;
+  unsigned int pvflags, pvscale, pvsublen;
+  OP *bufop, *offsetop, *tmplop, *recordop, *indexop, *index2op;
+  SV *keysv;
+
+  PJ_DEBUG_1("pj_build_ast_kid considering kid type %s\n", OP_NAME(kid));
+
+  if (otype == OP_CONST) {
+    pj_keep_leading_leaf(aTHX_ kid, subtrees);
+    term = pj_make_const_term(aTHX_ cSVOPx_sv(kid));
+  }
+  else if (otype == OP_PUSHMARK) {
+    pj_keep_leading_leaf(aTHX_ kid, subtrees);
+    term = NULL;
+  }
+  else if (otype == OP_PADSV) {
+    term = pj_make_variable((*nvariables)++, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
+    PJ_DEBUG("PADSV being added to subtrees.\n");
+    ptrstack_push(*subtrees, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
+    ptrstack_push(*subtrees, kid);
+  }
+  else if (otype == OP_NULL) {
+    /* compiled out -- FIXME most certainly not correct, in particular for incoming op_next */
+    if (kid->op_flags & OPf_KIDS) {
+      /* FIXME Only looking at first kid -- is that a limitation on OP_NULL? */
+      term = pj_build_ast_kid(aTHX_ ((UNOP*)kid)->op_first, kid, subtrees, nvariables);
+    } else {
+      /* ex-pushmark and similar */
+      pj_keep_leading_leaf(aTHX_ kid, subtrees);
+      term = NULL;
+    }
+  }
+  else if (pj_op_mapping_checked(aTHX_ kid, 0) != NULL) {
+    term = pj_build_ast(aTHX_ kid, subtrees, nvariables);
+  }
+  else if ((bufop = pj_match_pvload(aTHX_ kid, &pvtype, &pvflags, &pvscale, &pvsublen, &offsetop, &tmplop)) != NULL) {
+    PJ_DEBUG_1("Reading from string buffer directly (%s)\n", OP_NAME(kid));
+    term = pj_build_pvload(aTHX_ kid, bufop, offsetop, tmplop,
+                           pvtype, pvflags, pvscale, pvsublen, subtrees, nvariables);
+  }
+  else if ((recordop = pj_match_fieldload(aTHX_ kid, &keysv)) != NULL) {
+    PJ_DEBUG_1("Loading hash element directly (%s)\n", OP_NAME(kid));
+    term = pj_build_fieldload(aTHX_ recordop, keysv, subtrees, nvariables);
+  }
+  else if ((recordop = pj_match_elemload(aTHX_ kid, &indexop, &index2op)) != NULL) {
+    PJ_DEBUG_1("Loading array element directly (%s)\n", OP_NAME(kid));
+    term = pj_build_elemload(aTHX_ kid, recordop, indexop, index2op, subtrees, nvariables);
+  }
+  else if (otype == OP_ENTERSUB
+           && (term = pj_build_inline_call(aTHX_ kid, subtrees, nvariables)) != NULL)
+  {
+    /* done */
+  }
+  else if ((term = pj_build_opcall(aTHX_ kid, subtrees, nvariables)) != NULL) {
+    PJ_DEBUG_1("Calling pp function from JIT code (%s)\n", OP_NAME(kid));
+  }
+  else {
+    /* Can't represent OP with AST. So instead,
+     * recursively scan for separate candidates and
+     * treat as subtree. */
+    PJ_DEBUG_1("Cannot represent this OP with AST. Emitting variable. (%s)", OP_NAME(kid));
+    pj_find_jit_candidate(aTHX_ kid, parent);
+    term = pj_make_variable((*nvariables)++, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
+
+    ptrstack_push(*subtrees, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
+    ptrstack_push(*subtrees, kid);
+  }
+
+  return term;
+}
+
 /* Walk OP tree recursively, build ASTs, build subtrees */
 static pj_term_t *
 pj_build_ast(pTHX_ OP *o, ptrstack_t **subtrees, unsigned int *nvariables)
 {
-  const unsigned int parent_otype = o->op_type;
+  const pj_op_mapping_t *map;
   pj_term_t *retval = NULL;
   OP *kid;
 
-  /* 2 is the maximum number of children that the supported
-   * OP types may have. Will change in future */
-  pj_term_t *kid_terms[2];
+  /* 3 is the maximum number of children that the supported
+   * OP types may have (COND_EXPR). Will change in future */
+  pj_term_t *kid_terms[3];
+  pj_term_t *term;
   unsigned int ikid = 0;
-  unsigned int i;
 
   PJ_DEBUG_2("pj_build_ast running on %s. Have %i subtrees right now.\n", OP_NAME(o), (int)(ptrstack_nelems(*subtrees)));
 
-  if (o && (o->op_flags & OPf_KIDS)) {
+  map = PJ_OP_MAPPING(o);
+  if (map == NULL) {
+    PJ_DEBUG_1("Shouldn't happen! Unsupported OP!? %s", OP_NAME(o));
+    abort();
+  }
+
+  if (o->op_flags & OPf_KIDS) {
     for (kid = ((UNOP*)o)->op_first; kid; kid = kid->op_sibling) {
       PJ_DEBUG_2("pj_build_ast considering kid (%u) type %s\n", ikid, OP_NAME(kid));
-
-      const unsigned int otype = kid->op_type;
-      if (otype == OP_CONST) {
-        if (ptrstack_empty(*subtrees)) {
-          PJ_DEBUG("CONST is first-executed tree element, can't inline.\n");
-          kid->op_ppaddr = PL_ppaddr[OP_NULL]; /* FIXME hobo nulling not nice. Breaks incoming pointers for some reason otherwise. */
-          //Perl_op_null(aTHX_ kid);
-          ptrstack_push(*subtrees, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
-          ptrstack_push(*subtrees, kid);
-        }
-        else {
-          PJ_DEBUG("CONST being inlined.\n");
-        }
-        kid_terms[ikid] = pj_make_const_dbl(SvNV(cSVOPx_sv(kid))); /* FIXME replace type by inferred type */
-      }
-      else if (otype == OP_PADSV) {
-        kid_terms[ikid] = pj_make_variable((*nvariables)++, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
-        PJ_DEBUG("PADSV being added to subtrees.\n");
-        ptrstack_push(*subtrees, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
-        ptrstack_push(*subtrees, kid);
-      }
-      else if (otype == OP_NULL) {
-        /* compiled out -- FIXME most certainly not correct, in particular for incoming op_next */
-        if (kid->op_flags & OPf_KIDS) {
-          /* FIXME Only looking at first kid -- is that a limitation on OP_NULL? */
-          kid_terms[ikid] = pj_build_ast(aTHX_ ((UNOP*)kid)->op_first, subtrees, nvariables);
-        } else {
-          PJ_DEBUG("Umm, unexpected OP_NULL");
-          abort();
-        }
-      }
-      else if (IS_JITTABLE_OP_TYPE(otype)) {
-        kid_terms[ikid] = pj_build_ast(aTHX_ kid, subtrees, nvariables);
-        if (kid_terms[ikid] == NULL) {
-          for (i = 0; i < ikid; ++i)
-            pj_free_tree(kid_terms[ikid]);
-          return NULL;
-        }
-      }
-      else {
-        /* Can't represent OP with AST. So instead,
-         * recursively scan for separate candidates and
-         * treat as subtree. */
-        PJ_DEBUG_1("Cannot represent this OP with AST. Emitting variable. (%s)", OP_NAME(kid));
-        pj_find_jit_candidate(aTHX_ kid, o); /* o is parent of kid */
-        kid_terms[ikid] = pj_make_variable((*nvariables)++, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
-
-        ptrstack_push(*subtrees, pj_double_type); /* FIXME replace pj_double_type with type that's imposed by the current OP */
-        ptrstack_push(*subtrees, kid);
+      term = pj_build_ast_kid(aTHX_ kid, o, subtrees, nvariables);
+      if (term == NULL) /* pushmark or similar */
+        continue;
+      if (ikid == 3) {
+        PJ_DEBUG_1("Shouldn't happen! Too many kids for %s", OP_NAME(o));
+        abort();
       }
-
-      ++ikid;
+      kid_terms[ikid++] = term;
     } /* end for kids */
+  } /* end if has kids */
+  else {
+    /* OP_PADSV and OP_CONST are handled in the caller as other OPs' kids.
+     * Anything else without kids is a leaf that may run first. */
+    pj_keep_leading_leaf(aTHX_ o, subtrees);
+  }
 
-    /* FIXME find a way of doing this that is less manual/verbose */
-    /* TODO modulo may have (very?) different behaviour in Perl than in C (or libjit or the platform...) */
-#define EMIT_BINOP_CODE(perl_op_type, pj_op_type) \
-    if (parent_otype == perl_op_type) { \
-      assert(ikid == 2); \
-      retval = pj_make_binop( pj_op_type, kid_terms[0], kid_terms[1] ); \
-    }
-#define EMIT_UNOP_CODE(perl_op_type, pj_op_type) \
-    if (parent_otype == perl_op_type) { \
-      assert(ikid == 1); \
-      retval = pj_make_unop( pj_op_type, kid_terms[0] ); \
-    }
-
-    EMIT_BINOP_CODE(OP_ADD, pj_binop_add)
-    else EMIT_BINOP_CODE(OP_SUBTRACT, pj_binop_subtract)
-    else EMIT_BINOP_CODE(OP_MULTIPLY, pj_binop_multiply)
-    else EMIT_BINOP_CODE(OP_DIVIDE, pj_binop_divide)
-    else EMIT_BINOP_CODE(OP_POW, pj_binop_pow)
-    else EMIT_BINOP_CODE(OP_LEFT_SHIFT, pj_binop_left_shift)
-    else EMIT_BINOP_CODE(OP_RIGHT_SHIFT, pj_binop_right_shift)
-    else EMIT_BINOP_CODE(OP_EQ, pj_binop_eq)
-    else EMIT_BINOP_CODE(OP_AND, pj_binop_bool_and)
-    else EMIT_BINOP_CODE(OP_OR, pj_binop_bool_or)
-    else EMIT_UNOP_CODE(OP_SIN, pj_unop_sin)
-    else EMIT_UNOP_CODE(OP_COS, pj_unop_cos)
-    else EMIT_UNOP_CODE(OP_SQRT, pj_unop_sqrt)
-    else EMIT_UNOP_CODE(OP_LOG, pj_unop_log)
-    else EMIT_UNOP_CODE(OP_EXP, pj_unop_exp)
-    else EMIT_UNOP_CODE(OP_INT, pj_unop_perl_int)
-    else EMIT_UNOP_CODE(OP_NOT, pj_unop_bool_not) /* FIXME Modification of a read-only value attempted at -e line 1. */
-    /* else EMIT_UNOP_CODE(OP_COMPLEMENT, pj_unop_bitwise_not) */ /* FIXME not same as perl */
-    else {
-      PJ_DEBUG_1("Shouldn't happen! Unsupported OP!? %s", OP_NAME(o));
-      abort();
-    }
-#undef EMIT_BINOP_CODE
-#undef EMIT_UNOP_CODE
+  /* rand() and the like */
+  if (ikid + 1 == map->nkids && (map->flags & PJ_OPMf_OPTIONAL_KID))
+    kid_terms[ikid++] = pj_make_const_dbl(0.);
 
-  } /* end if has kids */
-  else { /* OP without kids */
-    /* OP_PADSV and OP_CONST are handled in the caller as other OPs' kids */
-    PJ_DEBUG_1("ARG! Unsupported OP without kids, %s", OP_NAME(o));
+  if (ikid != map->nkids) {
+    PJ_DEBUG_1("Shouldn't happen! Wrong number of kids for %s", OP_NAME(o));
     abort();
   }
 
+  retval = pj_op_mapping_make_term(aTHX_ o, map, kid_terms, ikid);
+
   /* PMOP doesn't matter for JIT right now */
   /*
     if (o && OP_CLASS(o) == OA_PMOP && o->op_type != OP_PUSHRE
@@ -185,15 +667,150 @@ pj_build_ast(pTHX_ OP *o, ptrstack_t **subtrees, unsigned int *nvariables)
   return retval;
 }
 
+/* Collects the OPs of the tree rooted at o that a JIT OP replaces: all
+ * but the subtrees that become its kids and, for a branching JIT OP,
+ * the branches from stop on. They're freed along with the JIT OP rather
+ * than right away since opcalls still run some of them. Must be called
+ * before the kids are relinked. */
+static void
+pj_collect_orphans(pTHX_ OP *o, ptrstack_t *subtrees, OP *stop, ptrstack_t *orphans)
+{
+  void **subtree_array = ptrstack_data_pointer(subtrees);
+  const unsigned int n = ptrstack_nelems(subtrees);
+  unsigned int i;
+  OP *kid;
+
+  for (i = 1; i < n; i += 2) {
+    if (subtree_array[i] == (void *)o)
+      return;
+  }
+  ptrstack_push(orphans, o);
+
+  if (o->op_flags & OPf_KIDS) {
+    for (kid = cUNOPo->op_first; kid != NULL && kid != stop; kid = kid->op_sibling)
+      pj_collect_orphans(aTHX_ kid, subtrees, stop, orphans);
+  }
+}
+
+/* Hands the orphans (see above) to the JIT OP */
+static void
+pj_jitop_adopt_orphans(pj_jitop_aux_t *aux, ptrstack_t *orphans)
+{
+  aux->norphans = ptrstack_nelems(orphans);
+  aux->orphans = (OP **)malloc((aux->norphans > 0 ? aux->norphans : 1) * sizeof(OP *));
+  Copy(ptrstack_data_pointer(orphans), aux->orphans, aux->norphans, OP *);
+}
+
+/* Where the op_next or op_other of one of the OPs a JIT OP replaced
+ * goes in its fallback (see pj_pp_jit_fallback_param) */
+static OP *
+pj_fallback_target(OP *o, OP *exit, OP *leave, OP **firsts, OP **params, unsigned int n)
+{
+  unsigned int i;
+
+  if (o == exit)
+    return leave;
+  for (i = 0; i < n; ++i) {
+    if (o == firsts[i])
+      return params[i];
+  }
+  return o;
+}
+
+/* Counts the marks pushed on top of the JIT OP's one by the time the
+ * subtrees that become its kids would run in the tree rooted at o: one
+ * per list around them that starts with a PUSHMARK */
+static void
+pj_fallback_marks(pTHX_ OP *o, OP *stop, unsigned int depth, ptrstack_t *subtrees, U8 *marks)
+{
+  void **subtree_array = ptrstack_data_pointer(subtrees);
+  const unsigned int n = ptrstack_nelems(subtrees);
+  unsigned int i;
+  OP *kid;
+
+  for (i = 1; i < n; i += 2) {
+    if (subtree_array[i] == (void *)o) {
+      marks[i/2] = (U8)depth;
+      return;
+    }
+  }
+
+  if (o->op_flags & OPf_KIDS) {
+    kid = cUNOPo->op_first;
+    if (kid->op_type == OP_PUSHMARK)
+      ++depth;
+    for (; kid != NULL && kid != stop; kid = kid->op_sibling)
+      pj_fallback_marks(aTHX_ kid, stop, depth, subtrees, marks);
+  }
+}
+
+/* Makes the OPs that the JIT OP replaces, rooted at o, runnable as its
+ * fallback: the subtrees that become its kids are replaced by fallback
+ * param OPs, and whatever went on to exit goes through a fallback leave
+ * OP first. The branches of a branching JIT OP, from stop on, stay as
+ * they are. Adds the new OPs to the orphans. Must be called before the
+ * kids are relinked. */
+static void
+pj_setup_fallback(pTHX_ pj_jitop_aux_t *aux, OP *o, OP *stop, OP *exit,
+                  ptrstack_t *subtrees, ptrstack_t *orphans)
+{
+  const unsigned int n = ptrstack_nelems(subtrees) / 2;
+  const unsigned int norphans = ptrstack_nelems(orphans);
+  void **subtree_array = ptrstack_data_pointer(subtrees);
+  OP **firsts = (OP **)malloc((n > 0 ? n : 1) * sizeof(OP *));
+  OP **params = (OP **)malloc((n > 0 ? n : 1) * sizeof(OP *));
+  U8 *marks = (U8 *)calloc(n > 0 ? n : 1, sizeof(U8));
+  OP *leave, *kid;
+  unsigned int i;
+
+  pj_fallback_marks(aTHX_ o, stop, 0, subtrees, marks);
+
+  NewOp(1101, leave, 1, OP);
+  leave->op_type = (OPCODE)OP_CUSTOM;
+  leave->op_ppaddr = pj_pp_jit_fallback_leave;
+  leave->op_targ = n;
+  leave->op_next = exit;
+
+  for (i = 0; i < n; ++i) {
+    kid = (OP *)subtree_array[2*i+1];
+    firsts[i] = pj_find_first_executed_op(aTHX_ kid);
+    NewOp(1101, params[i], 1, OP);
+    params[i]->op_type = (OPCODE)OP_CUSTOM;
+    params[i]->op_ppaddr = pj_pp_jit_fallback_param;
+    params[i]->op_targ = i;
+    params[i]->op_private = marks[i];
+    params[i]->op_next = kid->op_next;
+  }
+
+  for (i = 0; i < norphans; ++i) {
+    kid = (OP *)ptrstack_data_pointer(orphans)[i];
+    if (kid == exit)
+      continue;
+    kid->op_next = pj_fallback_target(kid->op_next, exit, leave, firsts, params, n);
+    if (OP_CLASS(kid) == OA_LOGOP)
+      cLOGOPx(kid)->op_other = pj_fallback_target(cLOGOPx(kid)->op_other, exit, leave, firsts, params, n);
+  }
+  for (i = 0; i < n; ++i) {
+    params[i]->op_next = pj_fallback_target(params[i]->op_next, exit, leave, firsts, params, n);
+    ptrstack_push(orphans, params[i]);
+  }
+  ptrstack_push(orphans, leave);
+
+  aux->fallback = pj_fallback_target(pj_find_first_executed_op(aTHX_ o), exit, leave, firsts, params, n);
+  free(firsts);
+  free(params);
+  free(marks);
+}
+
 /* Builds op_sibling list between JITOP children, but also
  * re-wires the direct children's op_next to the following
  * child's first OP and the last child's op_next to the JITOP itself. */
 static void
-pj_build_jitop_kid_list(pTHX_ LISTOP *jitop, ptrstack_t *subtrees)
+pj_build_jitop_kid_list(pTHX_ OP *jitop, OP **first, OP **last, ptrstack_t *subtrees)
 {
   if (ptrstack_empty(subtrees)) {
-    jitop->op_first = NULL; /* FIXME is this valid for a LISTOP? */
-    jitop->op_last = NULL;
+    *first = NULL; /* FIXME is this valid for a LISTOP? */
+    *last = NULL;
   }
   else {
     void **subtree_array = ptrstack_data_pointer(subtrees);
@@ -204,7 +821,7 @@ pj_build_jitop_kid_list(pTHX_ LISTOP *jitop, ptrstack_t *subtrees)
     /* TODO for now, we just always impose "numeric". Later, this may need
      *      to be flexible. */
     o = (OP *)subtree_array[1];
-    jitop->op_first = o;
+    *first = o;
     PJ_DEBUG_1("First kid is %s\n", OP_NAME(o));
 
     /* Alternating op-imposed-type and actual subtree */
@@ -217,15 +834,15 @@ pj_build_jitop_kid_list(pTHX_ LISTOP *jitop, ptrstack_t *subtrees)
     }
 
     /* Wire last child OP to execute JITOP next. */
-    jitop->op_last = o;
-    o->op_next = (OP *)jitop;
+    *last = o;
+    o->op_next = jitop;
     o->op_sibling = NULL;
   }
 }
 
 
 static void
-pj_fixup_parent_op(pTHX_ OP *jitop, OP *origop, UNOP *parentop)
+pj_fixup_parent_op(pTHX_ OP *jitop, OP *origop, OP *orignext, UNOP *parentop)
 {
   OP *kid;
 
@@ -237,7 +854,7 @@ pj_fixup_parent_op(pTHX_ OP *jitop, OP *origop, UNOP *parentop)
   }
   PJ_DEBUG_1("Doing parent fixups for %s\n", OP_NAME((OP *)parentop));
   */
-  jitop->op_next = origop->op_next;
+  jitop->op_next = orignext;
 
   if (parentop->op_first == origop) {
     parentop->op_first = jitop;
@@ -311,7 +928,12 @@ pj_attempt_jit(pTHX_ OP *o, OP *parentop)
   if (ast != NULL) {
     OP *jitop;
     pj_jitop_aux_t *jitop_aux;
-    o->op_next = o;
+    ptrstack_t *orphans;
+    /* A COND_EXPR's op_next is its true branch. Both branches continue
+     * with whatever follows the COND_EXPR. */
+    OP *orignext = (o->op_type == OP_COND_EXPR
+                    ? cLOGOPo->op_first->op_sibling->op_next
+                    : o->op_next);
 
     PJ_DEBUG_2("Built actual AST for jitting. Have %i subtrees which means %i variables.\n", (int)(ptrstack_nelems(subtrees)/2), nvariables);
     if (PJ_DEBUGGING)
@@ -320,6 +942,11 @@ pj_attempt_jit(pTHX_ OP *o, OP *parentop)
     jitop = (OP *)pj_prepare_jit_op(aTHX_ nvariables, o);
     PJ_DEBUG_1("Have a JIT OP: %s\n", OP_NAME(jitop));
 
+    jitop_aux = (pj_jitop_aux_t *)jitop->op_targ;
+    orphans = ptrstack_make(8, 0);
+    pj_collect_orphans(aTHX_ o, subtrees, NULL, orphans);
+    pj_setup_fallback(aTHX_ jitop_aux, o, NULL, orignext, subtrees, orphans);
+
     /* The following function call will build the usual LISTOP
      * structure where op_first points at the start of the linked
      * list of kids and op_last points at the end. The kids
@@ -334,30 +961,121 @@ pj_attempt_jit(pTHX_ OP *o, OP *parentop)
      *
      * where op_s is understood to be "op_sibling".
      */
-    pj_build_jitop_kid_list(aTHX_ (LISTOP *)jitop, subtrees);
+    pj_build_jitop_kid_list(aTHX_ jitop, &cLISTOPx(jitop)->op_first,
+                            &cLISTOPx(jitop)->op_last, subtrees);
 
-    pj_fixup_parent_op(aTHX_ jitop, o, (UNOP *)parentop);
+    pj_fixup_parent_op(aTHX_ jitop, o, orignext, (UNOP *)parentop);
 
-    /* TODO clean up orphaned OPs */
-
-    jitop_aux = (pj_jitop_aux_t *)jitop->op_targ;
+    pj_jitop_adopt_orphans(jitop_aux, orphans);
+    ptrstack_free(orphans);
+    pj_jitop_setup_params(aTHX_ jitop_aux, ast);
+    jitop_aux->bool_result = (ast->type == pj_ttype_op
+                              && (PJ_OP_FLAGS((pj_op_t *)ast) & PJ_ASTf_BOOLEAN));
+    /* Compiled when first run, see pj_jitop_run */
+    jitop_aux->ast = pj_clone_tree(ast, NULL);
+    jitop_aux->funtype = pj_tree_determine_funtype(ast);
+  }
 
-    /* JIT it for real */
-    {
-      jit_function_t func = NULL;
-      pj_basic_type funtype;
+  pj_free_tree(ast);
+  ptrstack_free(subtrees);
+}
 
-      if (0 == pj_tree_jit(PJ_jit_context, ast, &func, &funtype)) {
-        PJ_DEBUG("JIT succeeded!\n");
-      } else {
-        PJ_DEBUG("JIT failed!\n");
-      }
-      jitop_aux->jit_fun = (void *)jit_function_to_closure(func);
-    }
+/* The condition of an AND/OR/COND_EXPR, skipping compiled-out wrappers */
+static OP *
+pj_branch_condition(pTHX_ OP *o)
+{
+  OP *cond = cLOGOPo->op_first;
+  while (cond->op_type == OP_NULL && (cond->op_flags & OPf_KIDS)
+         && cUNOPx(cond)->op_first->op_sibling == NULL)
+  {
+    cond = cUNOPx(cond)->op_first;
   }
+  return cond;
+}
+
+/* AND, OR and COND_EXPR in void context (if/unless/elsif, statement
+ * modifiers and some loops) only serve to pick the OP to execute next.
+ * If their condition is numeric, we can compute it natively and jump to
+ * op_other or op_next without producing a boolean SV in between. */
+static int
+pj_is_jittable_branch(pTHX_ OP *o)
+{
+  OP *cond;
+
+  if (o->op_type != OP_AND && o->op_type != OP_OR && o->op_type != OP_COND_EXPR)
+    return 0;
+  if ((o->op_flags & OPf_WANT) != OPf_WANT_VOID || !(o->op_flags & OPf_KIDS))
+    return 0;
+
+  cond = pj_branch_condition(aTHX_ o);
+  return pj_op_mapping_checked(aTHX_ cond, 0) != NULL
+         && pj_truth_is_numeric(aTHX_ cond)
+         && !pj_jit_would_reorder(aTHX_ cond);
+}
+
+/* Replace a branching OP (see above) by a branching JIT OP. Its kids
+ * are the condition's subtrees followed by the original OP's branches.
+ * Returns the new OP. */
+static OP *
+pj_attempt_jit_branch(pTHX_ OP *o, OP *parentop)
+{
+  ptrstack_t *subtrees;
+  pj_term_t *ast;
+  unsigned int nvariables = 0;
+  OP *cond = pj_branch_condition(aTHX_ o);
+  OP *branches = cLOGOPo->op_first->op_sibling;
+  OP *jitop, *lastkid;
+  pj_jitop_aux_t *jitop_aux;
+  ptrstack_t *orphans;
+
+  if (PJ_DEBUGGING)
+    printf("Attempting JIT on condition of %s (%p, %p)\n", OP_NAME(o), o, o->op_next);
+  subtrees = ptrstack_make(3, 0);
+
+  ast = pj_build_ast(aTHX_ cond, &subtrees, &nvariables);
+  /* There's always at least the leading leaf. */
+  assert(!ptrstack_empty(subtrees));
+
+  if (PJ_DEBUGGING)
+    pj_dump_tree(ast);
+
+  jitop = (OP *)pj_prepare_jit_branch_op(aTHX_ nvariables, cLOGOPo);
+  PJ_DEBUG_1("Have a JIT OP: %s\n", OP_NAME(jitop));
+
+  /* The branches stay, the fallback leaves them to the original OP */
+  jitop_aux = (pj_jitop_aux_t *)jitop->op_targ;
+  orphans = ptrstack_make(8, 0);
+  pj_collect_orphans(aTHX_ o, subtrees, branches, orphans);
+  pj_setup_fallback(aTHX_ jitop_aux, o, branches, o, subtrees, orphans);
+
+  /* Same as for the JIT OP, but with the branches added on:
+   *
+   *       /--------JITOP--------------\
+   *      /op_first                     \op_other
+   *     /                               \
+   *   OP ---> ... ---> OP ---> branch ---> [branch]
+   *      op_s     op_s    op_s        op_s
+   *
+   * The subtrees run into the JIT OP, the branches are reached via
+   * op_other and op_next as before. */
+  pj_build_jitop_kid_list(aTHX_ jitop, &cLOGOPx(jitop)->op_first, &lastkid, subtrees);
+  lastkid->op_sibling = branches;
+
+  pj_fixup_parent_op(aTHX_ jitop, o, o->op_next, (UNOP *)parentop);
+  /* The original's op_next is the false branch of a COND_EXPR, not
+   * whatever follows */
+  jitop->op_next = o->op_next;
+
+  pj_jitop_adopt_orphans(jitop_aux, orphans);
+  ptrstack_free(orphans);
+  pj_jitop_setup_params(aTHX_ jitop_aux, ast);
+  jitop_aux->ast = pj_clone_tree(ast, NULL);
+  jitop_aux->funtype = pj_tree_determine_funtype(ast);
 
   pj_free_tree(ast);
   ptrstack_free(subtrees);
+
+  return jitop;
 }
 
 /* inspired by B.xs */
@@ -370,7 +1088,6 @@ pj_attempt_jit(pTHX_ OP *o, OP *parentop)
 void
 pj_find_jit_candidate(pTHX_ OP *o, OP *parentop)
 {
-  unsigned int otype;
   OP *kid;
   ptrstack_t *backlog;
 
@@ -382,12 +1099,38 @@ pj_find_jit_candidate(pTHX_ OP *o, OP *parentop)
   while (!ptrstack_empty(backlog)) {
     o = ptrstack_pop(backlog);
     parentop = ptrstack_pop(backlog);
-    otype = o->op_type;
 
     PJ_DEBUG_1("Considering %s\n", OP_NAME(o));
 
+    /* Calls to natively compiled subs, or List::Util reductions with
+     * a numeric block. The arguments are still evaluated by Perl (or
+     * are there for the slow path), so carry on into the kids below. */
+    if (o->op_type == OP_ENTERSUB && !pj_attempt_native_entersub(aTHX_ o))
+      pj_attempt_reduce(aTHX_ o);
+
+    /* String concatenation chains. The pieces are left in place, so
+     * carry on into the kids below, too. */
+    if (o->op_type == OP_CONCAT)
+      pj_attempt_concat_chain(aTHX_ o);
+
+    /* Sort blocks comparing numeric keys. The block stays for the
+     * slow path, so carry on into it, too. */
+    if (o->op_type == OP_SORT)
+      pj_attempt_sort(aTHX_ o);
+
+    /* Conditions in control flow. Only the condition is JIT'd, so
+     * continue with the branches. */
+    if (parentop != NULL && pj_is_jittable_branch(aTHX_ o)) {
+      /* The condition's subtrees were scanned while building its AST */
+      OP *branches = cLOGOPo->op_first->op_sibling;
+      OP *jitop = pj_attempt_jit_branch(aTHX_ o, parentop);
+      for (kid = branches; kid; kid = kid->op_sibling) {
+        ptrstack_push(backlog, jitop); /* parent for kid */
+        ptrstack_push(backlog, kid);
+      }
+    }
     /* Attempt JIT if the right OP type. Don't recurse if so. */
-    if (IS_JITTABLE_ROOT_OP_TYPE(otype)) {
+    else if (pj_op_mapping_checked(aTHX_ o, 1) != NULL && !pj_jit_would_reorder(aTHX_ o)) {
       if (parentop != NULL) {
         /* Can only JIT if we have the parent OP. Some time later, maybe
          * I'll discover a way to find the parent... */
@@ -398,6 +1141,9 @@ pj_find_jit_candidate(pTHX_ OP *o, OP *parentop)
       else
         PJ_DEBUG_1("Might have been able to JIT %s, but parent OP is NULL", OP_NAME(o));
     }
+    else if ((o->op_type == OP_HELEM || o->op_type == OP_AELEM) && pj_attempt_deref_chain(aTHX_ o)) {
+      /* Dereference chain with constant keys, nothing else in there */
+    }
     else {
       if (o && (o->op_flags & OPf_KIDS)) {
         for (kid = ((UNOP*)o)->op_first; kid; kid = kid->op_sibling) {
@@ -0,0 +1,717 @@
+#include "pj_reduce.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "ppport.h"
+#include "ptable.h"
+#include "pj_debug.h"
+#include "pj_inline.h"
+
+#include "pj_ast_walkers.h"
+#include "pj_global_state.h"
+#include "pj_native_sub.h"
+#include "pj_jit_op.h"
+
+/* The block of a reduce/first/any, compiled at the end of its anon sub */
+typedef struct pj_native_block pj_native_block_t;
+struct pj_native_block {
+  OP *root;                 /* CvROOT at compile time */
+  pj_term_t *ast;           /* variables are $_, or $a and $b */
+  GV *agv;                  /* NULL for $_ */
+  GV *bgv;
+  pj_native_block_t *prev;  /* previous sub at the same address */
+};
+
+/* Compiled blocks by the prototype CV of their anon sub */
+static PTABLE_t *pj_native_blocks = NULL;
+
+static const struct {
+  const char *name;
+  pj_reduce_kind kind;
+} pj_reduce_funcs[] = {
+  {"sum",    pj_reduce_sum},
+  {"sum0",   pj_reduce_sum0},
+  {"min",    pj_reduce_min},
+  {"max",    pj_reduce_max},
+  {"reduce", pj_reduce_reduce},
+  {"first",  pj_reduce_first},
+  {"any",    pj_reduce_any},
+  {NULL,     0}
+};
+
+/* Whether cv is the List::Util XSUB for one of the kinds */
+static int
+pj_reduce_find_kind(pTHX_ CV *cv, pj_reduce_kind *kind)
+{
+  const char *stashname;
+  GV *gv;
+  unsigned int i;
+
+  if (!CvISXSUB(cv) || (gv = CvGV(cv)) == NULL || GvSTASH(gv) == NULL
+      || (stashname = HvNAME_get(GvSTASH(gv))) == NULL
+      || strcmp(stashname, "List::Util") != 0)
+  {
+    return 0;
+  }
+
+  for (i = 0; pj_reduce_funcs[i].name != NULL; ++i) {
+    if (strcmp(pj_reduce_funcs[i].name, GvNAME(gv)) == 0) {
+      *kind = pj_reduce_funcs[i].kind;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* A numeric expression that we can loop over without anyone noticing */
+static int
+pj_reduce_body_ok(pj_term_t *ast, int max_var)
+{
+  return ast->type == pj_ttype_op && max_var >= 0
+         && !pj_tree_has_op_flag(ast, PJ_ASTf_SIDE_EFFECT);
+}
+
+void
+pj_compile_native_block(pTHX_ CV *cv)
+{
+  GV *gvs[2];
+  OP *expr;
+  pj_term_t *ast;
+  pj_native_block_t *nb;
+  int max_var = -1;
+
+  /* Closures can't be anything but pure functions of $_, $a and $b */
+  if (!CvANON(cv) || CvROOT(cv) == NULL || CvISXSUB(cv) || CvCLONE(cv) || PL_perldb)
+    return;
+
+  /* leavesub(lineseq(nextstate, EXPR)) */
+  expr = pj_single_expr(cUNOPx(CvROOT(cv))->op_first);
+  if (expr == NULL)
+    return;
+
+  /* $_ for first and any, else $a and $b of the block's package */
+  gvs[0] = PL_defgv;
+  gvs[1] = NULL;
+  ast = pj_build_closed_ast(aTHX_ expr, NULL, gvs, 1, &max_var);
+  if (ast == NULL) {
+    gvs[0] = gv_fetchpvs("a", GV_ADD|GV_NOTQUAL, SVt_PV);
+    gvs[1] = gv_fetchpvs("b", GV_ADD|GV_NOTQUAL, SVt_PV);
+    ast = pj_build_closed_ast(aTHX_ expr, NULL, gvs, 2, &max_var);
+    if (ast == NULL)
+      return;
+  }
+  else {
+    gvs[0] = NULL;
+  }
+
+  if (!pj_reduce_body_ok(ast, max_var)) {
+    pj_free_tree(ast);
+    return;
+  }
+
+  PJ_DEBUG("Compiled block of anonymous sub for reductions\n");
+  nb = (pj_native_block_t *)malloc(sizeof(pj_native_block_t));
+  nb->root = CvROOT(cv);
+  nb->ast = ast;
+  nb->agv = (GV *)SvREFCNT_inc_simple((SV *)gvs[0]);
+  nb->bgv = (GV *)SvREFCNT_inc_simple((SV *)gvs[1]);
+
+  if (pj_native_blocks == NULL)
+    pj_native_blocks = PTABLE_new();
+  nb->prev = (pj_native_block_t *)PTABLE_fetch(pj_native_blocks, cv);
+  PTABLE_store(pj_native_blocks, cv, nb);
+}
+
+/* The compiled block of the anon sub that o (an srefgen) makes a
+ * reference to */
+static pj_native_block_t *
+pj_reduce_match_block(pTHX_ OP *o)
+{
+  pj_native_block_t *nb;
+  CV *cv;
+
+  /* srefgen(ex-list(anoncode)), as the & prototype demands */
+  if (o->op_type != OP_SREFGEN || !(o->op_flags & OPf_KIDS)
+      || !(cUNOPo->op_first->op_flags & OPf_KIDS))
+    return NULL;
+  o = cUNOPx(cUNOPo->op_first)->op_first;
+  if (o->op_type != OP_ANONCODE || pj_native_blocks == NULL)
+    return NULL;
+
+  /* ck_anoncode moved the CV into the pad */
+  cv = (CV *)PL_curpad[o->op_targ];
+  nb = (pj_native_block_t *)PTABLE_fetch(pj_native_blocks, cv);
+  if (nb == NULL || nb->root != CvROOT(cv))
+    return NULL;
+  return nb;
+}
+
+/* @lexical, @package or @$lexical */
+static int
+pj_reduce_match_array(pTHX_ OP *o, pj_reduce_aux_t *aux)
+{
+  OP *kid;
+
+  if (o->op_type == OP_PADAV) {
+    if (o->op_private & OPpLVAL_INTRO)
+      return 0;
+    aux->padix = o->op_targ;
+    return 1;
+  }
+
+  if (o->op_type != OP_RV2AV || !(o->op_flags & OPf_KIDS))
+    return 0;
+  kid = cUNOPo->op_first;
+  if (kid->op_type == OP_GV) {
+    aux->arraygv = (GV *)SvREFCNT_inc_simple_NN((SV *)cGVOPx_gv(kid));
+    return 1;
+  }
+  if (kid->op_type == OP_PADSV && !(kid->op_private & OPpLVAL_INTRO)) {
+    aux->padix = kid->op_targ;
+    aux->deref = TRUE;
+    return 1;
+  }
+  return 0;
+}
+
+/* Range of values of a term, for telling whether the doubles the kernel
+ * computes with are what perl would have in its IVs */
+typedef struct {
+  NV lo;
+  NV hi;
+} pj_reduce_range_t;
+
+/* The smallest range that holds the n values */
+static void
+pj_reduce_range_hull(pj_reduce_range_t *r, const NV *v, unsigned int n)
+{
+  unsigned int i;
+
+  r->lo = r->hi = v[0];
+  for (i = 1; i < n; ++i) {
+    if (v[i] < r->lo)
+      r->lo = v[i];
+    if (v[i] > r->hi)
+      r->hi = v[i];
+  }
+}
+
+/* Computes the range of term, given the ranges of its variables, and
+ * sets *iv to whether perl yields an IV for it when all variables are
+ * IVs. Returns 0 if anything computed on the way might get beyond 2**53
+ * in magnitude, or for terms it can't tell about. */
+static int
+pj_reduce_range(pj_term_t *term, const pj_reduce_range_t *vars,
+                pj_reduce_range_t *r, bool *iv)
+{
+  pj_reduce_range_t a, b;
+  bool aiv, biv;
+  pj_op_t *op;
+  NV v[4];
+
+  switch (term->type) {
+  case pj_ttype_constant: {
+      pj_constant_t *c = (pj_constant_t *)term;
+
+      v[0] = (c->const_type == pj_int_type ? (NV)c->value_u.int_value
+              : c->const_type == pj_uint_type ? (NV)c->value_u.uint_value
+              : c->value_u.dbl_value);
+      r->lo = r->hi = v[0];
+      /* perl does integer arithmetic on integral NVs, too */
+      *iv = (v[0] == floor(v[0]));
+      break;
+    }
+  case pj_ttype_variable:
+    *r = vars[((pj_variable_t *)term)->ivar];
+    *iv = TRUE;
+    break;
+  case pj_ttype_inline:
+    return pj_reduce_range(((pj_inline_t *)term)->body, vars, r, iv);
+  case pj_ttype_op:
+    op = (pj_op_t *)term;
+    if (op->optype == pj_listop_ternary) {
+      /* condition, then the two alternatives */
+      if (!pj_reduce_range(op->op1, vars, &a, &aiv)
+          || !pj_reduce_range(op->op1->op_sibling, vars, &a, &aiv)
+          || !pj_reduce_range(op->op2, vars, &b, &biv))
+      {
+        return 0;
+      }
+      v[0] = a.lo; v[1] = a.hi; v[2] = b.lo; v[3] = b.hi;
+      pj_reduce_range_hull(r, v, 4);
+      *iv = aiv && biv;
+      break;
+    }
+    if (!pj_reduce_range(op->op1, vars, &a, &aiv)
+        || (op->op2 != NULL && !pj_reduce_range(op->op2, vars, &b, &biv)))
+    {
+      return 0;
+    }
+
+    switch (op->optype) {
+    case pj_unop_negate:
+      r->lo = -a.hi;
+      r->hi = -a.lo;
+      *iv = aiv;
+      break;
+    case pj_unop_abs:
+      v[0] = fabs(a.lo); v[1] = fabs(a.hi); v[2] = (a.lo < 0 && a.hi > 0 ? 0 : v[0]);
+      pj_reduce_range_hull(r, v, 3);
+      *iv = aiv;
+      break;
+    case pj_unop_perl_int:
+      *r = a;
+      *iv = TRUE;
+      break;
+    case pj_unop_floor:
+    case pj_unop_ceil:
+      r->lo = floor(a.lo);
+      r->hi = ceil(a.hi);
+      *iv = FALSE;
+      break;
+    case pj_unop_sqrt:
+      /* negative operands croak */
+      r->lo = (a.lo > 0 ? sqrt(a.lo) : 0);
+      r->hi = (a.hi > 0 ? sqrt(a.hi) : 0);
+      *iv = FALSE;
+      break;
+    case pj_unop_log:
+      if (a.lo <= 0)
+        return 0;
+      r->lo = log(a.lo);
+      r->hi = log(a.hi);
+      *iv = FALSE;
+      break;
+    case pj_unop_exp:
+      r->lo = exp(a.lo);
+      r->hi = exp(a.hi);
+      *iv = FALSE;
+      break;
+    case pj_unop_sin:
+    case pj_unop_cos:
+      r->lo = -1;
+      r->hi = 1;
+      *iv = FALSE;
+      break;
+    case pj_unop_bool_not:
+    case pj_binop_eq:
+    case pj_binop_ne:
+    case pj_binop_lt:
+    case pj_binop_le:
+    case pj_binop_gt:
+    case pj_binop_ge:
+      r->lo = 0;
+      r->hi = 1;
+      *iv = FALSE;
+      break;
+    case pj_binop_ncmp:
+      r->lo = -1;
+      r->hi = 1;
+      *iv = TRUE;
+      break;
+    case pj_binop_add:
+      r->lo = a.lo + b.lo;
+      r->hi = a.hi + b.hi;
+      *iv = aiv && biv;
+      break;
+    case pj_binop_subtract:
+      r->lo = a.lo - b.hi;
+      r->hi = a.hi - b.lo;
+      *iv = aiv && biv;
+      break;
+    case pj_binop_multiply:
+      v[0] = a.lo * b.lo; v[1] = a.lo * b.hi; v[2] = a.hi * b.lo; v[3] = a.hi * b.hi;
+      pj_reduce_range_hull(r, v, 4);
+      *iv = aiv && biv;
+      break;
+    case pj_binop_divide:
+      /* perl croaks on 0, but anything near it is unbounded */
+      if (b.lo <= 0 && b.hi >= 0)
+        return 0;
+      v[0] = a.lo / b.lo; v[1] = a.lo / b.hi; v[2] = a.hi / b.lo; v[3] = a.hi / b.hi;
+      pj_reduce_range_hull(r, v, 4);
+      *iv = FALSE;
+      break;
+    case pj_binop_modulo:
+    case pj_binop_i_modulo:
+      /* Smaller than the right operand */
+      r->hi = (-b.lo > b.hi ? -b.lo : b.hi);
+      r->lo = -r->hi;
+      *iv = TRUE;
+      break;
+    case pj_binop_fmod:
+      /* Smaller than the left operand */
+      r->hi = (-a.lo > a.hi ? -a.lo : a.hi);
+      r->lo = -r->hi;
+      *iv = FALSE;
+      break;
+    case pj_binop_pow:
+      /* Only small constant powers that perl does on integers */
+      if (op->op2->type != pj_ttype_constant || b.lo != floor(b.lo) || b.lo < 0 || b.lo > 64)
+        return 0;
+      r->hi = pow((-a.lo > a.hi ? -a.lo : a.hi), b.lo);
+      r->lo = -r->hi;
+      *iv = aiv;
+      break;
+    case pj_binop_atan2:
+      r->lo = -4; /* pi and some */
+      r->hi = 4;
+      *iv = FALSE;
+      break;
+    case pj_binop_min:
+    case pj_binop_max:
+    case pj_binop_bool_and:
+    case pj_binop_bool_or:
+      /* One of the operands */
+      v[0] = a.lo; v[1] = a.hi; v[2] = b.lo; v[3] = b.hi;
+      pj_reduce_range_hull(r, v, 4);
+      *iv = aiv && biv;
+      break;
+    default:
+      return 0;
+    }
+    break;
+  default:
+    return 0;
+  }
+
+  /* Also rejects NaN */
+  return r->lo >= -(NV)PJ_MAX_EXACT_NV && r->hi <= (NV)PJ_MAX_EXACT_NV;
+}
+
+/* Whether the kernel computed with exactly the values perl would have
+ * in the n calls of the block, given the range of the elements. That's
+ * the case while nothing, including the partial sums and the values of
+ * $a, gets beyond 2**53, so that wherever perl keeps an IV the doubles
+ * are exact, too. Sets *iv to whether the block yields IVs for IVs. */
+static int
+pj_reduce_exact(const pj_reduce_aux_t *aux, SSize_t n,
+                const pj_reduce_range_t *elems, bool *iv)
+{
+  pj_reduce_range_t vars[2], r;
+  SSize_t i;
+
+  vars[0] = vars[1] = *elems;
+  if (aux->kind != pj_reduce_reduce) {
+    if (!pj_reduce_range(aux->ast, vars, &r, iv))
+      return 0;
+    if (aux->kind != pj_reduce_sum && aux->kind != pj_reduce_sum0)
+      return 1;
+    return (NV)n * (-r.lo > r.hi ? -r.lo : r.hi) <= (NV)PJ_MAX_EXACT_NV;
+  }
+
+  /* $a starts out as the first element, then it's what the block
+   * returned. Widen its range until it stops growing. */
+  for (i = 1; i < n; ++i) {
+    if (!pj_reduce_range(aux->ast, vars, &r, iv))
+      return 0;
+    if (r.lo >= vars[0].lo && r.hi <= vars[0].hi)
+      break;
+    if (r.lo < vars[0].lo)
+      vars[0].lo = r.lo;
+    if (r.hi > vars[0].hi)
+      vars[0].hi = r.hi;
+  }
+  return 1;
+}
+
+/* The result of a reduction to a number, an IV where List::Util would
+ * return one */
+PJ_STATIC_INLINE SV *
+pj_reduce_result(pTHX_ double acc, bool iv)
+{
+  if (iv && acc == floor(acc)
+      && acc >= -(NV)PJ_MAX_EXACT_NV && acc <= (NV)PJ_MAX_EXACT_NV)
+  {
+    return sv_2mortal(newSViv((IV)acc));
+  }
+  return sv_2mortal(newSVnv((NV)acc));
+}
+
+/* reassociate is in effect where the call is. Only known at run time,
+ * when PL_curcop is the call's statement. */
+static int
+pj_reduce_may_reassociate(pTHX)
+{
+#ifdef cop_hints_fetch_pvs
+  SV *sv = cop_hints_fetch_pvs(PL_curcop, "Perl::JIT/reassociate", 0);
+  return sv != NULL && sv != &PL_sv_placeholder && SvTRUE(sv);
+#else
+  return 0;
+#endif
+}
+
+int
+pj_attempt_reduce(pTHX_ OP *o)
+{
+  pj_reduce_kind kind;
+  pj_kernel_kind kernel_kind;
+  pj_reduce_aux_t *aux;
+  pj_native_block_t *nb;
+  jit_function_t func = NULL, reassoc_func = NULL;
+  pj_term_t *ast;
+  OP *first, *kid, *args[2], *arrayop, *mapstart;
+  unsigned int nargs = 0;
+  int max_var = -1;
+  GV *gv;
+  CV *cv;
+
+  cv = pj_call_target_cv(aTHX_ o, &gv);
+  if (cv == NULL || !pj_reduce_find_kind(aTHX_ cv, &kind)
+      || (o->op_flags & OPf_WANT) == OPf_WANT_VOID)
+  {
+    return 0;
+  }
+
+  /* pushmark, args..., ex-rv2cv. Possibly wrapped in an ex-list. */
+  first = cUNOPo->op_first;
+  if (first->op_sibling == NULL && (first->op_flags & OPf_KIDS))
+    first = cUNOPx(first)->op_first;
+  if (first->op_type != OP_PUSHMARK)
+    return 0;
+  for (kid = first->op_sibling; kid != NULL && kid->op_sibling != NULL; kid = kid->op_sibling) {
+    if (kid->op_type == OP_NULL && !(kid->op_flags & OPf_KIDS))
+      continue;
+    if (nargs == 2)
+      return 0;
+    args[nargs++] = kid;
+  }
+
+  if (kind == pj_reduce_reduce || kind == pj_reduce_first || kind == pj_reduce_any) {
+    /* FUNC BLOCK ARRAY */
+    if (nargs != 2 || (nb = pj_reduce_match_block(aTHX_ args[0])) == NULL
+        || (kind == pj_reduce_reduce) != (nb->agv != NULL))
+    {
+      return 0;
+    }
+    arrayop = args[1];
+    ast = pj_clone_tree(nb->ast, NULL);
+  }
+  else {
+    /* FUNC(map BLOCK ARRAY): mapwhile(mapstart(pushmark, BLOCK, ARRAY)) */
+    GV *gvs[1];
+
+    if (nargs != 1 || args[0]->op_type != OP_MAPWHILE)
+      return 0;
+    mapstart = cLOGOPx(args[0])->op_first;
+    if (mapstart->op_type != OP_MAPSTART || !(mapstart->op_flags & OPf_KIDS))
+      return 0;
+    kid = cLISTOPx(mapstart)->op_first;
+    if (kid->op_type != OP_PUSHMARK || (kid = kid->op_sibling) == NULL
+        || (arrayop = kid->op_sibling) == NULL || arrayop->op_sibling != NULL)
+    {
+      return 0;
+    }
+
+    gvs[0] = PL_defgv;
+    if ((kid = pj_single_expr(kid)) == NULL
+        || (ast = pj_build_closed_ast(aTHX_ kid, NULL, gvs, 1, &max_var)) == NULL)
+    {
+      return 0;
+    }
+    if (!pj_reduce_body_ok(ast, max_var)) {
+      pj_free_tree(ast);
+      return 0;
+    }
+    nb = NULL;
+  }
+
+  aux = (pj_reduce_aux_t *)malloc(sizeof(pj_reduce_aux_t));
+  aux->arraygv = NULL;
+  aux->padix = 0;
+  aux->deref = FALSE;
+  if (!pj_reduce_match_array(aTHX_ arrayop, aux)) {
+    free(aux);
+    pj_free_tree(ast);
+    return 0;
+  }
+
+  kernel_kind = (kind == pj_reduce_sum || kind == pj_reduce_sum0 ? pj_kernel_sum
+                 : kind == pj_reduce_min ? pj_kernel_min
+                 : kind == pj_reduce_max ? pj_kernel_max
+                 : kind == pj_reduce_reduce ? pj_kernel_reduce
+                 : pj_kernel_find);
+  if (0 != pj_tree_jit_kernel(PJ_jit_context, ast, kernel_kind, 1, &func)
+      || (kernel_kind == pj_kernel_sum
+          && 0 != pj_tree_jit_kernel(PJ_jit_context, ast, kernel_kind, PJ_REDUCE_NACC, &reassoc_func)))
+  {
+    PJ_DEBUG("JIT failed!\n");
+    SvREFCNT_dec(aux->arraygv);
+    free(aux);
+    pj_free_tree(ast);
+    return 0;
+  }
+
+  PJ_DEBUG_1("Replacing List::Util::%s call with native loop\n", GvNAME(CvGV(cv)));
+  aux->kind = kind;
+  aux->entersub = o;
+  aux->gv = (GV *)SvREFCNT_inc_simple_NN((SV *)gv);
+  aux->cv = cv;
+  aux->agv = (nb != NULL ? (GV *)SvREFCNT_inc_simple((SV *)nb->agv) : NULL);
+  aux->bgv = (nb != NULL ? (GV *)SvREFCNT_inc_simple((SV *)nb->bgv) : NULL);
+  aux->kernel_func = func;
+  aux->reassoc_func = reassoc_func;
+  aux->ast = ast;
+  aux->kernel = (pj_kernel_func_t)jit_function_to_closure(func);
+  aux->reassoc_kernel = (reassoc_func != NULL
+                         ? (pj_kernel_func_t)jit_function_to_closure(reassoc_func) : NULL);
+
+  /* The call's PUSHMARK is executed first, so it gets to decide */
+  first->op_type = OP_CUSTOM;
+  first->op_ppaddr = pj_pp_jit_reduce;
+  first->op_targ = (PADOFFSET)PTR2UV(aux);
+
+  return 1;
+}
+
+/* The array to loop over, NULL if it's not a plain one */
+PJ_STATIC_INLINE AV *
+pj_reduce_array(pTHX_ const pj_reduce_aux_t *aux)
+{
+  SV *sv;
+
+  if (aux->arraygv != NULL)
+    return GvAV(aux->arraygv);
+  sv = PAD_SV(aux->padix);
+  if (!aux->deref)
+    return (AV *)sv;
+  if (SvGMAGICAL(sv) || !SvROK(sv) || SvAMAGIC(sv) || SvTYPE(SvRV(sv)) != SVt_PVAV)
+    return NULL;
+  return (AV *)SvRV(sv);
+}
+
+OP *
+pj_pp_jit_reduce(pTHX)
+{
+  dSP;
+  pj_reduce_aux_t *aux = (pj_reduce_aux_t *)PL_op->op_targ;
+  pj_kernel_func_t kernel = aux->kernel;
+  double buf[PJ_REDUCE_CHUNK];
+  double acc = 0.;
+  pj_reduce_range_t range = {0, 0};
+  SSize_t n, i, j, chunk, found = -1, nivs = 0;
+  bool iv = FALSE;
+  SV **elems;
+  SV *result;
+  AV *av;
+
+  /* Still the same function, which would set the same $a and $b */
+  if (GvCV(aux->gv) != aux->cv
+      || (aux->agv != NULL
+          && (aux->agv != gv_fetchpvs("a", GV_ADD|GV_NOTQUAL, SVt_PV)
+              || aux->bgv != gv_fetchpvs("b", GV_ADD|GV_NOTQUAL, SVt_PV))))
+  {
+    goto slow;
+  }
+  if ((av = pj_reduce_array(aTHX_ aux)) == NULL || SvRMAGICAL(av))
+    goto slow;
+
+  n = AvFILLp(av) + 1;
+  elems = AvARRAY(av);
+  /* reduce returns a copy of a single element as it is */
+  if (aux->kind == pj_reduce_reduce && n < 2)
+    goto slow;
+
+  if (aux->reassoc_kernel != NULL && pj_reduce_may_reassociate(aTHX))
+    kernel = aux->reassoc_kernel;
+
+  /* Nothing observable happens until we're done, so we can still bail
+   * out at any element */
+  for (i = 0; i < n; i += chunk) {
+    chunk = (n - i < PJ_REDUCE_CHUNK ? n - i : PJ_REDUCE_CHUNK);
+    for (j = 0; j < chunk; ++j) {
+      SV *sv = elems[i + j];
+      NV nv;
+      if (sv == NULL)
+        goto slow;
+      /* The same test List::Util uses to add up an element as an IV */
+      if (!SvNOK(sv) && SvIOK(sv))
+        ++nivs;
+      if (!pj_plain_nv(aTHX_ sv, &nv))
+        goto slow;
+      if (i + j == 0)
+        range.lo = range.hi = nv;
+      else if (nv < range.lo)
+        range.lo = nv;
+      else if (nv > range.hi)
+        range.hi = nv;
+      buf[j] = (double)nv;
+    }
+    j = (SSize_t)kernel(&acc, buf, (jit_nint)chunk, i == 0);
+    if (j < chunk) {
+      found = i + j;
+      break;
+    }
+  }
+
+  if (!pj_reduce_exact(aux, (found >= 0 ? found + 1 : n), &range, &iv))
+    goto slow;
+  /* The block returns IVs where List::Util keeps adding up IVs */
+  iv = iv && nivs == n;
+
+  switch (aux->kind) {
+  case pj_reduce_sum0:
+    result = (n == 0 ? sv_2mortal(newSViv(0)) : pj_reduce_result(aTHX_ acc, iv));
+    break;
+  case pj_reduce_first:
+    result = (found >= 0 ? elems[found] : &PL_sv_undef);
+    break;
+  case pj_reduce_any:
+    result = (found >= 0 ? &PL_sv_yes : &PL_sv_no);
+    break;
+  default:
+    result = (n == 0 ? &PL_sv_undef : pj_reduce_result(aTHX_ acc, iv));
+    break;
+  }
+
+  if (OP_GIMME(aux->entersub, block_gimme()) != G_VOID)
+    XPUSHs(result);
+  PUTBACK;
+  return aux->entersub->op_next;
+
+ slow:
+  PUSHMARK(SP);
+  return NORMAL;
+}
+
+void
+pj_reduce_free_aux(pTHX_ OP *o)
+{
+  pj_reduce_aux_t *aux = (pj_reduce_aux_t *)o->op_targ;
+
+  SvREFCNT_dec(aux->gv);
+  SvREFCNT_dec(aux->agv);
+  SvREFCNT_dec(aux->bgv);
+  SvREFCNT_dec(aux->arraygv);
+  pj_free_jit_function(aux->kernel_func);
+  pj_free_jit_function(aux->reassoc_func);
+  pj_free_tree(aux->ast);
+  free(aux);
+  o->op_targ = 0; /* important or Perl will use it to access the pad */
+}
+
+void
+pj_free_native_blocks(pTHX)
+{
+  PTABLE_ITER_t *iter;
+  PTABLE_ENTRY_t *entry;
+  pj_native_block_t *nb, *prev;
+  PERL_UNUSED_CONTEXT;
+
+  if (pj_native_blocks == NULL)
+    return;
+
+  /* Called after global destruction, so the GVs are gone already */
+  iter = PTABLE_iter_new(pj_native_blocks);
+  while ((entry = PTABLE_iter_next(iter)) != NULL) {
+    for (nb = (pj_native_block_t *)entry->value; nb != NULL; nb = prev) {
+      prev = nb->prev;
+      pj_free_tree(nb->ast);
+      free(nb);
+    }
+  }
+  PTABLE_iter_free(iter);
+
+  PTABLE_free(pj_native_blocks);
+  pj_native_blocks = NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef PJ_REDUCE_H_
+#define PJ_REDUCE_H_
+
+/* List::Util reductions over an array with a numeric block, like
+ *   sum(map { $_ * $_ } @x), reduce { $a + $b * $b } @x, first { $_ > 3 } @x
+ * done by a natively compiled loop over the array instead of running
+ * the block per element. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "pj_ast_terms.h"
+#include "pj_ast_jit.h"
+
+/* Elements converted to doubles per call of the kernel */
+#define PJ_REDUCE_CHUNK 256
+
+/* Accumulators of a sum under "use Perl::JIT 'reassociate'" */
+#define PJ_REDUCE_NACC 4
+
+typedef enum {
+  pj_reduce_sum,    /* sum(map BLOCK ARRAY) */
+  pj_reduce_sum0,
+  pj_reduce_min,
+  pj_reduce_max,
+  pj_reduce_reduce, /* reduce BLOCK ARRAY */
+  pj_reduce_first,
+  pj_reduce_any
+} pj_reduce_kind;
+
+/* The struct of per-OP data of the jitreduce OP */
+typedef struct {
+  pj_reduce_kind kind;
+  OP *entersub;         /* the call we do the work of, we continue after it */
+  GV *gv;               /* what the call goes through */
+  CV *cv;               /* and the XSUB it called at compile time */
+  GV *agv;              /* $a and $b for reduce, NULL otherwise */
+  GV *bgv;
+  GV *arraygv;          /* the array: a package array, */
+  PADOFFSET padix;      /* or a lexical array, or a lexical array reference */
+  bool deref;
+  pj_kernel_func_t kernel;
+  pj_kernel_func_t reassoc_kernel; /* with PJ_REDUCE_NACC accumulators, sums only */
+  jit_function_t kernel_func;  /* the compiled functions, released with the OP */
+  jit_function_t reassoc_func;
+  pj_term_t *ast;       /* the block, for telling whether it was exact */
+} pj_reduce_aux_t;
+
+/* Compiles the body of an anonymous sub that may turn out to be the
+ * block of a reduce/first/any, if it's a numeric expression of $a and
+ * $b or of $_. Must be called before the body is otherwise JIT'd. */
+void pj_compile_native_block(pTHX_ CV *cv);
+
+/* If o is a call to one of the List::Util functions we do, with a
+ * compiled block, over a single array, turn its PUSHMARK into a
+ * jitreduce OP. Everything else stays in place for the slow path.
+ * Returns whether it did so. */
+int pj_attempt_reduce(pTHX_ OP *o);
+
+/* The jitreduce OP implementation. Runs the kernel over the array and
+ * skips the call if the function hasn't been redefined and all elements
+ * are plain numbers. Otherwise, it's just a PUSHMARK. */
+OP *pj_pp_jit_reduce(pTHX);
+
+/* Frees the aux struct of a jitreduce OP */
+void pj_reduce_free_aux(pTHX_ OP *o);
+
+/* Releases all compiled blocks */
+void pj_free_native_blocks(pTHX);
+
+#endif
@@ -0,0 +1,403 @@
+#include "pj_sort.h"
+#include <stdlib.h>
+
+#include "ppport.h"
+#include "pj_debug.h"
+#include "pj_inline.h"
+#include "pj_native_sub.h"
+#include "pj_jit_op.h"
+
+/* $a or $b, returns its GV. Still rv2sv(gv) before perl's peephole
+ * optimizer turned it into a gvsv, unless ck_sort already had the
+ * block optimized. deref is what the variable needs to yield. */
+static GV *
+pj_sort_match_var(pTHX_ OP *o, U8 deref)
+{
+  GV *gv;
+
+  if (o->op_type == OP_NULL && o->op_targ == OP_RV2SV && (o->op_flags & OPf_KIDS))
+    o = cUNOPo->op_first;
+
+  if (o->op_type == OP_GVSV && deref == 0)
+    gv = cGVOPo_gv;
+  else if (o->op_type == OP_RV2SV && (o->op_private & OPpDEREF) == deref
+           && cUNOPo->op_first->op_type == OP_GV)
+    gv = cGVOPx_gv(cUNOPo->op_first);
+  else
+    return NULL;
+
+  if ((o->op_private & OPpLVAL_INTRO) || GvNAMELEN(gv) != 1
+      || (GvNAME(gv)[0] != 'a' && GvNAME(gv)[0] != 'b'))
+  {
+    return NULL;
+  }
+  return gv;
+}
+
+/* One side of a comparison. Fills in key (the constant key still
+ * borrowed from the OP tree) and the GV of $a or $b. */
+static int
+pj_sort_match_key(pTHX_ OP *o, pj_sort_key_t *key, GV **gvp)
+{
+  OP *first, *keyop;
+
+  Zero(key, 1, pj_sort_key_t);
+  if ((*gvp = pj_sort_match_var(aTHX_ o, 0)) != NULL) {
+    key->kind = pj_sort_key_self;
+    return 1;
+  }
+
+  if ((o->op_type != OP_AELEM && o->op_type != OP_HELEM) || (o->op_flags & OPf_MOD)
+      || (o->op_private & (OPpLVAL_INTRO|OPpLVAL_DEFER|OPpMAYBE_LVSUB|OPpDEREF)))
+  {
+    return 0;
+  }
+  first = cBINOPo->op_first;
+  keyop = first->op_sibling;
+  if (keyop == NULL)
+    return 0;
+
+  /* $h{$a} */
+  if (o->op_type == OP_HELEM
+      && ((first->op_type == OP_PADHV && !(first->op_private & OPpLVAL_INTRO))
+          || (first->op_type == OP_RV2HV && (first->op_flags & OPf_KIDS)
+              && cUNOPx(first)->op_first->op_type == OP_GV)))
+  {
+    if ((*gvp = pj_sort_match_var(aTHX_ keyop, 0)) == NULL)
+      return 0;
+    key->kind = pj_sort_key_lookup;
+    if (first->op_type == OP_PADHV)
+      key->padhv = first->op_targ;
+    else
+      key->hashgv = cGVOPx_gv(cUNOPx(first)->op_first);
+    return 1;
+  }
+
+  /* $a->[CONST], $a->{CONST} */
+  if (first->op_type != (o->op_type == OP_AELEM ? OP_RV2AV : OP_RV2HV)
+      || !(first->op_flags & OPf_KIDS)
+      || keyop->op_type != OP_CONST || SvROK(cSVOPx_sv(keyop)))
+  {
+    return 0;
+  }
+  *gvp = pj_sort_match_var(aTHX_ cUNOPx(first)->op_first,
+                           o->op_type == OP_AELEM ? OPpDEREF_AV : OPpDEREF_HV);
+  if (*gvp == NULL)
+    return 0;
+
+  if (o->op_type == OP_AELEM) {
+    key->kind = pj_sort_key_aelem;
+    key->index = SvIV(cSVOPx_sv(keyop));
+  }
+  else {
+    key->kind = pj_sort_key_helem;
+    key->key = cSVOPx_sv(keyop);
+  }
+  return 1;
+}
+
+static int
+pj_sort_same_key(pTHX_ const pj_sort_key_t *x, const pj_sort_key_t *y)
+{
+  if (x->kind != y->kind)
+    return 0;
+  switch (x->kind) {
+  case pj_sort_key_aelem:
+    return x->index == y->index;
+  case pj_sort_key_helem:
+    return sv_eq(x->key, y->key);
+  case pj_sort_key_lookup:
+    return x->padhv == y->padhv && x->hashgv == y->hashgv;
+  default:
+    return 1;
+  }
+}
+
+/* KEY($a) <=> KEY($b) || ..., in the order they're compared */
+static int
+pj_sort_match_expr(pTHX_ OP *o, pj_sort_aux_t *aux)
+{
+  pj_sort_key_t x, y;
+  GV *gvx, *gvy, *tmp;
+  OP *left;
+
+  if ((o = pj_single_expr(o)) == NULL)
+    return 0;
+
+  if (o->op_type == OP_OR) {
+    return pj_sort_match_expr(aTHX_ cLOGOPo->op_first, aux)
+           && pj_sort_match_expr(aTHX_ cLOGOPo->op_first->op_sibling, aux);
+  }
+
+  /* Not i_ncmp: use integer truncates the keys */
+  if (o->op_type != OP_NCMP || aux->nkeys == PJ_SORT_MAX_KEYS)
+    return 0;
+
+  left = cBINOPo->op_first;
+  if (!pj_sort_match_key(aTHX_ left, &x, &gvx)
+      || !pj_sort_match_key(aTHX_ left->op_sibling, &y, &gvy)
+      || !pj_sort_same_key(aTHX_ &x, &y) || gvx == gvy)
+  {
+    return 0;
+  }
+
+  /* $b's key first sorts in descending order */
+  x.descending = (GvNAME(gvx)[0] == 'b');
+  if (x.descending) {
+    tmp = gvx;
+    gvx = gvy;
+    gvy = tmp;
+  }
+  if (GvNAME(gvx)[0] != 'a' || GvNAME(gvy)[0] != 'b')
+    return 0;
+
+  if (aux->agv == NULL) {
+    aux->agv = gvx;
+    aux->bgv = gvy;
+  }
+  else if (aux->agv != gvx || aux->bgv != gvy) {
+    return 0;
+  }
+
+  aux->keys[aux->nkeys++] = x;
+  return 1;
+}
+
+int
+pj_attempt_sort(pTHX_ OP *o)
+{
+  pj_sort_aux_t *aux;
+  OP *block;
+  unsigned int i;
+
+  /* Only sort BLOCK LIST. Plain sort and sort { $a <=> $b } are done
+   * by perl without a block already. */
+  if (o->op_type != OP_SORT || o->op_targ != 0
+      || (o->op_flags & (OPf_STACKED|OPf_SPECIAL)) != (OPf_STACKED|OPf_SPECIAL))
+  {
+    return 0;
+  }
+
+  block = cLISTOPo->op_first->op_sibling;
+  if (block == NULL || block->op_type != OP_NULL || !(block->op_flags & OPf_KIDS))
+    return 0;
+
+  aux = (pj_sort_aux_t *)malloc(sizeof(pj_sort_aux_t));
+  aux->agv = aux->bgv = NULL;
+  aux->nkeys = 0;
+  if (!pj_sort_match_expr(aTHX_ cUNOPx(block)->op_first, aux)) {
+    free(aux);
+    return 0;
+  }
+
+  PJ_DEBUG_1("Sorting natively by %u keys\n", aux->nkeys);
+  SvREFCNT_inc_simple_void_NN(aux->agv);
+  SvREFCNT_inc_simple_void_NN(aux->bgv);
+  for (i = 0; i < aux->nkeys; ++i) {
+    pj_sort_key_t *key = &aux->keys[i];
+    if (key->kind == pj_sort_key_helem) {
+      STRLEN len;
+      const char *pv = SvPV_const(key->key, len);
+      key->key = newSVpvn_share(pv, SvUTF8(key->key) ? -(I32)len : (I32)len, 0);
+      key->hash = SvSHARED_HASH(key->key);
+    }
+    else if (key->kind == pj_sort_key_lookup && key->hashgv != NULL) {
+      SvREFCNT_inc_simple_void_NN(key->hashgv);
+    }
+  }
+
+  o->op_type = OP_CUSTOM;
+  o->op_ppaddr = pj_pp_jit_sort;
+  o->op_targ = (PADOFFSET)PTR2UV(aux);
+
+  return 1;
+}
+
+/* The numeric value of sv as <=> would compare it, if getting that
+ * has no side effects */
+PJ_STATIC_INLINE int
+pj_sort_num(pTHX_ SV *sv, NV *nv)
+{
+  /* <=> yields undef for NaN */
+  return pj_plain_nv(aTHX_ sv, nv) && !Perl_isnan(*nv);
+}
+
+static int
+pj_sort_extract(pTHX_ const pj_sort_key_t *key, SV *item, NV *nv)
+{
+  SV *sv, *container;
+  HE *he;
+
+  switch (key->kind) {
+  case pj_sort_key_self:
+    sv = item;
+    break;
+
+  case pj_sort_key_aelem:
+  case pj_sort_key_helem:
+    if (SvGMAGICAL(item) || !SvROK(item) || SvAMAGIC(item))
+      return 0;
+    container = SvRV(item);
+    if (SvTYPE(container) != (key->kind == pj_sort_key_aelem ? SVt_PVAV : SVt_PVHV)
+        || SvRMAGICAL(container))
+    {
+      return 0;
+    }
+    if (key->kind == pj_sort_key_aelem) {
+      IV i = key->index;
+      if (i < 0)
+        i += AvFILLp((AV *)container) + 1;
+      if (i < 0 || i > AvFILLp((AV *)container))
+        return 0;
+      sv = AvARRAY((AV *)container)[i];
+    }
+    else {
+      he = hv_fetch_ent((HV *)container, key->key, 0, key->hash);
+      sv = (he != NULL ? HeVAL(he) : NULL);
+    }
+    break;
+
+  case pj_sort_key_lookup:
+    container = (key->hashgv != NULL ? (SV *)GvHV(key->hashgv) : PAD_SV(key->padhv));
+    if (container == NULL || SvRMAGICAL(container) || SvGMAGICAL(item)
+        || SvROK(item) || !SvOK(item))
+    {
+      return 0;
+    }
+    he = hv_fetch_ent((HV *)container, item, 0, 0);
+    sv = (he != NULL ? HeVAL(he) : NULL);
+    break;
+
+  default:
+    return 0;
+  }
+
+  return sv != NULL && pj_sort_num(aTHX_ sv, nv);
+}
+
+PJ_STATIC_INLINE int
+pj_sort_cmp(const pj_sort_aux_t *aux, const NV *x, const NV *y)
+{
+  unsigned int k;
+
+  for (k = 0; k < aux->nkeys; ++k) {
+    if (x[k] < y[k])
+      return aux->keys[k].descending ? 1 : -1;
+    if (x[k] > y[k])
+      return aux->keys[k].descending ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Bottom-up merge sort of the item numbers in order (with n more of
+ * scratch space in tmp) by their keys. Stable, like perl's mergesort.
+ * Returns whichever of the two buffers ends up sorted. */
+static SSize_t *
+pj_sort_merge(const pj_sort_aux_t *aux, const NV *keys,
+              SSize_t *order, SSize_t *tmp, SSize_t n)
+{
+  const unsigned int nkeys = aux->nkeys;
+  SSize_t width, lo, mid, hi, i, j, out;
+  SSize_t *swap;
+
+  for (width = 1; width < n; width *= 2) {
+    for (lo = 0; lo < n; lo += 2 * width) {
+      mid = (lo + width < n ? lo + width : n);
+      hi = (lo + 2 * width < n ? lo + 2 * width : n);
+      i = lo;
+      j = mid;
+      out = lo;
+      while (i < mid && j < hi) {
+        /* Ties go to the left run */
+        if (pj_sort_cmp(aux, &keys[order[j] * nkeys], &keys[order[i] * nkeys]) < 0)
+          tmp[out++] = order[j++];
+        else
+          tmp[out++] = order[i++];
+      }
+      while (i < mid)
+        tmp[out++] = order[i++];
+      while (j < hi)
+        tmp[out++] = order[j++];
+    }
+    swap = order;
+    order = tmp;
+    tmp = swap;
+  }
+  return order;
+}
+
+OP *
+pj_pp_jit_sort(pTHX)
+{
+  dSP;
+  SV **mark = PL_stack_base + TOPMARK;
+  const pj_sort_aux_t *aux = (const pj_sort_aux_t *)PL_op->op_targ;
+  const SSize_t n = SP - mark;
+  const unsigned int nkeys = aux->nkeys;
+  SSize_t *order, *sorted, i;
+  unsigned int k;
+  NV *keys;
+  SV **items;
+
+  /* Same $a and $b as pp_sort would set */
+  if (GIMME_V != G_ARRAY || n < 2
+      || aux->agv != gv_fetchpvs("a", GV_ADD|GV_NOTQUAL, SVt_PV)
+      || aux->bgv != gv_fetchpvs("b", GV_ADD|GV_NOTQUAL, SVt_PV))
+  {
+    return PL_ppaddr[OP_SORT](aTHX);
+  }
+
+  /* All keys up front, so falling back doesn't repeat anything */
+  Newx(keys, n * nkeys, NV);
+  for (i = 0; i < n; ++i) {
+    SV *item = mark[i + 1];
+    for (k = 0; k < nkeys; ++k) {
+      if (item == NULL || !pj_sort_extract(aTHX_ &aux->keys[k], item, &keys[i * nkeys + k])) {
+        Safefree(keys);
+        return PL_ppaddr[OP_SORT](aTHX);
+      }
+    }
+  }
+
+  Newx(order, 2 * n, SSize_t);
+  for (i = 0; i < n; ++i)
+    order[i] = i;
+  sorted = pj_sort_merge(aux, keys, order, order + n, n);
+
+  Newx(items, n, SV *);
+  Copy(mark + 1, items, n, SV *);
+  for (i = 0; i < n; ++i) {
+    SV *sv = items[sorted[i]];
+    /* Like pp_sort, don't hand out pad temporaries, and don't let
+     * assignments steal the buffers of the sorted items */
+    if (SvPADTMP(sv))
+      sv = sv_mortalcopy(sv);
+    SvTEMP_off(sv);
+    mark[i + 1] = sv;
+  }
+
+  Safefree(items);
+  Safefree(order);
+  Safefree(keys);
+
+  (void)POPMARK;
+  return NORMAL;
+}
+
+void
+pj_sort_free_aux(pTHX_ OP *o)
+{
+  pj_sort_aux_t *aux = (pj_sort_aux_t *)o->op_targ;
+  unsigned int i;
+
+  for (i = 0; i < aux->nkeys; ++i) {
+    if (aux->keys[i].kind == pj_sort_key_helem)
+      SvREFCNT_dec(aux->keys[i].key);
+    else if (aux->keys[i].kind == pj_sort_key_lookup)
+      SvREFCNT_dec(aux->keys[i].hashgv);
+  }
+  SvREFCNT_dec(aux->agv);
+  SvREFCNT_dec(aux->bgv);
+  free(aux);
+  o->op_targ = 0; /* important or Perl will use it to access the pad */
+}
@@ -0,0 +1,55 @@
+#ifndef PJ_SORT_H_
+#define PJ_SORT_H_
+
+/* sort BLOCKs that just compare numeric keys of $a and $b, such as
+ *   sort { $a->[1] <=> $b->[1] || $h{$b} <=> $h{$a} } LIST
+ * done by a custom OP that extracts all keys once and sorts natively. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+/* Comparators with more keys than this are left alone */
+#define PJ_SORT_MAX_KEYS 8
+
+typedef enum {
+  pj_sort_key_self,     /* $a */
+  pj_sort_key_aelem,    /* $a->[CONST] */
+  pj_sort_key_helem,    /* $a->{CONST} */
+  pj_sort_key_lookup    /* $h{$a}, %h being a lexical or a package hash */
+} pj_sort_key_kind;
+
+/* One key of the comparator */
+typedef struct {
+  pj_sort_key_kind kind;
+  int descending;       /* $b's key first */
+  SV *key;              /* shared key for helem, with precomputed hash */
+  U32 hash;
+  IV index;             /* for aelem */
+  PADOFFSET padhv;      /* the lexical hash for lookup, 0 if it's hashgv */
+  GV *hashgv;
+} pj_sort_key_t;
+
+/* The struct of per-OP data of the jitsort OP */
+typedef struct {
+  GV *agv;              /* what the block calls $a and $b */
+  GV *bgv;
+  unsigned int nkeys;
+  pj_sort_key_t keys[PJ_SORT_MAX_KEYS];
+} pj_sort_aux_t;
+
+/* If o is a sort with a BLOCK made up of numeric comparisons of keys
+ * of $a and $b (chained with ||), turn it into a jitsort OP. The block
+ * stays in place for the slow path. Returns whether it did so. */
+int pj_attempt_sort(pTHX_ OP *o);
+
+/* The jitsort OP implementation. Extracts the keys of all items into a
+ * packed array and merge sorts that, which is stable like perl's own
+ * sort. Anything the keys can't be extracted from without side effects
+ * (magic, overloading, missing or non-numeric keys, NaN) and scalar
+ * context fall back to pp_sort. */
+OP *pj_pp_jit_sort(pTHX);
+
+/* Frees the aux struct of a jitsort OP */
+void pj_sort_free_aux(pTHX_ OP *o);
+
+#endif
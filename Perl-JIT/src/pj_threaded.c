@@ -0,0 +1,434 @@
+#include "pj_threaded.h"
+#include <stdlib.h>
+
+#include "ppport.h"
+#include "ptable.h"
+#include "stack.h"
+#include "pj_debug.h"
+
+#include "pj_global_state.h"
+#include "pj_native_sub.h"
+
+/* Hooked first OPs to their subs */
+static PTABLE_t *pj_threaded_subs = NULL;
+
+/* Hooked OPs after calls to their pj_threaded_resume_t */
+static PTABLE_t *pj_threaded_resumes = NULL;
+
+#ifdef MULTIPLICITY
+#  define PJ_THREADED_INTERP aTHX
+#else
+#  define PJ_THREADED_INTERP NULL
+#endif
+
+void
+pj_install_threaded_sub(pTHX_ OP *start, OP *root, unsigned int min_calls)
+{
+  pj_threaded_sub_t *ts;
+
+  if (start == NULL || root == NULL || PL_perldb || start->op_ppaddr == pj_pp_threaded_enter)
+    return;
+
+  ts = (pj_threaded_sub_t *)malloc(sizeof(pj_threaded_sub_t));
+  ts->orig_ppaddr = start->op_ppaddr;
+  ts->root = root;
+  ts->ncalls = 0;
+  ts->min_calls = min_calls;
+  ts->ops = NULL;
+  ts->nops = 0;
+  ts->func = NULL;
+  ts->function = NULL;
+
+  if (pj_threaded_subs == NULL)
+    pj_threaded_subs = PTABLE_new();
+  PTABLE_store(pj_threaded_subs, start, ts);
+  start->op_ppaddr = pj_pp_threaded_enter;
+}
+
+static void
+pj_threaded_free_sub(pj_threaded_sub_t *ts)
+{
+  free(ts->ops);
+  pj_free_jit_function(ts->function);
+  free(ts);
+}
+
+/* Gives up on the sub for good */
+static OP *
+pj_threaded_uninstall(pTHX_ pj_threaded_sub_t *ts)
+{
+  Perl_ppaddr_t ppaddr = ts->orig_ppaddr;
+
+  PL_op->op_ppaddr = ppaddr;
+  PTABLE_delete(pj_threaded_subs, PL_op);
+  pj_threaded_free_sub(ts);
+  return ppaddr(aTHX);
+}
+
+static int
+pj_threaded_op_cmp(const void *a, const void *b)
+{
+  const OP *x = *(const OP * const *)a;
+  const OP *y = *(const OP * const *)b;
+  return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/* Index of o in the sub's OPs, -1 if it's not one of them. Also called
+ * from the compiled code for OPs that only pp functions know about,
+ * such as the targets of next and last. */
+static jit_nint
+pj_threaded_find(void *sub, void *o)
+{
+  const pj_threaded_sub_t *ts = (const pj_threaded_sub_t *)sub;
+  unsigned int lo = 0, hi = ts->nops;
+
+  while (lo < hi) {
+    const unsigned int mid = lo + (hi - lo) / 2;
+    if (ts->ops[mid] == (OP *)o)
+      return (jit_nint)mid;
+    if ((OP *)ts->ops[mid] < (OP *)o)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+/* All OPs of the tree, nulled ones included: some are still run */
+static int
+pj_threaded_collect_ops(pTHX_ pj_threaded_sub_t *ts)
+{
+  ptrstack_t *todo = ptrstack_make(32, 0);
+  unsigned int max = 64;
+  OP *o, *kid;
+
+  ts->ops = (OP **)malloc(max * sizeof(OP *));
+  ptrstack_push(todo, ts->root);
+  while (!ptrstack_empty(todo)) {
+    o = (OP *)ptrstack_pop(todo);
+
+    if (ts->nops == PJ_THREADED_MAX_OPS) {
+      ptrstack_free(todo);
+      return 0;
+    }
+    if (ts->nops == max) {
+      max *= 2;
+      ts->ops = (OP **)realloc(ts->ops, max * sizeof(OP *));
+    }
+    ts->ops[ts->nops++] = o;
+
+    if (o->op_flags & OPf_KIDS) {
+      for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling)
+        ptrstack_push(todo, kid);
+    }
+    if (OP_CLASS(o) == OA_PMOP && o->op_type != OP_PUSHRE
+        && (kid = cPMOPo->op_pmreplrootu.op_pmreplroot) != NULL)
+    {
+      ptrstack_push(todo, kid);
+    }
+  }
+  ptrstack_free(todo);
+
+  qsort(ts->ops, ts->nops, sizeof(OP *), pj_threaded_op_cmp);
+  return 1;
+}
+
+/* OPs that may return into other code (a sub, an eval) which returns
+ * to their op_next when it's done */
+static int
+pj_threaded_is_call(OP *o)
+{
+  switch (o->op_type) {
+  case OP_ENTERSUB:
+  case OP_ENTEREVAL:
+  case OP_REQUIRE:
+  case OP_DOFILE:
+    return 1;
+  default:
+    return o->op_ppaddr == pj_pp_jit_entersub;
+  }
+}
+
+/* The OPs to hook after compilation so that returns from calls come
+ * back into the compiled function: resume[i] is set for ts->ops[i]. */
+static char *
+pj_threaded_find_resumes(pj_threaded_sub_t *ts, OP *start)
+{
+  char *resume = (char *)calloc(ts->nops, 1);
+  unsigned int i;
+  jit_nint j;
+
+  for (i = 0; i < ts->nops; ++i) {
+    OP *next = ts->ops[i]->op_next;
+    if (!pj_threaded_is_call(ts->ops[i]) || next == NULL || next == start
+        || next->op_ppaddr == pj_pp_threaded_enter
+        || next->op_ppaddr == pj_pp_threaded_resume
+        || (j = pj_threaded_find(ts, next)) < 0)
+    {
+      continue;
+    }
+    resume[j] = 1;
+  }
+  return resume;
+}
+
+static void
+pj_threaded_install_resumes(pj_threaded_sub_t *ts, OP *start, const char *resume)
+{
+  pj_threaded_resume_t *tr;
+  unsigned int i;
+
+  for (i = 0; i < ts->nops; ++i) {
+    if (!resume[i])
+      continue;
+    tr = (pj_threaded_resume_t *)malloc(sizeof(pj_threaded_resume_t));
+    tr->orig_ppaddr = ts->ops[i]->op_ppaddr;
+    tr->start = start;
+    if (pj_threaded_resumes == NULL)
+      pj_threaded_resumes = PTABLE_new();
+    PTABLE_store(pj_threaded_resumes, ts->ops[i], tr);
+    ts->ops[i]->op_ppaddr = pj_pp_threaded_resume;
+  }
+}
+
+/* r = (*ppaddr)(aTHX). A direct call to known if ppaddr is NULL.
+ * pp functions may die, hence NOTHROW. */
+static void
+pj_threaded_emit_pp_call(jit_function_t function, jit_type_t pp_signature, jit_value_t interp,
+                         jit_value_t r, const char *name, Perl_ppaddr_t known, jit_value_t ppaddr)
+{
+#ifdef MULTIPLICITY
+  jit_value_t *args = &interp;
+  const unsigned int nargs = 1;
+#else
+  jit_value_t *args = NULL;
+  const unsigned int nargs = 0;
+  PERL_UNUSED_VAR(interp);
+#endif
+
+  if (ppaddr == NULL)
+    jit_insn_store(function, r, jit_insn_call_native(function, name, (void *)known, pp_signature,
+                                                     args, nargs, JIT_CALL_NOTHROW));
+  else
+    jit_insn_store(function, r, jit_insn_call_indirect(function, ppaddr, pp_signature,
+                                                       args, nargs, JIT_CALL_NOTHROW));
+}
+
+/* Branch to the OP's label if r is target, which may or may not be one
+ * of the sub's OPs */
+static void
+pj_threaded_emit_edge(jit_function_t function, pj_threaded_sub_t *ts, jit_label_t *labels,
+                      jit_value_t r, OP *target)
+{
+  jit_nint i;
+
+  if (target == NULL || (i = pj_threaded_find(ts, target)) < 0)
+    return;
+  jit_insn_branch_if(function,
+                     jit_insn_eq(function, r, jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)target)),
+                     &labels[i]);
+}
+
+static int
+pj_threaded_compile(pTHX_ pj_threaded_sub_t *ts, OP *start)
+{
+  jit_function_t function;
+  jit_type_t params[2], signature, pp_signature, find_signature;
+  jit_value_t interp, opaddr, r, idx, args[2];
+  jit_label_t *labels;
+  char *resume;
+  jit_label_t dispatchlabel = jit_label_undefined;
+  jit_label_t exitlabel = jit_label_undefined;
+  unsigned int i;
+
+  if (!pj_threaded_collect_ops(aTHX_ ts))
+    return 0;
+
+  PJ_DEBUG_1("Compiling %u OPs into threaded code\n", ts->nops);
+  jit_context_build_start(PJ_jit_context);
+
+  params[0] = jit_type_void_ptr;
+  params[1] = jit_type_nint;
+  signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void_ptr, params, 2, 1);
+#ifdef MULTIPLICITY
+  pp_signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void_ptr, params, 1, 1);
+#else
+  pp_signature = jit_type_create_signature(jit_abi_cdecl, jit_type_void_ptr, NULL, 0, 1);
+#endif
+  params[1] = jit_type_void_ptr;
+  find_signature = jit_type_create_signature(jit_abi_cdecl, jit_type_nint, params, 2, 1);
+
+  function = jit_function_create(PJ_jit_context, signature);
+  interp = jit_value_get_param(function, 0);
+  r = jit_value_create(function, jit_type_void_ptr);
+
+  /* &PL_op */
+#ifdef MULTIPLICITY
+  opaddr = jit_insn_add_relative(function, interp, STRUCT_OFFSET(struct interpreter, Iop));
+#else
+  PERL_UNUSED_VAR(interp);
+  opaddr = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)&PL_op);
+#endif
+
+  labels = (jit_label_t *)malloc(ts->nops * sizeof(jit_label_t));
+  for (i = 0; i < ts->nops; ++i)
+    labels[i] = jit_label_undefined;
+
+  jit_insn_jump_table(function, jit_value_get_param(function, 1), labels, ts->nops);
+
+  resume = pj_threaded_find_resumes(ts, start);
+
+  /* PL_op = o; r = o->op_ppaddr(aTHX); and on to the OP that r is.
+   * op_ppaddr is read when the OP runs: it may be hooked again later
+   * (JIT OPs tiering up, trace recording). As long as it's still what
+   * it was at compile time, the call is a direct one. Our own hooks
+   * stand for the original pp functions. */
+  for (i = 0; i < ts->nops; ++i) {
+    OP *o = ts->ops[i];
+    jit_value_t opval = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)o);
+    jit_value_t ppaddr;
+
+    jit_insn_label(function, &labels[i]);
+    jit_insn_store_relative(function, opaddr, 0, opval);
+    if (o == start) {
+      pj_threaded_emit_pp_call(function, pp_signature, interp, r, OP_NAME(o), ts->orig_ppaddr, NULL);
+    }
+    else {
+      jit_label_t hookedlabel = jit_label_undefined;
+      jit_label_t calledlabel = jit_label_undefined;
+      Perl_ppaddr_t expected = (resume[i] ? pj_pp_threaded_resume : o->op_ppaddr);
+
+      ppaddr = jit_insn_load_relative(function, opval, STRUCT_OFFSET(OP, op_ppaddr), jit_type_void_ptr);
+      jit_insn_branch_if_not(function,
+                             jit_insn_eq(function, ppaddr, jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)expected)),
+                             &hookedlabel);
+      pj_threaded_emit_pp_call(function, pp_signature, interp, r, OP_NAME(o), o->op_ppaddr, NULL);
+      jit_insn_branch(function, &calledlabel);
+      jit_insn_label(function, &hookedlabel);
+      pj_threaded_emit_pp_call(function, pp_signature, interp, r, NULL, NULL, ppaddr);
+      jit_insn_label(function, &calledlabel);
+    }
+
+    pj_threaded_emit_edge(function, ts, labels, r, o->op_next);
+    if (OP_CLASS(o) == OA_LOGOP)
+      pj_threaded_emit_edge(function, ts, labels, r, cLOGOPo->op_other);
+    jit_insn_branch(function, &dispatchlabel);
+  }
+
+  /* Somewhere else: one of ours after all, or back to the run loop */
+  jit_insn_label(function, &dispatchlabel);
+  args[0] = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)ts);
+  args[1] = r;
+  idx = jit_insn_call_native(function, "pj_threaded_find", (void *)pj_threaded_find,
+                             find_signature, args, 2, JIT_CALL_NOTHROW);
+  jit_insn_branch_if(function,
+                     jit_insn_lt(function, idx, jit_value_create_nint_constant(function, jit_type_nint, 0)),
+                     &exitlabel);
+  jit_insn_jump_table(function, idx, labels, ts->nops);
+
+  jit_insn_label(function, &exitlabel);
+  jit_insn_return(function, r);
+
+  jit_function_compile(function);
+  jit_context_build_end(PJ_jit_context);
+  free(labels);
+
+  ts->function = function;
+  ts->func = (pj_threaded_func_t)jit_function_to_closure(function);
+  if (ts->func != NULL)
+    pj_threaded_install_resumes(ts, start, resume);
+  free(resume);
+  return ts->func != NULL;
+}
+
+OP *
+pj_pp_threaded_enter(pTHX)
+{
+  pj_threaded_sub_t *ts = (pj_threaded_sub_t *)PTABLE_fetch(pj_threaded_subs, PL_op);
+
+  /* Debuggers and profilers want to see every OP */
+  if (PL_runops != Perl_runops_standard)
+    return ts->orig_ppaddr(aTHX);
+
+  if (ts->func == NULL) {
+    if (++ts->ncalls < ts->min_calls)
+      return ts->orig_ppaddr(aTHX);
+    if (!pj_threaded_compile(aTHX_ ts, PL_op))
+      return pj_threaded_uninstall(aTHX_ ts);
+  }
+
+  return ts->func(PJ_THREADED_INTERP, pj_threaded_find(ts, PL_op));
+}
+
+OP *
+pj_pp_threaded_resume(pTHX)
+{
+  pj_threaded_resume_t *tr = (pj_threaded_resume_t *)PTABLE_fetch(pj_threaded_resumes, PL_op);
+  pj_threaded_sub_t *ts;
+  jit_nint i;
+
+  /* The sub may have been freed, and its first OP's address reused */
+  if (PL_runops != Perl_runops_standard
+      || (ts = (pj_threaded_sub_t *)PTABLE_fetch(pj_threaded_subs, tr->start)) == NULL
+      || ts->func == NULL || (i = pj_threaded_find(ts, PL_op)) < 0)
+  {
+    return tr->orig_ppaddr(aTHX);
+  }
+
+  return ts->func(PJ_THREADED_INTERP, i);
+}
+
+void
+pj_threaded_free_op(pTHX_ OP *o)
+{
+  pj_threaded_sub_t *ts;
+  pj_threaded_resume_t *tr;
+  PERL_UNUSED_CONTEXT;
+
+  if (o->op_ppaddr == pj_pp_threaded_resume) {
+    if (pj_threaded_resumes != NULL
+        && (tr = (pj_threaded_resume_t *)PTABLE_fetch(pj_threaded_resumes, o)) != NULL)
+    {
+      PTABLE_delete(pj_threaded_resumes, o);
+      free(tr);
+    }
+    return;
+  }
+
+  if (pj_threaded_subs == NULL
+      || (ts = (pj_threaded_sub_t *)PTABLE_fetch(pj_threaded_subs, o)) == NULL)
+  {
+    return;
+  }
+  PTABLE_delete(pj_threaded_subs, o);
+  pj_threaded_free_sub(ts);
+}
+
+void
+pj_free_threaded_subs(pTHX)
+{
+  PTABLE_ITER_t *iter;
+  PTABLE_ENTRY_t *entry;
+  PERL_UNUSED_CONTEXT;
+
+  if (pj_threaded_resumes != NULL) {
+    iter = PTABLE_iter_new(pj_threaded_resumes);
+    while ((entry = PTABLE_iter_next(iter)) != NULL)
+      free(entry->value);
+    PTABLE_iter_free(iter);
+
+    PTABLE_free(pj_threaded_resumes);
+    pj_threaded_resumes = NULL;
+  }
+
+  if (pj_threaded_subs == NULL)
+    return;
+
+  iter = PTABLE_iter_new(pj_threaded_subs);
+  while ((entry = PTABLE_iter_next(iter)) != NULL)
+    pj_threaded_free_sub((pj_threaded_sub_t *)entry->value);
+  PTABLE_iter_free(iter);
+
+  PTABLE_free(pj_threaded_subs);
+  pj_threaded_subs = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef PJ_THREADED_H_
+#define PJ_THREADED_H_
+
+/* The baseline tier: all OPs of a sub compiled into a native function
+ * that calls their pp functions one after the other, and
+ * follows op_next and op_other with direct branches instead of going
+ * through the run loop's indirect call. Hooked into the sub's first OP,
+ * compiled once the sub has been entered often enough. */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+#include <jit/jit.h>
+
+/* Entries of a sub before it's compiled. The main program only runs
+ * once, so it's compiled right away. */
+#define PJ_THREADED_MIN_CALLS 8
+
+/* Subs with more OPs than this are left to the run loop */
+#define PJ_THREADED_MAX_OPS 4096
+
+/* The compiled function. Runs from the OP at index first of ops on for
+ * as long as the pp functions return OPs of the sub and returns the
+ * first one that isn't (a called sub's first OP, the caller's next OP,
+ * NULL...) for the run loop to carry on with. interp is my_perl, if
+ * there is one. */
+typedef OP *(*pj_threaded_func_t)(void *interp, jit_nint first);
+
+typedef struct {
+  Perl_ppaddr_t orig_ppaddr;  /* of the first OP, which we've hooked */
+  OP *root;                   /* of the sub */
+  unsigned int ncalls;
+  unsigned int min_calls;
+  OP **ops;                   /* all OPs of the sub, sorted by address */
+  unsigned int nops;
+  pj_threaded_func_t func;    /* NULL until compiled */
+  jit_function_t function;    /* what func is the closure of */
+} pj_threaded_sub_t;
+
+/* The OPs that calls (entersub, require...) return to are hooked, too,
+ * once the sub is compiled, so the run loop goes back into the compiled
+ * function when the called code is done. */
+typedef struct {
+  Perl_ppaddr_t orig_ppaddr;  /* of the hooked OP */
+  OP *start;                  /* first OP of the sub it belongs to */
+} pj_threaded_resume_t;
+
+/* Hooks the first OP of the OP tree rooted at root. Must be called
+ * after the peephole optimizer is done with it. */
+void pj_install_threaded_sub(pTHX_ OP *start, OP *root, unsigned int min_calls);
+
+/* The hooked first OP's implementation: counts, compiles and runs the
+ * compiled function, or just the original pp function. */
+OP *pj_pp_threaded_enter(pTHX);
+
+/* The hooked OPs after calls: back into the compiled function at
+ * that OP, or just the original pp function if there's none (anymore). */
+OP *pj_pp_threaded_resume(pTHX);
+
+/* Forgets about the sub if o is its hooked first OP, or about the OP
+ * if it's hooked after a call */
+void pj_threaded_free_op(pTHX_ OP *o);
+
+/* Releases all subs' data */
+void pj_free_threaded_subs(pTHX);
+
+#endif
@@ -0,0 +1,739 @@
+#include "pj_trace.h"
+#include <stdlib.h>
+
+#include "ppport.h"
+#include "ptable.h"
+#include "pj_debug.h"
+#include "pj_inline.h"
+
+#include "pj_global_state.h"
+#include "pj_op_map.h"
+#include "pj_jit_op.h"
+#include "pj_native_sub.h"
+
+/* Hooked UNSTACK OPs to their loops */
+static PTABLE_t *pj_traces = NULL;
+
+/* An OP of the recording and the flags of the lexical it read, if any */
+typedef struct {
+  OP *op;
+  U32 svflags;
+} pj_trace_rec_t;
+
+/* The loop being recorded, there's one at a time */
+static pj_trace_t *pj_trace_current = NULL;
+static pj_trace_rec_t pj_trace_buf[PJ_TRACE_MAX_OPS];
+static unsigned int pj_trace_nrec = 0;
+
+/* Doubles are exact up to here */
+#define PJ_TRACE_MAX_EXACT_IV ((IV)1 << 53)
+
+/* What an OP of the recording does in the trace */
+typedef enum {
+  pj_trace_op_other,  /* nothing of its own: statement boundary, part of an expression or unsupported */
+  pj_trace_op_guard,  /* AND/OR/COND_EXPR deciding where to go on */
+  pj_trace_op_assign, /* $x = EXPR */
+  pj_trace_op_modify, /* $x += EXPR and friends */
+  pj_trace_op_targ,   /* my $x; $x = $y + 1, with the assignment optimized away */
+  pj_trace_op_incdec  /* $x++ and friends */
+} pj_trace_op_kind;
+
+/* Lexicals and exits of the trace being compiled */
+typedef struct {
+  PADOFFSET padix[PJ_TRACE_MAX_VARS];
+  pj_trace_var_t vars[PJ_TRACE_MAX_VARS];
+  U32 svflags[PJ_TRACE_MAX_VARS]; /* as first read, 0 if never read */
+  unsigned int nvars;
+  OP **exits;
+  unsigned int nexits;
+} pj_trace_builder_t;
+
+
+PJ_STATIC_INLINE OP *
+pj_trace_skip_null_wrappers(OP *o)
+{
+  while (o->op_type == OP_NULL && (o->op_flags & OPf_KIDS)
+         && cUNOPo->op_first->op_sibling == NULL)
+  {
+    o = cUNOPo->op_first;
+  }
+  return o;
+}
+
+/* Whether a lexical with these flags can be had as a double, exactly */
+static int
+pj_trace_flags_ok(U32 flags)
+{
+  if ((flags & SVTYPEMASK) > SVt_PVMG
+      || (flags & (SVs_GMG|SVs_SMG|SVs_RMG|SVf_ROK|SVs_OBJECT)))
+  {
+    return 0;
+  }
+  return (flags & SVf_NOK) || ((flags & SVf_IOK) && !(flags & SVf_IVisUV));
+}
+
+PJ_STATIC_INLINE int
+pj_trace_flags_int(U32 flags)
+{
+  return (flags & SVf_IOK) && !(flags & (SVf_NOK|SVf_IVisUV));
+}
+
+/* Index of the lexical in the trace, added if it's new. -1 if there
+ * are too many. */
+static int
+pj_trace_var(pj_trace_builder_t *b, PADOFFSET padix, U32 svflags)
+{
+  unsigned int i;
+
+  for (i = 0; i < b->nvars; ++i) {
+    if (b->padix[i] == padix) {
+      if (b->svflags[i] == 0)
+        b->svflags[i] = svflags;
+      return (int)i;
+    }
+  }
+  if (b->nvars == PJ_TRACE_MAX_VARS)
+    return -1;
+
+  b->padix[i] = padix;
+  b->svflags[i] = svflags;
+  b->vars[i].padix = padix;
+  b->vars[i].is_int = FALSE;
+  b->vars[i].modified = FALSE;
+  return (int)b->nvars++;
+}
+
+static unsigned int
+pj_trace_exit(pj_trace_builder_t *b, OP *o)
+{
+  unsigned int i;
+
+  for (i = 0; i < b->nexits; ++i) {
+    if (b->exits[i] == o)
+      return i;
+  }
+  b->exits = (OP **)realloc(b->exits, (b->nexits + 1) * sizeof(OP *));
+  b->exits[b->nexits] = o;
+  return b->nexits++;
+}
+
+PJ_STATIC_INLINE int
+pj_trace_is_void(OP *o)
+{
+  return (o->op_flags & OPf_WANT) == OPf_WANT_VOID;
+}
+
+static pj_trace_op_kind
+pj_trace_classify(pTHX_ OP *o)
+{
+  const pj_op_mapping_t *map;
+
+  switch (o->op_type) {
+  case OP_AND:
+  case OP_OR:
+  case OP_COND_EXPR:
+    /* Only picking what to run next, the condition of a while loop
+     * included. Its value is thrown away by the LEAVELOOP. */
+    if (pj_trace_is_void(o) || (o->op_next != NULL && o->op_next->op_type == OP_LEAVELOOP))
+      return pj_trace_op_guard;
+    return pj_trace_op_other;
+  case OP_SASSIGN:
+    return pj_trace_is_void(o) ? pj_trace_op_assign : pj_trace_op_other;
+  case OP_PREINC:
+  case OP_PREDEC:
+  case OP_POSTINC:
+  case OP_POSTDEC:
+    return pj_trace_is_void(o) ? pj_trace_op_incdec : pj_trace_op_other;
+  case OP_CUSTOM:
+    if (o->op_ppaddr == pj_pp_jit_branch)
+      return pj_trace_op_guard;
+    return pj_trace_op_other;
+  default:
+    break;
+  }
+
+  if (!pj_trace_is_void(o) || (map = PJ_OP_MAPPING(o)) == NULL || map->nkids != 2)
+    return pj_trace_op_other;
+  if (o->op_flags & OPf_STACKED)
+    return pj_trace_op_modify;
+  if ((PL_opargs[o->op_type] & OA_TARGLEX) && (o->op_private & OPpTARGET_MY))
+    return pj_trace_op_targ;
+  return pj_trace_op_other;
+}
+
+/* The OPs a guard's condition is computed from: its first kid, or for
+ * a branching JIT OP, the kids it takes its params from */
+static void
+pj_trace_guard_operands(pTHX_ OP *o, OP **first, unsigned int *nkids)
+{
+  *first = cLOGOPo->op_first;
+  if (o->op_type == OP_CUSTOM)
+    *nkids = (unsigned int)((pj_jitop_aux_t *)o->op_targ)->nparams;
+  else
+    *nkids = 1;
+}
+
+static void
+pj_trace_cover(pTHX_ PTABLE_t *covered, OP *o)
+{
+  OP *kid;
+
+  PTABLE_store(covered, o, o);
+  if (o->op_flags & OPf_KIDS) {
+    for (kid = cUNOPo->op_first; kid; kid = kid->op_sibling)
+      pj_trace_cover(aTHX_ covered, kid);
+  }
+}
+
+static pj_term_t *pj_trace_build(pTHX_ pj_trace_builder_t *b, OP *o);
+
+/* Whether a kept AST can be compiled without its JIT OP */
+static int
+pj_trace_ast_usable(pj_term_t *t)
+{
+  pj_term_t *kid;
+
+  switch (t->type) {
+  case pj_ttype_constant:
+  case pj_ttype_variable:
+    return 1;
+  case pj_ttype_op:
+    for (kid = ((pj_op_t *)t)->op1; kid; kid = kid->op_sibling) {
+      if (!pj_trace_ast_usable(kid))
+        return 0;
+    }
+    return 1;
+  case pj_ttype_inline:
+    if (!pj_trace_ast_usable(((pj_inline_t *)t)->body))
+      return 0;
+    for (kid = ((pj_inline_t *)t)->args; kid; kid = kid->op_sibling) {
+      if (!pj_trace_ast_usable(kid))
+        return 0;
+    }
+    return 1;
+  default:
+    /* String buffers, records and opcalls are set up by the JIT OP */
+    return 0;
+  }
+}
+
+/* A JIT OP's AST with its params replaced by the terms for its kids */
+static pj_term_t *
+pj_trace_inline_jitop(pTHX_ pj_trace_builder_t *b, OP *o, OP *kid, unsigned int nkids)
+{
+  pj_jitop_aux_t *aux = (pj_jitop_aux_t *)o->op_targ;
+  pj_term_t *args[PJ_TRACE_MAX_VARS];
+  pj_term_t *term = NULL;
+  unsigned int i, n = 0;
+
+  if (aux->ast == NULL || nkids > PJ_TRACE_MAX_VARS || !pj_trace_ast_usable(aux->ast))
+    return NULL;
+
+  for (; n < nkids && kid != NULL; kid = kid->op_sibling) {
+    if ((args[n] = pj_trace_build(aTHX_ b, kid)) == NULL)
+      break;
+    ++n;
+  }
+  if (n == nkids)
+    term = pj_clone_tree(aux->ast, args);
+
+  for (i = 0; i < n; ++i)
+    pj_free_tree(args[i]);
+  return term;
+}
+
+/* The term for the value of an expression of the trace's lexicals */
+static pj_term_t *
+pj_trace_build(pTHX_ pj_trace_builder_t *b, OP *o)
+{
+  int max_var = -1;
+
+  o = pj_trace_skip_null_wrappers(o);
+  if (o->op_type == OP_CUSTOM && o->op_ppaddr == pj_pp_jit)
+    return pj_trace_inline_jitop(aTHX_ b, o, cLISTOPo->op_first,
+                                 (unsigned int)((pj_jitop_aux_t *)o->op_targ)->nparams);
+  return pj_build_closed_ast(aTHX_ o, b->padix, NULL, b->nvars, &max_var);
+}
+
+/* Whether the expression's value is a plain number, given that the
+ * trace's lexicals are */
+static int
+pj_trace_yields_number(pTHX_ OP *o)
+{
+  o = pj_trace_skip_null_wrappers(o);
+  if (o->op_type == OP_PADSV)
+    return 1;
+  if (o->op_type == OP_CUSTOM && o->op_ppaddr == pj_pp_jit)
+    return !((pj_jitop_aux_t *)o->op_targ)->bool_result;
+  return pj_yields_plain_number(aTHX_ o);
+}
+
+/* Whether the truth of the expression's value is that of its NV */
+static int
+pj_trace_truth_is_numeric(pTHX_ OP *o)
+{
+  o = pj_trace_skip_null_wrappers(o);
+  if (o->op_type == OP_CUSTOM && o->op_ppaddr == pj_pp_jit)
+    return 1;
+  return pj_truth_is_numeric(aTHX_ o);
+}
+
+/* The lexical an assignment or ++/-- modifies, -1 if it's not one of ours */
+static int
+pj_trace_target(pTHX_ pj_trace_builder_t *b, OP *o)
+{
+  o = pj_trace_skip_null_wrappers(o);
+  if (o->op_type != OP_PADSV || (o->op_private & (OPpLVAL_INTRO|OPpDEREF)))
+    return -1;
+  return pj_trace_var(b, o->op_targ, 0);
+}
+
+/* The step for an assignment, NULL term if we can't */
+static void
+pj_trace_build_store(pTHX_ pj_trace_builder_t *b, OP *o, pj_trace_op_kind kind, pj_trace_step_t *step)
+{
+  const pj_op_mapping_t *map;
+  pj_term_t *kids[2];
+  OP *rhs;
+
+  step->term = NULL;
+  step->expected = 0;
+  step->exit = 0;
+  step->exact_int = 0;
+
+  switch (kind) {
+  case pj_trace_op_assign:
+    rhs = cBINOPo->op_first;
+    if (o->op_private & OPpASSIGN_BACKWARDS || !pj_trace_yields_number(aTHX_ rhs))
+      return;
+    if ((step->ivar = pj_trace_target(aTHX_ b, cBINOPo->op_last)) >= 0)
+      step->term = pj_trace_build(aTHX_ b, rhs);
+    break;
+  case pj_trace_op_incdec:
+    if ((step->ivar = pj_trace_target(aTHX_ b, cUNOPo->op_first)) >= 0) {
+      step->term = pj_make_binop(
+        (o->op_type == OP_PREINC || o->op_type == OP_POSTINC ? pj_binop_add : pj_binop_subtract),
+        pj_make_variable(step->ivar, pj_double_type),
+        pj_make_const_dbl(1.)
+      );
+    }
+    break;
+  case pj_trace_op_modify:
+    map = pj_op_mapping_checked(aTHX_ o, 0);
+    if (map == NULL || !pj_yields_plain_number(aTHX_ o))
+      return;
+    if ((step->ivar = pj_trace_target(aTHX_ b, cBINOPo->op_first)) < 0)
+      return;
+    if ((kids[1] = pj_trace_build(aTHX_ b, cBINOPo->op_last)) == NULL)
+      return;
+    kids[0] = pj_make_variable(step->ivar, pj_double_type);
+    step->term = pj_op_mapping_make_term(aTHX_ o, map, kids, 2);
+    break;
+  case pj_trace_op_targ:
+    if (!pj_yields_plain_number(aTHX_ o))
+      return;
+    if ((step->ivar = pj_trace_var(b, o->op_targ, 0)) >= 0)
+      step->term = pj_trace_build(aTHX_ b, o);
+    break;
+  default:
+    break;
+  }
+
+  if (step->term != NULL)
+    b->vars[step->ivar].modified = TRUE;
+}
+
+/* The step for a guard, NULL term if we can't. next is the OP that
+ * was run after it. */
+static void
+pj_trace_build_guard(pTHX_ pj_trace_builder_t *b, OP *o, OP *next, pj_trace_step_t *step)
+{
+  OP *first;
+  unsigned int nkids;
+  int took_other;
+
+  step->term = NULL;
+  step->ivar = -1;
+  step->exit = 0;
+  step->exact_int = 0;
+
+  if (next == cLOGOPo->op_other)
+    took_other = 1;
+  else if (next == o->op_next)
+    took_other = 0;
+  else
+    return;
+
+  pj_trace_guard_operands(aTHX_ o, &first, &nkids);
+  if (o->op_type == OP_CUSTOM) {
+    step->expected = (took_other == (int)((pj_jitop_aux_t *)o->op_targ)->other_if_true);
+    step->term = pj_trace_inline_jitop(aTHX_ b, o, first, nkids);
+  }
+  else {
+    step->expected = (o->op_type == OP_OR ? !took_other : took_other);
+    if (pj_trace_truth_is_numeric(aTHX_ first))
+      step->term = pj_trace_build(aTHX_ b, first);
+  }
+}
+
+static void
+pj_trace_free_steps(pj_trace_step_t *steps, unsigned int nsteps)
+{
+  unsigned int i;
+  for (i = 0; i < nsteps; ++i)
+    pj_free_tree(steps[i].term);
+  free(steps);
+}
+
+/* Turn the recording into the trace's function. Returns whether that
+ * worked out. */
+static int
+pj_trace_compile(pTHX_ pj_trace_t *tr)
+{
+  pj_trace_builder_t b;
+  pj_trace_step_t *steps;
+  unsigned int nsteps = 0, nstores = 0, i;
+  unsigned int exitpt;
+  OP *after_store = NULL;
+  PTABLE_t *covered;
+  jit_function_t func;
+  int ok = 1;
+
+  PJ_DEBUG_1("Compiling a trace of %u OPs\n", pj_trace_nrec);
+
+  b.nvars = 0;
+  b.exits = NULL;
+  b.nexits = 0;
+  exitpt = pj_trace_exit(&b, tr->unstack->op_next);
+
+  /* The lexicals read, as they were when first read */
+  for (i = 0; i < pj_trace_nrec && ok; ++i) {
+    OP *o = pj_trace_buf[i].op;
+    if (o->op_type != OP_PADSV)
+      continue;
+    ok = !(o->op_private & (OPpLVAL_INTRO|OPpDEREF))
+         && pj_trace_flags_ok(pj_trace_buf[i].svflags)
+         && pj_trace_var(&b, o->op_targ, pj_trace_buf[i].svflags) >= 0;
+  }
+
+  /* What's computed by the guards and assignments rather than run */
+  covered = PTABLE_new();
+  for (i = 0; i < pj_trace_nrec && ok; ++i) {
+    OP *o = pj_trace_buf[i].op;
+    OP *first;
+    unsigned int nkids;
+
+    switch (pj_trace_classify(aTHX_ o)) {
+    case pj_trace_op_guard:
+      pj_trace_guard_operands(aTHX_ o, &first, &nkids);
+      for (; nkids > 0 && first != NULL; --nkids, first = first->op_sibling)
+        pj_trace_cover(aTHX_ covered, first);
+      break;
+    case pj_trace_op_other:
+      break;
+    default:
+      if (o->op_flags & OPf_KIDS) {
+        for (first = cUNOPo->op_first; first; first = first->op_sibling)
+          pj_trace_cover(aTHX_ covered, first);
+      }
+      break;
+    }
+  }
+
+  /* One step per guard or assignment, in the order they were run */
+  steps = (pj_trace_step_t *)malloc((pj_trace_nrec + 1) * sizeof(pj_trace_step_t));
+  for (i = 0; i < pj_trace_nrec && ok; ++i) {
+    OP *o = pj_trace_buf[i].op;
+    OP *next = (i + 1 < pj_trace_nrec ? pj_trace_buf[i + 1].op : tr->unstack);
+    const pj_trace_op_kind kind = pj_trace_classify(aTHX_ o);
+
+    if (PTABLE_fetch(covered, o) != NULL) {
+      /* A guard or assignment can't be part of another's expression */
+      ok = (kind == pj_trace_op_other);
+      continue;
+    }
+
+    switch (kind) {
+    case pj_trace_op_other:
+      if (o->op_type == OP_NEXTSTATE) {
+        /* Side exits go back to the start of the statement, which is
+         * fine as long as nothing has been assigned to since */
+        exitpt = pj_trace_exit(&b, o);
+        nstores = 0;
+      }
+      else if (o->op_type != OP_NULL) {
+        PJ_DEBUG_1("Can't trace %s\n", OP_NAME(o));
+        ok = 0;
+      }
+      continue;
+    case pj_trace_op_guard:
+      pj_trace_build_guard(aTHX_ &b, o, next, &steps[nsteps]);
+      steps[nsteps].exit = exitpt;
+      if (nstores > 0)
+        ok = 0;
+      break;
+    default:
+      pj_trace_build_store(aTHX_ &b, o, kind, &steps[nsteps]);
+      /* Should the value turn out not to be exact, perl redoes the
+       * store. Stores are in void context, so it may start right after
+       * the previous one. */
+      steps[nsteps].exit = (nstores == 0 ? exitpt : pj_trace_exit(&b, after_store));
+      after_store = next;
+      ++nstores;
+      break;
+    }
+    if (steps[nsteps].term == NULL)
+      ok = 0;
+    else
+      ++nsteps;
+  }
+  PTABLE_free(covered);
+
+  /* The types the lexicals are known to have */
+  for (i = 0; i < b.nvars && ok; ++i) {
+    const U32 now = SvFLAGS(PAD_SVl(b.padix[i]));
+    const U32 before = (b.svflags[i] != 0 ? b.svflags[i] : now);
+    ok = pj_trace_flags_ok(now) && pj_trace_flags_ok(before)
+         && !(b.vars[i].modified && (now & SVf_READONLY));
+    b.vars[i].is_int = pj_trace_flags_int(now) && pj_trace_flags_int(before);
+  }
+
+  /* Perl's IVs stay exact beyond 2**53, the trace's doubles don't */
+  for (i = 0; i < nsteps && ok; ++i)
+    steps[i].exact_int = (steps[i].ivar >= 0 && b.vars[steps[i].ivar].is_int);
+
+  if (ok && nsteps > 0) {
+    if (PJ_DEBUGGING) {
+      for (i = 0; i < nsteps; ++i)
+        pj_dump_tree(steps[i].term);
+    }
+    ok = (0 == pj_tree_jit_trace(PJ_jit_context, steps, nsteps, b.nvars, PJ_TRACE_MAX_ITER, &func));
+    if (ok) {
+      tr->function = func;
+      ok = ((tr->func = (pj_trace_func_t)jit_function_to_closure(func)) != NULL);
+    }
+  }
+  else {
+    ok = 0;
+  }
+  pj_trace_free_steps(steps, nsteps);
+
+  if (!ok) {
+    free(b.exits);
+    return 0;
+  }
+
+  tr->vars = (pj_trace_var_t *)malloc((b.nvars > 0 ? b.nvars : 1) * sizeof(pj_trace_var_t));
+  Copy(b.vars, tr->vars, b.nvars, pj_trace_var_t);
+  tr->nvars = b.nvars;
+  tr->exits = b.exits;
+  tr->nexits = b.nexits;
+  return 1;
+}
+
+/* The run didn't get anywhere: give up on the trace if that keeps happening */
+PJ_STATIC_INLINE void
+pj_trace_futile(pj_trace_t *tr)
+{
+  if (++tr->count >= PJ_TRACE_MAX_FUTILE) {
+    PJ_DEBUG("Giving up on trace\n");
+    tr->state = pj_trace_failed;
+  }
+}
+
+/* Run the trace if the lexicals have the types it was recorded with */
+static OP *
+pj_trace_run(pTHX_ pj_trace_t *tr, OP *next)
+{
+  double values[PJ_TRACE_MAX_VARS];
+  jit_nint niter = 0, iexit;
+  unsigned int i;
+
+  for (i = 0; i < tr->nvars; ++i) {
+    SV *sv = PAD_SVl(tr->vars[i].padix);
+    const U32 flags = SvFLAGS(sv);
+
+    if (!pj_trace_flags_ok(flags) || (tr->vars[i].modified && SvREADONLY(sv))) {
+      pj_trace_futile(tr);
+      return next;
+    }
+    if (tr->vars[i].is_int) {
+      if (!pj_trace_flags_int(flags)
+          || SvIVX(sv) > PJ_TRACE_MAX_EXACT_IV || SvIVX(sv) < -PJ_TRACE_MAX_EXACT_IV)
+      {
+        pj_trace_futile(tr);
+        return next;
+      }
+      values[i] = (double)SvIVX(sv);
+    }
+    else {
+      if (!(flags & SVf_NOK)) {
+        pj_trace_futile(tr);
+        return next;
+      }
+      values[i] = SvNVX(sv);
+    }
+  }
+
+  iexit = tr->func(values, &niter);
+  if (niter == 0)
+    pj_trace_futile(tr);
+
+  /* Integers stay integers where they can. The trace has left before
+   * one could get too large to be exact. */
+  for (i = 0; i < tr->nvars; ++i) {
+    SV *sv;
+    const double nv = values[i];
+
+    if (!tr->vars[i].modified)
+      continue;
+    sv = PAD_SVl(tr->vars[i].padix);
+    if (tr->vars[i].is_int && nv >= -(double)PJ_TRACE_MAX_EXACT_IV
+        && nv <= (double)PJ_TRACE_MAX_EXACT_IV && nv == (double)(IV)nv)
+    {
+      sv_setiv(sv, (IV)nv);
+    }
+    else {
+      sv_setnv(sv, nv);
+    }
+  }
+
+  return tr->exits[iexit];
+}
+
+OP *
+pj_pp_trace_unstack(pTHX)
+{
+  pj_trace_t *tr = (pj_trace_t *)PTABLE_fetch(pj_traces, PL_op);
+  OP *next = PL_ppaddr[OP_UNSTACK](aTHX);
+
+  if (PL_runops != pj_runops_trace || next != tr->unstack->op_next)
+    return next;
+
+  switch (tr->state) {
+  case pj_trace_counting:
+    if (++tr->count >= PJ_TRACE_HOT_LOOP && pj_trace_current == NULL) {
+      PJ_DEBUG("Recording trace\n");
+      tr->state = pj_trace_recording;
+      tr->count = 0;
+      pj_trace_current = tr;
+      pj_trace_nrec = 0;
+    }
+    break;
+  case pj_trace_recording:
+    /* Back where we started: that's the iteration */
+    pj_trace_current = NULL;
+    tr->state = (pj_trace_compile(aTHX_ tr) ? pj_trace_compiled : pj_trace_failed);
+    break;
+  case pj_trace_compiled:
+    return pj_trace_run(aTHX_ tr, next);
+  case pj_trace_failed:
+    break;
+  }
+  return next;
+}
+
+/* Hook the loop's backward branch */
+static void
+pj_trace_watch(pTHX_ OP *o)
+{
+  pj_trace_t *tr = (pj_trace_t *)malloc(sizeof(pj_trace_t));
+
+  tr->unstack = o;
+  tr->state = pj_trace_counting;
+  tr->count = 0;
+  tr->vars = NULL;
+  tr->nvars = 0;
+  tr->exits = NULL;
+  tr->nexits = 0;
+  tr->func = NULL;
+  tr->function = NULL;
+
+  if (pj_traces == NULL)
+    pj_traces = PTABLE_new();
+  PTABLE_store(pj_traces, o, tr);
+  o->op_ppaddr = pj_pp_trace_unstack;
+}
+
+PJ_STATIC_INLINE void
+pj_trace_record(pTHX_ OP *o)
+{
+  if (pj_trace_nrec == PJ_TRACE_MAX_OPS) {
+    PJ_DEBUG("Trace too long\n");
+    pj_trace_current->state = pj_trace_failed;
+    pj_trace_current = NULL;
+    return;
+  }
+  pj_trace_buf[pj_trace_nrec].op = o;
+  pj_trace_buf[pj_trace_nrec].svflags = (o->op_type == OP_PADSV ? SvFLAGS(PAD_SVl(o->op_targ)) : 0);
+  ++pj_trace_nrec;
+}
+
+int
+pj_runops_trace(pTHX)
+{
+  OP *op = PL_op;
+
+  while (op != NULL) {
+    if (op->op_type == OP_UNSTACK && op->op_ppaddr == PL_ppaddr[OP_UNSTACK] && !PL_perldb)
+      pj_trace_watch(aTHX_ op);
+    if (pj_trace_current != NULL && op != pj_trace_current->unstack)
+      pj_trace_record(aTHX_ op);
+    PL_op = op = op->op_ppaddr(aTHX);
+  }
+
+  PERL_ASYNC_CHECK();
+  TAINT_NOT;
+  return 0;
+}
+
+void
+pj_set_tracing(pTHX_ int enable)
+{
+  if (enable && PL_runops == Perl_runops_standard)
+    PL_runops = pj_runops_trace;
+  else if (!enable && PL_runops == pj_runops_trace)
+    PL_runops = Perl_runops_standard;
+}
+
+static void
+pj_trace_free(pj_trace_t *tr)
+{
+  if (pj_trace_current == tr)
+    pj_trace_current = NULL;
+  free(tr->vars);
+  free(tr->exits);
+  pj_free_jit_function(tr->function);
+  free(tr);
+}
+
+void
+pj_trace_free_op(pTHX_ OP *o)
+{
+  pj_trace_t *tr;
+  PERL_UNUSED_CONTEXT;
+
+  if (pj_traces == NULL || (tr = (pj_trace_t *)PTABLE_fetch(pj_traces, o)) == NULL)
+    return;
+  PTABLE_delete(pj_traces, o);
+  pj_trace_free(tr);
+}
+
+void
+pj_free_traces(pTHX)
+{
+  PTABLE_ITER_t *iter;
+  PTABLE_ENTRY_t *entry;
+  PERL_UNUSED_CONTEXT;
+
+  if (pj_traces == NULL)
+    return;
+
+  iter = PTABLE_iter_new(pj_traces);
+  while ((entry = PTABLE_iter_next(iter)) != NULL)
+    pj_trace_free((pj_trace_t *)entry->value);
+  PTABLE_iter_free(iter);
+
+  PTABLE_free(pj_traces);
+  pj_traces = NULL;
+}
@@ -0,0 +1,80 @@
+#ifndef PJ_TRACE_H_
+#define PJ_TRACE_H_
+
+/* Trace recording for hot loops, see "use Perl::JIT 'trace'". A custom
+ * run loop hooks the backward branch of each loop (its UNSTACK OP). Once
+ * a loop has gone round often enough, the OPs of one iteration are
+ * recorded along with the types of the lexicals they read. If that's a
+ * sequence of numeric assignments to lexicals and numeric conditions,
+ * the iteration is compiled into a native loop, with guards on the
+ * conditions going the way they did while recording. A failing guard
+ * writes the lexicals back and continues in the run loop at the start
+ * of its statement (a side exit). */
+
+#include <EXTERN.h>
+#include <perl.h>
+
+#include "pj_ast_terms.h"
+#include "pj_ast_jit.h"
+
+/* Iterations of a loop before an iteration is recorded */
+#define PJ_TRACE_HOT_LOOP 64
+
+/* Recordings longer than this are abandoned */
+#define PJ_TRACE_MAX_OPS 512
+
+/* Most lexicals a trace may use */
+#define PJ_TRACE_MAX_VARS 32
+
+/* Iterations per run of a trace before the run loop gets to see the
+ * backward branch again, for signals */
+#define PJ_TRACE_MAX_ITER (1 << 20)
+
+/* Runs of a trace that don't complete an iteration (or don't get past
+ * the type checks) before we give up on it */
+#define PJ_TRACE_MAX_FUTILE 32
+
+typedef enum {
+  pj_trace_counting,
+  pj_trace_recording,
+  pj_trace_compiled,
+  pj_trace_failed
+} pj_trace_state;
+
+/* A lexical used by a trace and the type it was recorded with */
+typedef struct {
+  PADOFFSET padix;
+  bool is_int;   /* an IV before and after the recorded iteration, else an NV */
+  bool modified; /* assigned to by the trace, so written back after it ran */
+} pj_trace_var_t;
+
+typedef struct {
+  OP *unstack;          /* the hooked backward branch, its op_next is the loop's start */
+  pj_trace_state state;
+  unsigned int count;   /* iterations, then futile runs */
+  pj_trace_var_t *vars;
+  unsigned int nvars;
+  OP **exits;           /* where to continue after the trace, exits[0] is the loop's start */
+  unsigned int nexits;
+  pj_trace_func_t func;
+  jit_function_t function; /* what func is the closure of */
+} pj_trace_t;
+
+/* The run loop for PL_runops: Perl_runops_standard plus the hooking of
+ * backward branches and the recording */
+int pj_runops_trace(pTHX);
+
+/* Switches PL_runops to pj_runops_trace or back, unless some other run
+ * loop (a debugger's or profiler's) is in place */
+void pj_set_tracing(pTHX_ int enable);
+
+/* The hooked UNSTACK OP: pp_unstack, then count, record or run the trace */
+OP *pj_pp_trace_unstack(pTHX);
+
+/* Forgets about the loop if o is its hooked UNSTACK OP */
+void pj_trace_free_op(pTHX_ OP *o);
+
+/* Releases all traces */
+void pj_free_traces(pTHX);
+
+#endif
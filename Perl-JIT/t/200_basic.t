@@ -69,7 +69,10 @@ _run_test(
     [1, 1 => 2],
     [1, 2 => 4],
     [2, 2 => 8],
-    #[-1, 3, => (-1 << 3)],
+    [4, -1 => 2],
+    [1, 64 => 0],
+    [1.9, 1.9 => 2],
+    [-1, 3 => 18446744073709551608],
   ]
 );
 
@@ -81,26 +84,650 @@ _run_test(
     [1, 0 => 1],
     [2, 1 => 1],
     [2, 4 => 0],
-    #[-1, 4 => (-1 >> 4)],
+    [-1, 60 => 15],
+    [1, -3 => 8],
+    [-1, 64 => 0],
+  ],
+);
+
+_run_test(
+  code => 'use integer; my $a = TMPL; my $b = TMPL; my $x = ($a << $b) . "," . ($a >> $b);',
+  name => 'use integer; TMPL << TMPL, TMPL >> TMPL',
+  data => [
+    [-1, 3 => '-8,-1'],
+    [-16, 2 => '-64,-4'],
+    [5, -1 => '2,10'],
+    [-5, 70 => '0,-1'],
+  ],
+);
+
+# Bitwise OPs work on strings unless an operand is known to be a number
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = (($a + 0) & ($b ^ 0xFF)) | 0x100;',
+  name => '((TMPL + 0) & (TMPL ^ 0xFF)) | 0x100',
+  data => [
+    [12, 10 => 260],
+    [-1, 0 => 511],
+    [3.7, 1 => 258],
+  ],
+);
+
+# Testing element loads from packed strings
+_run_test(
+  code => 'my $s = pack("d<*", 1.5, -2.25, 1e10); my $i = TMPL; my $x = 1 + unpack("d<", substr($s, 8*$i, 8));',
+  name => 'unpack("d<", substr($s, 8*TMPL, 8))',
+  data => [
+    [0 => 2.5],
+    [1 => -1.25],
+    [2 => 10000000001],
+    [3 => 1], # out of bounds
+    [-1 => 10000000001], # negative offsets count from the end
+  ],
+);
+
+_run_test(
+  code => 'my $s = pack("N n", 70000, 513); my $o = TMPL; my $x = 0 + unpack("N", substr($s, $o));',
+  name => 'unpack("N", substr($s, TMPL))',
+  data => [
+    [0 => 70000],
+    [2 => 292553217], # straddles both values
+    [4 => 0], # not enough bytes left
+    [-100 => 70000], # clamped to the start like substr does
+  ],
+);
+
+_run_test(
+  code => 'my $s = "\x01\x02\x03\x04\x05"; my $o = TMPL; my $x = 0 + unpack("N", substr($s, $o, 5));',
+  name => 'unpack("N", substr($s, TMPL, 5))',
+  data => [
+    [-6 => 16909060], # clamped, four bytes of the length left
+    [-7 => 0], # clamped, too short
+    [-100 => 0],
+  ],
+);
+
+# Strings with wide characters are left to the original OPs
+_run_test(
+  code => 'my $s = TMPL; my $o = 1; my $x = 0 + unpack("N", substr($s, $o));',
+  name => 'unpack("N", substr(TMPL, 1))',
+  data => [
+    ['"\x00\x01\x02\x03\x04"' => 16909060],
+    ['do { my $t = "\x00\xe9\x02\x03\x04"; utf8::upgrade($t); $t }' => 3909223172],
+    ['"\x00\x01\x02\x03\x{104}"' => 16909060], # wrapped by unpack
+  ],
+);
+
+_run_test(
+  code => 'my $s = "\x01\x02\x03\x04\x05"; my $i = TMPL; my $x = 0 + vec($s, $i, 16);',
+  name => 'vec($s, TMPL, 16)',
+  data => [
+    [0 => 258],
+    [1 => 772],
+    [2 => 1280], # zero-padded
+    [3 => 0],
+  ],
+);
+
+# Comparisons yield PL_sv_yes/PL_sv_no, not numbers
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = "<" . ($a < $b) . "><" . ($a >= $b) . ">";',
+  name => 'TMPL < TMPL, TMPL >= TMPL',
+  data => [
+    [1, 2 => '<1><>'],
+    [2, 1 => '<><1>'],
+    [2, 2 => '<><1>'],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = $a <=> $b;',
+  name => 'TMPL <=> TMPL',
+  data => [
+    [1, 2 => -1],
+    [2, 1 => 1],
+    [-2.5, -2.5 => 0],
+  ],
+);
+
+# Ternaries stay within the JIT OP
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = $a > $b ? $a - $b : $b - $a;',
+  name => 'TMPL > TMPL ? ... : ...',
+  data => [
+    [1, 3 => 2],
+    [3, 1 => 2],
+    [-1, -1 => 0],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $x = 2 * ($a < 0 ? 0 : $a > 10 ? 10 : $a);',
+  name => 'clamp(TMPL)',
+  data => [
+    [-5 => 0],
+    [5 => 10],
+    [50 => 20],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = -abs($a - $b);',
+  name => '-abs(TMPL - TMPL)',
+  data => [
+    [1, 3 => -2],
+    [3, 1 => -2],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = atan2($a, $b);',
+  name => 'atan2(TMPL, TMPL)',
+  data => [
+    [1, 1 => '0.785398163397448'],
+    [-1, 0 => '-1.5707963267949'],
+  ],
+);
+
+# Perl's modulus takes the sign of the right operand
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = $a % $b;',
+  name => 'TMPL % TMPL',
+  data => [
+    [7, 3 => 1],
+    [-7, 3 => 2],
+    [7, -3 => -2],
+    [-7, -3 => -1],
+    [7.5, 2 => 1],
+  ],
+);
+
+_run_test(
+  code => 'use integer; my $a = TMPL; my $b = TMPL; my $x = ($a / $b) . "," . ($a % $b);',
+  name => 'use integer; TMPL / TMPL, TMPL % TMPL',
+  data => [
+    [7, 2 => '3,1'],
+    [-7, 2 => '-3,-1'],
+    [7, -3 => '-2,1'],
+    [7.9, 2.9 => '3,1'],
+  ],
+);
+
+# use integer computes in (wrapping) IVs, variables are read as IVs
+_run_test(
+  code => 'use integer; my $a = TMPL; my $b = TMPL; my $x = $a * $b + 7;',
+  name => 'use integer; TMPL * TMPL + 7',
+  data => [
+    [4294967296, 4294967296 => 7],
+    [9007199254740993, 1 => 9007199254741000],
+    [3037000500, 3037000500 => -9223372036709301609],
+    [-2.5, 3 => 1],
+  ],
+);
+
+# Run-time errors croak like the original OPs
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x; eval { $x = $a / $b; 1 } or $x = $@;',
+  name => 'TMPL / TMPL croaks',
+  data => [
+    [1, 0 => 'Illegal division by zero'],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x; eval { $x = $a % $b; 1 } or $x = $@;',
+  name => 'TMPL % TMPL croaks',
+  data => [
+    [1, 0 => 'Illegal modulus zero'],
+  ],
+);
+
+# Conditions in control flow become branching JIT OPs
+_run_test(
+  code => 'my $a = TMPL; my $b = TMPL; my $x = "out"; if ($a*$a + $b*$b < 2) { $x = "in" }',
+  name => 'if (TMPL**2 + TMPL**2 < 2)',
+  jit_re => qr/\bjitbranch\b/,
+  data => [
+    [1, 0.5 => 'in'],
+    [1, 1.5 => 'out'],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $x; if ($a < 0) { $x = "neg" } elsif ($a == 0) { $x = "zero" } else { $x = "pos" }',
+  name => 'if/elsif/else on TMPL',
+  jit_re => qr/\bjitbranch\b/,
+  data => [
+    [-1 => 'neg'],
+    [0 => 'zero'],
+    [3 => 'pos'],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $x = "small"; $x = "big" unless $a < 10;',
+  name => 'unless (TMPL < 10)',
+  jit_re => qr/\bjitbranch\b/,
+  data => [
+    [5 => 'small'],
+    [50 => 'big'],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $x = 0; while ($a > 1) { $a = $a / 2; $x++ }',
+  name => 'while (TMPL > 1)',
+  jit_re => qr/\bjitbranch\b/,
+  data => [
+    [1 => 0],
+    [8 => 3],
+    [9 => 4],
+  ],
+);
+
+# Purely numeric subs are compiled as a whole and called directly
+_run_test(
+  code => 'sub dist { my ($a, $b) = @_; sqrt($a*$a + $b*$b) } my $x = dist(TMPL, TMPL);',
+  name => 'dist(TMPL, TMPL)',
+  jit_re => qr/\bjitentersub\b/,
+  data => [
+    [3, 4 => 5],
+    [-5, 12 => 13],
+  ],
+);
+
+_run_test(
+  code => 'sub lt3 { my ($a) = @_; $a < 3 } my $x = lt3(TMPL) ? "yes" : "no";',
+  name => 'lt3(TMPL)',
+  jit_re => qr/\bjitentersub\b/,
+  data => [
+    [1 => 'yes'],
+    [5 => 'no'],
+  ],
+);
+
+# Redefinition and wrong argument counts fall back to a normal call
+_run_test(
+  code => 'sub f { my ($a) = @_; $a * 2 } my $a = TMPL; no warnings; *f = sub { 42 } if $a; my $x = f($a) . "/" . f(1, 2);',
+  name => 'redefined f(TMPL)',
+  jit_re => qr/\bjitentersub\b/,
+  data => [
+    [0 => '0/2'],
+    [1 => '42/42'],
+  ],
+);
+
+# Redefining a native sub leaves the old definition to the call sites
+# that were compiled against it, their guards must still work
+_run_test(
+  code => 'sub g { my ($a) = @_; $a + 1 } my $a = TMPL; my $x = g($a); eval q{ no warnings; sub g { my ($a) = @_; $a * 3 } 1 } or die $@; $x .= "/" . g($a);',
+  name => 'g(TMPL) redefined as a native sub',
+  jit_re => qr/\bjitentersub\b/,
+  data => [
+    [2 => '3/6'],
+    [-1 => '0/-3'],
+  ],
+);
+
+# Calls to such subs within a larger expression are inlined
+_run_test(
+  code => 'sub sq { my ($a) = @_; $a * $a } my $a = TMPL; my $b = $a + 1; my $x = sq($a) + sq($b);',
+  name => 'sq(TMPL) + sq(TMPL + 1)',
+  jit_re => qr/\bjitop\[(?![\s\S]*\bentersub\b)/,
+  data => [
+    [2 => 13],
+    [-1 => 1],
+  ],
+);
+
+# ... unless that would compute an arg more than once
+_run_test(
+  code => 'sub sq { my ($a) = @_; $a * $a } my $a = TMPL; my $x = sq($a + 1) + 1;',
+  name => 'sq(TMPL + 1) + 1',
+  jit_re => qr/\bjitentersub\b/,
+  data => [
+    [2 => 10],
+    [-1 => 1],
+  ],
+);
+
+_run_test(
+  code => 'sub sq { my ($a) = @_; $a * $a } my $a = TMPL; { no warnings; *sq = sub { -$_[0] } if $a > 5; } my $x = sq($a) + 1;',
+  name => 'inlined sq(TMPL) + 1, possibly redefined',
+  data => [
+    [2 => 5],
+    [6 => -5],
+  ],
+);
+
+# Well-known XS math functions are done natively
+_run_test(
+  code => 'use POSIX qw(floor ceil fmod); use List::Util qw(min max); my $a = TMPL; my $x = floor($a) + ceil($a) + fmod($a, 2) + max($a, 0, -$a) + min($a, 1);',
+  name => 'floor/ceil/fmod/min/max of TMPL',
+  jit_re => qr/\bjitop\[(?![\s\S]*\bentersub\b)/,
+  data => [
+    [2.5 => 2 + 3 + 0.5 + 2.5 + 1],
+    [-1.5 => -2 + -1 + -1.5 + 1.5 + -1.5],
+  ],
+);
+
+# rand uses Perl's generator, so the sequence is the same
+_run_test(
+  code => 'srand(42); my $a = TMPL; my $x = int(1000 * rand($a)) + (rand() < 0.5 ? 1 : 0) + int(rand(0) * 100);',
+  name => 'rand(TMPL) after srand(42)',
+  data => [
+    [1 => 756],
+    [10 => 7457],
+  ],
+);
+
+# An arg with side effects mustn't be copied into an inlined body
+_run_test(
+  code => 'sub twice { my ($a) = @_; $a + $a } my $a = TMPL; srand(42); my $r = rand($a); srand(42); my $x = twice(rand($a)) + 1 == 2 * $r + 1 ? "once" : "twice";',
+  name => 'twice(rand(TMPL)) + 1',
+  data => [
+    [1 => 'once'],
+    [10 => 'once'],
   ],
 );
 
-# FIXME not implemented - not same as perl
 # Testing bitwise not ~
-#_run_test(
-#  code => 'my $a = TMPL; my $x = ~$a;',
-#  name => '~TMPL',
-#  data => [
-#    [1 => ~1],
-#    [2 => ~2],
-#    [-1 => ~(-1)],
-#    [-100 => ~(-100)],
-#  ],
-#);
+_run_test(
+  code => 'my $a = TMPL; my $x = ~($a + 0) & 0xFFFF;',
+  name => '~(TMPL + 0) & 0xFFFF',
+  data => [
+    [1 => 65534],
+    [-1 => 0],
+    [-100 => 99],
+  ],
+);
+
+_run_test(
+  code => 'my $a = TMPL; my $x = ~($a + 0);',
+  name => '~(TMPL + 0)',
+  data => [
+    [1 => 18446744073709551614],
+    [-1 => 0],
+  ],
+);
+
+_run_test(
+  code => 'use integer; my $a = TMPL; my $x = ~($a + 0);',
+  name => 'use integer; ~(TMPL + 0)',
+  data => [
+    [1 => -2],
+    [-100 => 99],
+  ],
+);
+
+# Numeric fields of hash references are read by the JIT'd code
+_run_test(
+  code => 'use strict; my $p = {x => TMPL, y => 2}; my $q = {x => 3, y => 4}; my $x = $p->{x} * $q->{x} + $p->{y} * $q->{y};',
+  name => 'dot product of hash references with TMPL',
+  jit_re => qr/\bjitop\[(?![\s\S]*\bhelem\b)/,
+  data => [
+    [1 => 11],
+    [-0.5 => 6.5],
+    ['"7"' => 29],
+  ],
+);
+
+# An undef reference is autovivified, even for an rvalue
+_run_test(
+  code => 'use strict; no warnings; my $p; my $v; my $a = TMPL; my $x = ($a + $p->{x} * 2 + $v->[1] * 3) . ref($p) . ref($v);',
+  name => 'field and element of undef references plus TMPL',
+  jit_re => qr/\bjitop\[(?![\s\S]*\bhelem\b)/,
+  data => [
+    [1 => '1HASHARRAY'],
+  ],
+);
+
+# So are elements of (nested) array references
+_run_test(
+  code => 'use strict; my $m = [[1, 2], [3, TMPL]]; my $v = [5, 6]; my $i = 1; my $x = $m->[$i][0] * $v->[0] + $m->[$i][1] * $v->[-1];',
+  name => 'matrix row times vector with TMPL',
+  jit_re => qr/\bjitop\[(?![\s\S]*\baelem\b)/,
+  data => [
+    [4 => 39],
+    [-1 => 9],
+  ],
+);
+
+# Concatenation chains are built in one go. Newer perls do that
+# themselves with OP_MULTICONCAT.
+if ($] < 5.028) {
+  _run_test(
+    code => 'my $a = TMPL; my $x = "<$a|" . ($a + 1) . ">" . $a x 2;',
+    name => 'concatenation chain with TMPL',
+    jit_re => qr/\bjitconcat\b/,
+    data => [
+      [3 => '<3|4>33'],
+      [-1.5 => '<-1.5|-0.5>-1.5-1.5'],
+    ],
+  );
+
+  # Overloaded objects take the slow path
+  _run_test(
+    code => '{ package S; use overload q("") => sub { "s" . ${$_[0]} }, fallback => 1; } my $v = TMPL; my $a = bless \$v, "S"; my $x = "[$a]" . $a . "!";',
+    name => 'concatenation chain with overloaded TMPL',
+    jit_re => qr/\bjitconcat\b/,
+    data => [
+      [1 => '[s1]s1!'],
+    ],
+  );
+
+  # Only left-nested chains are collapsed, a concatenation on the right
+  # goes to overloaded "." as a whole
+  _run_test(
+    code => '{ package P; use overload "." => sub { my ($s, $o, $swap) = @_; $swap ? "$o<${$s}>" : "<${$s}>$o" }, fallback => 1; } my $v = TMPL; my $a = bless \$v, "P"; my $x = "[" . ($a . "|" . $a);',
+    name => 'right-nested concatenation with overloaded TMPL',
+    data => [
+      [1 => '[<1>|<1>'],
+    ],
+  );
+}
+
+# Chains of lookups with constant keys are done in one go. Newer
+# perls do that themselves with OP_MULTIDEREF.
+if ($] < 5.022) {
+  _run_test(
+    code => 'my $h = {foo => {bar => [1, 2, TMPL]}}; my $x = $h->{foo}{bar}[2] . "/" . ($h->{foo}{baz}[-1] // "u") . "/" . (exists $h->{foo}{baz} ? 1 : 0);',
+    name => 'dereference chain yielding TMPL',
+    jit_re => qr/\bjitderef\b/,
+    data => [
+      [3 => '3/u/1'],
+      ['"x"' => 'x/u/1'],
+    ],
+  );
+}
+
+# Sort blocks comparing numeric keys are done natively
+_run_test(
+  code => 'my @r = ([1, 5], [2, TMPL], [3, 5], [4, -1]); my $x = join ",", map $_->[0], sort { $b->[1] <=> $a->[1] || $a->[0] <=> $b->[0] } @r;',
+  name => 'sort by two keys with TMPL',
+  jit_re => qr/\bjitsort\b/,
+  data => [
+    [5 => '1,2,3,4'],
+    [7 => '2,1,3,4'],
+    [-3 => '1,3,4,2'],
+  ],
+);
+
+# ... and stable, like perl's
+_run_test(
+  code => 'my %h = (x => TMPL, y => 1, z => 1); my $x = join ",", sort { $h{$a} <=> $h{$b} } qw(z x y);',
+  name => 'sort by hash lookup with TMPL',
+  jit_re => qr/\bjitsort\b/,
+  data => [
+    [0 => 'x,z,y'],
+    [2 => 'z,y,x'],
+    ['"1"' => 'z,x,y'],
+  ],
+);
+
+# String comparisons and the like are run from within the JIT code
+# rather than splitting the formula around them
+_run_test(
+  code => 'my $s = "TMPL"; my $y = 2; my $x = ($s eq "a" ? 10 : 20) + $y * length($s);',
+  name => 'string ops on TMPL inside a formula',
+  jit_re => qr/\bjitop\[(?![\s\S]*\b(?:seq|length)\b)/,
+  data => [
+    ['a' => '12'],
+    ['abc' => '26'],
+  ],
+);
+
+# List::Util reductions with a numeric block run as a native loop
+_run_test(
+  code => 'use List::Util qw(sum max); my @v = (1, 2, TMPL); my $x = sum(map { $_ * $_ } @v) . "/" . max(map { -$_ } @v);',
+  name => 'sum and max over map with TMPL',
+  jit_re => qr/\bjitreduce\b/,
+  data => [
+    [3 => '14/-1'],
+    [-1 => '6/1'],
+    ['"1"' => '6/-1'],
+  ],
+);
+
+# Results are IVs where List::Util's are, and too large ones are left
+# to List::Util
+_run_test(
+  code => 'use List::Util qw(sum sum0 reduce); my @v = (TMPL); my $x = sum(map { $_ / 2 } @v) . "/" . sum0(map { $_ * 1000000 } @v) . "/" . (reduce { $a * $b } @v);',
+  name => 'exact reductions of TMPL',
+  jit_re => qr/\bjitreduce\b/,
+  data => [
+    ['1, 2' => '1.5/3000000/2'],
+    ['1.5, -3' => '-0.75/-1500000/-4.5'],
+    ['1 .. 20' => '105/210000000/2432902008176640000'],
+    ['1000000000, 2000000000' => '1500000000/3000000000000000/2000000000000000000'],
+    ['9007199254740991, 2' => '4.5035996273705e+15/9.00719925474099e+21/18014398509481982'],
+  ],
+);
+
+_run_test(
+  code => 'use List::Util qw(reduce first); my @v = (1, 2, TMPL, 4); my $x = (reduce { $a + $b * $b } @v) . "/" . ((first { $_ > 2 } @v) // "u");',
+  name => 'reduce and first with TMPL',
+  jit_re => qr/\bjitreduce\b/,
+  data => [
+    [3 => '30/3'],
+    [0 => '21/4'],
+    [5 => '46/5'],
+  ],
+);
+
+# Subs entered often enough run from threaded code, loop controls included
+_run_test(
+  code => 'sub f { my $r = ""; for my $c (split //, $_[0]) { next if $c eq "b"; last if $c eq "z"; $r .= uc $c } return $r } my $x = ""; $x .= f(TMPL) for 1 .. 10;',
+  name => 'threaded sub with TMPL',
+  jit_re => qr/\bleavesub\b/,
+  data => [
+    ['"abc"' => ('AC' x 10)],
+    ['"azb"' => ('A' x 10)],
+    ['"xyz"' => ('XY' x 10)],
+  ],
+);
+
+# ... and go back into it when the subs they call return
+_run_test(
+  code => 'sub g { $_[0] * 2 } sub f { my $r = 0; $r += g($_) for 1 .. $_[0]; $r } my $x = 0; $x += f(TMPL) for 1 .. 10;',
+  name => 'threaded sub calling another TMPL times',
+  jit_re => qr/\bleavesub\b/,
+  data => [
+    [0 => 0],
+    [3 => 120],
+  ],
+);
+
+# Cold tier first, hot tier after enough runs
+_run_test(
+  code => 'my $s = 0; for my $i (1 .. 1500) { $s = $s + $i * TMPL } my $x = $s;',
+  name => 'tiered compilation with TMPL',
+  data => [
+    [2 => 2251500],
+    [0.5 => 562875],
+    ['"-1"' => -1125750],
+  ],
+);
+
+# The hot tier at each optimization level, with a common subexpression
+_run_test(
+  code => 'use Perl::JIT optimize => TMPL; my $s = 0; for my $i (1 .. 1500) { my $t = $i * 3; $s = $s + $t * $t - $t * $t + $i } my $x = $s;',
+  name => 'optimization level TMPL',
+  data => [
+    [0 => 1125750],
+    [1 => 1125750],
+    [2 => 1125750],
+  ],
+);
+
+# The JIT OPs of the subs are freed, the next ones reuse their code space
+_run_test(
+  code => 'my $s = 0; for my $i (1 .. 200) { my $f = eval q{sub { my $t = $_[0]; $t * TMPL + 1 }}; $s = $s + $f->($i) } my $x = $s * 1.5 - 2;',
+  name => 'freed subs with TMPL',
+  data => [
+    [2 => 60598],
+    [0.5 => 15373],
+    [-3 => -90152],
+  ],
+);
+
+# Comparisons specialised to the IVs seen, then back to NVs
+_run_test(
+  code => 'my $c = 0; for my $v ((1 .. 40), (TMPL) x 64) { my $w = 20; $c += ($v > $w) + ($v == $w) } my $x = $c;',
+  name => 'specialised comparisons then TMPL',
+  data => [
+    [20.5 => 85],
+    [-1.5 => 21],
+    ['"20"' => 85],
+  ],
+);
+
+# Hot loops recorded and compiled with "trace", side exits included
+_run_test(
+  code => 'use Perl::JIT "trace"; my ($i, $s, $n) = (0, 0, TMPL); while ($i < $n) { $s += $i * $i; $i++ } my $x = "$s/$i";',
+  name => 'traced loop to TMPL',
+  data => [
+    [1000 => '332833500/1000'],
+    [3 => '5/3'],
+    [0 => '0/0'],
+  ],
+);
+
+_run_test(
+  code => 'use Perl::JIT "trace"; my ($i, $s, $n) = (0, 0.5, TMPL); while ($i < $n) { if ($i % 3) { $s += $i / 2 } else { $s -= 1 } $i++ } my $x = "$s/$i";',
+  name => 'traced loop with branches to TMPL',
+  jit_re => qr/\bjitbranch\b/,
+  data => [
+    [100 => '1600/100'],
+    [1000 => '166000/1000'],
+    [2 => '0/2'],
+  ],
+);
+
+_run_test(
+  code => 'use Perl::JIT "trace"; my ($i, $s) = (0, 0); while ($i < 1000) { $s += $i; last if $s > TMPL; $i++ } my $x = "$s/$i";',
+  name => 'traced loop leaving at TMPL',
+  jit_re => qr/\bjitbranch\b/,
+  data => [
+    [5000 => '5050/100'],
+    [100000 => '100128/447'],
+    [0 => '1/1'],
+  ],
+);
+
+# Integers in traces stay exact beyond 2**53
+_run_test(
+  code => 'use Perl::JIT "trace"; my ($i, $s) = (0, TMPL); while ($i < 36) { $s = $s * 3 + 1; $i++ } my $x = "$s/$i";',
+  name => 'traced integer loop from TMPL',
+  data => [
+    [1 => '225141952945498681/36'],
+    [2 => '375236588242497802/36'],
+  ],
+);
 
 sub _run_test {
   my %args = @_;
   my $data = $args{data};
+  my $jit_re = $args{jit_re} || qr/\bjitop\[/;
 
   foreach (@$data) {
     my @d = @$_;
@@ -112,7 +739,7 @@ sub _run_test {
 
     runperl_output_like(
       [qw(-MO=Concise -MPerl::JIT -e), $code],
-      qr/\bjitop\[/,
+      $jit_re,
       "'$name' is JIT'd"
     );
 
@@ -66,10 +66,8 @@ main(int argc, char **argv)
   double args2[2];
   args2[0] = arg1;
   args2[1] = arg2;
-  //int i;
-  //for (i=0;i<1e8;++i){
+  /* Call overhead is measured by Perl-JIT/ctest/900c_ast_bench.c */
   pj_invoke_func((pj_invoke_func_t)fptr, &args2, 2, funtype, (void *)&result);
-  //}
   printf("foo(%f, %f) = %f\n", (float)arg1, (float)arg2, (float)result);
 
   /* Call function again, with slightly different input */